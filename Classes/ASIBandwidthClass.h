@@ -0,0 +1,87 @@
+//
+//  ASIBandwidthClass.h
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import "ASITokenBucket.h"
+
+// A bandwidth class groups requests whose bandwidth should be limited together
+// Classes form a tree: the global class at the top (limited by +[ASIHTTPRequest setMaxBandwidthPerSecond:]), then typically a class for each
+// ASINetworkQueue, a class for each host the queue talks to, and occasionally a class for a single request
+//
+// Each class may have its own limit. A request is held to the limits of its class and all the classes above it
+// When a class above is limited, what it allows is shared between the children that are using bandwidth, in proportion to their weights
+// Children that haven't sent or received anything in the last second don't get a share, so bandwidth isn't held back for requests that aren't running
+//
+// For example, to stop background syncs from starving everything else:
+//
+// ASIBandwidthClass *bulk = [[ASIBandwidthClass globalBandwidthClass] childWithName:@"bulk"];
+// [bulk setMaxBandwidthPerSecond:32768];
+// [bulk setWeight:1];
+// [[[ASIBandwidthClass globalBandwidthClass] childWithName:@"interactive"] setWeight:4];
+// [syncQueue setBandwidthClass:bulk];
+//
+// All the methods here can be called from any thread. Requests only read and atomically update classes while running, they never take a lock
+// unless they need to work out their share of a class above them that is limited
+@interface ASIBandwidthClass : NSObject {
+
+	// A name for debugging, and for looking the class up with childWithName:
+	NSString *name;
+
+	// The class above this one, or nil for the global class (retained)
+	ASIBandwidthClass *parent;
+
+	// Children created with childWithName:, which are kept around for as long as their parent
+	NSMutableDictionary *namedChildren;
+
+	// All children, including those created with initWithName:parent: (not retained - children remove themselves when they are deallocated)
+	// Used for working out each child's share when this class is limited
+	CFMutableArrayRef children;
+
+	// How big a share of the parent's bandwidth this class gets compared with its siblings. Default is 1
+	volatile unsigned long weight;
+
+	// This class's own limit in bytes per second, 0 (the default) means this class isn't limited beyond the limits of the classes above it
+	unsigned long maxBandwidthPerSecond;
+
+	// Takes the bytes sent and received by requests in this class when maxBandwidthPerSecond is set
+	ASITokenBucket bucket;
+
+	// The monotonic time (in whole seconds) a request in this class last sent or received data
+	volatile int32_t lastActiveSecond;
+}
+
+// The class at the top of the tree
+// Its limit is set with +[ASIHTTPRequest setMaxBandwidthPerSecond:] and +[ASIHTTPRequest setShouldThrottleBandwidthForWWAN:] rather than directly
++ (ASIBandwidthClass *)globalBandwidthClass;
+
+// Creates a class below parent (or the global class when parent is nil)
+// The parent does not keep hold of classes created this way, so they are useful for limiting a single request
++ (id)bandwidthClassWithName:(NSString *)newName parent:(ASIBandwidthClass *)newParent;
+- (id)initWithName:(NSString *)newName parent:(ASIBandwidthClass *)newParent;
+
+// Returns the child with the supplied name, creating it if it doesn't exist yet
+// Children created this way stay around for as long as their parent, so settings made on them stick
+- (ASIBandwidthClass *)childWithName:(NSString *)childName;
+
+// Returns YES if this class or any class above it is limited
+- (BOOL)isThrottled;
+
+// The number of bytes a request in this class may send or receive right now
+// This is the smallest share of what any limited class above allows. Negative or 0 when a limited class has used up its allowance, LLONG_MAX when nothing is limited
+- (long long)availableBytes;
+
+// The monotonic time (see ASIMonotonicTime in ASITimerWheel.h) when every limited class above will have paid off any bandwidth it has overused
+- (NSTimeInterval)wakeUpTime;
+
+// Called by requests in this class when they send or receive data
+- (void)consumeBytes:(unsigned long)bytes;
+
+@property (retain, readonly) NSString *name;
+@property (retain, readonly) ASIBandwidthClass *parent;
+@property (assign) unsigned long weight;
+@property (assign) unsigned long maxBandwidthPerSecond;
+@end
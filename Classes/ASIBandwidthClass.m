@@ -0,0 +1,250 @@
+//
+//  ASIBandwidthClass.m
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import "ASIBandwidthClass.h"
+#import "ASITimerWheel.h"
+#import <libkern/OSAtomic.h>
+
+static ASIBandwidthClass *globalBandwidthClass = nil;
+
+// Mediates access to the children of every class, and to their limits
+// Only held for short periods, and never while calling out to other code
+static OSSpinLock treeLock = OS_SPINLOCK_INIT;
+
+// Children count as using bandwidth if they sent or received data this second or last second
+static int32_t ASICurrentSecond(void)
+{
+	return (int32_t)ASIMonotonicTime();
+}
+
+@interface ASIBandwidthClass ()
+- (double)shareForChild:(ASIBandwidthClass *)child activeSince:(int32_t)second;
+@property (retain, readwrite) NSString *name;
+@property (retain, readwrite) ASIBandwidthClass *parent;
+@end
+
+@implementation ASIBandwidthClass
+
++ (void)initialize
+{
+	if (self == [ASIBandwidthClass class]) {
+		globalBandwidthClass = [[self alloc] initWithName:@"global" parent:nil];
+	}
+}
+
++ (ASIBandwidthClass *)globalBandwidthClass
+{
+	return globalBandwidthClass;
+}
+
++ (id)bandwidthClassWithName:(NSString *)newName parent:(ASIBandwidthClass *)newParent
+{
+	return [[[self alloc] initWithName:newName parent:newParent] autorelease];
+}
+
+- (id)initWithName:(NSString *)newName parent:(ASIBandwidthClass *)newParent
+{
+	self = [super init];
+	[self setName:newName];
+	weight = 1;
+	children = CFArrayCreateMutable(kCFAllocatorDefault, 0, NULL);
+	namedChildren = [[NSMutableDictionary alloc] init];
+
+	// Everything apart from the global class itself lives under the global class
+	if (!newParent && globalBandwidthClass) {
+		newParent = globalBandwidthClass;
+	}
+	if (newParent) {
+		[self setParent:newParent];
+		OSSpinLockLock(&treeLock);
+		CFArrayAppendValue(newParent->children, self);
+		OSSpinLockUnlock(&treeLock);
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	if (parent) {
+		OSSpinLockLock(&treeLock);
+		CFIndex index = CFArrayGetFirstIndexOfValue(parent->children, CFRangeMake(0, CFArrayGetCount(parent->children)), self);
+		if (index != kCFNotFound) {
+			CFArrayRemoveValueAtIndex(parent->children, index);
+		}
+		OSSpinLockUnlock(&treeLock);
+	}
+	[name release];
+	[parent release];
+	[namedChildren release];
+	CFRelease(children);
+	[super dealloc];
+}
+
+- (NSString *)description
+{
+	return [NSString stringWithFormat:@"<%@: %p %@>",[self class],self,[self name]];
+}
+
+#pragma mark the tree
+
+- (ASIBandwidthClass *)childWithName:(NSString *)childName
+{
+	OSSpinLockLock(&treeLock);
+	ASIBandwidthClass *child = [[[namedChildren objectForKey:childName] retain] autorelease];
+	OSSpinLockUnlock(&treeLock);
+	if (child) {
+		return child;
+	}
+
+	// Creating the child takes the lock, so we make it first, then check nobody beat us to it
+	ASIBandwidthClass *newChild = [[[ASIBandwidthClass alloc] initWithName:childName parent:self] autorelease];
+	OSSpinLockLock(&treeLock);
+	child = [[[namedChildren objectForKey:childName] retain] autorelease];
+	if (!child) {
+		child = newChild;
+		[namedChildren setObject:child forKey:childName];
+	}
+	OSSpinLockUnlock(&treeLock);
+	return child;
+}
+
+#pragma mark limits
+
+- (unsigned long)maxBandwidthPerSecond
+{
+	OSSpinLockLock(&treeLock);
+	unsigned long amount = maxBandwidthPerSecond;
+	OSSpinLockUnlock(&treeLock);
+	return amount;
+}
+
+- (void)setMaxBandwidthPerSecond:(unsigned long)bytes
+{
+	OSSpinLockLock(&treeLock);
+	maxBandwidthPerSecond = bytes;
+	ASITokenBucketSetRate(&bucket, bytes);
+	OSSpinLockUnlock(&treeLock);
+}
+
+- (unsigned long)weight
+{
+	return weight;
+}
+
+// A class with no weight would never get a share, so the smallest weight is 1
+- (void)setWeight:(unsigned long)newWeight
+{
+	weight = (newWeight ? newWeight : 1);
+}
+
+- (BOOL)isThrottled
+{
+	ASIBandwidthClass *bandwidthClass;
+	for (bandwidthClass = self; bandwidthClass; bandwidthClass = bandwidthClass->parent) {
+		if (ASITokenBucketIsLimited(&bandwidthClass->bucket)) {
+			return YES;
+		}
+	}
+	return NO;
+}
+
+#pragma mark sharing bandwidth
+
+- (double)shareForChild:(ASIBandwidthClass *)child activeSince:(int32_t)second
+{
+	unsigned long totalWeight = 0;
+	OSSpinLockLock(&treeLock);
+	CFIndex count = CFArrayGetCount(children);
+	CFIndex i;
+	for (i=0; i<count; i++) {
+		ASIBandwidthClass *sibling = (ASIBandwidthClass *)CFArrayGetValueAtIndex(children, i);
+		if (sibling == child || sibling->lastActiveSecond >= second) {
+			totalWeight += sibling->weight;
+		}
+	}
+	OSSpinLockUnlock(&treeLock);
+	if (!totalWeight) {
+		return 1;
+	}
+	return (double)child->weight/(double)totalWeight;
+}
+
+- (long long)availableBytes
+{
+	// Find the highest class that is limited - we don't need to work out shares of anything above it
+	ASIBandwidthClass *highestLimitedClass = nil;
+	ASIBandwidthClass *bandwidthClass;
+	for (bandwidthClass = self; bandwidthClass; bandwidthClass = bandwidthClass->parent) {
+		if (ASITokenBucketIsLimited(&bandwidthClass->bucket)) {
+			highestLimitedClass = bandwidthClass;
+		}
+	}
+	if (!highestLimitedClass) {
+		return LLONG_MAX;
+	}
+
+	int32_t activeSince = ASICurrentSecond()-1;
+	long long available = LLONG_MAX;
+	double share = 1;
+	ASIBandwidthClass *child = nil;
+	for (bandwidthClass = self; bandwidthClass; bandwidthClass = bandwidthClass->parent) {
+		if (child) {
+			share *= [bandwidthClass shareForChild:child activeSince:activeSince];
+		}
+		if (ASITokenBucketIsLimited(&bandwidthClass->bucket)) {
+			long long classAvailable = ASITokenBucketAvailableBytes(&bandwidthClass->bucket);
+
+			// We only take our share of what is left, so a busy sibling can't use everything up before we get a look in
+			// Debt is not shared - everyone waits until it has been paid off
+			if (classAvailable > 0) {
+				classAvailable = (long long)(classAvailable*share);
+				if (classAvailable < 1) {
+					classAvailable = 1;
+				}
+			}
+			if (classAvailable < available) {
+				available = classAvailable;
+			}
+		}
+		if (bandwidthClass == highestLimitedClass) {
+			break;
+		}
+		child = bandwidthClass;
+	}
+	return available;
+}
+
+- (NSTimeInterval)wakeUpTime
+{
+	NSTimeInterval wakeUpTime = ASIMonotonicTime();
+	ASIBandwidthClass *bandwidthClass;
+	for (bandwidthClass = self; bandwidthClass; bandwidthClass = bandwidthClass->parent) {
+		if (ASITokenBucketIsLimited(&bandwidthClass->bucket)) {
+			NSTimeInterval classWakeUpTime = ASITokenBucketWakeUpTime(&bandwidthClass->bucket);
+			if (classWakeUpTime > wakeUpTime) {
+				wakeUpTime = classWakeUpTime;
+			}
+		}
+	}
+	return wakeUpTime;
+}
+
+- (void)consumeBytes:(unsigned long)bytes
+{
+	int32_t now = ASICurrentSecond();
+	ASIBandwidthClass *bandwidthClass;
+	for (bandwidthClass = self; bandwidthClass; bandwidthClass = bandwidthClass->parent) {
+		if (bandwidthClass->lastActiveSecond != now) {
+			bandwidthClass->lastActiveSecond = now;
+		}
+		ASITokenBucketConsume(&bandwidthClass->bucket, bytes);
+	}
+}
+
+@synthesize name;
+@synthesize parent;
+@end
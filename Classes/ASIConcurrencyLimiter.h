@@ -0,0 +1,87 @@
+//
+//  ASIConcurrencyLimiter.h
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+// By default, limiters start out allowing this many requests at once
+#define ASIConcurrencyLimiterDefaultInitialLimit 4
+
+// By default, limiters never allow more than this many requests at once
+#define ASIConcurrencyLimiterDefaultMaximumLimit 64
+
+// An ASIConcurrencyLimiter works out how many requests to a server (or a group of servers) should run at once, from how long responses take
+//
+// We keep track of the shortest time we've seen between a request starting and its response headers arriving, and a smoothed average of recent times
+// While responses arrive about as quickly as the shortest time, running more requests isn't making them wait on each other, so the limit grows
+// When responses slow down, requests are queueing somewhere (in the server, or in a buffer on the way) so the limit shrinks in proportion
+// A 503 or 429 response, a timeout or a connection failure halve the limit, at most once per smoothed response time
+// The shortest time is forgotten every so often, so a route or server that has got slower doesn't leave us shrinking the limit forever
+//
+// ASINetworkQueue uses limiters when shouldAdaptConcurrency is YES. All the methods here can be called from any thread
+@interface ASIConcurrencyLimiter : NSObject {
+
+	// Mediates access to everything below
+	NSLock *lock;
+
+	// The number of requests we currently allow at once, kept as a double so it can grow by less than one request at a time
+	double limit;
+
+	// The limit never goes below minimumLimit or above maximumLimit. Defaults are 1 and ASIConcurrencyLimiterDefaultMaximumLimit
+	NSUInteger minimumLimit;
+	NSUInteger maximumLimit;
+
+	// How much slower than the shortest response time the average can be before we shrink the limit. Default is 2.0
+	double tolerance;
+
+	// The shortest response time we've seen since we last forgot it, and an exponentially weighted average of recent response times (in seconds)
+	NSTimeInterval minimumResponseTime;
+	NSTimeInterval smoothedResponseTime;
+
+	// The number of response times we have been given, and the number since we last forgot minimumResponseTime
+	unsigned long long responseCount;
+	NSUInteger responsesSinceMinimumReset;
+
+	// The monotonic time we last halved the limit
+	NSTimeInterval lastDecreaseTime;
+
+	// Bytes received since lastThroughputMeasurementTime, and an exponentially weighted average of bytes received per second
+	unsigned long long bytesSinceLastMeasurement;
+	NSTimeInterval lastThroughputMeasurementTime;
+	double throughput;
+}
+
++ (id)limiter;
+
+// Call with the time between a request starting and its response headers arriving
+// requestsInProgress is the number of requests counted against this limiter that were running at the time. We only grow the limit when it's actually being used
+- (void)recordResponseTime:(NSTimeInterval)responseTime statusCode:(int)statusCode requestsInProgress:(NSUInteger)requestsInProgress;
+
+// Call when a request timed out or failed to connect
+- (void)recordFailure;
+
+// Call as requests counted against this limiter receive data
+- (void)recordBytesReceived:(unsigned long long)bytes;
+
+// The number of requests that should run at once, from minimumLimit to maximumLimit
+- (NSUInteger)limit;
+
+// Statistics, useful for monitoring
+
+// The shortest response time we are comparing against and the smoothed average response time, or 0 if we haven't seen a response yet
+- (NSTimeInterval)minimumResponseTime;
+- (NSTimeInterval)smoothedResponseTime;
+
+// An average of bytes received per second, updated about once a second while data is being received
+- (double)throughput;
+
+// The number of response times we've been given
+- (unsigned long long)responseCount;
+
+@property (assign) NSUInteger minimumLimit;
+@property (assign) NSUInteger maximumLimit;
+@property (assign) double tolerance;
+@end
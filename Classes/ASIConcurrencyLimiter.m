@@ -0,0 +1,240 @@
+//
+//  ASIConcurrencyLimiter.m
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import "ASIConcurrencyLimiter.h"
+#import "ASITimerWheel.h"
+
+// How much weight a new response time gets in smoothedResponseTime (the same as TCP gives new round trip times)
+#define ASIResponseTimeSmoothing 0.125
+
+// How much weight a new estimate gets when we update the limit
+#define ASILimitSmoothing 0.2
+
+// We forget the shortest response time after this many responses
+#define ASIMinimumResponseTimeResetCount 500
+
+// We never shrink the limit by more than half for one slow response
+#define ASIMinimumGradient 0.5
+
+// Response times shorter than this (eg for responses that come from a cache on the way) are treated as this long
+#define ASIShortestResponseTime 0.001
+
+// If nothing has been received for this long, we start measuring throughput again rather than counting the gap
+#define ASIThroughputIdleTime 5
+
+@interface ASIConcurrencyLimiter ()
+- (void)decreaseLimit;
+- (void)clampLimit;
+@end
+
+@implementation ASIConcurrencyLimiter
+
++ (id)limiter
+{
+	return [[[self alloc] init] autorelease];
+}
+
+- (id)init
+{
+	self = [super init];
+	lock = [[NSLock alloc] init];
+	limit = ASIConcurrencyLimiterDefaultInitialLimit;
+	minimumLimit = 1;
+	maximumLimit = ASIConcurrencyLimiterDefaultMaximumLimit;
+	tolerance = 2.0;
+	return self;
+}
+
+- (void)dealloc
+{
+	[lock release];
+	[super dealloc];
+}
+
+#pragma mark feedback
+
+- (void)recordResponseTime:(NSTimeInterval)responseTime statusCode:(int)statusCode requestsInProgress:(NSUInteger)requestsInProgress
+{
+	[lock lock];
+	responseCount++;
+
+	// The server is telling us it's overloaded
+	if (statusCode == 503 || statusCode == 429) {
+		[self decreaseLimit];
+		[lock unlock];
+		return;
+	}
+
+	responseTime = MAX(responseTime, ASIShortestResponseTime);
+	if (smoothedResponseTime > 0) {
+		smoothedResponseTime = smoothedResponseTime*(1-ASIResponseTimeSmoothing)+responseTime*ASIResponseTimeSmoothing;
+	} else {
+		smoothedResponseTime = responseTime;
+	}
+	if (!responsesSinceMinimumReset || responseTime < minimumResponseTime) {
+		minimumResponseTime = responseTime;
+	}
+	responsesSinceMinimumReset++;
+	if (responsesSinceMinimumReset >= ASIMinimumResponseTimeResetCount) {
+		responsesSinceMinimumReset = 0;
+	}
+
+	// Shrink in proportion to how much slower responses are than we'd expect, once they're outside our tolerance
+	double gradient = MAX(ASIMinimumGradient, MIN(1.0, tolerance*minimumResponseTime/smoothedResponseTime));
+	double newLimit = limit*gradient;
+
+	// Only grow when we are using most of the limit, otherwise fast responses just tell us we aren't busy
+	if ((double)requestsInProgress*2 >= limit) {
+		newLimit += sqrt(limit);
+	}
+	limit = limit*(1-ASILimitSmoothing)+newLimit*ASILimitSmoothing;
+	[self clampLimit];
+	[lock unlock];
+}
+
+- (void)recordFailure
+{
+	[lock lock];
+	[self decreaseLimit];
+	[lock unlock];
+}
+
+// Halves the limit, unless we did so within the last smoothed response time
+// Requests that were already running when we last shrank the limit will often fail too, and shouldn't make us shrink it again
+- (void)decreaseLimit
+{
+	NSTimeInterval now = ASIMonotonicTime();
+	if (lastDecreaseTime > 0 && now-lastDecreaseTime < smoothedResponseTime) {
+		return;
+	}
+	lastDecreaseTime = now;
+	limit /= 2;
+	[self clampLimit];
+}
+
+- (void)clampLimit
+{
+	limit = MAX((double)minimumLimit, MIN((double)maximumLimit, limit));
+}
+
+- (void)recordBytesReceived:(unsigned long long)bytes
+{
+	[lock lock];
+	NSTimeInterval now = ASIMonotonicTime();
+	NSTimeInterval elapsed = now-lastThroughputMeasurementTime;
+	if (lastThroughputMeasurementTime <= 0 || elapsed > ASIThroughputIdleTime) {
+		lastThroughputMeasurementTime = now;
+		bytesSinceLastMeasurement = 0;
+		elapsed = 0;
+	}
+	bytesSinceLastMeasurement += bytes;
+	if (elapsed >= 1) {
+		double rate = bytesSinceLastMeasurement/elapsed;
+		throughput = (throughput > 0 ? throughput*0.75+rate*0.25 : rate);
+		bytesSinceLastMeasurement = 0;
+		lastThroughputMeasurementTime = now;
+	}
+	[lock unlock];
+}
+
+#pragma mark limits and statistics
+
+- (NSUInteger)limit
+{
+	[lock lock];
+	NSUInteger theLimit = (NSUInteger)limit;
+	[lock unlock];
+	return theLimit;
+}
+
+- (NSUInteger)minimumLimit
+{
+	[lock lock];
+	NSUInteger theLimit = minimumLimit;
+	[lock unlock];
+	return theLimit;
+}
+
+- (void)setMinimumLimit:(NSUInteger)newLimit
+{
+	[lock lock];
+	minimumLimit = MAX(newLimit, (NSUInteger)1);
+	maximumLimit = MAX(maximumLimit, minimumLimit);
+	[self clampLimit];
+	[lock unlock];
+}
+
+- (NSUInteger)maximumLimit
+{
+	[lock lock];
+	NSUInteger theLimit = maximumLimit;
+	[lock unlock];
+	return theLimit;
+}
+
+- (void)setMaximumLimit:(NSUInteger)newLimit
+{
+	[lock lock];
+	maximumLimit = MAX(newLimit, (NSUInteger)1);
+	minimumLimit = MIN(minimumLimit, maximumLimit);
+	[self clampLimit];
+	[lock unlock];
+}
+
+- (double)tolerance
+{
+	[lock lock];
+	double theTolerance = tolerance;
+	[lock unlock];
+	return theTolerance;
+}
+
+- (void)setTolerance:(double)newTolerance
+{
+	[lock lock];
+	tolerance = MAX(newTolerance, 1.0);
+	[lock unlock];
+}
+
+- (NSTimeInterval)minimumResponseTime
+{
+	[lock lock];
+	NSTimeInterval time = minimumResponseTime;
+	[lock unlock];
+	return time;
+}
+
+- (NSTimeInterval)smoothedResponseTime
+{
+	[lock lock];
+	NSTimeInterval time = smoothedResponseTime;
+	[lock unlock];
+	return time;
+}
+
+- (double)throughput
+{
+	[lock lock];
+	double theThroughput = throughput;
+	[lock unlock];
+	return theThroughput;
+}
+
+- (unsigned long long)responseCount
+{
+	[lock lock];
+	unsigned long long count = responseCount;
+	[lock unlock];
+	return count;
+}
+
+- (NSString *)description
+{
+	return [NSString stringWithFormat:@"<%@: %p> limit: %lu minimum response time: %f smoothed response time: %f throughput: %f",[self class],self,(unsigned long)[self limit],[self minimumResponseTime],[self smoothedResponseTime],[self throughput]];
+}
+
+@end
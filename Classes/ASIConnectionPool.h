@@ -0,0 +1,131 @@
+//
+//  ASIConnectionPool.h
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+@class ASIHTTPRequest;
+
+// Describes a single persistent connection
+// CFNetwork owns the actual socket - we tag every stream that should use this connection with the connection's id (see ASIStreamID in ASIHTTPRequest.m)
+@interface ASIPersistentConnection : NSObject {
+
+	// A unique number identifying this connection, used to tag streams
+	NSNumber *connectionID;
+
+	NSString *host;
+	NSString *scheme;
+	int port;
+
+	// Lowercased scheme://host:port, used to look up connections to the same server
+	NSString *originKey;
+
+	// When an idle connection should be closed, as an NSTimeInterval since the reference date
+	NSTimeInterval expires;
+
+	// The id of the request currently using this connection, or nil when the connection is idle
+	NSNumber *requestID;
+
+	// The last stream to use this connection
+	// We keep it open until the next stream using this connection has been opened, so that stream can make use of the underlying socket
+	NSInputStream *stream;
+
+	// The thread whose runloop the connection's streams are scheduled on
+	// Connections are only ever reused by requests running on this thread
+	NSThread *thread;
+}
+
+@property (retain) NSNumber *connectionID;
+@property (retain) NSString *host;
+@property (retain) NSString *scheme;
+@property (assign) int port;
+@property (retain) NSString *originKey;
+@property (assign) NSTimeInterval expires;
+@property (retain) NSNumber *requestID;
+@property (retain) NSInputStream *stream;
+@property (retain) NSThread *thread;
+@end
+
+
+// Keeps track of persistent connections, so requests to the same server can reuse them
+// Connections are indexed by server (scheme, host and port), and each server keeps its own list of idle connections
+// Optionally, the number of connections to a single server can be capped - requests that would open more connections than this wait until one is freed
+@interface ASIConnectionPool : NSObject {
+
+	// Mediates access to everything in the pool
+	NSRecursiveLock *lock;
+
+	// A dictionary of ASIConnectionPoolOrigin objects (private, see ASIConnectionPool.m) keyed by scheme://host:port
+	NSMutableDictionary *origins;
+
+	// The most connections we will open to a single server, 0 means no limit (the default)
+	NSUInteger maxConnectionsPerHost;
+
+	// Used to assign a unique id to each connection
+	unsigned int nextConnectionID;
+
+	// When we last looked through the whole pool for idle connections that have expired
+	NSTimeInterval lastExpiryCheck;
+
+	// Statistics
+	unsigned long long connectionsCreated;
+	unsigned long long connectionsReused;
+}
+
+// Returns the pool used by all ASIHTTPRequests
++ (id)sharedPool;
+
+// Finds an idle connection to the request's server that can be used by a request running on the current thread, or creates a new one
+// The connection returned is marked as being in use by the request with the supplied id
+// previousConnection is the connection this request used last time it ran (eg before a redirect), which will be preferred if it is still available
+// Returns nil when the server already has maxConnectionsPerHost connections in use. The request is then added to a list of waiting requests,
+// and will be handed back by releaseConnection:fromRequestWithID:expiresIn: or removeConnection:usedByRequestWithID: when it can try again
+- (ASIPersistentConnection *)checkOutConnectionForRequest:(ASIHTTPRequest *)request requestID:(NSNumber *)requestID previousConnection:(ASIPersistentConnection *)previousConnection;
+
+// Called when a request has finished with a connection that can be reused
+// Does nothing if the connection is no longer in use by the request with the supplied id
+// Returns a waiting request that can now be started, if there is one
+- (ASIHTTPRequest *)releaseConnection:(ASIPersistentConnection *)connection fromRequestWithID:(NSNumber *)requestID expiresIn:(NSTimeInterval)seconds;
+
+// Called when a connection can no longer be used (eg because the server closed it)
+// Does nothing if the connection is in use by a request other than the one with the supplied id
+// Returns a waiting request that can now be started, if there is one
+- (ASIHTTPRequest *)removeConnection:(ASIPersistentConnection *)connection usedByRequestWithID:(NSNumber *)requestID;
+
+// Stop a request waiting for a connection (eg because it was cancelled)
+- (void)removeWaitingRequest:(ASIHTTPRequest *)request;
+
+// Close and remove all idle connections that have expired
+- (void)expireIdleConnections;
+
+// As above, but only looks through the whole pool once a second
+// Expired connections to a server are also removed whenever we look for a connection to that server
+- (void)expireIdleConnectionsIfNeeded;
+
+// Statistics
+
+// The number of connections in the pool, both idle and in use
+- (NSUInteger)connectionCount;
+
+// The number of connections in the pool that are not being used by a request
+- (NSUInteger)idleConnectionCount;
+
+// Returns YES when the pool has an idle connection to url's server that hasn't expired
+// ASINetworkQueue uses this to prefer requests that won't need to open a new connection
+- (BOOL)hasIdleConnectionForURL:(NSURL *)url;
+
+// The number of requests waiting for a connection because of maxConnectionsPerHost
+- (NSUInteger)waitingRequestCount;
+
+// The number of connections we have created, and the number of times a request reused an existing connection
+- (unsigned long long)connectionsCreated;
+- (unsigned long long)connectionsReused;
+
+// The proportion of requests that were able to reuse an existing connection (0.0 - 1.0)
+- (double)reuseRate;
+
+@property (assign) NSUInteger maxConnectionsPerHost;
+@end
@@ -0,0 +1,451 @@
+//
+//  ASIConnectionPool.m
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import "ASIConnectionPool.h"
+#import "ASIHTTPRequest.h"
+
+static ASIConnectionPool *sharedPool = nil;
+
+// Everything we know about connections to a single server
+@interface ASIConnectionPoolOrigin : NSObject {
+
+	// Connections not currently in use, least recently used first
+	NSMutableArray *idleConnections;
+
+	// Connections currently in use by a request
+	NSMutableSet *activeConnections;
+
+	// Requests waiting for a connection to this server, in the order they asked for one
+	NSMutableArray *waitingRequests;
+}
+- (BOOL)isEmpty;
+@property (retain, nonatomic) NSMutableArray *idleConnections;
+@property (retain, nonatomic) NSMutableSet *activeConnections;
+@property (retain, nonatomic) NSMutableArray *waitingRequests;
+@end
+
+@implementation ASIConnectionPoolOrigin
+
+- (id)init
+{
+	self = [super init];
+	[self setIdleConnections:[NSMutableArray array]];
+	[self setActiveConnections:[NSMutableSet set]];
+	[self setWaitingRequests:[NSMutableArray array]];
+	return self;
+}
+
+- (void)dealloc
+{
+	[idleConnections release];
+	[activeConnections release];
+	[waitingRequests release];
+	[super dealloc];
+}
+
+- (BOOL)isEmpty
+{
+	return (![idleConnections count] && ![activeConnections count] && ![waitingRequests count]);
+}
+
+@synthesize idleConnections;
+@synthesize activeConnections;
+@synthesize waitingRequests;
+@end
+
+
+@implementation ASIPersistentConnection
+
+- (void)dealloc
+{
+	[connectionID release];
+	[host release];
+	[scheme release];
+	[originKey release];
+	[requestID release];
+	[stream release];
+	[thread release];
+	[super dealloc];
+}
+
+- (NSString *)description
+{
+	return [NSString stringWithFormat:@"<%@: %p #%@ %@>",[self class],self,[self connectionID],[self originKey]];
+}
+
+@synthesize connectionID;
+@synthesize host;
+@synthesize scheme;
+@synthesize port;
+@synthesize originKey;
+@synthesize expires;
+@synthesize requestID;
+@synthesize stream;
+@synthesize thread;
+@end
+
+
+@interface ASIConnectionPool ()
++ (NSString *)originKeyForURL:(NSURL *)url;
+- (ASIConnectionPoolOrigin *)originForKey:(NSString *)key create:(BOOL)create;
+- (void)expireIdleConnectionsForOrigin:(ASIConnectionPoolOrigin *)origin now:(NSTimeInterval)now;
+- (ASIHTTPRequest *)nextWaitingRequestForOrigin:(ASIConnectionPoolOrigin *)origin key:(NSString *)key;
+- (void)closeStreamOfConnection:(ASIPersistentConnection *)connection;
+
+@property (retain, nonatomic) NSRecursiveLock *lock;
+@property (retain, nonatomic) NSMutableDictionary *origins;
+@end
+
+@implementation ASIConnectionPool
+
+- (id)init
+{
+	self = [super init];
+	[self setLock:[[[NSRecursiveLock alloc] init] autorelease]];
+	[self setOrigins:[NSMutableDictionary dictionary]];
+	return self;
+}
+
++ (id)sharedPool
+{
+	if (!sharedPool) {
+		@synchronized(self) {
+			if (!sharedPool) {
+				sharedPool = [[self alloc] init];
+			}
+		}
+	}
+	return sharedPool;
+}
+
+- (void)dealloc
+{
+	[lock release];
+	[origins release];
+	[super dealloc];
+}
+
++ (NSString *)originKeyForURL:(NSURL *)url
+{
+	return [NSString stringWithFormat:@"%@://%@:%i",[[url scheme] lowercaseString],[[url host] lowercaseString],[[url port] intValue]];
+}
+
+- (ASIConnectionPoolOrigin *)originForKey:(NSString *)key create:(BOOL)create
+{
+	ASIConnectionPoolOrigin *origin = [[self origins] objectForKey:key];
+	if (!origin && create) {
+		origin = [[[ASIConnectionPoolOrigin alloc] init] autorelease];
+		[[self origins] setObject:origin forKey:key];
+	}
+	return origin;
+}
+
+#pragma mark checking connections in and out
+
+- (ASIPersistentConnection *)checkOutConnectionForRequest:(ASIHTTPRequest *)request requestID:(NSNumber *)requestID previousConnection:(ASIPersistentConnection *)previousConnection
+{
+	NSURL *url = [request url];
+	NSString *key = [ASIConnectionPool originKeyForURL:url];
+	NSThread *currentThread = [NSThread currentThread];
+	NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+
+	[[self lock] lock];
+
+	ASIConnectionPoolOrigin *origin = [self originForKey:key create:YES];
+	[self expireIdleConnectionsForOrigin:origin now:now];
+
+	ASIPersistentConnection *connection = nil;
+
+	// If we are redirecting or retrying, we will re-use the current connection only if we are connecting to the same server
+	if (previousConnection && [[previousConnection originKey] isEqualToString:key] && [previousConnection thread] == currentThread && [[origin idleConnections] indexOfObjectIdenticalTo:previousConnection] != NSNotFound) {
+		connection = previousConnection;
+
+	#if DEBUG_PERSISTENT_CONNECTIONS
+	} else if (previousConnection && [previousConnection requestID]) {
+		ASI_DEBUG_LOG(@"[CONNECTION] Not re-using connection #%@ for request #%@ because it is already used by request #%@",[previousConnection connectionID],requestID,[previousConnection requestID]);
+	#endif
+	}
+
+	// Otherwise, use the most recently used idle connection to this server that was opened on this thread
+	if (!connection) {
+		NSUInteger i = [[origin idleConnections] count];
+		while (i > 0) {
+			i--;
+			ASIPersistentConnection *idleConnection = [[origin idleConnections] objectAtIndex:i];
+			if ([idleConnection thread] == currentThread) {
+				connection = idleConnection;
+				break;
+			}
+		}
+	}
+
+	if (connection) {
+		[[origin activeConnections] addObject:connection];
+		[[origin idleConnections] removeObjectIdenticalTo:connection];
+		connectionsReused++;
+
+	} else {
+
+		NSUInteger max = [self maxConnectionsPerHost];
+		if (max > 0 && [[origin activeConnections] count] + [[origin idleConnections] count] >= max) {
+
+			// All connections to this server are in use, we'll have to wait for one to become available
+			if ([[origin activeConnections] count] >= max) {
+				if ([[origin waitingRequests] indexOfObjectIdenticalTo:request] == NSNotFound) {
+					[[origin waitingRequests] addObject:request];
+				}
+				#if DEBUG_PERSISTENT_CONNECTIONS
+				ASI_DEBUG_LOG(@"[CONNECTION] Request #%@ will wait for a connection to %@ (%lu requests waiting)",requestID,key,(unsigned long)[[origin waitingRequests] count]);
+				#endif
+				[[self lock] unlock];
+				return nil;
+			}
+
+			// There's an idle connection we can't use because it belongs to another thread - close it to make room for ours
+			ASIPersistentConnection *oldestConnection = [[origin idleConnections] objectAtIndex:0];
+			#if DEBUG_PERSISTENT_CONNECTIONS
+			ASI_DEBUG_LOG(@"[CONNECTION] Closing idle connection #%@ to make room for a new connection to %@",[oldestConnection connectionID],key);
+			#endif
+			[self closeStreamOfConnection:oldestConnection];
+			[[origin idleConnections] removeObjectAtIndex:0];
+		}
+
+		connection = [[[ASIPersistentConnection alloc] init] autorelease];
+		nextConnectionID++;
+		[connection setConnectionID:[NSNumber numberWithUnsignedInt:nextConnectionID]];
+		[connection setHost:[url host]];
+		[connection setScheme:[url scheme]];
+		[connection setPort:[[url port] intValue]];
+		[connection setOriginKey:key];
+		[connection setThread:currentThread];
+		[[origin activeConnections] addObject:connection];
+		connectionsCreated++;
+	}
+
+	[connection setRequestID:requestID];
+	[[origin waitingRequests] removeObjectIdenticalTo:request];
+
+	[[self lock] unlock];
+	return connection;
+}
+
+- (ASIHTTPRequest *)releaseConnection:(ASIPersistentConnection *)connection fromRequestWithID:(NSNumber *)requestID expiresIn:(NSTimeInterval)seconds
+{
+	if (!connection) {
+		return nil;
+	}
+	[[self lock] lock];
+	ASIConnectionPoolOrigin *origin = [self originForKey:[connection originKey] create:NO];
+	if (!requestID || ![[connection requestID] isEqualToNumber:requestID] || ![[origin activeConnections] containsObject:connection]) {
+		[[self lock] unlock];
+		return nil;
+	}
+	[connection setRequestID:nil];
+	[connection setExpires:[NSDate timeIntervalSinceReferenceDate]+seconds];
+	[[origin idleConnections] addObject:connection];
+	[[origin activeConnections] removeObject:connection];
+
+	ASIHTTPRequest *waitingRequest = [self nextWaitingRequestForOrigin:origin key:[connection originKey]];
+	[[self lock] unlock];
+	return waitingRequest;
+}
+
+- (ASIHTTPRequest *)removeConnection:(ASIPersistentConnection *)connection usedByRequestWithID:(NSNumber *)requestID
+{
+	if (!connection) {
+		return nil;
+	}
+	[[self lock] lock];
+	if ([connection requestID] && (!requestID || ![[connection requestID] isEqualToNumber:requestID])) {
+		[[self lock] unlock];
+		return nil;
+	}
+	[connection setRequestID:nil];
+	ASIConnectionPoolOrigin *origin = [self originForKey:[connection originKey] create:NO];
+	ASIHTTPRequest *waitingRequest = nil;
+	if (origin) {
+		[[origin activeConnections] removeObject:connection];
+		[[origin idleConnections] removeObjectIdenticalTo:connection];
+		waitingRequest = [self nextWaitingRequestForOrigin:origin key:[connection originKey]];
+	}
+	[[self lock] unlock];
+	return waitingRequest;
+}
+
+- (ASIHTTPRequest *)nextWaitingRequestForOrigin:(ASIConnectionPoolOrigin *)origin key:(NSString *)key
+{
+	ASIHTTPRequest *waitingRequest = nil;
+	NSUInteger max = [self maxConnectionsPerHost];
+	while ([[origin waitingRequests] count] && (max == 0 || [[origin activeConnections] count] < max)) {
+		ASIHTTPRequest *candidate = [[[[origin waitingRequests] objectAtIndex:0] retain] autorelease];
+		[[origin waitingRequests] removeObjectAtIndex:0];
+		if (![candidate isCancelled] && ![candidate isFinished]) {
+			waitingRequest = candidate;
+			break;
+		}
+	}
+	if ([origin isEmpty]) {
+		[[self origins] removeObjectForKey:key];
+	}
+	return waitingRequest;
+}
+
+- (void)removeWaitingRequest:(ASIHTTPRequest *)request
+{
+	[[self lock] lock];
+	for (NSString *key in [[self origins] allKeys]) {
+		ASIConnectionPoolOrigin *origin = [[self origins] objectForKey:key];
+		[[origin waitingRequests] removeObjectIdenticalTo:request];
+		if ([origin isEmpty]) {
+			[[self origins] removeObjectForKey:key];
+		}
+	}
+	[[self lock] unlock];
+}
+
+#pragma mark expiring connections
+
+- (void)expireIdleConnectionsForOrigin:(ASIConnectionPoolOrigin *)origin now:(NSTimeInterval)now
+{
+	NSUInteger i = 0;
+	while (i < [[origin idleConnections] count]) {
+		ASIPersistentConnection *connection = [[origin idleConnections] objectAtIndex:i];
+		if ([connection expires] <= now) {
+			#if DEBUG_PERSISTENT_CONNECTIONS
+			ASI_DEBUG_LOG(@"[CONNECTION] Closing connection #%@ because it has expired",[connection connectionID]);
+			#endif
+			[self closeStreamOfConnection:connection];
+			[[origin idleConnections] removeObjectAtIndex:i];
+		} else {
+			i++;
+		}
+	}
+}
+
+// A connection's stream is scheduled on its thread's runloop, so it has to be closed there
+// When we're on another thread, we ask the connection's thread to close it when it next runs its runloop
+- (void)closeStreamOfConnection:(ASIPersistentConnection *)connection
+{
+	NSInputStream *stream = [[[connection stream] retain] autorelease];
+	if (!stream) {
+		return;
+	}
+	[connection setStream:nil];
+	NSThread *thread = [connection thread];
+	if (!thread || thread == [NSThread currentThread] || [thread isFinished]) {
+		[stream close];
+	} else {
+		[stream performSelector:@selector(close) onThread:thread withObject:nil waitUntilDone:NO];
+	}
+}
+
+- (void)expireIdleConnections
+{
+	NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+	[[self lock] lock];
+	lastExpiryCheck = now;
+	for (NSString *key in [[self origins] allKeys]) {
+		ASIConnectionPoolOrigin *origin = [[self origins] objectForKey:key];
+		[self expireIdleConnectionsForOrigin:origin now:now];
+		if ([origin isEmpty]) {
+			[[self origins] removeObjectForKey:key];
+		}
+	}
+	[[self lock] unlock];
+}
+
+- (void)expireIdleConnectionsIfNeeded
+{
+	[[self lock] lock];
+	BOOL needsCheck = ([NSDate timeIntervalSinceReferenceDate] - lastExpiryCheck >= 1);
+	if (needsCheck) {
+		[self expireIdleConnections];
+	}
+	[[self lock] unlock];
+}
+
+#pragma mark statistics
+
+- (NSUInteger)connectionCount
+{
+	[[self lock] lock];
+	NSUInteger count = 0;
+	for (ASIConnectionPoolOrigin *origin in [[self origins] objectEnumerator]) {
+		count += [[origin idleConnections] count] + [[origin activeConnections] count];
+	}
+	[[self lock] unlock];
+	return count;
+}
+
+- (NSUInteger)idleConnectionCount
+{
+	[[self lock] lock];
+	NSUInteger count = 0;
+	for (ASIConnectionPoolOrigin *origin in [[self origins] objectEnumerator]) {
+		count += [[origin idleConnections] count];
+	}
+	[[self lock] unlock];
+	return count;
+}
+
+- (BOOL)hasIdleConnectionForURL:(NSURL *)url
+{
+	BOOL hasIdleConnection = NO;
+	NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+	[[self lock] lock];
+	for (ASIPersistentConnection *connection in [[self originForKey:[ASIConnectionPool originKeyForURL:url] create:NO] idleConnections]) {
+		if ([connection expires] > now) {
+			hasIdleConnection = YES;
+			break;
+		}
+	}
+	[[self lock] unlock];
+	return hasIdleConnection;
+}
+
+- (NSUInteger)waitingRequestCount
+{
+	[[self lock] lock];
+	NSUInteger count = 0;
+	for (ASIConnectionPoolOrigin *origin in [[self origins] objectEnumerator]) {
+		count += [[origin waitingRequests] count];
+	}
+	[[self lock] unlock];
+	return count;
+}
+
+- (unsigned long long)connectionsCreated
+{
+	[[self lock] lock];
+	unsigned long long count = connectionsCreated;
+	[[self lock] unlock];
+	return count;
+}
+
+- (unsigned long long)connectionsReused
+{
+	[[self lock] lock];
+	unsigned long long count = connectionsReused;
+	[[self lock] unlock];
+	return count;
+}
+
+- (double)reuseRate
+{
+	[[self lock] lock];
+	double rate = 0;
+	if (connectionsCreated + connectionsReused > 0) {
+		rate = (double)connectionsReused/(double)(connectionsCreated + connectionsReused);
+	}
+	[[self lock] unlock];
+	return rate;
+}
+
+@synthesize lock;
+@synthesize origins;
+@synthesize maxConnectionsPerHost;
+@end
@@ -16,21 +16,39 @@
 @interface ASIDataCompressor : NSObject {
 	BOOL streamReady;
 	z_stream zStream;
+
+	// The zlib compression level (0-9, or Z_DEFAULT_COMPRESSION) - only takes effect when setupStream is called
+	int compressionLevel;
 }
 
 // Convenience constructor will call setupStream for you
 + (id)compressor;
 
+// Convenience constructor for a compressor that uses the passed zlib compression level
++ (id)compressorWithLevel:(int)level;
+
 // Compress the passed chunk of data
 // Passing YES for shouldFinish will finalize the deflated data - you must pass YES when you are on the last chunk of data
+// (if you don't know which chunk is the last until you've read it, you can pass YES with no data at all)
 - (NSData *)compressBytes:(Bytef *)bytes length:(NSUInteger)length error:(NSError **)err shouldFinish:(BOOL)shouldFinish;
 
+// Compress all the data in one go. This is quicker than compressBytes:length:error:shouldFinish: for data you already have in memory,
+// because we know how big the output can be before we start (see deflateBound), so the output buffer is never grown
+- (NSData *)compressAllBytes:(Bytef *)bytes length:(NSUInteger)length error:(NSError **)err;
+
 // Convenience method - pass it some data, and you'll get deflated data back
 + (NSData *)compressData:(NSData*)uncompressedData error:(NSError **)err;
 
 // Convenience method - pass it a file containing the data to compress in sourcePath, and it will write deflated data to destinationPath
+// Large files are split into blocks that are compressed at the same time on all available cores (like pigz)
+// The result is still a single gzip member that any gzip decoder can read, though it won't be byte-for-byte the same as zlib's output
 + (BOOL)compressDataFromFile:(NSString *)sourcePath toFile:(NSString *)destinationPath error:(NSError **)err;
 
+// Returns the size of the data in inputStream once it has been gzipped with compressBytes:length:error:shouldFinish:, without storing the compressed data
+// ASIHTTPRequest uses this to find the Content-Length of a request body it will compress as it sends it
+// Returns 0 and sets err if the stream could not be read or compressed
++ (unsigned long long)compressedLengthOfDataFromStream:(NSInputStream *)inputStream level:(int)level error:(NSError **)err;
+
 // Sets up zlib to handle the inflating. You only need to call this yourself if you aren't using the convenience constructor 'compressor'
 - (NSError *)setupStream;
 
@@ -39,4 +57,5 @@
 - (NSError *)closeStream;
 
 @property (atomic, assign, readonly) BOOL streamReady;
+@property (atomic, assign) int compressionLevel;
 @end
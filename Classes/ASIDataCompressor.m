@@ -8,23 +8,114 @@
 
 #import "ASIDataCompressor.h"
 #import "ASIHTTPRequest.h"
+#if ASI_LIBDEFLATE_SUPPORT
+#import <libdeflate.h>
+#endif
 
 #define DATA_CHUNK_SIZE 262144 // Deal with gzipped data in 256KB chunks
 #define COMPRESSION_AMOUNT Z_DEFAULT_COMPRESSION
 
+// Files at least this big are compressed on several threads at once
+#define PARALLEL_COMPRESSION_MINIMUM_FILE_SIZE (DATA_CHUNK_SIZE*8)
+
+// Each block compressed in parallel is primed with this much of the data before it, so we lose very little compression by splitting the file up
+#define PARALLEL_COMPRESSION_DICTIONARY_SIZE 32768
+
 @interface ASIDataCompressor ()
 + (NSError *)deflateErrorWithCode:(int)code;
+#if NS_BLOCKS_AVAILABLE
++ (BOOL)compressDataFromFileInParallel:(NSString *)sourcePath toFile:(NSString *)destinationPath error:(NSError **)err;
+#endif
 @end
 
+#if NS_BLOCKS_AVAILABLE
+// Deflates a block of a file as a raw deflate stream, primed with the data that came before it
+// The output ends with a sync flush rather than a final block, so the output for each block can simply be joined together
+static int ASIDeflateBlock(const Bytef *dictionary, NSUInteger dictionaryLength, Bytef *input, NSUInteger inputLength, NSMutableData *outputData)
+{
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	int status = deflateInit2(&stream, COMPRESSION_AMOUNT, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	if (status != Z_OK) {
+		return status;
+	}
+	if (dictionaryLength) {
+		status = deflateSetDictionary(&stream, dictionary, (uInt)dictionaryLength);
+		if (status != Z_OK) {
+			deflateEnd(&stream);
+			return status;
+		}
+	}
+
+	// deflateBound doesn't include the empty stored block written by the sync flush
+	[outputData setLength:deflateBound(&stream, (uLong)inputLength)+16];
+	stream.next_in = input;
+	stream.avail_in = (uInt)inputLength;
+	stream.next_out = (Bytef *)[outputData mutableBytes];
+	stream.avail_out = (uInt)[outputData length];
+	status = deflate(&stream, Z_SYNC_FLUSH);
+	if (status == Z_OK && (stream.avail_in || !stream.avail_out)) {
+		status = Z_BUF_ERROR;
+	}
+	[outputData setLength:stream.total_out];
+	deflateEnd(&stream);
+	return status;
+}
+
+// Reads until buffer is full or we reach the end of the stream, returns -1 if reading failed
+static NSInteger ASIReadBlock(NSInputStream *inputStream, UInt8 *buffer, NSUInteger length)
+{
+	NSUInteger totalRead = 0;
+	while (totalRead < length) {
+		NSInteger readLength = [inputStream read:buffer+totalRead maxLength:length-totalRead];
+		if (readLength < 0 || [inputStream streamStatus] == NSStreamStatusError) {
+			return -1;
+		}
+		if (readLength == 0) {
+			break;
+		}
+		totalRead += (NSUInteger)readLength;
+	}
+	return (NSInteger)totalRead;
+}
+
+// Writes all of length bytes, returns NO if writing failed
+static BOOL ASIWriteBlock(NSOutputStream *outputStream, const UInt8 *buffer, NSUInteger length)
+{
+	NSUInteger totalWritten = 0;
+	while (totalWritten < length) {
+		NSInteger writtenLength = [outputStream write:buffer+totalWritten maxLength:length-totalWritten];
+		if (writtenLength <= 0) {
+			return NO;
+		}
+		totalWritten += (NSUInteger)writtenLength;
+	}
+	return YES;
+}
+#endif
+
 @implementation ASIDataCompressor
 
 + (id)compressor
+{
+	return [self compressorWithLevel:COMPRESSION_AMOUNT];
+}
+
++ (id)compressorWithLevel:(int)level
 {
 	ASIDataCompressor *compressor = [[[self alloc] init] autorelease];
+	[compressor setCompressionLevel:level];
 	[compressor setupStream];
 	return compressor;
 }
 
+- (id)init
+{
+	self = [super init];
+	compressionLevel = COMPRESSION_AMOUNT;
+	return self;
+}
+
 - (void)dealloc
 {
 	if (streamReady) {
@@ -44,7 +135,7 @@
 	zStream.opaque = Z_NULL;
 	zStream.avail_in = 0;
 	zStream.next_in = 0;
-	int status = deflateInit2(&zStream, COMPRESSION_AMOUNT, Z_DEFLATED, (15+16), 8, Z_DEFAULT_STRATEGY);
+	int status = deflateInit2(&zStream, compressionLevel, Z_DEFLATED, (15+16), 8, Z_DEFAULT_STRATEGY);
 	if (status != Z_OK) {
 		return [[self class] deflateErrorWithCode:status];
 	}
@@ -68,39 +159,46 @@
 
 - (NSData *)compressBytes:(Bytef *)bytes length:(NSUInteger)length error:(NSError **)err shouldFinish:(BOOL)shouldFinish
 {
-	if (length == 0) return nil;
+	if (length == 0 && !shouldFinish) return nil;
 	
-	NSUInteger halfLength = length/2;
+	// Make sure we always have room to grow, even for tiny (or empty) chunks
+	NSUInteger halfLength = MAX(length/2, 64);
 	
 	// We'll take a guess that the compressed data will fit in half the size of the original (ie the max to compress at once is half DATA_CHUNK_SIZE), if not, we'll increase it below
 	NSMutableData *outputData = [NSMutableData dataWithLength:length/2]; 
 	
 	int status;
 	
+	// zlib can only take UINT_MAX bytes at a time, so we give it larger inputs a piece at a time, and only finish with the last piece
+	NSUInteger unfedLength = length;
 	zStream.next_in = bytes;
-	zStream.avail_in = (unsigned int)length;
-	zStream.avail_out = 0;
 
 	NSUInteger bytesProcessedAlready = zStream.total_out;
-	while (zStream.avail_out == 0) {
-		
-		if (zStream.total_out-bytesProcessedAlready >= [outputData length]) {
-			[outputData increaseLengthBy:halfLength];
-		}
-		
-		zStream.next_out = (Bytef*)[outputData mutableBytes] + zStream.total_out-bytesProcessedAlready;
-		zStream.avail_out = (unsigned int)([outputData length] - (zStream.total_out-bytesProcessedAlready));
-		status = deflate(&zStream, shouldFinish ? Z_FINISH : Z_NO_FLUSH);
-		
-		if (status == Z_STREAM_END) {
-			break;
-		} else if (status != Z_OK) {
-			if (err) {
-				*err = [[self class] deflateErrorWithCode:status];
+	do {
+		zStream.avail_in = (unsigned int)MIN(unfedLength, (NSUInteger)UINT_MAX);
+		unfedLength -= zStream.avail_in;
+		zStream.avail_out = 0;
+
+		while (zStream.avail_out == 0) {
+			
+			if (zStream.total_out-bytesProcessedAlready >= [outputData length]) {
+				[outputData increaseLengthBy:halfLength];
+			}
+			
+			zStream.next_out = (Bytef*)[outputData mutableBytes] + zStream.total_out-bytesProcessedAlready;
+			zStream.avail_out = (unsigned int)MIN([outputData length] - (zStream.total_out-bytesProcessedAlready), (NSUInteger)UINT_MAX);
+			status = deflate(&zStream, (shouldFinish && !unfedLength) ? Z_FINISH : Z_NO_FLUSH);
+			
+			if (status == Z_STREAM_END) {
+				break;
+			} else if (status != Z_OK) {
+				if (err) {
+					*err = [[self class] deflateErrorWithCode:status];
+				}
+				return NO;
 			}
-			return NO;
 		}
-	}
+	} while (unfedLength);
 
 	// Set real length
 	[outputData setLength: zStream.total_out-bytesProcessedAlready];
@@ -108,10 +206,52 @@
 }
 
 
+- (NSData *)compressAllBytes:(Bytef *)bytes length:(NSUInteger)length error:(NSError **)err
+{
+	if (length == 0) return nil;
+
+	// zlib can only take this much in one go, so we let compressBytes: give it to zlib a piece at a time
+	if (length > UINT_MAX) {
+		return [self compressBytes:bytes length:length error:err shouldFinish:YES];
+	}
+
+	#if ASI_LIBDEFLATE_SUPPORT
+	// Z_DEFAULT_COMPRESSION is level 6, so we use the same level here
+	struct libdeflate_compressor *compressor = libdeflate_alloc_compressor(compressionLevel == Z_DEFAULT_COMPRESSION ? 6 : compressionLevel);
+	if (compressor) {
+		NSMutableData *outputData = [NSMutableData dataWithLength:libdeflate_gzip_compress_bound(compressor, length)];
+		size_t compressedLength = libdeflate_gzip_compress(compressor, bytes, length, [outputData mutableBytes], [outputData length]);
+		libdeflate_free_compressor(compressor);
+		if (compressedLength) {
+			[outputData setLength:compressedLength];
+			return outputData;
+		}
+	}
+	#endif
+
+	// deflateBound includes the gzip header and trailer, so deflate will always finish in a single call
+	NSMutableData *outputData = [NSMutableData dataWithLength:deflateBound(&zStream, (uLong)length)];
+	NSUInteger bytesProcessedAlready = zStream.total_out;
+	zStream.next_in = bytes;
+	zStream.avail_in = (unsigned int)length;
+	zStream.next_out = (Bytef *)[outputData mutableBytes];
+	zStream.avail_out = (unsigned int)[outputData length];
+
+	int status = deflate(&zStream, Z_FINISH);
+	if (status != Z_STREAM_END) {
+		if (err) {
+			*err = [[self class] deflateErrorWithCode:status];
+		}
+		return nil;
+	}
+	[outputData setLength:zStream.total_out-bytesProcessedAlready];
+	return outputData;
+}
+
 + (NSData *)compressData:(NSData*)uncompressedData error:(NSError **)err
 {
 	NSError *theError = nil;
-	NSData *outputData = [[ASIDataCompressor compressor] compressBytes:(Bytef *)[uncompressedData bytes] length:[uncompressedData length] error:&theError shouldFinish:YES];
+	NSData *outputData = [[ASIDataCompressor compressor] compressAllBytes:(Bytef *)[uncompressedData bytes] length:[uncompressedData length] error:&theError];
 	if (theError) {
 		if (err) {
 			*err = theError;
@@ -142,6 +282,14 @@
 		}
 		return NO;
 	}
+
+	#if NS_BLOCKS_AVAILABLE
+	// Big files are worth splitting up between cores
+	unsigned long long fileSize = [[fileManager attributesOfItemAtPath:sourcePath error:NULL] fileSize];
+	if (fileSize >= PARALLEL_COMPRESSION_MINIMUM_FILE_SIZE && [[NSProcessInfo processInfo] activeProcessorCount] > 1) {
+		return [self compressDataFromFileInParallel:sourcePath toFile:destinationPath error:err];
+	}
+	#endif
 	
 	UInt8 inputData[DATA_CHUNK_SIZE];
 	NSData *outputData;
@@ -210,10 +358,165 @@
 	return YES;
 }
 
+#if NS_BLOCKS_AVAILABLE
++ (BOOL)compressDataFromFileInParallel:(NSString *)sourcePath toFile:(NSString *)destinationPath error:(NSError **)err
+{
+	// We read a batch of blocks, compress them all at once, then write them out in order
+	// Two blocks per core keeps every core busy without holding too much of the file in memory
+	NSUInteger blocksPerBatch = [[NSProcessInfo processInfo] activeProcessorCount]*2;
+	UInt8 *input = malloc(blocksPerBatch*DATA_CHUNK_SIZE);
+	NSUInteger *blockLengths = malloc(blocksPerBatch*sizeof(NSUInteger));
+	uLong *blockCRCs = malloc(blocksPerBatch*sizeof(uLong));
+	int *blockStatuses = malloc(blocksPerBatch*sizeof(int));
+	UInt8 *dictionary = malloc(PARALLEL_COMPRESSION_DICTIONARY_SIZE);
+	NSUInteger dictionaryLength = 0;
+	NSMutableArray *blockOutputs = [NSMutableArray arrayWithCapacity:blocksPerBatch];
+	NSUInteger b;
+	for (b=0; b<blocksPerBatch; b++) {
+		[blockOutputs addObject:[NSMutableData data]];
+	}
+
+	uLong crc = crc32(0L, Z_NULL, 0);
+	unsigned long long totalLength = 0;
+	NSError *theError = nil;
+
+	NSInputStream *inputStream = [NSInputStream inputStreamWithFileAtPath:sourcePath];
+	[inputStream open];
+	NSOutputStream *outputStream = [NSOutputStream outputStreamToFileAtPath:destinationPath append:NO];
+	[outputStream open];
+
+	// A gzip header with no file name or modification time, the same as zlib writes
+	const UInt8 header[10] = {0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 0x03};
+	if (!ASIWriteBlock(outputStream, header, sizeof(header))) {
+		theError = [NSError errorWithDomain:NetworkRequestErrorDomain code:ASICompressionError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:[NSString stringWithFormat:@"Compression of %@ failed because we were unable to write to the destination data file at %@",sourcePath,destinationPath],NSLocalizedDescriptionKey,[outputStream streamError],NSUnderlyingErrorKey,nil]];
+	}
+
+	BOOL reachedEnd = NO;
+	while (!theError && !reachedEnd) {
+
+		// Read the next batch
+		NSUInteger blockCount = 0;
+		while (blockCount < blocksPerBatch) {
+			NSInteger readLength = ASIReadBlock(inputStream, input+blockCount*DATA_CHUNK_SIZE, DATA_CHUNK_SIZE);
+			if (readLength < 0) {
+				theError = [NSError errorWithDomain:NetworkRequestErrorDomain code:ASICompressionError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:[NSString stringWithFormat:@"Compression of %@ failed because we were unable to read from the source data file",sourcePath],NSLocalizedDescriptionKey,[inputStream streamError],NSUnderlyingErrorKey,nil]];
+				break;
+			}
+			if (readLength) {
+				blockLengths[blockCount++] = (NSUInteger)readLength;
+			}
+			if (readLength < DATA_CHUNK_SIZE) {
+				reachedEnd = YES;
+				break;
+			}
+		}
+		if (theError || !blockCount) {
+			break;
+		}
+
+		// Compress every block in the batch at once
+		// Only the last block can be shorter than DATA_CHUNK_SIZE, so every other block can prime the next one with a full dictionary
+		dispatch_apply(blockCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+			UInt8 *block = input+i*DATA_CHUNK_SIZE;
+			const UInt8 *blockDictionary = (i ? block-PARALLEL_COMPRESSION_DICTIONARY_SIZE : dictionary);
+			NSUInteger blockDictionaryLength = (i ? PARALLEL_COMPRESSION_DICTIONARY_SIZE : dictionaryLength);
+			blockCRCs[i] = crc32(crc32(0L, Z_NULL, 0), block, (uInt)blockLengths[i]);
+			blockStatuses[i] = ASIDeflateBlock(blockDictionary, blockDictionaryLength, block, blockLengths[i], [blockOutputs objectAtIndex:i]);
+		});
+
+		// Write them out in order
+		for (b=0; b<blockCount; b++) {
+			if (blockStatuses[b] != Z_OK) {
+				theError = [[self class] deflateErrorWithCode:blockStatuses[b]];
+				break;
+			}
+			NSData *blockOutput = [blockOutputs objectAtIndex:b];
+			if (!ASIWriteBlock(outputStream, (const UInt8 *)[blockOutput bytes], [blockOutput length])) {
+				theError = [NSError errorWithDomain:NetworkRequestErrorDomain code:ASICompressionError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:[NSString stringWithFormat:@"Compression of %@ failed because we were unable to write to the destination data file at %@",sourcePath,destinationPath],NSLocalizedDescriptionKey,[outputStream streamError],NSUnderlyingErrorKey,nil]];
+				break;
+			}
+			crc = crc32_combine(crc, blockCRCs[b], (z_off_t)blockLengths[b]);
+			totalLength += blockLengths[b];
+		}
+
+		// The first block of the next batch is primed with the end of this one
+		UInt8 *lastBlock = input+(blockCount-1)*DATA_CHUNK_SIZE;
+		dictionaryLength = MIN(blockLengths[blockCount-1], PARALLEL_COMPRESSION_DICTIONARY_SIZE);
+		memcpy(dictionary, lastBlock+blockLengths[blockCount-1]-dictionaryLength, dictionaryLength);
+	}
+
+	if (!theError) {
+		// An empty final block (with fixed Huffman codes) ends the deflate stream, then the trailer has the CRC and the length of the original data
+		UInt8 trailer[10] = {0x03, 0x00};
+		NSUInteger i;
+		for (i=0; i<4; i++) {
+			trailer[2+i] = (UInt8)(crc >> (8*i));
+			trailer[6+i] = (UInt8)(totalLength >> (8*i));
+		}
+		if (!ASIWriteBlock(outputStream, trailer, sizeof(trailer))) {
+			theError = [NSError errorWithDomain:NetworkRequestErrorDomain code:ASICompressionError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:[NSString stringWithFormat:@"Compression of %@ failed because we were unable to write to the destination data file at %@",sourcePath,destinationPath],NSLocalizedDescriptionKey,[outputStream streamError],NSUnderlyingErrorKey,nil]];
+		}
+	}
+
+	[inputStream close];
+	[outputStream close];
+	free(input);
+	free(blockLengths);
+	free(blockCRCs);
+	free(blockStatuses);
+	free(dictionary);
+
+	if (theError) {
+		if (err) {
+			*err = theError;
+		}
+		return NO;
+	}
+	return YES;
+}
+#endif
+
++ (unsigned long long)compressedLengthOfDataFromStream:(NSInputStream *)inputStream level:(int)level error:(NSError **)err
+{
+	UInt8 inputData[DATA_CHUNK_SIZE];
+	unsigned long long compressedLength = 0;
+	NSError *theError = nil;
+
+	ASIDataCompressor *compressor = [ASIDataCompressor compressorWithLevel:level];
+	[inputStream open];
+
+	while ([compressor streamReady]) {
+		NSInteger readLength = [inputStream read:inputData maxLength:DATA_CHUNK_SIZE];
+		if (readLength < 0 || [inputStream streamStatus] == NSStreamStatusError) {
+			theError = [NSError errorWithDomain:NetworkRequestErrorDomain code:ASICompressionError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:@"Compression failed because we were unable to read from the source data",NSLocalizedDescriptionKey,[inputStream streamError],NSUnderlyingErrorKey,nil]];
+			break;
+		}
+		NSData *outputData = [compressor compressBytes:inputData length:(NSUInteger)readLength error:&theError shouldFinish:(readLength == 0)];
+		if (theError) {
+			break;
+		}
+		compressedLength += [outputData length];
+		if (readLength == 0) {
+			break;
+		}
+	}
+	[inputStream close];
+	[compressor closeStream];
+
+	if (theError) {
+		if (err) {
+			*err = theError;
+		}
+		return 0;
+	}
+	return compressedLength;
+}
+
 + (NSError *)deflateErrorWithCode:(int)code
 {
 	return [NSError errorWithDomain:NetworkRequestErrorDomain code:ASICompressionError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:[NSString stringWithFormat:@"Compression of data failed with code %d",code],NSLocalizedDescriptionKey,nil]];
 }
 
 @synthesize streamReady;
+@synthesize compressionLevel;
 @end
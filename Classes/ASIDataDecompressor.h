@@ -9,6 +9,14 @@
 // This is a helper class used by ASIHTTPRequest to handle inflating (decompressing) data in memory and on disk
 // You may also find it helpful if you need to inflate data and files yourself - see the class methods below
 // Most of the zlib stuff is based on the sample code by Mark Adler available at http://zlib.net
+//
+// ASIDataDecompressor itself decodes gzip and deflate. Other content encodings (brotli and zstd when turned on in ASIHTTPRequestConfig.h)
+// are decoded by subclasses, which override setupStream, closeStream, uncompressBytes:length:error: and uncompressAllBytes:length:error:
+// ASIHTTPRequest picks the decompressor to use from the response's Content-Encoding header (see decompressorForContentEncoding:)
+// When the header lists several encodings (eg 'gzip, br'), they are undone in reverse order by a chain of decompressors
+//
+// Some servers send 'deflate' responses as raw deflate data without the zlib header the spec asks for, so when the header check fails
+// at the start of a stream, we start again expecting raw deflate
 
 #import <Foundation/Foundation.h>
 #import <zlib.h>
@@ -16,20 +24,52 @@
 @interface ASIDataDecompressor : NSObject {
 	BOOL streamReady;
 	z_stream zStream;
+
+	// Set once we have switched zStream to raw deflate, so we only try it once
+	BOOL triedRawDeflate;
 }
 
 // Convenience constructor will call setupStream for you
 + (id)decompressor;
 
+// Returns the class that decodes data with the supplied Content-Encoding, or nil if we can't decode it
+// encoding must be a single encoding - see decompressorForContentEncoding: for Content-Encoding headers that list several
++ (Class)decompressorClassForContentEncoding:(NSString *)encoding;
+
+// Returns a decompressor (already set up) that undoes every encoding in a Content-Encoding header, in reverse order of how they were applied
+// Returns nil if the header doesn't list any encodings other than 'identity', or lists one we can't decode
++ (id)decompressorForContentEncoding:(NSString *)encoding;
+
+// Returns YES if decompressorForContentEncoding: would return a decompressor for this Content-Encoding header
++ (BOOL)canDecodeContentEncoding:(NSString *)encoding;
+
+// The content encodings we can decode, most preferred first. ASIHTTPRequest uses these for its Accept-Encoding header
++ (NSArray *)supportedContentEncodings;
+
+// Use decompressorClass (a subclass of ASIDataDecompressor) to decode responses with the supplied Content-Encoding
+// Encodings registered this way are preferred to the built-in ones
++ (void)registerDecompressorClass:(Class)decompressorClass forContentEncoding:(NSString *)encoding;
+
 // Uncompress the passed chunk of data
 - (NSData *)uncompressBytes:(Bytef *)bytes length:(NSUInteger)length error:(NSError **)err;
 
+// Inflate a complete compressed body in one go
+// For gzipped data this is quicker than uncompressBytes:length:error:, because the gzip trailer tells us how big the output will be before we start
+// Gzipped data made of several members one after another is inflated in full
+- (NSData *)uncompressAllBytes:(Bytef *)bytes length:(NSUInteger)length error:(NSError **)err;
+
 // Convenience method - pass it some deflated data, and you'll get inflated data back
+// Call this on a subclass to decode data in that subclass's encoding
 + (NSData *)uncompressData:(NSData*)compressedData error:(NSError **)err;
 
 // Convenience method - pass it a file containing deflated data in sourcePath, and it will write inflated data to destinationPath
+// Call this on a subclass to decode a file in that subclass's encoding
 + (BOOL)uncompressDataFromFile:(NSString *)sourcePath toFile:(NSString *)destinationPath error:(NSError **)err;
 
+// Inflates the file at sourcePath into destinationPath using this decompressor, which must be set up and not have been used yet
+// The stream is closed when this returns
+- (BOOL)uncompressFile:(NSString *)sourcePath toFile:(NSString *)destinationPath error:(NSError **)err;
+
 // Sets up zlib to handle the inflating. You only need to call this yourself if you aren't using the convenience constructor 'decompressor'
 - (NSError *)setupStream;
 
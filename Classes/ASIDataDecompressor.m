@@ -8,15 +8,189 @@
 
 #import "ASIDataDecompressor.h"
 #import "ASIHTTPRequest.h"
+#if ASI_BROTLI_SUPPORT
+#import <brotli/decode.h>
+#endif
+#if ASI_ZSTD_SUPPORT
+#import <zstd.h>
+#endif
+#if ASI_LIBDEFLATE_SUPPORT
+#import <libdeflate.h>
+#endif
 
 #define DATA_CHUNK_SIZE 262144 // Deal with gzipped data in 256KB chunks
 
+// Maps lowercased content encodings to the class that decodes them
+static NSMutableDictionary *decompressorClasses = nil;
+
+// The encodings in decompressorClasses, most preferred first
+static NSMutableArray *supportedContentEncodings = nil;
+
+// Mediates access to decompressorClasses and supportedContentEncodings
+static NSLock *decompressorClassesLock = nil;
+
+// No deflate stream can expand to more than about 1032 times its compressed size, so a gzip trailer claiming more than this is wrong
+#define MAX_INFLATE_RATIO 1032
+
+// A trailer can still claim up to 1032 times the compressed size without being impossible, so we don't take its word for anything above
+// this ratio (or MAX_TRUSTED_INFLATED_LENGTH, for small bodies). Beyond that, we start smaller and grow the buffer if the data really is that big
+#define MAX_TRUSTED_INFLATE_RATIO 16
+#define MAX_TRUSTED_INFLATED_LENGTH (1024*1024)
+
+// Returns YES if bytes starts with the gzip magic number
+static BOOL ASIIsGzipped(const Bytef *bytes, NSUInteger length)
+{
+	return (length >= 18 && bytes[0] == 0x1f && bytes[1] == 0x8b);
+}
+
+// Returns our best guess at the inflated size of some compressed data, and sets isExact when it comes from a gzip trailer we believe
+// A gzip stream ends with the size of the original data (modulo 2^32, so we sanity check it), for anything else we guess
+static NSUInteger ASIExpectedInflatedLength(const Bytef *bytes, NSUInteger length, BOOL *isExact)
+{
+	*isExact = NO;
+	if (ASIIsGzipped(bytes, length)) {
+		const Bytef *trailer = bytes+length-4;
+		NSUInteger originalLength = (NSUInteger)trailer[0] | ((NSUInteger)trailer[1] << 8) | ((NSUInteger)trailer[2] << 16) | ((NSUInteger)trailer[3] << 24);
+		if (originalLength && originalLength/MAX_INFLATE_RATIO <= length) {
+			if (originalLength <= MAX_TRUSTED_INFLATED_LENGTH || originalLength/MAX_TRUSTED_INFLATE_RATIO <= length) {
+				*isExact = YES;
+				return originalLength;
+			}
+			return length*MAX_TRUSTED_INFLATE_RATIO;
+		}
+	}
+	return length*3;
+}
+
 @interface ASIDataDecompressor ()
 + (NSError *)inflateErrorWithCode:(int)code;
++ (NSArray *)decompressorClassesForContentEncoding:(NSString *)encoding;
+- (BOOL)switchToRawDeflate;
 @end;
 
+// Undoes several content encodings one after another
+@interface ASIChainedDecompressor : ASIDataDecompressor {
+	// In the order we decode with them, ie the reverse of the order the encodings were applied
+	NSArray *decompressors;
+}
+- (id)initWithDecompressors:(NSArray *)theDecompressors;
+@end
+
+#if ASI_BROTLI_SUPPORT
+// Decodes brotli ('br') compressed data
+@interface ASIBrotliDecompressor : ASIDataDecompressor {
+	BrotliDecoderState *brotliState;
+}
+@end
+#endif
+
+#if ASI_ZSTD_SUPPORT
+// Decodes zstd compressed data
+@interface ASIZstdDecompressor : ASIDataDecompressor {
+	ZSTD_DStream *zstdStream;
+}
+@end
+#endif
+
 @implementation ASIDataDecompressor
 
++ (void)initialize
+{
+	if (self == [ASIDataDecompressor class]) {
+		decompressorClassesLock = [[NSLock alloc] init];
+		decompressorClasses = [[NSMutableDictionary alloc] init];
+		supportedContentEncodings = [[NSMutableArray alloc] init];
+
+		// Registered in reverse order of preference, as each one is preferred to those before it
+		[self registerDecompressorClass:self forContentEncoding:@"deflate"];
+		[self registerDecompressorClass:self forContentEncoding:@"gzip"];
+		#if ASI_BROTLI_SUPPORT
+		[self registerDecompressorClass:[ASIBrotliDecompressor class] forContentEncoding:@"br"];
+		#endif
+		#if ASI_ZSTD_SUPPORT
+		[self registerDecompressorClass:[ASIZstdDecompressor class] forContentEncoding:@"zstd"];
+		#endif
+
+		// Old name for gzip that some servers still use - we decode it, but don't ask for it
+		[decompressorClasses setObject:self forKey:@"x-gzip"];
+	}
+}
+
++ (void)registerDecompressorClass:(Class)decompressorClass forContentEncoding:(NSString *)encoding
+{
+	encoding = [encoding lowercaseString];
+	[decompressorClassesLock lock];
+	[decompressorClasses setObject:decompressorClass forKey:encoding];
+	[supportedContentEncodings removeObject:encoding];
+	[supportedContentEncodings insertObject:encoding atIndex:0];
+	[decompressorClassesLock unlock];
+}
+
++ (Class)decompressorClassForContentEncoding:(NSString *)encoding
+{
+	if (!encoding) {
+		return nil;
+	}
+	encoding = [[encoding stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]] lowercaseString];
+	[decompressorClassesLock lock];
+	Class decompressorClass = [decompressorClasses objectForKey:encoding];
+	[decompressorClassesLock unlock];
+	return decompressorClass;
+}
+
+// Returns the classes that undo each encoding in a Content-Encoding header, last applied first
+// Returns nil if there's nothing to decode, or an encoding we can't decode
++ (NSArray *)decompressorClassesForContentEncoding:(NSString *)encoding
+{
+	if (!encoding) {
+		return nil;
+	}
+	NSMutableArray *classes = [NSMutableArray array];
+	for (NSString *token in [[encoding componentsSeparatedByString:@","] reverseObjectEnumerator]) {
+		token = [[token stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]] lowercaseString];
+		if (![token length] || [token isEqualToString:@"identity"]) {
+			continue;
+		}
+		Class decompressorClass = [self decompressorClassForContentEncoding:token];
+		if (!decompressorClass) {
+			return nil;
+		}
+		[classes addObject:decompressorClass];
+	}
+	if (![classes count]) {
+		return nil;
+	}
+	return classes;
+}
+
++ (id)decompressorForContentEncoding:(NSString *)encoding
+{
+	NSArray *classes = [self decompressorClassesForContentEncoding:encoding];
+	if ([classes count] == 1) {
+		return [[classes objectAtIndex:0] decompressor];
+	} else if (!classes) {
+		return nil;
+	}
+	NSMutableArray *decompressors = [NSMutableArray arrayWithCapacity:[classes count]];
+	for (Class decompressorClass in classes) {
+		[decompressors addObject:[decompressorClass decompressor]];
+	}
+	return [[[ASIChainedDecompressor alloc] initWithDecompressors:decompressors] autorelease];
+}
+
++ (BOOL)canDecodeContentEncoding:(NSString *)encoding
+{
+	return ([self decompressorClassesForContentEncoding:encoding] != nil);
+}
+
++ (NSArray *)supportedContentEncodings
+{
+	[decompressorClassesLock lock];
+	NSArray *encodings = [[supportedContentEncodings copy] autorelease];
+	[decompressorClassesLock unlock];
+	return encodings;
+}
+
 + (id)decompressor
 {
 	ASIDataDecompressor *decompressor = [[[self alloc] init] autorelease];
@@ -43,6 +217,7 @@
 	zStream.opaque = Z_NULL;
 	zStream.avail_in = 0;
 	zStream.next_in = 0;
+	triedRawDeflate = NO;
 	int status = inflateInit2(&zStream, (15+32));
 	if (status != Z_OK) {
 		return [[self class] inflateErrorWithCode:status];
@@ -65,6 +240,16 @@
 	return nil;
 }
 
+// Called when inflate fails - if the zlib header check failed at the very start of the stream, we reset zStream to expect raw deflate
+- (BOOL)switchToRawDeflate
+{
+	if (triedRawDeflate || zStream.total_out != 0) {
+		return NO;
+	}
+	triedRawDeflate = YES;
+	return (inflateReset2(&zStream, -MAX_WBITS) == Z_OK);
+}
+
 - (NSData *)uncompressBytes:(Bytef *)bytes length:(NSUInteger)length error:(NSError **)err
 {
 	if (length == 0) return nil;
@@ -74,10 +259,13 @@
 
 	int status;
 	
+	// zlib can only take UINT_MAX bytes at a time, so we give it larger inputs a piece at a time
 	zStream.next_in = bytes;
-	zStream.avail_in = (unsigned int)length;
+	zStream.avail_in = (unsigned int)MIN(length, (NSUInteger)UINT_MAX);
 	zStream.avail_out = 0;
+	NSUInteger unfedLength = length-zStream.avail_in;
 	
+	BOOL atStartOfStream = (zStream.total_in == 0);
 	NSUInteger bytesProcessedAlready = zStream.total_out;
 	while (zStream.avail_in != 0) {
 		
@@ -86,12 +274,23 @@
 		}
 		
 		zStream.next_out = (Bytef*)[outputData mutableBytes] + zStream.total_out-bytesProcessedAlready;
-		zStream.avail_out = (unsigned int)([outputData length] - (zStream.total_out-bytesProcessedAlready));
+		zStream.avail_out = (unsigned int)MIN([outputData length] - (zStream.total_out-bytesProcessedAlready), (NSUInteger)UINT_MAX);
 		
 		status = inflate(&zStream, Z_NO_FLUSH);
 		
+		// next_in is already at the start of the next piece
+		if (zStream.avail_in == 0 && unfedLength) {
+			zStream.avail_in = (unsigned int)MIN(unfedLength, (NSUInteger)UINT_MAX);
+			unfedLength -= zStream.avail_in;
+		}
+		
 		if (status == Z_STREAM_END) {
 			break;
+		} else if (status == Z_DATA_ERROR && atStartOfStream && [self switchToRawDeflate]) {
+			zStream.next_in = bytes;
+			zStream.avail_in = (unsigned int)MIN(length, (NSUInteger)UINT_MAX);
+			unfedLength = length-zStream.avail_in;
+			continue;
 		} else if (status != Z_OK) {
 			if (err) {
 				*err = [[self class] inflateErrorWithCode:status];
@@ -106,10 +305,91 @@
 }
 
 
+- (NSData *)uncompressAllBytes:(Bytef *)bytes length:(NSUInteger)length error:(NSError **)err
+{
+	if (length == 0) return nil;
+
+	// zlib can only take this much in one go, so we let uncompressBytes: give it to zlib a piece at a time
+	if (length > UINT_MAX) {
+		return [self uncompressBytes:bytes length:length error:err];
+	}
+
+	BOOL isExact;
+	NSUInteger expectedLength = ASIExpectedInflatedLength(bytes, length, &isExact);
+
+	#if ASI_LIBDEFLATE_SUPPORT
+	// libdeflate needs to know how big the output will be, so we only use it when there's a gzip trailer to tell us
+	// If the trailer is wrong (eg for a multi-member gzip file, where it only gives the size of the last member) or the data is damaged, we let zlib deal with it below
+	if (isExact) {
+		struct libdeflate_decompressor *decompressor = libdeflate_alloc_decompressor();
+		if (decompressor) {
+			NSMutableData *outputData = [NSMutableData dataWithLength:expectedLength];
+			size_t inflatedLength = 0;
+			enum libdeflate_result result = libdeflate_gzip_decompress(decompressor, bytes, length, [outputData mutableBytes], [outputData length], &inflatedLength);
+			libdeflate_free_decompressor(decompressor);
+			if (result == LIBDEFLATE_SUCCESS) {
+				[outputData setLength:inflatedLength];
+				return outputData;
+			}
+		}
+	}
+	#endif
+
+	NSMutableData *outputData = [NSMutableData dataWithLength:expectedLength];
+	NSUInteger written = 0;
+	int status;
+
+	zStream.next_in = bytes;
+	zStream.avail_in = (unsigned int)length;
+
+	// We count what we've written ourselves, because inflateReset (for the next member of a multi-member gzip file) sets total_out back to zero
+	BOOL atStartOfStream = (zStream.total_in == 0);
+	while (zStream.avail_in != 0) {
+
+		// Only happens when we didn't know how big the output would be, or didn't believe the gzip trailer
+		if (written >= [outputData length]) {
+			[outputData increaseLengthBy:[outputData length]];
+		}
+
+		zStream.next_out = (Bytef*)[outputData mutableBytes] + written;
+		zStream.avail_out = (unsigned int)MIN([outputData length]-written, (NSUInteger)UINT_MAX);
+
+		status = inflate(&zStream, Z_NO_FLUSH);
+		written = (NSUInteger)(zStream.next_out-(Bytef*)[outputData mutableBytes]);
+
+		if (status == Z_STREAM_END) {
+			// A gzip file can be several gzip members one after another (eg files that were concatenated), so we carry on with the next one
+			if (zStream.avail_in < 2 || zStream.next_in[0] != 0x1f || zStream.next_in[1] != 0x8b) {
+				break;
+			}
+			status = inflateReset(&zStream);
+			if (status != Z_OK) {
+				if (err) {
+					*err = [[self class] inflateErrorWithCode:status];
+				}
+				return nil;
+			}
+			atStartOfStream = NO;
+		} else if (status == Z_DATA_ERROR && atStartOfStream && [self switchToRawDeflate]) {
+			zStream.next_in = bytes;
+			zStream.avail_in = (unsigned int)length;
+			written = 0;
+		} else if (status != Z_OK) {
+			if (err) {
+				*err = [[self class] inflateErrorWithCode:status];
+			}
+			return nil;
+		}
+	}
+
+	[outputData setLength:written];
+	return outputData;
+}
+
 + (NSData *)uncompressData:(NSData*)compressedData error:(NSError **)err
 {
 	NSError *theError = nil;
-	NSData *outputData = [[ASIDataDecompressor decompressor] uncompressBytes:(Bytef *)[compressedData bytes] length:[compressedData length] error:&theError];
+	NSData *outputData = [[self decompressor] uncompressAllBytes:(Bytef *)[compressedData bytes] length:[compressedData length] error:&theError];
 	if (theError) {
 		if (err) {
 			*err = theError;
@@ -120,6 +400,11 @@
 }
 
 + (BOOL)uncompressDataFromFile:(NSString *)sourcePath toFile:(NSString *)destinationPath error:(NSError **)err
+{
+	return [[self decompressor] uncompressFile:sourcePath toFile:destinationPath error:err];
+}
+
+- (BOOL)uncompressFile:(NSString *)sourcePath toFile:(NSString *)destinationPath error:(NSError **)err
 {
 	NSFileManager *fileManager = [[[NSFileManager alloc] init] autorelease];
 
@@ -145,14 +430,19 @@
 	NSError *theError = nil;
 	
 
-	ASIDataDecompressor *decompressor = [ASIDataDecompressor decompressor];
+	if (![self streamReady]) {
+		if (err) {
+			*err = [NSError errorWithDomain:NetworkRequestErrorDomain code:ASICompressionError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:[NSString stringWithFormat:@"Decompression of %@ failed because we were unable to set up the decompressor",sourcePath],NSLocalizedDescriptionKey,nil]];
+		}
+		return NO;
+	}
 
 	NSInputStream *inputStream = [NSInputStream inputStreamWithFileAtPath:sourcePath];
 	[inputStream open];
 	NSOutputStream *outputStream = [NSOutputStream outputStreamToFileAtPath:destinationPath append:NO];
 	[outputStream open];
 	
-    while ([decompressor streamReady]) {
+    while ([self streamReady]) {
 		
 		// Read some data from the file
 		readLength = [inputStream read:inputData maxLength:DATA_CHUNK_SIZE];
@@ -162,7 +452,7 @@
 			if (err) {
 				*err = [NSError errorWithDomain:NetworkRequestErrorDomain code:ASICompressionError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:[NSString stringWithFormat:@"Decompression of %@ failed because we were unable to read from the source data file",sourcePath],NSLocalizedDescriptionKey,[inputStream streamError],NSUnderlyingErrorKey,nil]];
 			}
-            [decompressor closeStream];
+            [self closeStream];
 			return NO;
 		}
 		// Have we reached the end of the input data?
@@ -171,12 +461,12 @@
 		}
 
 		// Attempt to inflate the chunk of data
-		outputData = [decompressor uncompressBytes:inputData length:(NSUInteger)readLength error:&theError];
+		outputData = [self uncompressBytes:inputData length:(NSUInteger)readLength error:&theError];
 		if (theError) {
 			if (err) {
 				*err = theError;
 			}
-			[decompressor closeStream];
+			[self closeStream];
 			return NO;
 		}
 		
@@ -188,7 +478,7 @@
 			if (err) {
 				*err = [NSError errorWithDomain:NetworkRequestErrorDomain code:ASICompressionError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:[NSString stringWithFormat:@"Decompression of %@ failed because we were unable to write to the destination data file at %@",sourcePath,destinationPath],NSLocalizedDescriptionKey,[outputStream streamError],NSUnderlyingErrorKey,nil]];
             }
-			[decompressor closeStream];
+			[self closeStream];
 			return NO;
 		}
 		
@@ -197,7 +487,7 @@
 	[inputStream close];
 	[outputStream close];
 
-	NSError *error = [decompressor closeStream];
+	NSError *error = [self closeStream];
 	if (error) {
 		if (err) {
 			*err = error;
@@ -216,3 +506,239 @@
 
 @synthesize streamReady;
 @end
+
+
+@implementation ASIChainedDecompressor
+
+- (id)initWithDecompressors:(NSArray *)theDecompressors
+{
+	self = [super init];
+	decompressors = [theDecompressors retain];
+	streamReady = YES;
+	return self;
+}
+
+- (void)dealloc
+{
+	[self closeStream];
+	[decompressors release];
+	[super dealloc];
+}
+
+// Our decompressors are set up when they are created
+- (NSError *)setupStream
+{
+	return nil;
+}
+
+- (NSError *)closeStream
+{
+	if (!streamReady) {
+		return nil;
+	}
+	streamReady = NO;
+	NSError *firstError = nil;
+	for (ASIDataDecompressor *decompressor in decompressors) {
+		NSError *theError = [decompressor closeStream];
+		if (!firstError) {
+			firstError = theError;
+		}
+	}
+	return firstError;
+}
+
+- (NSData *)uncompressBytes:(Bytef *)bytes length:(NSUInteger)length error:(NSError **)err
+{
+	NSData *data = [NSData dataWithBytesNoCopy:bytes length:length freeWhenDone:NO];
+	for (ASIDataDecompressor *decompressor in decompressors) {
+		// A decompressor may be holding on to input it can't decode yet, in which case there's nothing for the next one
+		if (![data length]) {
+			return data;
+		}
+		NSError *theError = nil;
+		data = [decompressor uncompressBytes:(Bytef *)[data bytes] length:[data length] error:&theError];
+		if (theError) {
+			if (err) {
+				*err = theError;
+			}
+			return nil;
+		}
+	}
+	return data;
+}
+
+- (NSData *)uncompressAllBytes:(Bytef *)bytes length:(NSUInteger)length error:(NSError **)err
+{
+	NSData *data = [NSData dataWithBytesNoCopy:bytes length:length freeWhenDone:NO];
+	for (ASIDataDecompressor *decompressor in decompressors) {
+		if (![data length]) {
+			return data;
+		}
+		NSError *theError = nil;
+		data = [decompressor uncompressAllBytes:(Bytef *)[data bytes] length:[data length] error:&theError];
+		if (theError) {
+			if (err) {
+				*err = theError;
+			}
+			return nil;
+		}
+	}
+	return data;
+}
+
+@end
+
+
+#if ASI_BROTLI_SUPPORT
+@implementation ASIBrotliDecompressor
+
+- (NSError *)setupStream
+{
+	if (streamReady) {
+		return nil;
+	}
+	brotliState = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+	if (!brotliState) {
+		return [[self class] inflateErrorWithCode:BROTLI_DECODER_RESULT_ERROR];
+	}
+	streamReady = YES;
+	return nil;
+}
+
+- (NSError *)closeStream
+{
+	if (!streamReady) {
+		return nil;
+	}
+	streamReady = NO;
+	BrotliDecoderDestroyInstance(brotliState);
+	brotliState = NULL;
+	return nil;
+}
+
+- (NSData *)uncompressBytes:(Bytef *)bytes length:(NSUInteger)length error:(NSError **)err
+{
+	if (length == 0) return nil;
+
+	// Brotli usually compresses text much more than gzip, so we start with a bigger buffer
+	NSMutableData *outputData = [NSMutableData dataWithLength:length*4];
+	size_t availableIn = length;
+	const uint8_t *nextIn = bytes;
+	size_t written = 0;
+
+	while (1) {
+		size_t availableOut = [outputData length]-written;
+		uint8_t *nextOut = (uint8_t *)[outputData mutableBytes]+written;
+		BrotliDecoderResult result = BrotliDecoderDecompressStream(brotliState, &availableIn, &nextIn, &availableOut, &nextOut, NULL);
+		written = [outputData length]-availableOut;
+
+		if (result == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT) {
+			[outputData increaseLengthBy:[outputData length]];
+		} else if (result == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT || result == BROTLI_DECODER_RESULT_SUCCESS) {
+			break;
+		} else {
+			if (err) {
+				*err = [[self class] inflateErrorWithCode:(int)BrotliDecoderGetErrorCode(brotliState)];
+			}
+			return nil;
+		}
+	}
+	[outputData setLength:written];
+	return outputData;
+}
+
+- (NSData *)uncompressAllBytes:(Bytef *)bytes length:(NSUInteger)length error:(NSError **)err
+{
+	return [self uncompressBytes:bytes length:length error:err];
+}
+
+@end
+#endif
+
+
+#if ASI_ZSTD_SUPPORT
+@implementation ASIZstdDecompressor
+
+- (NSError *)setupStream
+{
+	if (streamReady) {
+		return nil;
+	}
+	zstdStream = ZSTD_createDStream();
+	if (!zstdStream) {
+		return [[self class] inflateErrorWithCode:0];
+	}
+	size_t status = ZSTD_initDStream(zstdStream);
+	if (ZSTD_isError(status)) {
+		ZSTD_freeDStream(zstdStream);
+		zstdStream = NULL;
+		return [[self class] inflateErrorWithCode:(int)ZSTD_getErrorCode(status)];
+	}
+	streamReady = YES;
+	return nil;
+}
+
+- (NSError *)closeStream
+{
+	if (!streamReady) {
+		return nil;
+	}
+	streamReady = NO;
+	ZSTD_freeDStream(zstdStream);
+	zstdStream = NULL;
+	return nil;
+}
+
+- (NSData *)uncompressBytes:(Bytef *)bytes length:(NSUInteger)length error:(NSError **)err
+{
+	if (length == 0) return nil;
+
+	NSMutableData *outputData = [NSMutableData dataWithLength:MAX(length*4, ZSTD_DStreamOutSize())];
+	ZSTD_inBuffer input = {bytes, length, 0};
+	ZSTD_outBuffer output = {[outputData mutableBytes], [outputData length], 0};
+
+	// Keep going until we've used all the input, and zstd has nothing more to give us
+	while (input.pos < input.size || output.pos == output.size) {
+		if (output.pos == output.size) {
+			[outputData increaseLengthBy:[outputData length]];
+			output.dst = [outputData mutableBytes];
+			output.size = [outputData length];
+		}
+		size_t status = ZSTD_decompressStream(zstdStream, &output, &input);
+		if (ZSTD_isError(status)) {
+			if (err) {
+				*err = [[self class] inflateErrorWithCode:(int)ZSTD_getErrorCode(status)];
+			}
+			return nil;
+		}
+		if (input.pos == input.size && output.pos < output.size) {
+			break;
+		}
+	}
+	[outputData setLength:output.pos];
+	return outputData;
+}
+
+- (NSData *)uncompressAllBytes:(Bytef *)bytes length:(NSUInteger)length error:(NSError **)err
+{
+	// zstd frames usually record their original size, so we can size the output exactly when they do
+	// As with a gzip trailer, we don't take the frame's word for a size far bigger than the data, and let the buffer grow as the data really arrives instead
+	unsigned long long contentSize = ZSTD_getFrameContentSize(bytes, length);
+	if (contentSize == ZSTD_CONTENTSIZE_UNKNOWN || contentSize == ZSTD_CONTENTSIZE_ERROR || contentSize > NSUIntegerMax) {
+		return [self uncompressBytes:bytes length:length error:err];
+	}
+	if (contentSize > MAX_TRUSTED_INFLATED_LENGTH && contentSize/MAX_TRUSTED_INFLATE_RATIO > length) {
+		return [self uncompressBytes:bytes length:length error:err];
+	}
+	NSMutableData *outputData = [NSMutableData dataWithLength:(NSUInteger)contentSize];
+	size_t status = ZSTD_decompress([outputData mutableBytes], [outputData length], bytes, length);
+	if (ZSTD_isError(status)) {
+		// Might be several frames, let the streaming decoder sort it out
+		return [self uncompressBytes:bytes length:length error:err];
+	}
+	[outputData setLength:status];
+	return outputData;
+}
+
+@end
+#endif
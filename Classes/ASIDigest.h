@@ -0,0 +1,53 @@
+//
+//  ASIDigest.h
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import <CommonCrypto/CommonDigest.h>
+
+// Algorithms can be combined, eg (ASIMD5DigestAlgorithm|ASISHA256DigestAlgorithm)
+typedef enum _ASIDigestAlgorithm {
+	ASIMD5DigestAlgorithm = 1,
+	ASISHA256DigestAlgorithm = 2,
+	ASICRC32CDigestAlgorithm = 4
+} ASIDigestAlgorithm;
+
+// An ASIDigest works out one or more digests of data that is passed to it a piece at a time
+// Requests use them to hash request and response bodies as they are sent and received, so you don't need to read a file again to check it
+//
+// Digests are finished the first time you ask for one, after which more data is ignored
+@interface ASIDigest : NSObject {
+
+	// The algorithms we are using
+	NSUInteger algorithms;
+
+	CC_MD5_CTX md5Context;
+	CC_SHA256_CTX sha256Context;
+	uint32_t crc32c;
+
+	// The finished digests, keyed by algorithm
+	NSMutableDictionary *digests;
+
+	// The number of bytes we've been given
+	unsigned long long length;
+}
+
++ (id)digestWithAlgorithms:(NSUInteger)algorithms;
+- (id)initWithAlgorithms:(NSUInteger)algorithms;
+
+// Adds more data to the digests
+- (void)updateWithBytes:(const void *)bytes length:(NSUInteger)length;
+
+// Returns the digest for algorithm (which must be one of the algorithms we were created with), or nil
+// CRC32C digests are 4 bytes, most significant byte first
+- (NSData *)digestForAlgorithm:(ASIDigestAlgorithm)algorithm;
+
+// As above, as a lower case hex string
+- (NSString *)hexDigestForAlgorithm:(ASIDigestAlgorithm)algorithm;
+
+@property (assign, readonly) NSUInteger algorithms;
+@property (assign, readonly) unsigned long long length;
+@end
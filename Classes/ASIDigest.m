@@ -0,0 +1,136 @@
+//
+//  ASIDigest.m
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import "ASIDigest.h"
+
+// Lookup table for CRC32C (the Castagnoli polynomial, reversed), filled in +initialize
+static uint32_t crc32cTable[256];
+
+@interface ASIDigest ()
+- (void)finish;
+@end
+
+@implementation ASIDigest
+
++ (void)initialize
+{
+	if (self == [ASIDigest class]) {
+		uint32_t b;
+		for (b=0; b<256; b++) {
+			uint32_t crc = b;
+			int bit;
+			for (bit=0; bit<8; bit++) {
+				crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : (crc >> 1);
+			}
+			crc32cTable[b] = crc;
+		}
+	}
+}
+
++ (id)digestWithAlgorithms:(NSUInteger)newAlgorithms
+{
+	return [[[self alloc] initWithAlgorithms:newAlgorithms] autorelease];
+}
+
+- (id)initWithAlgorithms:(NSUInteger)newAlgorithms
+{
+	self = [super init];
+	algorithms = newAlgorithms;
+	if (algorithms & ASIMD5DigestAlgorithm) {
+		CC_MD5_Init(&md5Context);
+	}
+	if (algorithms & ASISHA256DigestAlgorithm) {
+		CC_SHA256_Init(&sha256Context);
+	}
+	crc32c = 0xFFFFFFFF;
+	return self;
+}
+
+- (void)dealloc
+{
+	[digests release];
+	[super dealloc];
+}
+
+- (void)updateWithBytes:(const void *)bytes length:(NSUInteger)len
+{
+	if (digests || !len) {
+		return;
+	}
+	length += len;
+
+	// CommonCrypto takes lengths as CC_LONG, so very large buffers are hashed in pieces
+	const unsigned char *remaining = bytes;
+	NSUInteger remainingLength = len;
+	while (remainingLength) {
+		CC_LONG chunk = (CC_LONG)MIN(remainingLength, (NSUInteger)0x40000000);
+		if (algorithms & ASIMD5DigestAlgorithm) {
+			CC_MD5_Update(&md5Context, remaining, chunk);
+		}
+		if (algorithms & ASISHA256DigestAlgorithm) {
+			CC_SHA256_Update(&sha256Context, remaining, chunk);
+		}
+		remaining += chunk;
+		remainingLength -= chunk;
+	}
+
+	if (algorithms & ASICRC32CDigestAlgorithm) {
+		const unsigned char *byte = bytes;
+		const unsigned char *end = byte+len;
+		uint32_t crc = crc32c;
+		while (byte < end) {
+			crc = crc32cTable[(crc ^ *byte++) & 0xFF] ^ (crc >> 8);
+		}
+		crc32c = crc;
+	}
+}
+
+- (void)finish
+{
+	digests = [[NSMutableDictionary alloc] init];
+	if (algorithms & ASIMD5DigestAlgorithm) {
+		unsigned char result[CC_MD5_DIGEST_LENGTH];
+		CC_MD5_Final(result, &md5Context);
+		[digests setObject:[NSData dataWithBytes:result length:CC_MD5_DIGEST_LENGTH] forKey:[NSNumber numberWithUnsignedInt:ASIMD5DigestAlgorithm]];
+	}
+	if (algorithms & ASISHA256DigestAlgorithm) {
+		unsigned char result[CC_SHA256_DIGEST_LENGTH];
+		CC_SHA256_Final(result, &sha256Context);
+		[digests setObject:[NSData dataWithBytes:result length:CC_SHA256_DIGEST_LENGTH] forKey:[NSNumber numberWithUnsignedInt:ASISHA256DigestAlgorithm]];
+	}
+	if (algorithms & ASICRC32CDigestAlgorithm) {
+		uint32_t crc = CFSwapInt32HostToBig(crc32c ^ 0xFFFFFFFF);
+		[digests setObject:[NSData dataWithBytes:&crc length:sizeof(crc)] forKey:[NSNumber numberWithUnsignedInt:ASICRC32CDigestAlgorithm]];
+	}
+}
+
+- (NSData *)digestForAlgorithm:(ASIDigestAlgorithm)algorithm
+{
+	if (!digests) {
+		[self finish];
+	}
+	return [digests objectForKey:[NSNumber numberWithUnsignedInt:algorithm]];
+}
+
+- (NSString *)hexDigestForAlgorithm:(ASIDigestAlgorithm)algorithm
+{
+	NSData *digest = [self digestForAlgorithm:algorithm];
+	if (!digest) {
+		return nil;
+	}
+	const unsigned char *bytes = [digest bytes];
+	NSMutableString *hex = [NSMutableString stringWithCapacity:[digest length]*2];
+	NSUInteger i;
+	for (i=0; i<[digest length]; i++) {
+		[hex appendFormat:@"%02x",bytes[i]];
+	}
+	return hex;
+}
+
+@synthesize algorithms;
+@synthesize length;
+@end
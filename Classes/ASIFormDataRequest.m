@@ -8,6 +8,80 @@
 
 #import "ASIFormDataRequest.h"
 
+// Bytes that don't need to be percent-escaped in a URL-encoded body (letters, numbers, '-', '.' and '_')
+// Everything else is escaped, so we produce exactly what CFURLCreateStringByAddingPercentEscapes does with the characters we pass it
+static BOOL urlSafeBytes[256];
+
+static const char hexDigits[] = "0123456789ABCDEF";
+
+// Returns true if characters that aren't ASCII only ever turn into bytes above 127 in encoding
+// For these encodings, we can percent-escape a string a byte at a time
+static BOOL ASIEncodingCanBeEscapedBytewise(NSStringEncoding encoding)
+{
+	switch (encoding) {
+		case NSASCIIStringEncoding:
+		case NSUTF8StringEncoding:
+		case NSISOLatin1StringEncoding:
+		case NSISOLatin2StringEncoding:
+		case NSMacOSRomanStringEncoding:
+		case NSWindowsCP1250StringEncoding:
+		case NSWindowsCP1251StringEncoding:
+		case NSWindowsCP1252StringEncoding:
+		case NSWindowsCP1253StringEncoding:
+		case NSWindowsCP1254StringEncoding:
+			return YES;
+	}
+	return NO;
+}
+
+// Percent-escapes string in encoding, appending the result to buffer
+// Runs of bytes that don't need escaping (eg the whole of most keys) are copied in one go
+// Like CFURLCreateStringByAddingPercentEscapes, nothing is appended if the string can't be represented in encoding
+static void ASIAppendURLEncodedString(NSMutableData *buffer, NSString *string, NSStringEncoding encoding)
+{
+	CFIndex stringLength = (CFIndex)[string length];
+	if (!stringLength) {
+		return;
+	}
+	CFStringEncoding cfEncoding = CFStringConvertNSStringEncodingToEncoding(encoding);
+	unsigned char *convertedBytes = NULL;
+	CFIndex length = stringLength;
+
+	// Strings stored internally in a compatible 8-bit encoding can be read without converting them
+	const unsigned char *bytes = (const unsigned char *)CFStringGetCStringPtr((CFStringRef)string, cfEncoding);
+	if (!bytes) {
+		CFIndex converted = CFStringGetBytes((CFStringRef)string, CFRangeMake(0, stringLength), cfEncoding, 0, false, NULL, 0, &length);
+		if (converted != stringLength) {
+			return;
+		}
+		convertedBytes = malloc((size_t)length);
+		if (!convertedBytes) {
+			return;
+		}
+		CFStringGetBytes((CFStringRef)string, CFRangeMake(0, stringLength), cfEncoding, 0, false, convertedBytes, length, NULL);
+		bytes = convertedBytes;
+	}
+
+	const unsigned char *end = bytes+length;
+	while (bytes < end) {
+		const unsigned char *run = bytes;
+		while (bytes < end && urlSafeBytes[*bytes]) {
+			bytes++;
+		}
+		if (bytes > run) {
+			[buffer appendBytes:run length:(NSUInteger)(bytes-run)];
+		}
+		if (bytes < end) {
+			char escape[3] = {'%', hexDigits[*bytes >> 4], hexDigits[*bytes & 0x0F]};
+			[buffer appendBytes:escape length:3];
+			bytes++;
+		}
+	}
+	if (convertedBytes) {
+		free(convertedBytes);
+	}
+}
+
 
 // Private stuff
 @interface ASIFormDataRequest ()
@@ -27,9 +101,24 @@
 
 @implementation ASIFormDataRequest
 
++ (void)initialize
+{
+	if (self == [ASIFormDataRequest class]) {
+		unsigned int b;
+		for (b=0; b<256; b++) {
+			urlSafeBytes[b] = ((b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z') || (b >= '0' && b <= '9') || b == '-' || b == '.' || b == '_');
+		}
+	}
+}
+
 #pragma mark utilities
 - (NSString*)encodeURL:(NSString *)string
 {
+	if (ASIEncodingCanBeEscapedBytewise([self stringEncoding])) {
+		NSMutableData *encodedData = [NSMutableData dataWithCapacity:[string length]];
+		ASIAppendURLEncodedString(encodedData, string, [self stringEncoding]);
+		return [[[NSString alloc] initWithData:encodedData encoding:NSASCIIStringEncoding] autorelease];
+	}
 	NSString *newString = [NSMakeCollectable(CFURLCreateStringByAddingPercentEscapes(kCFAllocatorDefault, (CFStringRef)string, NULL, CFSTR(":/?#[]@!$ &'()*+,;=\"<>%{}|\\^~`"), CFStringConvertNSStringEncodingToEncoding([self stringEncoding]))) autorelease];
 	if (newString) {
 		return newString;
@@ -195,10 +284,6 @@
 		[super buildPostBody];
 		return;
 	}	
-	if ([[self fileData] count] > 0) {
-		[self setShouldStreamPostDataFromDisk:YES];
-	}
-	
 	if ([self postFormat] == ASIURLEncodedPostFormat) {
 		[self buildURLEncodedPostBody];
 	} else {
@@ -251,11 +336,12 @@
 		[self appendPostString:[NSString stringWithFormat:@"Content-Disposition: form-data; name=\"%@\"; filename=\"%@\"\r\n", [val objectForKey:@"key"], [val objectForKey:@"fileName"]]];
 		[self appendPostString:[NSString stringWithFormat:@"Content-Type: %@\r\n\r\n", [val objectForKey:@"contentType"]]];
 		
+		// Files are read in place when the request is sent, and data is sent from where it is, rather than being copied into the body now
 		id data = [val objectForKey:@"data"];
 		if ([data isKindOfClass:[NSString class]]) {
-			[self appendPostDataFromFile:data];
+			[self appendPostDataFromFileInPlace:data];
 		} else {
-			[self appendPostData:data];
+			[self appendPostDataInPlace:data];
 		}
 		i++;
 		// Only add the boundary if this is not the last item in the post body
@@ -293,6 +379,28 @@
 	
 	NSUInteger i=0;
 	NSUInteger count = [[self postData] count]-1;
+
+	// The escaped body is plain ASCII, so for most encodings we can write every pair straight into a single buffer
+	// Subclasses that escape values their own way still go through encodeURL:
+	if (ASIEncodingCanBeEscapedBytewise([self stringEncoding]) && [self methodForSelector:@selector(encodeURL:)] == [ASIFormDataRequest instanceMethodForSelector:@selector(encodeURL:)]) {
+		NSMutableData *body = [NSMutableData dataWithCapacity:[[self postData] count]*32];
+		for (NSDictionary *val in [self postData]) {
+			ASIAppendURLEncodedString(body, [val objectForKey:@"key"], [self stringEncoding]);
+			[body appendBytes:"=" length:1];
+			ASIAppendURLEncodedString(body, [val objectForKey:@"value"], [self stringEncoding]);
+			if (i<count) {
+				[body appendBytes:"&" length:1];
+			}
+			i++;
+		}
+#if DEBUG_FORM_DATA_REQUEST
+		[self addToDebugBody:[[[NSString alloc] initWithData:body encoding:NSASCIIStringEncoding] autorelease]];
+		[self addToDebugBody:@"\r\n==== End of application/x-www-form-urlencoded body ====\r\n"];
+#endif
+		[super appendPostData:body];
+		return;
+	}
+
 	for (NSDictionary *val in [self postData]) {
         NSString *data = [NSString stringWithFormat:@"%@=%@%@", [self encodeURL:[val objectForKey:@"key"]], [self encodeURL:[val objectForKey:@"value"]],(i<count ?  @"&" : @"")]; 
 		[self appendPostString:data];
@@ -318,7 +426,7 @@
 	[super appendPostData:data];
 }
 
-- (void)appendPostDataFromFile:(NSString *)file
+- (void)appendPostDataFromFileInPlace:(NSString *)file
 {
 	NSError *err = nil;
 	unsigned long long fileSize = [[[[[[NSFileManager alloc] init] autorelease] attributesOfItemAtPath:file error:&err] objectForKey:NSFileSize] unsignedLongLongValue];
@@ -328,7 +436,13 @@
 		[self addToDebugBody:[NSString stringWithFormat:@"[%llu bytes of data from file '%@']",fileSize,file]];
 	}
 
-	[super appendPostDataFromFile:file];
+	[super appendPostDataFromFileInPlace:file];
+}
+
+- (void)appendPostDataInPlace:(NSData *)data
+{
+	[self addToDebugBody:[NSString stringWithFormat:@"[%lu bytes of data]",(unsigned long)[data length]]];
+	[super appendPostDataInPlace:data];
 }
 
 - (void)addToDebugBody:(NSString *)string
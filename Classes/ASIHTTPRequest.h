@@ -23,8 +23,14 @@
 #import "ASIHTTPRequestDelegate.h"
 #import "ASIProgressDelegate.h"
 #import "ASICacheDelegate.h"
+#import "ASIDigest.h"
 
 @class ASIDataDecompressor;
+@class ASIPersistentConnection;
+@class ASITimerWheel;
+@class ASIBandwidthClass;
+@class ASIResponseBuffer;
+@class ASIRetryPolicy;
 
 extern NSString *ASIHTTPRequestVersion;
 
@@ -60,7 +66,9 @@ typedef enum _ASINetworkErrorType {
 	ASIFileManagementError = 8,
 	ASITooMuchRedirectionErrorType = 9,
 	ASIUnhandledExceptionError = 10,
-	ASICompressionError = 11
+	ASICompressionError = 11,
+	ASIUnexpectedRangeErrorType = 12,
+	ASIDigestMismatchErrorType = 13
 	
 } ASINetworkErrorType;
 
@@ -73,6 +81,30 @@ extern NSString* const NetworkRequestErrorDomain;
 // This number is not official, as far as I know there is no officially documented bandwidth limit
 extern unsigned long const ASIWWANBandwidthThrottleAmount;
 
+// The largest number of network threads requests can be spread across (see setNumberOfNetworkThreads:)
+#define ASIMaximumNetworkThreads 16
+
+// Controls which network thread a request is placed on when more than one network thread is in use
+typedef enum _ASINetworkThreadPolicy {
+	// Requests to the same scheme, host and port always run on the same thread, so they can share persistent connections
+	ASIHostAffinityNetworkThreadPolicy = 0,
+	// Requests run on whichever thread currently has the fewest unfinished requests
+	ASILeastLoadedNetworkThreadPolicy = 1
+} ASINetworkThreadPolicy;
+
+// Controls where a request calls its delegates, queue and blocks
+typedef enum _ASICallbackMode {
+	// On the main thread (the default)
+	ASIMainThreadCallbackMode = 0,
+	// On callbackDispatchQueue - use a serial queue if you need callbacks to arrive in order
+	ASIDispatchQueueCallbackMode = 1,
+	// On callbackOperationQueue - set its maxConcurrentOperationCount to 1 if you need callbacks to arrive in order
+	ASIOperationQueueCallbackMode = 2,
+	// On whichever thread the event happened, usually the network thread running the request
+	// Callbacks must return quickly, as the network thread can't run any other requests until they do
+	ASINetworkThreadCallbackMode = 3
+} ASICallbackMode;
+
 #if NS_BLOCKS_AVAILABLE
 typedef void (^ASIBasicBlock)(void);
 typedef void (^ASIHeadersBlock)(NSDictionary *responseHeaders);
@@ -106,19 +138,21 @@ typedef void (^ASIDataBlock)(NSData *data);
 	// Request body - only used when the whole body is stored in memory (shouldStreamPostDataFromDisk is false)
 	NSMutableData *postBody;
 	
-	// gzipped request body used when shouldCompressRequestBody is YES
-	NSData *compressedPostBody;
-	
+	// A request body made of several parts sent one after another - NSData objects, and paths of files that are read in place when the request is sent
+	// Set up by appendPostDataFromFileInPlace: and appendPostDataInPlace:, and used instead of postBody (ASIFormDataRequests use this for attached files and data)
+	NSMutableArray *postBodyParts;
+
 	// When true, post body will be streamed from a file on disk, rather than loaded into memory at once (useful for large uploads)
-	// Automatically set to true in ASIFormDataRequests when using setFile:forKey:
 	BOOL shouldStreamPostDataFromDisk;
 	
 	// Path to file used to store post body (when shouldStreamPostDataFromDisk is true)
 	// You can set this yourself - useful if you want to PUT a file from local disk 
 	NSString *postBodyFilePath;
-	
-	// Path to a temporary file used to store a deflated post body (when shouldCompressPostBody is YES)
-	NSString *compressedPostBodyFilePath;
+
+	// When true, an uncompressed request body stored at postBodyFilePath is sent straight from a memory mapping of the file, so it isn't copied into a read buffer first
+	// The file must not be truncated while the request is running. Default is false, but S3 and CloudFiles requests for uploading files turn it on
+	// Files on network volumes, and (on 32-bit systems) files bigger than 64MB, are read in the normal way instead
+	BOOL shouldMemoryMapPostBodyFile;
 	
 	// Set to true when ASIHTTPRequest automatically created a temporary file containing the request body (when true, the file at postBodyFilePath will be deleted at the end of the request)
 	BOOL didCreateTemporaryPostDataFile;
@@ -153,28 +187,50 @@ typedef void (^ASIDataBlock)(NSData *data);
 	// If useSessionPersistence is true, network requests will save credentials and reuse for the duration of the session (until clearSession is called)
 	BOOL useSessionPersistence;
 	
-	// If allowCompressedResponse is true, requests will inform the server they can accept compressed data, and will automatically decompress gzipped responses. Default is true.
+	// If allowCompressedResponse is true, requests will inform the server they can accept compressed data, and will automatically decompress compressed responses. Default is true.
+	// The encodings we ask for are those listed by [ASIDataDecompressor supportedContentEncodings] - gzip and deflate, plus brotli and zstd if you turn them on in ASIHTTPRequestConfig.h
 	BOOL allowCompressedResponse;
 	
 	// If shouldCompressRequestBody is true, the request body will be gzipped. Default is false.
 	// You will probably need to enable this feature on your webserver to make this work. Tested with apache only.
+	// The body is compressed as it is sent, so the compressed body is never stored in memory or on disk
+	// Because we don't know how big the compressed body will be until it has been sent, it is sent with chunked transfer encoding (see shouldPrecomputeCompressedPostLength)
 	BOOL shouldCompressRequestBody;
+
+	// Some servers won't accept a request body sent with chunked transfer encoding
+	// When this is true, requests with shouldCompressRequestBody set compress the body once before it is sent to find its length (without keeping the compressed data),
+	// then compress it again as it is sent with a Content-Length header. Default is false
+	// Requests that use HTTP 1.0 (see useHTTPVersionOne) always do this, as HTTP 1.0 has no chunked transfer encoding
+	BOOL shouldPrecomputeCompressedPostLength;
+
+	// When true, the request decides for itself whether the request body is worth compressing, and sets shouldCompressRequestBody and requestBodyCompressionLevel to match. Default is false
+	// Bodies that are already compressed (judging by their Content-Type header or file extension) or look random (judging by the first 64KB) are sent as they are
+	// Otherwise, we try compressing the first 64KB at a few levels to see how much each saves and how long it takes on this device,
+	// then pick the level that should get the body sent soonest at the bandwidth we've been using recently (see averageBandwidthUsedPerSecond)
+	BOOL shouldAutomaticallyCompressRequestBody;
+
+	// The zlib compression level (1-9) used when shouldCompressRequestBody is true. Default is -1 (Z_DEFAULT_COMPRESSION, currently level 6)
+	int requestBodyCompressionLevel;
+
+	// The size of the compressed request body divided by the size of the original body, or 0 if we don't know yet
+	// Known before the request starts when the compressed length is worked out up front (see shouldPrecomputeCompressedPostLength), otherwise once the body has been sent
+	double requestBodyCompressionRatio;
 	
 	// When downloadDestinationPath is set, the result of this request will be downloaded to the file at this location
 	// If downloadDestinationPath is not set, download data will be stored in memory
 	NSString *downloadDestinationPath;
 	
 	// The location that files will be downloaded to. Once a download is complete, files will be decompressed (if necessary) and moved to downloadDestinationPath
+	// Gzipped responses are inflated as they arrive, so this file holds the inflated response, unless allowResumeForFileDownloads is YES
 	NSString *temporaryFileDownloadPath;
 	
-	// If the response is gzipped and shouldWaitToInflateCompressedResponses is NO, a file will be created at this path containing the inflated response as it comes in
+	// No longer used - gzipped downloads are inflated straight into temporaryFileDownloadPath
+	// Kept so code that sets or cleans up this path continues to work
 	NSString *temporaryUncompressedDataDownloadPath;
 	
 	// Used for writing data to a file when downloadDestinationPath is set
 	NSOutputStream *fileDownloadOutputStream;
 	
-	NSOutputStream *inflatedFileDownloadOutputStream;
-	
 	// When the request fails or completes successfully, complete will be true
 	BOOL complete;
 	
@@ -216,6 +272,10 @@ typedef void (^ASIDataBlock)(NSData *data);
 	
 	// Data we receive will be stored here. Data may be compressed unless allowCompressedResponse is false - you should use [request responseData] instead in most cases
 	NSMutableData *rawResponseData;
+
+	// When the response is stored in memory, data is read into this as it arrives, with space for the whole body reserved from the Content-Length header
+	// rawResponseData returns the buffer's data, which is only put together into a single NSMutableData the first time someone asks for it
+	ASIResponseBuffer *responseBuffer;
 	
 	// Used for sending and receiving data
     CFHTTPMessageRef request;	
@@ -270,6 +330,9 @@ typedef void (^ASIDataBlock)(NSData *data);
 	// Size of the partially downloaded content
 	unsigned long long partialDownloadSize;
 	
+	// YES when the Range header was added to resume a partial download, rather than set by whoever made the request
+	BOOL rangeHeaderIsForResume;
+	
 	// Size of the POST payload
 	unsigned long long postLength;	
 	
@@ -308,8 +371,9 @@ typedef void (^ASIDataBlock)(NSData *data);
 	// If you set this and implement the method in your delegate, you must handle the data yourself - ASIHTTPRequest will not populate responseData or write the data to downloadDestinationPath
 	SEL didReceiveDataSelector;
 	
-	// Used for recording when something last happened during the request, we will compare this value with the current date to time out requests when appropriate
-	NSDate *lastActivityTime;
+	// Used for recording when something last happened during the request, we will compare this value with the current time to time out requests when appropriate
+	// This is a monotonic time (see ASIMonotonicTime in ASITimerWheel.h), 0 when we aren't waiting for anything to happen
+	NSTimeInterval lastActivityTime;
 	
 	// Number of seconds to wait before timing out - default is 10
 	NSTimeInterval timeOutSeconds;
@@ -329,6 +393,32 @@ typedef void (^ASIDataBlock)(NSData *data);
 	
 	// Used to ensure the progress indicator is only incremented once when showAccurateProgress = NO
 	BOOL updatedProgress;
+
+	// Progress that has happened on the network thread but hasn't been passed on to the main thread yet
+	// Byte counts are added up here as data arrives, and passed on in a single update at most once every progressUpdateInterval seconds
+	long long pendingBytesReceived;
+	long long pendingBytesSent;
+	long long pendingDownloadSizeIncrement;
+	long long pendingUploadSizeIncrement;
+
+	// What the progress indicators will be set to by the next update
+	unsigned long long pendingDownloadProgress;
+	unsigned long long pendingDownloadTotal;
+	unsigned long long pendingUploadProgress;
+	unsigned long long pendingUploadTotal;
+	BOOL downloadIndicatorNeedsUpdate;
+	BOOL uploadIndicatorNeedsUpdate;
+
+	// YES when an update has been sent to the main thread but hasn't run yet - any progress made in the meantime is included in that update
+	BOOL progressDeliveryScheduled;
+
+	// The monotonic time we last sent an update to the main thread
+	NSTimeInterval lastProgressDeliveryTime;
+
+	// The queue, progress delegates and progress blocks are told about progress at most once every progressUpdateInterval seconds
+	// Changes to the size of the upload or download, and the final progress when the request completes, are always passed on straight away
+	// Default is 0.1 (see setDefaultProgressUpdateInterval:)
+	NSTimeInterval progressUpdateInterval;
 	
 	// Prevents the body of the post being built more than once (largely for subclasses)
 	BOOL haveBuiltPostBody;
@@ -346,6 +436,59 @@ typedef void (^ASIDataBlock)(NSData *data);
 	
 	// Tells ASIHTTPRequest not to delete partial downloads, and allows it to use an existing file to resume a download. Defaults to NO.
 	BOOL allowResumeForFileDownloads;
+
+	// Partial downloads are kept with a manifest (temporaryFileDownloadPath + '.asiresume') recording the url, the ETag / Last-Modified date and expected length of the file,
+	// and a checksum of the bytes we have written. We only resume when the manifest matches the partial file, and we send its validator as If-Range,
+	// so a file that has changed on the server is downloaded again from the start rather than being spliced onto the old one
+	// (When the server sent no validator and the file turns out to have changed length, we throw the partial download away and start again)
+	NSMutableDictionary *resumeManifest;
+
+	// A running CRC-32 of the data written to temporaryFileDownloadPath, and the number of bytes it covers
+	unsigned long resumeChecksum;
+	unsigned long long resumeChecksumLength;
+
+	// The value of resumeChecksumLength when the manifest was last written to disk
+	unsigned long long resumeManifestSavedLength;
+
+	// Digests (see ASIDigestAlgorithm in ASIDigest.h) to work out while the request body is sent and the response body arrives
+	// Bodies are hashed as they go past, so there's no need to read a file again afterwards to check it
+	// The request body digest covers the body as it was sent (ie after compression), and the response digest covers the body as it arrived (ie before it is inflated)
+	NSUInteger requestBodyDigestAlgorithms;
+	NSUInteger responseDigestAlgorithms;
+
+	// The digests, once the request has finished
+	// There is no response digest for a resumed download, because we only see the end of the file
+	ASIDigest *requestBodyDigest;
+	ASIDigest *responseDigest;
+
+	// When true, the request fails with ASIDigestMismatchErrorType if the response body doesn't match the server's Content-MD5 header
+	// Default is NO
+	BOOL shouldVerifyResponseDigest;
+
+	// When true, the request also fails if an ETag that is a plain MD5 (as S3 sends for objects that weren't uploaded in parts) doesn't match
+	// the request body for uploads, or the response body for GET requests. Default is NO, but S3 object requests turn it on
+	BOOL shouldVerifyDigestsAgainstETag;
+
+	// When true, a GET request that is identical to one already running (same url, headers and credentials) doesn't make a connection of its own
+	// Instead, it is passed the running request's response data as it arrives (so progress, didReceiveData: and downloading to a file work as usual),
+	// and finishes or fails when the running request does. If the running request is cancelled, the requests waiting for it carry on by themselves
+	// Requests that allow resuming file downloads are never coalesced. Default is NO
+	BOOL shouldCoalesceIdenticalRequests;
+
+	// When other requests are waiting for our response, the waiting requests, and the key we were registered under when we started
+	NSMutableArray *coalescedRequests;
+	NSString *coalescingKey;
+
+	// The number of bytes of our response we've passed on to coalescedRequests
+	// If we retry, the response is read again from the start, so we don't pass on anything up to this point a second time
+	unsigned long long coalescedBytesForwarded;
+
+	// When we are waiting for an identical request, the request we are waiting for, and the thread its response is passed to us on
+	ASIHTTPRequest *coalescingLeader;
+	NSThread *coalescingThread;
+	
+	// The port we added to keep a synchronous request's runloop waiting for its leader, removed once the request is finished
+	NSPort *coalescingPort;
 	
 	// Custom user information associated with the request (not sent to the server)
 	NSDictionary *userInfo;
@@ -406,6 +549,17 @@ typedef void (^ASIDataBlock)(NSData *data);
 	// The number of times this request has retried (when numberOfTimesToRetryOnTimeout > 0)
 	int retryCount;
 
+	// Decides whether this request should try again when it fails, or when the server sends a response like 503 (see ASIRetryPolicy.h)
+	// The policy is only asked once numberOfTimesToRetryOnTimeout retries (and the single retry on a closed persistent connection) have been used up
+	// While the request waits to retry, it is still in progress, and can be cancelled as normal
+	// When retrying a response, the delegate and queue will have received its response headers already, and will get the next response's headers too
+	// Resumed downloads keep what they have downloaded, and ask for the rest with a Range header
+	// Default is nil, so requests don't retry apart from as described above
+	ASIRetryPolicy *retryPolicy;
+
+	// The number of times this request has retried because retryPolicy told it to
+	int policyRetryCount;
+
 	// Temporarily set to YES when a closed connection forces a retry (internally, this stops ASIHTTPRequest cleaning up a temporary post body)
 	BOOL willRetryRequest;
 
@@ -417,21 +571,19 @@ typedef void (^ASIDataBlock)(NSData *data);
 	// Number of seconds to keep an inactive persistent connection open on the client side
 	// Default is 60
 	// If we get a keep-alive header, this is this value is replaced with how long the server told us to keep the connection around
-	// A future date is created from this and used for expiring the connection, this is stored in connectionInfo's expires value
+	// A future date is created from this and used for expiring the connection, this is stored in connectionInfo's expires property
 	NSTimeInterval persistentConnectionTimeoutSeconds;
 	
 	// Set to yes when an appropriate keep-alive header is found
 	BOOL connectionCanBeReused;
 	
-	// Stores information about the persistent connection that is currently in use.
-	// It may contain:
-	// * The id we set for a particular connection, incremented every time we want to specify that we need a new connection
-	// * The date that connection should expire
-	// * A host, port and scheme for the connection. These are used to determine whether that connection can be reused by a subsequent request (all must match the new request)
-	// * An id for the request that is currently using the connection. This is used for determining if a connection is available or not (we store a number rather than a reference to the request so we don't need to hang onto a request until the connection expires)
-	// * A reference to the stream that is currently using the connection. This is necessary because we need to keep the old stream open until we've opened a new one.
-	//   The stream will be closed + released either when another request comes to use the connection, or when the timer fires to tell the connection to expire
-	NSMutableDictionary *connectionInfo;
+	// The persistent connection that is currently in use (see ASIConnectionPool.h)
+	// We keep hold of it after the request finishes, so a redirected or retried request can go back to the same connection
+	ASIPersistentConnection *connectionInfo;
+
+	// Set when startRequest had to wait for a connection because of the connection pool's maxConnectionsPerHost
+	// This is the thread the request was running on, and the request will be started again on it when a connection becomes available
+	NSThread *connectionWaitThread;
 	
 	// When set to YES, 301 and 302 automatic redirects will use the original method and and body, according to the HTTP 1.1 standard
 	// Default is NO (to follow the behaviour of most browsers)
@@ -446,8 +598,9 @@ typedef void (^ASIDataBlock)(NSData *data);
 	// Will be ASIHTTPRequestRunLoopMode for synchronous requests, NSDefaultRunLoopMode for all other requests
 	NSString *runLoopMode;
 	
-	// This timer checks up on the request every 0.25 seconds, and updates progress
-	NSTimer *statusTimer;
+	// The timer wheel for the thread this request is running on
+	// The wheel calls us back to check for a timeout, and every 0.25 seconds while we are uploading, throttled or reporting progress
+	ASITimerWheel *statusTimerWheel;
 	
 	// The download cache that will be used for this request (use [ASIHTTPRequest setDefaultCache:cache] to configure a default cache
 	id <ASICacheDelegate> downloadCache;
@@ -469,19 +622,21 @@ typedef void (^ASIDataBlock)(NSData *data);
 	UIBackgroundTaskIdentifier backgroundTask;
 	#endif
 	
-	// When downloading a gzipped response, the request will use this helper object to inflate the response
+	// When downloading a compressed response, the request will use this helper object to inflate the response
+	// It will be an instance of whichever ASIDataDecompressor class handles the response's Content-Encoding
 	ASIDataDecompressor *dataDecompressor;
 	
-	// Controls how responses with a gzipped encoding are inflated (decompressed)
+	// Controls how responses with a gzipped encoding are inflated (decompressed) when they are stored in memory or passed to a delegate
 	// When set to YES (This is the default):
 	// * gzipped responses for requests without a downloadDestinationPath will be inflated only when [request responseData] / [request responseString] is called
-	// * gzipped responses for requests with a downloadDestinationPath set will be inflated only when the request completes
 	//
 	// When set to NO
 	// All requests will inflate the response as it comes in
 	// * If the request has no downloadDestinationPath set, the raw (compressed) response is discarded and rawResponseData will contain the decompressed response
-	// * If the request has a downloadDestinationPath, the raw response will be stored in temporaryFileDownloadPath as normal, the inflated response will be stored in temporaryUncompressedDataDownloadPath
-	//   Once the request completes successfully, the contents of temporaryUncompressedDataDownloadPath are moved into downloadDestinationPath
+	//
+	// gzipped responses for requests with a downloadDestinationPath are always inflated as they come in, and only the inflated response is written to temporaryFileDownloadPath
+	// The exception is when allowResumeForFileDownloads is YES - we can't pick up inflating part way through a response,
+	// so the compressed response is stored in temporaryFileDownloadPath, and is inflated into downloadDestinationPath when the request completes
 	//
 	// Setting this to NO may be especially useful for users using ASIHTTPRequest in conjunction with a streaming parser, as it will allow partial gzipped responses to be inflated and passed on to the parser while the request is still running
 	BOOL shouldWaitToInflateCompressedResponses;
@@ -538,6 +693,38 @@ typedef void (^ASIDataBlock)(NSData *data);
     //block for handling redirections, if you want to
     ASIBasicBlock requestRedirectedBlock;
 	#endif
+
+	// The network thread this request was assigned to by threadForRequest:
+	// Once set, the request will always run on this thread until it has finished
+	NSThread *requestThread;
+
+	// Index of requestThread in the network thread pool, used to track how many requests each thread is running
+	// Will be -1 when the request is not counted against a network thread
+	NSInteger networkThreadIndex;
+
+	// How much we try to read from the stream at once (see ASIReadBufferPool.h)
+	// Starts off based on the Content-Length, grows while the stream fills our buffer and shrinks when it keeps handing us much less
+	NSUInteger readBufferSize;
+
+	// The number of reads in a row that have used less than a quarter of the buffer
+	NSUInteger smallReadCount;
+
+	// Where delegate methods, blocks and progress are delivered (see ASICallbackMode above). Default is ASIMainThreadCallbackMode
+	// Progress indicators (NSProgressIndicator / UIProgressView) are always updated on the main thread
+	ASICallbackMode callbackMode;
+
+	// The queue callbacks are delivered on when callbackMode is ASIOperationQueueCallbackMode
+	NSOperationQueue *callbackOperationQueue;
+
+	#if NS_BLOCKS_AVAILABLE
+	// The queue callbacks are delivered on when callbackMode is ASIDispatchQueueCallbackMode
+	dispatch_queue_t callbackDispatchQueue;
+	#endif
+
+	// The bandwidth class this request's data is counted against when throttling (see ASIBandwidthClass.h)
+	// When nil (the default), the request only counts against the global class
+	// ASINetworkQueues set this on requests added to them, unless it has already been set
+	ASIBandwidthClass *bandwidthClass;
 }
 
 #pragma mark init / dealloc
@@ -564,6 +751,10 @@ typedef void (^ASIDataBlock)(NSData *data);
 - (void)setAuthenticationNeededBlock:(ASIBasicBlock)anAuthenticationBlock;
 - (void)setProxyAuthenticationNeededBlock:(ASIBasicBlock)aProxyAuthenticationBlock;
 - (void)setRequestRedirectedBlock:(ASIBasicBlock)aRedirectBlock;
+
+// The queue callbacks are delivered on when callbackMode is ASIDispatchQueueCallbackMode (retained by the request)
+- (dispatch_queue_t)callbackDispatchQueue;
+- (void)setCallbackDispatchQueue:(dispatch_queue_t)newQueue;
 #endif
 
 #pragma mark setup request
@@ -588,6 +779,15 @@ typedef void (^ASIDataBlock)(NSData *data);
 - (void)appendPostData:(NSData *)data;
 - (void)appendPostDataFromFile:(NSString *)file;
 
+// Adds a file to the post body without reading it now. The file is read in place when the request is sent, so it is never copied into memory or a temporary file
+// Anything added with appendPostData: afterwards is sent after the file
+// When shouldStreamPostDataFromDisk is true, this is the same as appendPostDataFromFile:
+- (void)appendPostDataFromFileInPlace:(NSString *)file;
+
+// Adds data to the post body as a part of its own, rather than copying it into postBody. The data must not be changed until the request has finished
+// When shouldStreamPostDataFromDisk is true, this is the same as appendPostData:
+- (void)appendPostDataInPlace:(NSData *)data;
+
 #pragma mark get information about this request
 
 // Returns the contents of the result as an NSString (not appropriate for binary data - used responseData instead)
@@ -596,7 +796,7 @@ typedef void (^ASIDataBlock)(NSData *data);
 // Response data, automatically uncompressed where appropriate
 - (NSData *)responseData;
 
-// Returns true if the response was gzip compressed
+// Returns true if the response was compressed with an encoding we know how to decode
 - (BOOL)isResponseCompressed;
 
 #pragma mark running a request
@@ -618,7 +818,8 @@ typedef void (^ASIDataBlock)(NSData *data);
 
 #pragma mark upload/download progress
 
-// Called approximately every 0.25 seconds to update the progress delegates
+// Called whenever the request reads or sends data, and every 0.25 seconds while the request is running, to update the progress delegates
+// Progress is collected and passed on to the main thread at most once every progressUpdateInterval seconds
 - (void)updateProgressIndicators;
 
 // Updates upload progress (notifies the queue and/or uploadProgressDelegate of this request)
@@ -637,7 +838,12 @@ typedef void (^ASIDataBlock)(NSData *data);
 // Also called (with a negative length) to remove the size of the underlying buffer used for uploading
 - (void)incrementUploadSizeBy:(long long)length;
 
+// Sends progress collected so far to the main thread, unless an update was sent less than progressUpdateInterval seconds ago
+// When immediately is YES (eg when the request has finished), progress is sent regardless of when we last sent an update
+- (void)scheduleProgressDelivery:(BOOL)immediately;
+
 // Helper method for interacting with progress indicators to abstract the details of different APIS (NSProgressIndicator and UIProgressView)
+// When called on the main thread, the indicator is updated straight away
 + (void)updateProgressIndicator:(id *)indicator withProgress:(unsigned long long)progress ofTotal:(unsigned long long)total;
 
 // Helper method used for performing invocations on the main thread (used for progress)
@@ -665,6 +871,11 @@ typedef void (^ASIDataBlock)(NSData *data);
 // Can be called by delegates from inside their willRedirectSelector implementations to restart the request with a new url
 - (void)redirectToURL:(NSURL *)newURL;
 
+// Performs selector on target with object wherever this request delivers its callbacks (see callbackMode)
+// When wait is YES and we're already running there, the selector is performed straight away
+// Otherwise it is queued up to be performed after the current method returns
+- (void)performCallback:(SEL)selector onTarget:(id)target withObject:(id)object waitUntilDone:(BOOL)wait;
+
 #pragma mark parsing HTTP response headers
 
 // Reads the response headers to find the content length, encoding, cookies for the session 
@@ -675,6 +886,10 @@ typedef void (^ASIDataBlock)(NSData *data);
 // Attempts to set the correct encoding by looking at the Content-Type header, if this is one
 - (void)parseStringEncodingFromHeaders;
 
+// Used when shouldVerifyDigestsAgainstETag is true. Returns YES if eTag (without its quotes) looks like an MD5 of the body we sent or received
+// Subclasses can override this to return NO for responses where the server's ETags are something else
+- (BOOL)responseETagIsMD5OfBody:(NSString *)eTag;
+
 + (void)parseMimeType:(NSString **)mimeType andResponseEncoding:(NSStringEncoding *)stringEncoding fromContentType:(NSString *)contentType;
 
 #pragma mark http authentication stuff
@@ -712,6 +927,11 @@ typedef void (^ASIDataBlock)(NSData *data);
 // CFnetwork event handlers
 - (void)handleNetworkEvent:(CFStreamEventType)type;
 - (void)handleBytesAvailable;
+
+// Called by handleBytesAvailable for each chunk of the body it reads
+// readData wraps a buffer from the thread's ASIReadBufferPool, which goes back to the pool when the data is released
+- (void)handleBytesRead:(NSData *)readData;
+
 - (void)handleStreamComplete;
 - (void)handleStreamError;
 
@@ -726,13 +946,14 @@ typedef void (^ASIDataBlock)(NSData *data);
 // Clean up the temporary file used to store the downloaded data when it comes in (if downloadDestinationPath is set)
 - (BOOL)removeTemporaryDownloadFile;
 
-// Clean up the temporary file used to store data that is inflated (decompressed) as it comes in
+// Clean up the file at temporaryUncompressedDataDownloadPath, if one has been set
 - (BOOL)removeTemporaryUncompressedDownloadFile;
 
 // Clean up the temporary file used to store the request body (when shouldStreamPostDataFromDisk is YES)
 - (BOOL)removeTemporaryUploadFile;
 
-// Clean up the temporary file used to store a deflated (compressed) request body when shouldStreamPostDataFromDisk is YES
+// No longer used - compressed request bodies are compressed as they are sent, rather than written to a temporary file first
+// Does nothing and returns YES
 - (BOOL)removeTemporaryCompressedUploadFile;
 
 // Remove a file on disk, returning NO and populating the passed error pointer if it fails
@@ -743,14 +964,28 @@ typedef void (^ASIDataBlock)(NSData *data);
 // Get the ID of the connection this request used (only really useful in tests and debugging)
 - (NSNumber *)connectionID;
 
-// Called automatically when a request is started to clean up any persistent connections that have expired
+// Close any idle persistent connections that have expired
+// Requests clean up expired connections automatically as they start, so you shouldn't normally need to call this
 + (void)expirePersistentConnections;
 
+// Set the most persistent connections that will be opened to a single server (0 means no limit, which is the default)
+// When a server has this many connections in use, requests that would need another wait until a connection is freed
+// Time spent waiting for a connection does not count towards a request's timeout
+// See ASIConnectionPool for statistics on connection reuse
++ (NSUInteger)maxConnectionsPerHost;
++ (void)setMaxConnectionsPerHost:(NSUInteger)max;
+
 #pragma mark default time out
 
 + (NSTimeInterval)defaultTimeOutSeconds;
 + (void)setDefaultTimeOutSeconds:(NSTimeInterval)newTimeOutSeconds;
 
+#pragma mark default progress update interval
+
+// The progressUpdateInterval new requests and queues will use (default is 0.1 seconds)
++ (NSTimeInterval)defaultProgressUpdateInterval;
++ (void)setDefaultProgressUpdateInterval:(NSTimeInterval)newInterval;
+
 #pragma mark client certificate
 
 - (void)setClientCertificateIdentity:(SecIdentityRef)anIdentity;
@@ -818,12 +1053,22 @@ typedef void (^ASIDataBlock)(NSData *data);
 // Get a rough average (for the last 5 seconds) of how much bandwidth is being used, in bytes
 + (unsigned long)averageBandwidthUsedPerSecond;
 
+// Puts the request to sleep while its bandwidth class (or one above it) has used up its allowance, and wakes it up again when it hasn't
 - (void)performThrottling;
 
-// Will return YES is bandwidth throttling is currently in use
+// Returns bandwidthClass, or the global class if the request hasn't been given one
+- (ASIBandwidthClass *)effectiveBandwidthClass;
+
+// Used internally to record bandwidth used by this request, and by ASIInputStreams when uploading
+// Takes the bytes out of the allowance of the request's bandwidth class and every class above it
+- (void)incrementBandwidthUsedBy:(unsigned long)bytes;
+
+// Will return YES is global bandwidth throttling is currently in use
+// Requests in a bandwidth class with its own limit may be throttled even when this returns NO (see -[ASIBandwidthClass isThrottled])
+// This doesn't take a lock, so it's cheap enough to call every time data is read
 + (BOOL)isBandwidthThrottled;
 
-// Used internally to record bandwidth use, and by ASIInputStreams when uploading. It's probably best if you don't mess with this.
+// Records bandwidth used outside of a request against the global bandwidth class. It's probably best if you don't mess with this.
 + (void)incrementBandwidthUsedInLastSecond:(unsigned long)bytes;
 
 // On iPhone, ASIHTTPRequest can automatically turn throttling on and off as the connection type changes between WWAN and WiFi
@@ -852,7 +1097,8 @@ typedef void (^ASIDataBlock)(NSData *data);
 + (void)setDefaultCache:(id <ASICacheDelegate>)cache;
 + (id <ASICacheDelegate>)defaultCache;
 
-// Returns the maximum amount of data we can read as part of the current measurement period, and sleeps this thread if our allowance is used up
+// Returns the maximum amount of data we can read right now without going over the global bandwidth limit (0 when the allowance is used up)
+// Requests use the share of their own bandwidth class instead (see -[ASIBandwidthClass availableBytes])
 + (unsigned long)maxUploadReadLength;
 
 #pragma mark network activity
@@ -889,7 +1135,8 @@ typedef void (^ASIDataBlock)(NSData *data);
 
 #pragma mark threading behaviour
 
-// In the default implementation, all requests run in a single background thread
+// In the default implementation, requests run in a pool of background threads (one thread unless you change numberOfNetworkThreads)
+// A request always runs on the same thread once it has been assigned one, including when it is restarted for redirection or authentication
 // Advanced users only: Override this method in a subclass for a different threading behaviour
 // Eg: return [NSThread mainThread] to run all requests in the main thread
 // Alternatively, you can create a thread on demand, or manage a pool of threads
@@ -898,6 +1145,16 @@ typedef void (^ASIDataBlock)(NSData *data);
 // If you have multiple requests sharing the thread you'll need to restart the runloop when this happens
 + (NSThread *)threadForRequest:(ASIHTTPRequest *)request;
 
+// Set the number of background threads requests will be spread across (between 1 and ASIMaximumNetworkThreads, default is 1)
+// Threads are created on demand, and are never destroyed. Lowering this number means existing threads beyond the limit will not be given any new requests
+// Persistent connections are only reused by requests running on the thread that opened them
++ (NSUInteger)numberOfNetworkThreads;
++ (void)setNumberOfNetworkThreads:(NSUInteger)count;
+
+// Controls how requests are assigned to threads when numberOfNetworkThreads is more than 1 (default is ASIHostAffinityNetworkThreadPolicy)
++ (ASINetworkThreadPolicy)networkThreadPolicy;
++ (void)setNetworkThreadPolicy:(ASINetworkThreadPolicy)policy;
+
 
 #pragma mark ===
 
@@ -918,6 +1175,9 @@ typedef void (^ASIDataBlock)(NSData *data);
 @property (atomic, retain) NSURL *originalURL;
 @property (assign, nonatomic) id delegate;
 @property (retain, nonatomic) id queue;
+@property (assign, atomic) ASICallbackMode callbackMode;
+@property (retain, atomic) NSOperationQueue *callbackOperationQueue;
+@property (retain, atomic) ASIBandwidthClass *bandwidthClass;
 @property (assign, nonatomic) id uploadProgressDelegate;
 @property (assign, nonatomic) id downloadProgressDelegate;
 @property (atomic, assign) BOOL useKeychainPersistence;
@@ -946,8 +1206,10 @@ typedef void (^ASIDataBlock)(NSData *data);
 @property (atomic, retain,readonly) NSString *responseStatusMessage;
 @property (atomic, retain) NSMutableData *rawResponseData;
 @property (atomic, assign) NSTimeInterval timeOutSeconds;
+@property (atomic, assign) NSTimeInterval progressUpdateInterval;
 @property (retain, nonatomic) NSString *requestMethod;
 @property (atomic, retain) NSMutableData *postBody;
+@property (atomic, retain) NSMutableArray *postBodyParts;
 @property (atomic, assign) unsigned long long contentLength;
 @property (atomic, assign) unsigned long long postLength;
 @property (atomic, assign) BOOL shouldResetDownloadProgress;
@@ -964,12 +1226,24 @@ typedef void (^ASIDataBlock)(NSData *data);
 @property (atomic, assign) NSInteger tag;
 @property (atomic, retain) NSString *postBodyFilePath;
 @property (atomic, assign) BOOL shouldStreamPostDataFromDisk;
+@property (atomic, assign) BOOL shouldMemoryMapPostBodyFile;
+@property (atomic, assign) NSUInteger requestBodyDigestAlgorithms;
+@property (atomic, assign) NSUInteger responseDigestAlgorithms;
+@property (atomic, retain, readonly) ASIDigest *requestBodyDigest;
+@property (atomic, retain, readonly) ASIDigest *responseDigest;
+@property (atomic, assign) BOOL shouldVerifyResponseDigest;
+@property (atomic, assign) BOOL shouldVerifyDigestsAgainstETag;
+@property (atomic, assign) BOOL shouldCoalesceIdenticalRequests;
 @property (atomic, assign) BOOL didCreateTemporaryPostDataFile;
 @property (atomic, assign) BOOL useHTTPVersionOne;
 @property (atomic, assign, readonly) unsigned long long partialDownloadSize;
 @property (atomic, assign) BOOL shouldRedirect;
 @property (atomic, assign) BOOL validatesSecureCertificate;
 @property (atomic, assign) BOOL shouldCompressRequestBody;
+@property (atomic, assign) BOOL shouldPrecomputeCompressedPostLength;
+@property (atomic, assign) BOOL shouldAutomaticallyCompressRequestBody;
+@property (atomic, assign) int requestBodyCompressionLevel;
+@property (atomic, assign, readonly) double requestBodyCompressionRatio;
 @property (atomic, retain) NSURL *PACurl;
 @property (atomic, retain) NSString *authenticationScheme;
 @property (atomic, retain) NSString *proxyAuthenticationScheme;
@@ -984,6 +1258,8 @@ typedef void (^ASIDataBlock)(NSData *data);
 @property (atomic, assign, readonly) BOOL inProgress;
 @property (atomic, assign) int numberOfTimesToRetryOnTimeout;
 @property (atomic, assign, readonly) int retryCount;
+@property (atomic, retain) ASIRetryPolicy *retryPolicy;
+@property (atomic, assign, readonly) int policyRetryCount;
 @property (atomic, assign) BOOL shouldAttemptPersistentConnection;
 @property (atomic, atomic, assign) NSTimeInterval persistentConnectionTimeoutSeconds;
 @property (atomic, assign) BOOL shouldUseRFC2616RedirectBehaviour;
@@ -22,6 +22,15 @@
 #import "ASIInputStream.h"
 #import "ASIDataDecompressor.h"
 #import "ASIDataCompressor.h"
+#import "ASIConnectionPool.h"
+#import "ASITimerWheel.h"
+#import "ASIBandwidthClass.h"
+#import "ASIResponseBuffer.h"
+#import "ASIReadBufferPool.h"
+#import "ASIRetryPolicy.h"
+#import <libkern/OSAtomic.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 // Automatically set on build
 NSString *ASIHTTPRequestVersion = @"v1.8.1-61 2011-09-19";
@@ -50,6 +59,9 @@ const int RedirectionLimit = 5;
 // The default number of seconds to use for a timeout
 static NSTimeInterval defaultTimeOutSeconds = 10;
 
+// The default for the most often progress will be passed on to the delegates
+static NSTimeInterval defaultProgressUpdateInterval = 0.1;
+
 static void ReadStreamClientCallBack(CFReadStreamRef readStream, CFStreamEventType type, void *clientCallBackInfo) {
     [((ASIHTTPRequest*)clientCallBackInfo) handleNetworkEvent: type];
 }
@@ -63,32 +75,81 @@ static NSError *ASIAuthenticationError;
 static NSError *ASIUnableToCreateRequestError;
 static NSError *ASITooMuchRedirectionError;
 
-static NSMutableArray *bandwidthUsageTracker = nil;
-static unsigned long averageBandwidthUsedPerSecond = 0;
+// The most times handleBytesAvailable will read from the stream before letting the runloop get on with something else
+#define ASIMaximumReadsPerCallback 16
+
+// When shouldAutomaticallyCompressRequestBody is true, we decide whether (and how hard) to compress the request body by looking at this much of it
+#define ASIRequestBodyCompressionSampleSize 65536
+
+// Samples with more bits of entropy per byte than this are too random to be worth compressing
+#define ASIIncompressibleEntropy 7.5
+
+// While downloading a file we might resume, we write the resume manifest to disk each time we've written this many more bytes
+#define ASIResumeManifestSaveInterval (4*1024*1024)
+
+// We won't compress a body unless it saves at least 10%
+#define ASIWorthwhileCompressionRatio 0.9
+
+// Content types that are already compressed, so compressing them again would be a waste of time
+static NSSet *compressedContentTypes = nil;
+
+// Returns the entropy of the passed bytes, in bits per byte
+// Deflate can't get the data much smaller than this without finding repeated strings
+static double ASIByteEntropy(const unsigned char *bytes, NSUInteger length)
+{
+	if (!length) {
+		return 0;
+	}
+	NSUInteger counts[256] = {0};
+	NSUInteger i;
+	for (i=0; i<length; i++) {
+		counts[bytes[i]]++;
+	}
+	double entropy = 0;
+	for (i=0; i<256; i++) {
+		if (counts[i]) {
+			double p = (double)counts[i]/(double)length;
+			entropy -= p*log2(p);
+		}
+	}
+	return entropy;
+}
+
+// The number of measurements of bandwidth use we keep to work out averageBandwidthUsedPerSecond
+// One measurement is taken a second, so this covers the last 5 seconds
+#define ASIBandwidthMeasurementCount 6
+
+typedef struct _ASIBandwidthMeasurement {
+	NSTimeInterval time;
+	int64_t totalBytes;
+} ASIBandwidthMeasurement;
+
+// A ring buffer of measurements of totalBandwidthUsed, oldest first starting at nextBandwidthMeasurement
+static ASIBandwidthMeasurement bandwidthMeasurements[ASIBandwidthMeasurementCount];
+static NSUInteger nextBandwidthMeasurement = 0;
 
-// These are used for queuing persistent connections on the same connection
+// Only one thread records a measurement at once - anyone else who finds this lock taken just skips their measurement
+static OSSpinLock bandwidthMeasurementLock = OS_SPINLOCK_INIT;
 
-// Incremented every time we specify we want a new connection
-static unsigned int nextConnectionNumberToCreate = 0;
+// The monotonic time when we next need to take a measurement
+static volatile NSTimeInterval nextBandwidthMeasurementTime = 0;
 
-// An array of connectionInfo dictionaries.
-// When attempting a persistent connection, we look here to try to find an existing connection to the same server that is currently not in use
-static NSMutableArray *persistentConnectionsPool = nil;
+static volatile unsigned long averageBandwidthUsedPerSecond = 0;
 
-// Mediates access to the persistent connections pool
+// Persistent connections themselves are managed by ASIConnectionPool
+
+// Mediates access to the request ids and the count of running requests
 static NSRecursiveLock *connectionsLock = nil;
 
-// Each request gets a new id, we store this rather than a ref to the request itself in the connectionInfo dictionary.
+// Each request gets a new id, we store this rather than a ref to the request itself in the connection pool.
 // We do this so we don't have to keep the request around while we wait for the connection to expire
 static unsigned int nextRequestID = 0;
 
-// Records how much bandwidth all requests combined have used in the last second
-static unsigned long bandwidthUsedInLastSecond = 0; 
-
-// A date one second in the future from the time it was created
-static NSDate *bandwidthMeasurementDate = nil;
+// The total number of bytes all requests have sent and received, only ever added to atomically
+static volatile int64_t totalBandwidthUsed = 0;
 
-// Since throttling variables are shared among all requests, we'll use a lock to mediate access
+// Mediates changes to the throttling settings below
+// Requests never take this lock while running - they only look at their bandwidth classes, and the global class is updated whenever the settings change
 static NSLock *bandwidthThrottlingLock = nil;
 
 // the maximum number of bytes that can be transmitted in one second
@@ -118,9 +179,6 @@ static NSRecursiveLock *sessionCookiesLock = nil;
 // This is so it can make use of any credentials supplied for the other request, if they are appropriate
 static NSRecursiveLock *delegateAuthenticationLock = nil;
 
-// When throttling bandwidth, Set to a date in future that we will allow all requests to wake up and reschedule their streams
-static NSDate *throttleWakeUpTime = nil;
-
 static id <ASICacheDelegate> defaultCache = nil;
 
 // Used for tracking when requests are using the network
@@ -131,14 +189,67 @@ static unsigned int runningRequestCount = 0;
 // By default this does nothing on Mac OS X, but again override the above methods for a different behaviour
 static BOOL shouldUpdateNetworkActivityIndicator = YES;
 
-// The thread all requests will run on
-// Hangs around forever, but will be blocked unless there are requests underway
-static NSThread *networkThread = nil;
+// The threads requests will run on
+// Each hangs around forever once created, but will be blocked unless there are requests underway
+static NSMutableArray *networkThreads = nil;
+
+// The number of requests that have been placed on each network thread and have not finished yet
+// Used for picking a thread when networkThreadPolicy is ASILeastLoadedNetworkThreadPolicy
+static unsigned int networkThreadLoad[ASIMaximumNetworkThreads];
+
+// The number of threads in networkThreads that new requests may be placed on. Default is 1
+static NSUInteger numberOfNetworkThreads = 1;
+
+// How requests are spread across network threads when numberOfNetworkThreads > 1
+static ASINetworkThreadPolicy networkThreadPolicy = ASIHostAffinityNetworkThreadPolicy;
+
+// Mediates access to the network threads and their load counts
+static NSLock *networkThreadsLock = nil;
 
 static NSOperationQueue *sharedQueue = nil;
 
+// Running requests that other identical requests can wait for (see shouldCoalesceIdenticalRequests), keyed by their coalescingKey
+static NSMutableDictionary *coalescableRequests = nil;
+
+// Mediates access to coalescableRequests, and to the coalescedRequests of the requests in it
+static NSRecursiveLock *coalescableRequestsLock = nil;
+
+// Works out the CRC-32 of the first length bytes of the file at path
+// Returns NO if the file is shorter than length
+static BOOL ASIChecksumOfFile(NSString *path, unsigned long long length, unsigned long *checksum)
+{
+	NSInputStream *stream = [NSInputStream inputStreamWithFileAtPath:path];
+	[stream open];
+	uint8_t *buffer = malloc(ASIReadBufferMaximumSize);
+	uLong crc = crc32(0L, Z_NULL, 0);
+	while (length) {
+		NSInteger bytesRead = [stream read:buffer maxLength:(NSUInteger)MIN(length, (unsigned long long)ASIReadBufferMaximumSize)];
+		if (bytesRead <= 0) {
+			break;
+		}
+		crc = crc32(crc, buffer, (uInt)bytesRead);
+		length -= (unsigned long long)bytesRead;
+	}
+	free(buffer);
+	[stream close];
+	*checksum = crc;
+	return (length == 0);
+}
+
+// Makes sure everything written to the file at path so far is on disk
+static BOOL ASISynchronizeFile(NSString *path)
+{
+	int fd = open([path fileSystemRepresentation], O_RDONLY);
+	if (fd == -1) {
+		return NO;
+	}
+	BOOL success = (fsync(fd) == 0);
+	close(fd);
+	return success;
+}
+
 // Private stuff
-@interface ASIHTTPRequest ()
+@interface ASIHTTPRequest () <ASITimerWheelTarget>
 
 - (void)cancelLoad;
 
@@ -154,9 +265,12 @@ static NSOperationQueue *sharedQueue = nil;
 
 + (void)measureBandwidthUsage;
 + (void)recordBandwidthUsage;
++ (void)updateGlobalBandwidthLimit;
 
 - (void)startRequest;
-- (void)updateStatus:(NSTimer *)timer;
+- (void)scheduleStatusCheck;
+- (void)stopStatusChecks;
+- (BOOL)needsFrequentStatusChecks;
 - (void)checkRequestStatus;
 - (void)reportFailure;
 - (void)reportFinished;
@@ -166,10 +280,31 @@ static NSOperationQueue *sharedQueue = nil;
 - (BOOL)willRedirect;
 - (BOOL)willAskDelegateToConfirmRedirect;
 
+- (NSString *)resumeManifestPath;
+- (unsigned long long)verifiedLengthOfPartialDownload;
+- (void)startResumeManifest;
+- (void)saveResumeManifest;
+- (void)removeResumeManifest;
+- (NSString *)resumeValidator;
+
+- (void)startDigests;
+- (NSError *)digestMismatchError;
+
+- (NSString *)coalescingKeyForRequest;
+- (BOOL)waitForIdenticalRequest;
+- (void)forwardDataToCoalescedRequests:(NSData *)data;
+- (void)takeResponseHeadersFromRequest:(ASIHTTPRequest *)leader;
+- (void)receiveDataFromCoalescingLeader:(NSData *)data;
+- (void)finishWithResponseOfRequest:(ASIHTTPRequest *)leader;
+- (void)stopCoalescing;
+
 + (void)performInvocation:(NSInvocation *)invocation onTarget:(id *)target releasingObject:(id)objectToRelease;
 + (void)hideNetworkActivityIndicatorAfterDelay;
 + (void)hideNetworkActivityIndicatorIfNeeeded;
 + (void)runRequests;
++ (NSUInteger)networkThreadIndexForRequest:(ASIHTTPRequest *)request;
++ (void)startRequestWaitingForConnection:(ASIHTTPRequest *)waitingRequest;
+- (void)releaseNetworkThread;
 
 // Handling Proxy autodetection and PAC file downloads
 - (BOOL)configureProxies;
@@ -180,9 +315,44 @@ static NSOperationQueue *sharedQueue = nil;
 
 - (void)useDataFromCache;
 
+- (void)adjustReadBufferSizeAfterReading:(NSUInteger)bytesRead maxLength:(NSUInteger)maxLength;
+- (BOOL)shouldInflateResponseAsItArrivesForDelegate:(BOOL)dataWillBeHandledExternally;
+
+// Returns YES when the request body will be compressed as it is sent without a Content-Length (see shouldPrecomputeCompressedPostLength)
+- (BOOL)shouldSendCompressedPostBodyChunked;
+
+// Works out how much of the request body has been sent
+- (void)updateTotalBytesSent;
+
+// Decides whether the request body is worth compressing, and how hard to compress it (see shouldAutomaticallyCompressRequestBody)
+- (void)chooseRequestBodyCompression;
+
+// Returns a new decompressor for the response's Content-Encoding, or nil if the response isn't compressed (or we can't decode it)
+- (ASIDataDecompressor *)responseDecompressor;
+
+// Turns the request body into a list of parts, if it isn't one already
+- (void)setupPostBodyParts;
+
+// Called where callbacks are delivered (see callbackMode) to pass on progress collected by updateProgressIndicators
+- (void)deliverProgress;
+
 // Called to update the size of a partial download when starting a request, or retrying after a timeout
 - (void)updatePartialDownloadSize;
 
+// Called when retrying a download that might be resumed, so we ask for the part we don't have yet
+- (void)updateRangeHeaderForRetry;
+
+// Asks retryPolicy whether we should retry after failing with theError (or nil, when we received an unsuccessful response)
+// If so, stops the current attempt and arranges for the request to start again after the delay the policy asks for, and returns YES
+- (BOOL)retryWithPolicyAfterError:(NSError *)theError;
+- (void)retryAfterPolicyDelay;
+
+// Stops the current attempt so the request can be sent again
+- (void)stopLoadingForRetry;
+
+// Throws away a partial download that belongs to a different version of the file, and sends the request again without a Range header
+- (void)restartDownloadFromBeginning;
+
 #if TARGET_OS_IPHONE
 + (void)registerForNetworkReachabilityNotifications;
 + (void)unsubscribeFromNetworkReachabilityNotifications;
@@ -191,10 +361,8 @@ static NSOperationQueue *sharedQueue = nil;
 #endif
 
 #if NS_BLOCKS_AVAILABLE
-- (void)performBlockOnMainThread:(ASIBasicBlock)block;
-- (void)releaseBlocksOnMainThread;
+- (void)releaseBlocksOnCallbackThread;
 + (void)releaseBlocks:(NSArray *)blocks;
-- (void)callBlock:(ASIBasicBlock)block;
 #endif
 
 
@@ -204,9 +372,10 @@ static NSOperationQueue *sharedQueue = nil;
 @property (assign) BOOL complete;
 @property (retain) NSArray *responseCookies;
 @property (assign) int responseStatusCode;
-@property (retain, nonatomic) NSDate *lastActivityTime;
+@property (assign, nonatomic) NSTimeInterval lastActivityTime;
 
 @property (assign) unsigned long long partialDownloadSize;
+@property (assign) BOOL rangeHeaderIsForResume;
 @property (assign, nonatomic) unsigned long long uploadBufferSize;
 @property (retain, nonatomic) NSOutputStream *postBodyWriteStream;
 @property (retain, nonatomic) NSInputStream *postBodyReadStream;
@@ -214,31 +383,41 @@ static NSOperationQueue *sharedQueue = nil;
 @property (assign, nonatomic) unsigned long long lastBytesSent;
 @property (atomic, retain) NSRecursiveLock *cancelledLock;
 @property (retain, nonatomic) NSOutputStream *fileDownloadOutputStream;
-@property (retain, nonatomic) NSOutputStream *inflatedFileDownloadOutputStream;
 @property (assign) int authenticationRetryCount;
 @property (assign) int proxyAuthenticationRetryCount;
 @property (assign, nonatomic) BOOL updatedProgress;
 @property (assign, nonatomic) BOOL needsRedirect;
 @property (assign, nonatomic) int redirectCount;
-@property (retain, nonatomic) NSData *compressedPostBody;
-@property (retain, nonatomic) NSString *compressedPostBodyFilePath;
+@property (atomic, assign, readwrite) double requestBodyCompressionRatio;
 @property (retain) NSString *authenticationRealm;
 @property (retain) NSString *proxyAuthenticationRealm;
 @property (retain) NSString *responseStatusMessage;
 @property (assign) BOOL inProgress;
 @property (assign) int retryCount;
+@property (atomic, assign, readwrite) int policyRetryCount;
 @property (atomic, assign) BOOL willRetryRequest;
 @property (assign) BOOL connectionCanBeReused;
-@property (retain, nonatomic) NSMutableDictionary *connectionInfo;
+@property (retain, nonatomic) ASIPersistentConnection *connectionInfo;
+@property (retain) NSThread *connectionWaitThread;
 @property (retain, nonatomic) NSInputStream *readStream;
 @property (assign) ASIAuthenticationState authenticationNeeded;
 @property (assign, nonatomic) BOOL readStreamIsScheduled;
 @property (assign, nonatomic) BOOL downloadComplete;
 @property (retain) NSNumber *requestID;
 @property (assign, nonatomic) NSString *runLoopMode;
-@property (retain, nonatomic) NSTimer *statusTimer;
+@property (retain, nonatomic) ASITimerWheel *statusTimerWheel;
+@property (retain, atomic) ASIResponseBuffer *responseBuffer;
+@property (assign, nonatomic) NSUInteger readBufferSize;
 @property (assign) BOOL didUseCachedResponse;
 @property (retain, nonatomic) NSURL *redirectURL;
+@property (retain, nonatomic) NSMutableDictionary *resumeManifest;
+@property (atomic, retain, readwrite) ASIDigest *requestBodyDigest;
+@property (atomic, retain, readwrite) ASIDigest *responseDigest;
+@property (retain, nonatomic) NSMutableArray *coalescedRequests;
+@property (retain, nonatomic) NSString *coalescingKey;
+@property (retain) ASIHTTPRequest *coalescingLeader;
+@property (retain) NSThread *coalescingThread;
+@property (retain) NSPort *coalescingPort;
 
 @property (assign, nonatomic) BOOL isPACFileRequest;
 @property (retain, nonatomic) ASIHTTPRequest *PACFileRequest;
@@ -246,6 +425,8 @@ static NSOperationQueue *sharedQueue = nil;
 @property (retain, nonatomic) NSMutableData *PACFileData;
 
 @property (assign, nonatomic, setter=setSynchronous:) BOOL isSynchronous;
+@property (retain) NSThread *requestThread;
+@property (assign) NSInteger networkThreadIndex;
 @end
 
 
@@ -256,14 +437,12 @@ static NSOperationQueue *sharedQueue = nil;
 + (void)initialize
 {
 	if (self == [ASIHTTPRequest class]) {
-		persistentConnectionsPool = [[NSMutableArray alloc] init];
 		connectionsLock = [[NSRecursiveLock alloc] init];
 		progressLock = [[NSRecursiveLock alloc] init];
 		bandwidthThrottlingLock = [[NSLock alloc] init];
 		sessionCookiesLock = [[NSRecursiveLock alloc] init];
 		sessionCredentialsLock = [[NSRecursiveLock alloc] init];
 		delegateAuthenticationLock = [[NSRecursiveLock alloc] init];
-		bandwidthUsageTracker = [[NSMutableArray alloc] initWithCapacity:5];
 		ASIRequestTimedOutError = [[NSError alloc] initWithDomain:NetworkRequestErrorDomain code:ASIRequestTimedOutErrorType userInfo:[NSDictionary dictionaryWithObjectsAndKeys:@"The request timed out",NSLocalizedDescriptionKey,nil]];  
 		ASIAuthenticationError = [[NSError alloc] initWithDomain:NetworkRequestErrorDomain code:ASIAuthenticationErrorType userInfo:[NSDictionary dictionaryWithObjectsAndKeys:@"Authentication needed",NSLocalizedDescriptionKey,nil]];
 		ASIRequestCancelledError = [[NSError alloc] initWithDomain:NetworkRequestErrorDomain code:ASIRequestCancelledErrorType userInfo:[NSDictionary dictionaryWithObjectsAndKeys:@"The request was cancelled",NSLocalizedDescriptionKey,nil]];
@@ -271,6 +450,11 @@ static NSOperationQueue *sharedQueue = nil;
 		ASITooMuchRedirectionError = [[NSError alloc] initWithDomain:NetworkRequestErrorDomain code:ASITooMuchRedirectionErrorType userInfo:[NSDictionary dictionaryWithObjectsAndKeys:@"The request failed because it redirected too many times",NSLocalizedDescriptionKey,nil]];
 		sharedQueue = [[NSOperationQueue alloc] init];
 		[sharedQueue setMaxConcurrentOperationCount:4];
+		networkThreads = [[NSMutableArray alloc] initWithCapacity:ASIMaximumNetworkThreads];
+		networkThreadsLock = [[NSLock alloc] init];
+		coalescableRequests = [[NSMutableDictionary alloc] init];
+		coalescableRequestsLock = [[NSRecursiveLock alloc] init];
+		compressedContentTypes = [[NSSet alloc] initWithObjects:@"image/jpeg",@"image/png",@"image/gif",@"image/webp",@"image/heic",@"audio/mpeg",@"audio/mp4",@"audio/aac",@"application/zip",@"application/gzip",@"application/x-gzip",@"application/x-bzip2",@"application/x-xz",@"application/x-7z-compressed",@"application/x-rar-compressed",@"application/vnd.rar",nil];
 
 	}
 }
@@ -291,10 +475,12 @@ static NSOperationQueue *sharedQueue = nil;
 	[self setShouldResetUploadProgress:YES];
 	[self setAllowCompressedResponse:YES];
 	[self setShouldWaitToInflateCompressedResponses:YES];
+	[self setRequestBodyCompressionLevel:Z_DEFAULT_COMPRESSION];
 	[self setDefaultResponseEncoding:NSISOLatin1StringEncoding];
 	[self setShouldPresentProxyAuthenticationDialog:YES];
 	
 	[self setTimeOutSeconds:[ASIHTTPRequest defaultTimeOutSeconds]];
+	[self setProgressUpdateInterval:[ASIHTTPRequest defaultProgressUpdateInterval]];
 	[self setUseSessionPersistence:YES];
 	[self setUseCookiePersistence:YES];
 	[self setValidatesSecureCertificate:YES];
@@ -306,6 +492,7 @@ static NSOperationQueue *sharedQueue = nil;
 	[self setDidFailSelector:@selector(requestFailed:)];
 	[self setDidReceiveDataSelector:@selector(request:didReceiveData:)];
 	[self setURL:newURL];
+	[self setNetworkThreadIndex:-1];
 	[self setCancelledLock:[[[NSRecursiveLock alloc] init] autorelease]];
 	[self setDownloadCache:[[self class] defaultCache]];
 	return self;
@@ -345,13 +532,20 @@ static NSOperationQueue *sharedQueue = nil;
 		CFRelease(clientCertificateIdentity);
 	}
 	[self cancelLoad];
+	[self releaseNetworkThread];
+
+	#if NS_BLOCKS_AVAILABLE
+	// This needs our lock and callback settings, so we do it before we release them
+	[self releaseBlocksOnCallbackThread];
+	#endif
+
+	[requestThread release];
 	[redirectURL release];
-	[statusTimer invalidate];
-	[statusTimer release];
+	[statusTimerWheel release];
 	[queue release];
 	[userInfo release];
 	[postBody release];
-	[compressedPostBody release];
+	[postBodyParts release];
 	[error release];
 	[requestHeaders release];
 	[requestCookies release];
@@ -359,7 +553,14 @@ static NSOperationQueue *sharedQueue = nil;
 	[temporaryFileDownloadPath release];
 	[temporaryUncompressedDataDownloadPath release];
 	[fileDownloadOutputStream release];
-	[inflatedFileDownloadOutputStream release];
+	[resumeManifest release];
+	[requestBodyDigest release];
+	[responseDigest release];
+	[coalescedRequests release];
+	[coalescingKey release];
+	[coalescingLeader release];
+	[coalescingThread release];
+	[coalescingPort release];
 	[username release];
 	[password release];
 	[domain release];
@@ -376,33 +577,38 @@ static NSOperationQueue *sharedQueue = nil;
 	[proxyCredentials release];
 	[url release];
 	[originalURL release];
-	[lastActivityTime release];
 	[responseCookies release];
 	[rawResponseData release];
+	[responseBuffer release];
 	[responseHeaders release];
 	[requestMethod release];
 	[cancelledLock release];
 	[postBodyFilePath release];
-	[compressedPostBodyFilePath release];
 	[postBodyWriteStream release];
 	[postBodyReadStream release];
 	[PACurl release];
 	[clientCertificates release];
 	[responseStatusMessage release];
 	[connectionInfo release];
+	[connectionWaitThread release];
 	[requestID release];
 	[dataDecompressor release];
 	[userAgentString release];
 
 	#if NS_BLOCKS_AVAILABLE
-	[self releaseBlocksOnMainThread];
+	if (callbackDispatchQueue) {
+		dispatch_release(callbackDispatchQueue);
+	}
 	#endif
+	[callbackOperationQueue release];
+	[bandwidthClass release];
+	[retryPolicy release];
 
 	[super dealloc];
 }
 
 #if NS_BLOCKS_AVAILABLE
-- (void)releaseBlocksOnMainThread
+- (void)releaseBlocksOnCallbackThread
 {
 	NSMutableArray *blocks = [NSMutableArray array];
 	if (completionBlock) {
@@ -465,9 +671,9 @@ static NSOperationQueue *sharedQueue = nil;
 		[requestRedirectedBlock release];
 		requestRedirectedBlock = nil;
 	}
-	[[self class] performSelectorOnMainThread:@selector(releaseBlocks:) withObject:blocks waitUntilDone:[NSThread isMainThread]];
+	[self performCallback:@selector(releaseBlocks:) onTarget:[self class] withObject:blocks waitUntilDone:YES];
 }
-// Always called on main thread
+// Always called where callbacks are delivered, since that's where the blocks were used
 + (void)releaseBlocks:(NSArray *)blocks
 {
 	// Blocks will be released when this method exits
@@ -485,6 +691,86 @@ static NSOperationQueue *sharedQueue = nil;
 	[requestHeaders setObject:value forKey:header];
 }
 
+- (BOOL)shouldSendCompressedPostBodyChunked
+{
+	return [self shouldCompressRequestBody] && ![self shouldPrecomputeCompressedPostLength] && ![self useHTTPVersionOne];
+}
+
+- (void)chooseRequestBodyCompression
+{
+	[self setShouldCompressRequestBody:NO];
+
+	// Don't bother with content that is already compressed
+	NSString *contentType = [[self requestHeaders] objectForKey:@"Content-Type"];
+	if (!contentType && [self postBodyFilePath]) {
+		contentType = [ASIHTTPRequest mimeTypeForFileAtPath:[self postBodyFilePath]];
+	}
+	contentType = [[[contentType componentsSeparatedByString:@";"] objectAtIndex:0] lowercaseString];
+	if (contentType && ([compressedContentTypes containsObject:contentType] || [contentType hasPrefix:@"video/"])) {
+		return;
+	}
+
+	NSData *sample;
+	if ([self postBodyFilePath]) {
+		NSFileHandle *fileHandle = [NSFileHandle fileHandleForReadingAtPath:[self postBodyFilePath]];
+		sample = [fileHandle readDataOfLength:ASIRequestBodyCompressionSampleSize];
+		[fileHandle closeFile];
+	} else if ([self postBodyParts]) {
+		NSMutableData *partsSample = [NSMutableData dataWithLength:ASIRequestBodyCompressionSampleSize];
+		NSUInteger sampleLength = 0;
+		NSInputStream *partsStream = [ASIInputStream inputStreamWithParts:[self postBodyParts] request:nil];
+		[partsStream open];
+		while (sampleLength < [partsSample length]) {
+			NSInteger readLength = [partsStream read:(uint8_t *)[partsSample mutableBytes]+sampleLength maxLength:[partsSample length]-sampleLength];
+			if (readLength <= 0) {
+				break;
+			}
+			sampleLength += (NSUInteger)readLength;
+		}
+		[partsStream close];
+		[partsSample setLength:sampleLength];
+		sample = partsSample;
+	} else {
+		sample = [[self postBody] subdataWithRange:NSMakeRange(0, MIN([[self postBody] length], (NSUInteger)ASIRequestBodyCompressionSampleSize))];
+	}
+	if (![sample length] || ASIByteEntropy((const unsigned char *)[sample bytes], [sample length]) > ASIIncompressibleEntropy) {
+		return;
+	}
+
+	// Try compressing the sample at each level, to see how much it saves and how quickly this device can do it
+	// The body is compressed while it is sent, so whichever is slower (compressing or sending) decides how long it takes
+	// We compare the time each level would take to send each byte of the original body with sending it uncompressed
+	double bandwidth = (double)[ASIHTTPRequest averageBandwidthUsedPerSecond];
+	double bestTimePerByte = (bandwidth > 0 ? 1/bandwidth : 0);
+	int bestLevel = 0;
+	int levels[3] = {Z_BEST_SPEED, 6, Z_BEST_COMPRESSION};
+	NSUInteger i;
+	for (i=0; i<3; i++) {
+		NSTimeInterval startTime = ASIMonotonicTime();
+		NSData *compressedSample = [[ASIDataCompressor compressorWithLevel:levels[i]] compressAllBytes:(Bytef *)[sample bytes] length:[sample length] error:NULL];
+		NSTimeInterval compressionTime = ASIMonotonicTime()-startTime;
+		double ratio = (double)[compressedSample length]/(double)[sample length];
+		if (!compressedSample || ratio > ASIWorthwhileCompressionRatio) {
+			continue;
+		}
+
+		// If we haven't been using the network, we don't know how fast it is, so we'll just use the default level if it's worth compressing at all
+		if (bandwidth <= 0) {
+			bestLevel = Z_DEFAULT_COMPRESSION;
+			break;
+		}
+		double timePerByte = MAX(compressionTime/[sample length], ratio/bandwidth);
+		if (timePerByte < bestTimePerByte) {
+			bestTimePerByte = timePerByte;
+			bestLevel = levels[i];
+		}
+	}
+	if (bestLevel) {
+		[self setShouldCompressRequestBody:YES];
+		[self setRequestBodyCompressionLevel:bestLevel];
+	}
+}
+
 // This function will be called either just before a request starts, or when postLength is needed, whichever comes first
 // postLength must be set by the time this function is complete
 - (void)buildPostBody
@@ -504,21 +790,7 @@ static NSOperationQueue *sharedQueue = nil;
 		}
 
 		
-		NSString *path;
-		if ([self shouldCompressRequestBody]) {
-			if (![self compressedPostBodyFilePath]) {
-				[self setCompressedPostBodyFilePath:[NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]]];
-				
-				NSError *err = nil;
-				if (![ASIDataCompressor compressDataFromFile:[self postBodyFilePath] toFile:[self compressedPostBodyFilePath] error:&err]) {
-					[self failWithError:err];
-					return;
-				}
-			}
-			path = [self compressedPostBodyFilePath];
-		} else {
-			path = [self postBodyFilePath];
-		}
+		NSString *path = [self postBodyFilePath];
 		NSError *err = nil;
 		[self setPostLength:[[[[[NSFileManager alloc] init] autorelease] attributesOfItemAtPath:path error:&err] fileSize]];
 		if (err) {
@@ -526,27 +798,64 @@ static NSOperationQueue *sharedQueue = nil;
 			return;
 		}
 		
+	// Are we sending a body made of several parts
+	// Files are only read when the request is sent, so we add up their sizes to find out how long it will be
+	} else if ([self postBodyParts]) {
+		NSFileManager *fileManager = [[[NSFileManager alloc] init] autorelease];
+		unsigned long long length = 0;
+		for (id part in [self postBodyParts]) {
+			if ([part isKindOfClass:[NSString class]]) {
+				NSError *err = nil;
+				unsigned long long fileSize = [[fileManager attributesOfItemAtPath:part error:&err] fileSize];
+				if (err) {
+					[self failWithError:[NSError errorWithDomain:NetworkRequestErrorDomain code:ASIFileManagementError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:[NSString stringWithFormat:@"Failed to get attributes for file at path '%@'",part],NSLocalizedDescriptionKey,err,NSUnderlyingErrorKey,nil]]];
+					return;
+				}
+				length += fileSize;
+			} else {
+				length += [part length];
+			}
+		}
+		[self setPostLength:length];
+
 	// Otherwise, we have an in-memory request body
 	} else {
-		if ([self shouldCompressRequestBody]) {
-			NSError *err = nil;
-			NSData *compressedBody = [ASIDataCompressor compressData:[self postBody] error:&err];
-			if (err) {
-				[self failWithError:err];
-				return;
-			}
-			[self setCompressedPostBody:compressedBody];
-			[self setPostLength:[[self compressedPostBody] length]];
+		[self setPostLength:[[self postBody] length]];
+	}
+
+	if ([self postLength] > 0 && [self shouldAutomaticallyCompressRequestBody]) {
+		[self chooseRequestBodyCompression];
+	}
+
+	// A compressed body is compressed as it is sent
+	// If we need a Content-Length, we compress it once now to find out how long it will be
+	if ([self postLength] > 0 && [self shouldCompressRequestBody] && ![self shouldSendCompressedPostBodyChunked]) {
+		NSInputStream *bodyStream;
+		if ([self postBodyFilePath]) {
+			bodyStream = [NSInputStream inputStreamWithFileAtPath:[self postBodyFilePath]];
+		} else if ([self postBodyParts]) {
+			bodyStream = [ASIInputStream inputStreamWithParts:[self postBodyParts] request:nil];
 		} else {
-			[self setPostLength:[[self postBody] length]];
+			bodyStream = [NSInputStream inputStreamWithData:[self postBody]];
+		}
+		NSError *err = nil;
+		unsigned long long compressedLength = [ASIDataCompressor compressedLengthOfDataFromStream:bodyStream level:[self requestBodyCompressionLevel] error:&err];
+		if (err) {
+			[self failWithError:err];
+			return;
 		}
+		[self setRequestBodyCompressionRatio:(double)compressedLength/(double)[self postLength]];
+		[self setPostLength:compressedLength];
 	}
 		
 	if ([self postLength] > 0) {
 		if ([requestMethod isEqualToString:@"GET"] || [requestMethod isEqualToString:@"DELETE"] || [requestMethod isEqualToString:@"HEAD"]) {
 			[self setRequestMethod:@"POST"];
 		}
-		[self addRequestHeader:@"Content-Length" value:[NSString stringWithFormat:@"%llu",[self postLength]]];
+		// Without a Content-Length, CFNetwork sends the body with chunked transfer encoding
+		if (![self shouldSendCompressedPostBodyChunked]) {
+			[self addRequestHeader:@"Content-Length" value:[NSString stringWithFormat:@"%llu",[self postLength]]];
+		}
 	}
 	[self setHaveBuiltPostBody:YES];
 
@@ -573,6 +882,19 @@ static NSOperationQueue *sharedQueue = nil;
 
 - (void)appendPostData:(NSData *)data
 {
+	// Once the body is made of parts, data goes after the last part (joined on to it, if that's data too)
+	if ([self postBodyParts]) {
+		if ([data length] == 0) {
+			return;
+		}
+		id lastPart = [[self postBodyParts] lastObject];
+		if (lastPart && ![lastPart isKindOfClass:[NSString class]]) {
+			[lastPart appendData:data];
+		} else {
+			[[self postBodyParts] addObject:[[data mutableCopy] autorelease]];
+		}
+		return;
+	}
 	[self setupPostBody];
 	if ([data length] == 0) {
 		return;
@@ -609,6 +931,44 @@ static NSOperationQueue *sharedQueue = nil;
 	[stream close];
 }
 
+- (void)appendPostDataFromFileInPlace:(NSString *)file
+{
+	if ([self shouldStreamPostDataFromDisk]) {
+		[self appendPostDataFromFile:file];
+		return;
+	}
+	[self setupPostBodyParts];
+	[[self postBodyParts] addObject:file];
+}
+
+- (void)appendPostDataInPlace:(NSData *)data
+{
+	if ([self shouldStreamPostDataFromDisk]) {
+		[self appendPostData:data];
+		return;
+	}
+	if ([data length] == 0) {
+		return;
+	}
+	[self setupPostBodyParts];
+	[[self postBodyParts] addObject:data];
+
+	// appendPostData: joins data on to the last part, so we give it a part of our own rather than letting it change this one
+	[[self postBodyParts] addObject:[NSMutableData data]];
+}
+
+- (void)setupPostBodyParts
+{
+	// Anything already in postBody becomes the first part
+	if (![self postBodyParts]) {
+		[self setPostBodyParts:[NSMutableArray array]];
+		if ([[self postBody] length]) {
+			[[self postBodyParts] addObject:[self postBody]];
+		}
+		[self setPostBody:nil];
+	}
+}
+
 - (NSString *)requestMethod
 {
 	[[self cancelledLock] lock];
@@ -623,7 +983,7 @@ static NSOperationQueue *sharedQueue = nil;
 	if (requestMethod != newRequestMethod) {
 		[requestMethod release];
 		requestMethod = [newRequestMethod retain];
-		if ([requestMethod isEqualToString:@"POST"] || [requestMethod isEqualToString:@"PUT"] || [postBody length] || postBodyFilePath) {
+		if ([requestMethod isEqualToString:@"POST"] || [requestMethod isEqualToString:@"PUT"] || [postBody length] || postBodyFilePath || postBodyParts) {
 			[self setShouldAttemptPersistentConnection:NO];
 		}
 	}
@@ -713,6 +1073,9 @@ static NSOperationQueue *sharedQueue = nil;
 		[[self cancelledLock] unlock];
 		return;
 	}
+	// Stop waiting to retry
+	[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(retryAfterPolicyDelay) object:nil];
+
 	[self failWithError:ASIRequestCancelledError];
 	[self setComplete:YES];
 	[self cancelLoad];
@@ -743,7 +1106,7 @@ static NSOperationQueue *sharedQueue = nil;
 
 	#if NS_BLOCKS_AVAILABLE
 	// Clear blocks
-	[self releaseBlocksOnMainThread];
+	[self releaseBlocksOnCallbackThread];
 	#endif
 
 	[[self cancelledLock] unlock];
@@ -775,14 +1138,47 @@ static NSOperationQueue *sharedQueue = nil;
 
 - (BOOL)isResponseCompressed
 {
-	NSString *encoding = [[self responseHeaders] objectForKey:@"Content-Encoding"];
-	return encoding && [encoding rangeOfString:@"gzip"].location != NSNotFound;
+	return [ASIDataDecompressor canDecodeContentEncoding:[[self responseHeaders] objectForKey:@"Content-Encoding"]];
+}
+
+- (ASIDataDecompressor *)responseDecompressor
+{
+	return [ASIDataDecompressor decompressorForContentEncoding:[[self responseHeaders] objectForKey:@"Content-Encoding"]];
+}
+
+- (NSMutableData *)rawResponseData
+{
+	[[self cancelledLock] lock];
+
+	// Responses we are downloading ourselves live in the response buffer until someone asks for them
+	// While the response is still arriving, we hand out a copy of what we have so far, so the network thread never appends to data someone else is reading
+	NSMutableData *data;
+	ASIResponseBuffer *buffer = [self responseBuffer];
+	if (buffer && ![self complete]) {
+		data = [[buffer copyOfData] autorelease];
+	} else if (buffer) {
+		data = [[[buffer data] retain] autorelease];
+	} else {
+		data = [[rawResponseData retain] autorelease];
+	}
+	[[self cancelledLock] unlock];
+	return data;
+}
+
+- (void)setRawResponseData:(NSMutableData *)newData
+{
+	[[self cancelledLock] lock];
+	[self setResponseBuffer:nil];
+	[rawResponseData release];
+	rawResponseData = [newData retain];
+	[[self cancelledLock] unlock];
 }
 
 - (NSData *)responseData
 {	
 	if ([self isResponseCompressed] && [self shouldWaitToInflateCompressedResponses]) {
-		return [ASIDataDecompressor uncompressData:[self rawResponseData] error:NULL];
+		NSData *data = [self rawResponseData];
+		return [[self responseDecompressor] uncompressAllBytes:(Bytef *)[data bytes] length:[data length] error:NULL];
 	} else {
 		return [self rawResponseData];
 	}
@@ -807,6 +1203,13 @@ static NSOperationQueue *sharedQueue = nil;
 		}
 	}
 
+	// If we waited for an identical request, we no longer need the port that kept the runloop waiting for it
+	if ([self coalescingPort]) {
+		[[NSRunLoop currentRunLoop] removePort:[self coalescingPort] forMode:[self runLoopMode]];
+		[[[NSThread currentThread] threadDictionary] removeObjectForKey:@"ASICoalescingPort"];
+		[self setCoalescingPort:nil];
+	}
+
 	[self setInProgress:NO];
 }
 
@@ -952,6 +1355,11 @@ static NSOperationQueue *sharedQueue = nil;
 			CFHTTPMessageSetHeaderFieldValue(request, (CFStringRef)header, (CFStringRef)[[self requestHeaders] objectForKey:header]);
 		}
 
+		// If an identical request is already running, we'll use its response rather than fetching our own
+		if ([self shouldCoalesceIdenticalRequests] && [self waitForIdenticalRequest]) {
+			return;
+		}
+
 		// If we immediately have access to proxy settings, start the request
 		// Otherwise, we'll start downloading the proxy PAC file, and call startRequest once that process is complete
 		if ([self configureProxies]) {
@@ -1103,7 +1511,7 @@ static NSOperationQueue *sharedQueue = nil;
 	
 	// Accept a compressed response
 	if ([self allowCompressedResponse]) {
-		[self addRequestHeader:@"Accept-Encoding" value:@"gzip"];
+		[self addRequestHeader:@"Accept-Encoding" value:[[ASIDataDecompressor supportedContentEncodings] componentsJoinedByString:@", "]];
 	}
 	
 	// Configure a compressed request body
@@ -1115,6 +1523,10 @@ static NSOperationQueue *sharedQueue = nil;
 	[self updatePartialDownloadSize];
 	if ([self partialDownloadSize]) {
 		[self addRequestHeader:@"Range" value:[NSString stringWithFormat:@"bytes=%llu-",[self partialDownloadSize]]];
+		if ([self resumeValidator]) {
+			[self addRequestHeader:@"If-Range" value:[self resumeValidator]];
+		}
+		[self setRangeHeaderIsForResume:YES];
 	}
 }
 
@@ -1124,12 +1536,122 @@ static NSOperationQueue *sharedQueue = nil;
 
 	if ([self allowResumeForFileDownloads] && [self downloadDestinationPath] && [self temporaryFileDownloadPath] && [fileManager fileExistsAtPath:[self temporaryFileDownloadPath]]) {
 		NSError *err = nil;
-		[self setPartialDownloadSize:[[fileManager attributesOfItemAtPath:[self temporaryFileDownloadPath] error:&err] fileSize]];
+		unsigned long long fileSize = [[fileManager attributesOfItemAtPath:[self temporaryFileDownloadPath] error:&err] fileSize];
 		if (err) {
 			[self failWithError:[NSError errorWithDomain:NetworkRequestErrorDomain code:ASIFileManagementError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:[NSString stringWithFormat:@"Failed to get attributes for file at path '%@'",[self temporaryFileDownloadPath]],NSLocalizedDescriptionKey,error,NSUnderlyingErrorKey,nil]]];
 			return;
 		}
+
+		// We wrote this file ourselves (eg we are retrying after a timeout), so we already have a checksum for all of it
+		if ([self resumeManifest] && fileSize == resumeChecksumLength) {
+			[self saveResumeManifest];
+			[self setPartialDownloadSize:fileSize];
+		} else {
+			[self setPartialDownloadSize:[self verifiedLengthOfPartialDownload]];
+		}
+	}
+}
+
+#pragma mark resume manifests
+
+- (NSString *)resumeManifestPath
+{
+	return [[self temporaryFileDownloadPath] stringByAppendingPathExtension:@"asiresume"];
+}
+
+// Returns the number of bytes at the start of temporaryFileDownloadPath we can resume from
+// If there's no manifest, it was for a different url, or the checksum doesn't match, the partial download is thrown away and we start again
+// We check all of the bytes the manifest covers, since any of them may have been damaged since they were written
+- (unsigned long long)verifiedLengthOfPartialDownload
+{
+	NSString *path = [self temporaryFileDownloadPath];
+	NSMutableDictionary *manifest = [NSMutableDictionary dictionaryWithContentsOfFile:[self resumeManifestPath]];
+	NSURL *theURL = ([self originalURL] ? [self originalURL] : [self url]);
+	unsigned long long verifiedLength = [[manifest objectForKey:@"VerifiedLength"] unsignedLongLongValue];
+	NSNumber *expectedChecksum = [manifest objectForKey:@"Checksum"];
+	unsigned long checksum = 0;
+
+	BOOL valid = [[manifest objectForKey:@"URL"] isEqualToString:[theURL absoluteString]];
+	if (valid) {
+		unsigned long long fileSize = [[[[[NSFileManager alloc] init] autorelease] attributesOfItemAtPath:path error:NULL] fileSize];
+
+		// Anything written after the manifest was last saved may not have made it to disk intact, so we'll download it again
+		valid = (fileSize >= verifiedLength && truncate([path fileSystemRepresentation], (off_t)verifiedLength) == 0);
+	}
+	if (valid) {
+		valid = (expectedChecksum && ASIChecksumOfFile(path, verifiedLength, &checksum) && checksum == [expectedChecksum unsignedLongValue]);
+	}
+	if (!valid || !verifiedLength) {
+		#if DEBUG_REQUEST_STATUS
+		ASI_DEBUG_LOG(@"[STATUS] Request %@ can't resume from the partial download at %@, will start again",self,path);
+		#endif
+		[[self class] removeFileAtPath:path error:NULL];
+		[[self class] removeFileAtPath:[self resumeManifestPath] error:NULL];
+		[self setResumeManifest:nil];
+		return 0;
+	}
+	[self setResumeManifest:manifest];
+	resumeChecksum = checksum;
+	resumeChecksumLength = verifiedLength;
+	resumeManifestSavedLength = verifiedLength;
+	return verifiedLength;
+}
+
+// Called when we start writing a download we might resume to an empty file
+- (void)startResumeManifest
+{
+	NSMutableDictionary *manifest = [NSMutableDictionary dictionary];
+	NSURL *theURL = ([self originalURL] ? [self originalURL] : [self url]);
+	[manifest setObject:[theURL absoluteString] forKey:@"URL"];
+	NSString *eTag = [[self responseHeaders] objectForKey:@"Etag"];
+	if (eTag) {
+		[manifest setObject:eTag forKey:@"ETag"];
+	}
+	NSString *lastModified = [[self responseHeaders] objectForKey:@"Last-Modified"];
+	if (lastModified) {
+		[manifest setObject:lastModified forKey:@"Last-Modified"];
+	}
+	if ([self contentLength]) {
+		[manifest setObject:[NSNumber numberWithUnsignedLongLong:[self contentLength]] forKey:@"ExpectedLength"];
+	}
+	[self setResumeManifest:manifest];
+	resumeChecksum = crc32(0L, Z_NULL, 0);
+	resumeChecksumLength = 0;
+	resumeManifestSavedLength = 0;
+	[self saveResumeManifest];
+}
+
+- (void)saveResumeManifest
+{
+	if (![self resumeManifest] || ![self temporaryFileDownloadPath]) {
+		return;
+	}
+	// The manifest mustn't vouch for bytes that could still be lost if the device loses power, so we keep the old one until they are on disk
+	if (resumeChecksumLength > resumeManifestSavedLength && !ASISynchronizeFile([self temporaryFileDownloadPath])) {
+		return;
+	}
+	[[self resumeManifest] setObject:[NSNumber numberWithUnsignedLongLong:resumeChecksumLength] forKey:@"VerifiedLength"];
+	[[self resumeManifest] setObject:[NSNumber numberWithUnsignedLong:resumeChecksum] forKey:@"Checksum"];
+	[[self resumeManifest] writeToFile:[self resumeManifestPath] atomically:YES];
+	resumeManifestSavedLength = resumeChecksumLength;
+}
+
+- (void)removeResumeManifest
+{
+	if ([self temporaryFileDownloadPath]) {
+		[[self class] removeFileAtPath:[self resumeManifestPath] error:NULL];
 	}
+	[self setResumeManifest:nil];
+}
+
+// Weak ETags can't be used with If-Range, so we use the Last-Modified date instead if that's all we have
+- (NSString *)resumeValidator
+{
+	NSString *eTag = [[self resumeManifest] objectForKey:@"ETag"];
+	if (eTag && ![eTag hasPrefix:@"W/"]) {
+		return eTag;
+	}
+	return [[self resumeManifest] objectForKey:@"Last-Modified"];
 }
 
 - (void)startRequest
@@ -1138,7 +1660,12 @@ static NSOperationQueue *sharedQueue = nil;
 		return;
 	}
 	
-	[self performSelectorOnMainThread:@selector(requestStarted) withObject:nil waitUntilDone:[NSThread isMainThread]];
+	// If we were waiting for a connection, the delegate has already been told we started
+	if ([self connectionWaitThread]) {
+		[self setConnectionWaitThread:nil];
+	} else {
+		[self performCallback:@selector(requestStarted) onTarget:self withObject:nil waitUntilDone:YES];
+	}
 	
 	[self setDownloadComplete:NO];
 	[self setComplete:NO];
@@ -1156,10 +1683,15 @@ static NSOperationQueue *sharedQueue = nil;
 	
 	[self setLastBytesSent:0];
 	[self setContentLength:0];
+	[self setReadBufferSize:0];
 	[self setResponseHeaders:nil];
 	if (![self downloadDestinationPath]) {
-		[self setRawResponseData:[[[NSMutableData alloc] init] autorelease]];
+		[self setRawResponseData:nil];
+		[self setResponseBuffer:[ASIResponseBuffer buffer]];
     }
+
+	// If we're retrying, the next response starts a new compressed stream
+	[self setDataDecompressor:nil];
 	
 	
     //
@@ -1170,12 +1702,23 @@ static NSOperationQueue *sharedQueue = nil;
 
 	[self setReadStreamIsScheduled:NO];
 	
+	// Do we need to send a request body made of several parts
+	if ([self postBodyParts] && [self postLength] > 0) {
+		if ([self shouldCompressRequestBody]) {
+			[self setPostBodyReadStream:[ASIInputStream compressedInputStreamWithParts:[self postBodyParts] request:self]];
+		} else {
+			[self setPostBodyReadStream:[ASIInputStream inputStreamWithParts:[self postBodyParts] request:self]];
+		}
+		[self setReadStream:[NSMakeCollectable(CFReadStreamCreateForStreamedHTTPRequest(kCFAllocatorDefault, request,(CFReadStreamRef)[self postBodyReadStream])) autorelease]];
+
 	// Do we need to stream the request body from disk
-	if ([self shouldStreamPostDataFromDisk] && [self postBodyFilePath] && [fileManager fileExistsAtPath:[self postBodyFilePath]]) {
+	} else if ([self shouldStreamPostDataFromDisk] && [self postBodyFilePath] && [fileManager fileExistsAtPath:[self postBodyFilePath]]) {
 		
 		// Are we gzipping the request body?
-		if ([self compressedPostBodyFilePath] && [fileManager fileExistsAtPath:[self compressedPostBodyFilePath]]) {
-			[self setPostBodyReadStream:[ASIInputStream inputStreamWithFileAtPath:[self compressedPostBodyFilePath] request:self]];
+		if ([self shouldCompressRequestBody]) {
+			[self setPostBodyReadStream:[ASIInputStream compressedInputStreamWithFileAtPath:[self postBodyFilePath] request:self]];
+		} else if ([self shouldMemoryMapPostBodyFile]) {
+			[self setPostBodyReadStream:[ASIInputStream inputStreamWithMappedFileAtPath:[self postBodyFilePath] request:self]];
 		} else {
 			[self setPostBodyReadStream:[ASIInputStream inputStreamWithFileAtPath:[self postBodyFilePath] request:self]];
 		}
@@ -1184,8 +1727,8 @@ static NSOperationQueue *sharedQueue = nil;
 		
 		// If we have a request body, we'll stream it from memory using our custom stream, so that we can measure bandwidth use and it can be bandwidth-throttled if necessary
 		if ([self postBody] && [[self postBody] length] > 0) {
-			if ([self shouldCompressRequestBody] && [self compressedPostBody]) {
-				[self setPostBodyReadStream:[ASIInputStream inputStreamWithData:[self compressedPostBody] request:self]];
+			if ([self shouldCompressRequestBody]) {
+				[self setPostBodyReadStream:[ASIInputStream compressedInputStreamWithData:[self postBody] request:self]];
 			} else if ([self postBody]) {
 				[self setPostBodyReadStream:[ASIInputStream inputStreamWithData:[self postBody] request:self]];
 			}
@@ -1201,6 +1744,8 @@ static NSOperationQueue *sharedQueue = nil;
         return;
     }
 
+	[self startDigests];
+
 
     
     
@@ -1285,10 +1830,8 @@ static NSOperationQueue *sharedQueue = nil;
 	// Handle persistent connections
 	//
 	
-	[ASIHTTPRequest expirePersistentConnections];
-
-	[connectionsLock lock];
-	
+	ASIConnectionPool *connectionPool = [ASIConnectionPool sharedPool];
+	[connectionPool expireIdleConnectionsIfNeeded];
 	
 	if (![[self url] host] || ![[self url] scheme]) {
 		[self setConnectionInfo:nil];
@@ -1300,88 +1843,52 @@ static NSOperationQueue *sharedQueue = nil;
 	
 	// Use a persistent connection if possible
 	if ([self shouldAttemptPersistentConnection]) {
-		
-
-		// If we are redirecting, we will re-use the current connection only if we are connecting to the same server
-		if ([self connectionInfo]) {
-			
-			if (![[[self connectionInfo] objectForKey:@"host"] isEqualToString:[[self url] host]] || ![[[self connectionInfo] objectForKey:@"scheme"] isEqualToString:[[self url] scheme]] || [(NSNumber *)[[self connectionInfo] objectForKey:@"port"] intValue] != [[[self url] port] intValue]) {
-				[self setConnectionInfo:nil];
 
-			// Check if we should have expired this connection
-			} else if ([[[self connectionInfo] objectForKey:@"expires"] timeIntervalSinceNow] < 0) {
-				#if DEBUG_PERSISTENT_CONNECTIONS
-				ASI_DEBUG_LOG(@"[CONNECTION] Not re-using connection #%i because it has expired",[[[self connectionInfo] objectForKey:@"id"] intValue]);
-				#endif
-				[persistentConnectionsPool removeObject:[self connectionInfo]];
-				[self setConnectionInfo:nil];
-
-			} else if ([[self connectionInfo] objectForKey:@"request"] != nil) {
-                //Some other request reused this connection already - we'll have to create a new one
-				#if DEBUG_PERSISTENT_CONNECTIONS
-                ASI_DEBUG_LOG(@"%@ - Not re-using connection #%i for request #%i because it is already used by request #%i",self,[[[self connectionInfo] objectForKey:@"id"] intValue],[[self requestID] intValue],[[[self connectionInfo] objectForKey:@"request"] intValue]);
-				#endif
-                [self setConnectionInfo:nil];
-            }
-		}
-		
-		
-		
-		if (![self connectionInfo] && [[self url] host] && [[self url] scheme]) { // We must have a proper url with a host and scheme, or this will explode
-			
-			// Look for a connection to the same server in the pool
-			for (NSMutableDictionary *existingConnection in persistentConnectionsPool) {
-				if (![existingConnection objectForKey:@"request"] && [[existingConnection objectForKey:@"host"] isEqualToString:[[self url] host]] && [[existingConnection objectForKey:@"scheme"] isEqualToString:[[self url] scheme]] && [(NSNumber *)[existingConnection objectForKey:@"port"] intValue] == [[[self url] port] intValue]) {
-					[self setConnectionInfo:existingConnection];
-				}
-			}
-		}
-		
-		if ([[self connectionInfo] objectForKey:@"stream"]) {
-			oldStream = [[[self connectionInfo] objectForKey:@"stream"] retain];
-
-		}
-		
-		// No free connection was found in the pool matching the server/scheme/port we're connecting to, we'll need to create a new one
-		if (![self connectionInfo]) {
-			[self setConnectionInfo:[NSMutableDictionary dictionary]];
-			nextConnectionNumberToCreate++;
-			[[self connectionInfo] setObject:[NSNumber numberWithInt:(int)nextConnectionNumberToCreate] forKey:@"id"];
-			[[self connectionInfo] setObject:[[self url] host] forKey:@"host"];
-			[[self connectionInfo] setObject:[NSNumber numberWithInt:[[[self url] port] intValue]] forKey:@"port"];
-			[[self connectionInfo] setObject:[[self url] scheme] forKey:@"scheme"];
-			[persistentConnectionsPool addObject:[self connectionInfo]];
-		}
-		
 		// If we are retrying this request, it will already have a requestID
 		if (![self requestID]) {
+			[connectionsLock lock];
 			nextRequestID++;
 			[self setRequestID:[NSNumber numberWithUnsignedInt:nextRequestID]];
+			[connectionsLock unlock];
 		}
-		[[self connectionInfo] setObject:[self requestID] forKey:@"request"];		
-		[[self connectionInfo] setObject:[self readStream] forKey:@"stream"];
+
+		// If we are redirecting, the pool will give us our current connection again if we are connecting to the same server and it is still free
+		ASIPersistentConnection *connection = [connectionPool checkOutConnectionForRequest:self requestID:[self requestID] previousConnection:[self connectionInfo]];
+
+		// We already have as many connections to this server as we are allowed
+		// The pool will hand us back when one is free, and we'll start again from the top
+		if (!connection) {
+			[self setConnectionWaitThread:[NSThread currentThread]];
+			[self setPostBodyReadStream:nil];
+			[self setReadStream:nil];
+			return;
+		}
+		[self setConnectionInfo:connection];
+		
+		if ([connection stream]) {
+			oldStream = [[connection stream] retain];
+		}
+		[connection setStream:[self readStream]];
 		CFReadStreamSetProperty((CFReadStreamRef)[self readStream],  kCFStreamPropertyHTTPAttemptPersistentConnection, kCFBooleanTrue);
 		
 		#if DEBUG_PERSISTENT_CONNECTIONS
-		ASI_DEBUG_LOG(@"[CONNECTION] Request #%@ will use connection #%i",[self requestID],[[[self connectionInfo] objectForKey:@"id"] intValue]);
+		ASI_DEBUG_LOG(@"[CONNECTION] Request #%@ will use connection #%@",[self requestID],[connection connectionID]);
 		#endif
 		
 		
 		// Tag the stream with an id that tells it which connection to use behind the scenes
 		// See http://lists.apple.com/archives/macnetworkprog/2008/Dec/msg00001.html for details on this approach
 		
-		CFReadStreamSetProperty((CFReadStreamRef)[self readStream], CFSTR("ASIStreamID"), [[self connectionInfo] objectForKey:@"id"]);
+		CFReadStreamSetProperty((CFReadStreamRef)[self readStream], CFSTR("ASIStreamID"), [connection connectionID]);
 	
 	} else {
 		#if DEBUG_PERSISTENT_CONNECTIONS
 		ASI_DEBUG_LOG(@"[CONNECTION] Request %@ will not use a persistent connection",self);
 		#endif
 	}
-	
-	[connectionsLock unlock];
 
 	// Schedule the stream
-	if (![self readStreamIsScheduled] && (!throttleWakeUpTime || [throttleWakeUpTime timeIntervalSinceDate:[NSDate date]] < 0)) {
+	if (![self readStreamIsScheduled] && [[self effectiveBandwidthClass] availableBytes] > 0) {
 		[self scheduleReadStream];
 	}
 	
@@ -1428,30 +1935,80 @@ static NSOperationQueue *sharedQueue = nil;
 	
 	
 	// Record when the request started, so we can timeout if nothing happens
-	[self setLastActivityTime:[NSDate date]];
-	[self setStatusTimer:[NSTimer timerWithTimeInterval:0.25 target:self selector:@selector(updateStatus:) userInfo:nil repeats:YES]];
-	[[NSRunLoop currentRunLoop] addTimer:[self statusTimer] forMode:[self runLoopMode]];
+	[self setLastActivityTime:ASIMonotonicTime()];
+	[self setStatusTimerWheel:[ASITimerWheel timerWheelForCurrentThreadInMode:[self runLoopMode]]];
+	[self scheduleStatusCheck];
+}
+
+// Ask our timer wheel to call us back when we next need to check on the request
+// Requests that are uploading, throttled or reporting progress are checked every 0.25 seconds, other requests only when they would time out
+- (void)scheduleStatusCheck
+{
+	NSTimeInterval now = ASIMonotonicTime();
+	NSTimeInterval nextCheck;
+	if ([self readStream] && ![self readStreamIsScheduled] && [[self effectiveBandwidthClass] isThrottled]) {
+		// We're asleep because our bandwidth class has used up its allowance, so we'll check again when it has been paid back
+		nextCheck = [[self effectiveBandwidthClass] wakeUpTime];
+	} else if ([self needsFrequentStatusChecks]) {
+		nextCheck = now+ASITimerWheelTickInterval;
+	} else if ([self lastActivityTime] > 0 && [self timeOutSeconds] > 0) {
+		// See shouldTimeOut - requests with a body may get up to half as long again
+		nextCheck = [self lastActivityTime]+[self timeOutSeconds];
+		if ([self postLength] && !([self uploadBufferSize] > 0 && [self totalBytesSent] > [self uploadBufferSize])) {
+			nextCheck = [self lastActivityTime]+([self timeOutSeconds]*1.5);
+		}
+	} else {
+		// Nothing can time out at the moment (eg we're waiting for credentials), but we keep the request scheduled so it is retained while it runs
+		nextCheck = now+16;
+	}
+	[[self statusTimerWheel] scheduleTarget:self atTime:nextCheck];
 }
 
-- (void)setStatusTimer:(NSTimer *)timer
+- (void)stopStatusChecks
 {
-	CFRetain(self);
-	// We must invalidate the old timer here, not before we've created and scheduled a new timer
-	// This is because the timer may be the only thing retaining an asynchronous request
-	if (statusTimer && timer != statusTimer) {
-		[statusTimer invalidate];
-		[statusTimer release];
+	if ([[self statusTimerWheel] thread] == [NSThread currentThread]) {
+		[[self statusTimerWheel] unscheduleTarget:self];
 	}
-	statusTimer = [timer retain];
-	CFRelease(self);
 }
 
-// This gets fired every 1/4 of a second to update the progress and work out if we need to timeout
-- (void)updateStatus:(NSTimer*)timer
+- (BOOL)needsFrequentStatusChecks
+{
+	// We need to wake up throttled requests
+	if ([[self effectiveBandwidthClass] isThrottled]) {
+		return YES;
+	}
+	// CFNetwork doesn't tell us when it sends more of the body, so we have to ask
+	if ([self postLength] && [self totalBytesSent] < [self postLength]) {
+		return YES;
+	}
+	if ([self downloadProgressDelegate] || [self uploadProgressDelegate]) {
+		return YES;
+	}
+	// A queue only needs to hear about progress as it happens when it has progress delegates of its own
+	// We can't tell for queues that aren't ASINetworkQueues, so they always hear
+	id theQueue = [self queue];
+	if (theQueue) {
+		if (![theQueue respondsToSelector:@selector(downloadProgressDelegate)] || ![theQueue respondsToSelector:@selector(uploadProgressDelegate)]) {
+			return YES;
+		}
+		if ([theQueue downloadProgressDelegate] || [theQueue uploadProgressDelegate]) {
+			return YES;
+		}
+	}
+	#if NS_BLOCKS_AVAILABLE
+	if (bytesReceivedBlock || bytesSentBlock) {
+		return YES;
+	}
+	#endif
+	return NO;
+}
+
+// Called by our timer wheel to update the progress and work out if we need to timeout
+- (void)timerWheelFired:(ASITimerWheel *)timerWheel
 {
 	[self checkRequestStatus];
-	if (![self inProgress]) {
-		[self setStatusTimer:nil];
+	if ([self inProgress] && timerWheel == [self statusTimerWheel]) {
+		[self scheduleStatusCheck];
 	}
 }
 
@@ -1481,9 +2038,9 @@ static NSOperationQueue *sharedQueue = nil;
 
 - (BOOL)shouldTimeOut
 {
-	NSTimeInterval secondsSinceLastActivity = [[NSDate date] timeIntervalSinceDate:lastActivityTime];
+	NSTimeInterval secondsSinceLastActivity = ASIMonotonicTime()-[self lastActivityTime];
 	// See if we need to timeout
-	if ([self readStream] && [self readStreamIsScheduled] && [self lastActivityTime] && [self timeOutSeconds] > 0 && secondsSinceLastActivity > [self timeOutSeconds]) {
+	if ([self readStream] && [self readStreamIsScheduled] && [self lastActivityTime] > 0 && [self timeOutSeconds] > 0 && secondsSinceLastActivity > [self timeOutSeconds]) {
 		
 		// We have no body, or we've sent more than the upload buffer size,so we can safely time out here
 		if ([self postLength] == 0 || ([self uploadBufferSize] > 0 && [self totalBytesSent] > [self uploadBufferSize])) {
@@ -1515,17 +2072,17 @@ static NSOperationQueue *sharedQueue = nil;
 		// Do we need to auto-retry this request?
 		if ([self numberOfTimesToRetryOnTimeout] > [self retryCount]) {
 
-			// If we are resuming a download, we may need to update the Range header to take account of data we've just downloaded
-			[self updatePartialDownloadSize];
-			if ([self partialDownloadSize]) {
-				CFHTTPMessageSetHeaderFieldValue(request, (CFStringRef)@"Range", (CFStringRef)[NSString stringWithFormat:@"bytes=%llu-",[self partialDownloadSize]]);
-			}
+			[self updateRangeHeaderForRetry];
 			[self setRetryCount:[self retryCount]+1];
 			[self unscheduleReadStream];
 			[[self cancelledLock] unlock];
 			[self startRequest];
 			return;
 		}
+		if ([self retryWithPolicyAfterError:ASIRequestTimedOutError]) {
+			[[self cancelledLock] unlock];
+			return;
+		}
 		[self failWithError:ASIRequestTimedOutError];
 		[self cancelLoad];
 		[self setComplete:YES];
@@ -1533,85 +2090,331 @@ static NSOperationQueue *sharedQueue = nil;
 		return;
 	}
 
-	// readStream will be null if we aren't currently running (perhaps we're waiting for a delegate to supply credentials)
-	if ([self readStream]) {
-		
-		// If we have a post body
-		if ([self postLength]) {
-		
-			[self setLastBytesSent:totalBytesSent];	
-			
-			// Find out how much data we've uploaded so far
-			[self setTotalBytesSent:[[NSMakeCollectable(CFReadStreamCopyProperty((CFReadStreamRef)[self readStream], kCFStreamPropertyHTTPRequestBytesWrittenCount)) autorelease] unsignedLongLongValue]];
-			if (totalBytesSent > lastBytesSent) {
-				
-				// We've uploaded more data,  reset the timeout
-				[self setLastActivityTime:[NSDate date]];
-				[ASIHTTPRequest incrementBandwidthUsedInLastSecond:(unsigned long)(totalBytesSent-lastBytesSent)];		
-						
-				#if DEBUG_REQUEST_STATUS
-				if ([self totalBytesSent] == [self postLength]) {
-					ASI_DEBUG_LOG(@"[STATUS] Request %@ finished uploading data",self);
-				}
-				#endif
-			}
+	// readStream will be null if we aren't currently running (perhaps we're waiting for a delegate to supply credentials)
+	if ([self readStream]) {
+		
+		// If we have a post body
+		if ([self postLength]) {
+		
+			[self setLastBytesSent:totalBytesSent];	
+			
+			// Find out how much data we've uploaded so far
+			[self updateTotalBytesSent];
+			if (totalBytesSent > lastBytesSent) {
+				
+				// We've uploaded more data,  reset the timeout
+				[self setLastActivityTime:ASIMonotonicTime()];
+				[self incrementBandwidthUsedBy:(unsigned long)(totalBytesSent-lastBytesSent)];		
+						
+				#if DEBUG_REQUEST_STATUS
+				if ([self totalBytesSent] == [self postLength]) {
+					ASI_DEBUG_LOG(@"[STATUS] Request %@ finished uploading data",self);
+				}
+				#endif
+			}
+		}
+			
+		[self updateProgressIndicators];
+
+	}
+	
+	[[self cancelledLock] unlock];
+}
+
+
+// Cancel loading and clean up. DO NOT USE THIS TO CANCEL REQUESTS - use [request cancel] instead
+- (void)cancelLoad
+{
+	// If we're in the middle of downloading a PAC file, let's stop that first
+	if (PACFileReadStream) {
+		[PACFileReadStream setDelegate:nil];
+		[PACFileReadStream close];
+		[self setPACFileReadStream:nil];
+		[self setPACFileData:nil];
+	} else if (PACFileRequest) {
+		[PACFileRequest setDelegate:nil];
+		[PACFileRequest cancel];
+		[self setPACFileRequest:nil];
+	}
+
+    [self destroyReadStream];
+	
+	[[self postBodyReadStream] close];
+	[self setPostBodyReadStream:nil];
+	
+	// We check the ivars here, as asking for rawResponseData would put the response in the buffer together
+    if (responseBuffer || rawResponseData) {
+		if (![self complete]) {
+			[self setRawResponseData:nil];
+		}
+	// If we were downloading to a file
+	} else if ([self temporaryFileDownloadPath]) {
+		[[self fileDownloadOutputStream] close];
+		[self setFileDownloadOutputStream:nil];
+		
+		// If we haven't said we might want to resume, let's remove the temporary file too
+		if (![self complete]) {
+			if (![self allowResumeForFileDownloads]) {
+				[self removeTemporaryDownloadFile];
+			} else {
+				[self saveResumeManifest];
+			}
+			[self removeTemporaryUncompressedDownloadFile];
+		}
+	}
+	
+	// Clean up any temporary file used to store request body for streaming
+	if (![self authenticationNeeded] && ![self willRetryRequest] && [self didCreateTemporaryPostDataFile]) {
+		[self removeTemporaryUploadFile];
+		[self setDidCreateTemporaryPostDataFile:NO];
+	}
+}
+
+#pragma mark digests
+
+- (void)startDigests
+{
+	NSUInteger algorithms = [self requestBodyDigestAlgorithms];
+	if ([self shouldVerifyDigestsAgainstETag]) {
+		algorithms |= ASIMD5DigestAlgorithm;
+	}
+	if (algorithms && [self postBodyReadStream]) {
+		[self setRequestBodyDigest:[ASIDigest digestWithAlgorithms:algorithms]];
+		[(ASIInputStream *)[self postBodyReadStream] setDigest:[self requestBodyDigest]];
+	} else {
+		[self setRequestBodyDigest:nil];
+	}
+
+	algorithms = [self responseDigestAlgorithms];
+	if ([self shouldVerifyResponseDigest] || [self shouldVerifyDigestsAgainstETag]) {
+		algorithms |= ASIMD5DigestAlgorithm;
+	}
+	[self setResponseDigest:(algorithms ? [ASIDigest digestWithAlgorithms:algorithms] : nil)];
+}
+
+// Returns an error if the request or response body doesn't match a digest the server sent us
+- (NSError *)digestMismatchError
+{
+	if ([self responseStatusCode] < 200 || [self responseStatusCode] >= 300) {
+		return nil;
+	}
+	if ([self shouldVerifyResponseDigest] && [self responseDigest]) {
+		NSString *contentMD5 = [[self responseHeaders] objectForKey:@"Content-MD5"];
+		if (contentMD5 && ![contentMD5 isEqualToString:[ASIHTTPRequest base64forData:[[self responseDigest] digestForAlgorithm:ASIMD5DigestAlgorithm]]]) {
+			return [NSError errorWithDomain:NetworkRequestErrorDomain code:ASIDigestMismatchErrorType userInfo:[NSDictionary dictionaryWithObjectsAndKeys:@"The response body doesn't match its Content-MD5 header",NSLocalizedDescriptionKey,nil]];
+		}
+	}
+	if ([self shouldVerifyDigestsAgainstETag]) {
+		NSString *eTag = [[[self responseHeaders] objectForKey:@"Etag"] stringByTrimmingCharactersInSet:[NSCharacterSet characterSetWithCharactersInString:@"\""]];
+		if (![self responseETagIsMD5OfBody:eTag]) {
+			return nil;
+		}
+		ASIDigest *digest = nil;
+		if ([self requestBodyDigest]) {
+			digest = [self requestBodyDigest];
+		} else if ([[self requestMethod] isEqualToString:@"GET"] && [self responseStatusCode] == 200) {
+			digest = [self responseDigest];
+		}
+		if (digest && ![[eTag lowercaseString] isEqualToString:[digest hexDigestForAlgorithm:ASIMD5DigestAlgorithm]]) {
+			return [NSError errorWithDomain:NetworkRequestErrorDomain code:ASIDigestMismatchErrorType userInfo:[NSDictionary dictionaryWithObjectsAndKeys:([digest isEqual:[self requestBodyDigest]] ? @"The server's ETag doesn't match the request body we sent" : @"The response body doesn't match its ETag"),NSLocalizedDescriptionKey,nil]];
+		}
+	}
+	return nil;
+}
+
+// ETags for objects uploaded in parts (and from most servers other than S3) aren't an MD5 of the body, so we leave them alone
+- (BOOL)responseETagIsMD5OfBody:(NSString *)eTag
+{
+	return ([eTag length] == 32 && [eTag rangeOfCharacterFromSet:[[NSCharacterSet characterSetWithCharactersInString:@"0123456789abcdefABCDEF"] invertedSet]].location == NSNotFound);
+}
+
+#pragma mark coalescing identical requests
+
+// Identifies requests that would get the same response - the credentials are part of the key, so it is hashed rather than kept as it is
+// Requests that would trust a different server, or reach it through a different proxy, don't share a response
+- (NSString *)coalescingKeyForRequest
+{
+	NSMutableString *key = [NSMutableString stringWithFormat:@"%@ %@\n%@\n%@\n%@\n",[self requestMethod],[[self url] absoluteString],[self username],[self password],[self domain]];
+	[key appendFormat:@"%d %d\n",[self validatesSecureCertificate],[self useHTTPVersionOne]];
+	[key appendFormat:@"%@ %@:%d\n%@\n%@\n%@\n%@\n",[self proxyType],[self proxyHost],[self proxyPort],[self proxyUsername],[self proxyPassword],[self proxyDomain],[[self PACurl] absoluteString]];
+	for (NSString *header in [[[self requestHeaders] allKeys] sortedArrayUsingSelector:@selector(caseInsensitiveCompare:)]) {
+		[key appendFormat:@"%@: %@\n",[header lowercaseString],[[self requestHeaders] objectForKey:header]];
+	}
+	NSData *keyData = [key dataUsingEncoding:NSUTF8StringEncoding];
+	ASIDigest *digest = [ASIDigest digestWithAlgorithms:ASISHA256DigestAlgorithm];
+	[digest updateWithBytes:[keyData bytes] length:[keyData length]];
+	return [digest hexDigestForAlgorithm:ASISHA256DigestAlgorithm];
+}
+
+// Returns YES if we are now waiting for an identical request that is already running
+// Otherwise, we register ourselves so identical requests that start after us can wait for us
+- (BOOL)waitForIdenticalRequest
+{
+	if (![[self requestMethod] isEqualToString:@"GET"] || [self mainRequest] || [self redirectCount] || [self allowResumeForFileDownloads]) {
+		return NO;
+	}
+
+	// We can't tell whether two client certificates are the same, so requests that present one fetch their own response
+	// A conditional request may be answered with a 304 that only means something to a request with the same cached response, so those do too
+	if (clientCertificateIdentity || [[self requestHeaders] objectForKey:@"If-None-Match"] || [[self requestHeaders] objectForKey:@"If-Modified-Since"]) {
+		return NO;
+	}
+	NSString *key = [self coalescingKeyForRequest];
+
+	[coalescableRequestsLock lock];
+	ASIHTTPRequest *leader = [coalescableRequests objectForKey:key];
+
+	// We can only wait for a request that hasn't passed on any of its response yet, since we need all of it
+	if (leader && leader != self && !leader->coalescedBytesForwarded) {
+		if (![leader coalescedRequests]) {
+			[leader setCoalescedRequests:[NSMutableArray array]];
+		}
+		[[leader coalescedRequests] addObject:self];
+		[self setCoalescingLeader:leader];
+		[self setCoalescingThread:[NSThread currentThread]];
+		[coalescableRequestsLock unlock];
+
+		#if DEBUG_REQUEST_STATUS
+		ASI_DEBUG_LOG(@"[STATUS] Request %@ will use the response of identical request %@",self,leader);
+		#endif
+
+		// Get ready to receive the response as if we were fetching it ourselves
+		[self setTotalBytesRead:0];
+		[self setLastBytesRead:0];
+		[self setOriginalURL:[self url]];
+		if (![self downloadDestinationPath]) {
+			[self setRawResponseData:nil];
+			[self setResponseBuffer:[ASIResponseBuffer buffer]];
+		}
+		[self startDigests];
+
+		// A synchronous request waits by running the runloop until it is complete, so it needs a source that keeps the runloop waiting for our leader
+		if ([self isSynchronous]) {
+			NSMutableDictionary *threadDictionary = [[NSThread currentThread] threadDictionary];
+			if (![threadDictionary objectForKey:@"ASICoalescingPort"]) {
+				NSPort *port = [NSPort port];
+				[threadDictionary setObject:port forKey:@"ASICoalescingPort"];
+				[[NSRunLoop currentRunLoop] addPort:port forMode:[self runLoopMode]];
+				[self setCoalescingPort:port];
+			}
+		}
+		return YES;
+	}
+	if (!leader) {
+		[coalescableRequests setObject:self forKey:key];
+		[self setCoalescingKey:key];
+		coalescedBytesForwarded = 0;
+	}
+	[coalescableRequestsLock unlock];
+	return NO;
+}
+
+- (void)forwardDataToCoalescedRequests:(NSData *)data
+{
+	[coalescableRequestsLock lock];
+
+	// If we retried, we've already passed on the start of the response
+	unsigned long long end = [self totalBytesRead];
+	unsigned long long start = end-[data length];
+	if (end <= coalescedBytesForwarded) {
+		[coalescableRequestsLock unlock];
+		return;
+	}
+	if (start < coalescedBytesForwarded) {
+		data = [data subdataWithRange:NSMakeRange((NSUInteger)(coalescedBytesForwarded-start), (NSUInteger)(end-coalescedBytesForwarded))];
+	}
+	coalescedBytesForwarded = end;
+
+	// Requests remove themselves from coalescedRequests (under the lock) when they stop waiting, so each one here still has a coalescingThread
+	for (ASIHTTPRequest *follower in [self coalescedRequests]) {
+		[follower performSelector:@selector(receiveDataFromCoalescingLeader:) onThread:[follower coalescingThread] withObject:data waitUntilDone:NO modes:[NSArray arrayWithObject:[follower runLoopMode]]];
+	}
+	[coalescableRequestsLock unlock];
+}
+
+- (void)takeResponseHeadersFromRequest:(ASIHTTPRequest *)leader
+{
+	[self setResponseHeaders:[leader responseHeaders]];
+	[self setResponseStatusCode:[leader responseStatusCode]];
+	[self setResponseStatusMessage:[leader responseStatusMessage]];
+	[self setResponseCookies:[leader responseCookies]];
+	[self setContentLength:[leader contentLength]];
+	[self parseStringEncodingFromHeaders];
+	if ([self contentLength] && ![self downloadDestinationPath]) {
+		[[self responseBuffer] reserveCapacity:[self contentLength]];
+	}
+	[self performCallback:@selector(requestReceivedResponseHeaders:) onTarget:self withObject:[[[self responseHeaders] copy] autorelease] waitUntilDone:YES];
+}
+
+// Called on coalescingThread with each piece of the response our leader reads
+- (void)receiveDataFromCoalescingLeader:(NSData *)data
+{
+	[[self cancelledLock] lock];
+	if (![self complete] && [self coalescingLeader]) {
+		if (![self responseHeaders]) {
+			[self takeResponseHeadersFromRequest:[self coalescingLeader]];
 		}
-			
+		[self handleBytesRead:data];
 		[self updateProgressIndicators];
-
 	}
-	
 	[[self cancelledLock] unlock];
 }
 
-
-// Cancel loading and clean up. DO NOT USE THIS TO CANCEL REQUESTS - use [request cancel] instead
-- (void)cancelLoad
+// Called on coalescingThread when our leader has finished
+- (void)finishWithResponseOfRequest:(ASIHTTPRequest *)leader
 {
-	// If we're in the middle of downloading a PAC file, let's stop that first
-	if (PACFileReadStream) {
-		[PACFileReadStream setDelegate:nil];
-		[PACFileReadStream close];
-		[self setPACFileReadStream:nil];
-		[self setPACFileData:nil];
-	} else if (PACFileRequest) {
-		[PACFileRequest setDelegate:nil];
-		[PACFileRequest cancel];
-		[self setPACFileRequest:nil];
+	[[self cancelledLock] lock];
+	if ([self complete] || [self coalescingLeader] != leader) {
+		[[self cancelledLock] unlock];
+		return;
 	}
+	[[leader retain] autorelease];
+	[self setCoalescingLeader:nil];
+	[self setCoalescingThread:nil];
 
-    [self destroyReadStream];
-	
-	[[self postBodyReadStream] close];
-	[self setPostBodyReadStream:nil];
-	
-    if ([self rawResponseData]) {
-		if (![self complete]) {
-			[self setRawResponseData:nil];
-		}
-	// If we were downloading to a file
-	} else if ([self temporaryFileDownloadPath]) {
+	// Whoever cancelled the request we were waiting for didn't cancel us, so we'll fetch the response ourselves
+	// We do the same when it used a cached response (eg after failing with ASIFallbackToCacheIfLoadFailsCachePolicy), since it never passed the cached body on
+	if ([[leader error] code] == ASIRequestCancelledErrorType || [leader didUseCachedResponse]) {
+		#if DEBUG_REQUEST_STATUS
+		ASI_DEBUG_LOG(@"[STATUS] Request %@ was waiting for request %@, which was cancelled or used a cached response, will start by itself",self,leader);
+		#endif
 		[[self fileDownloadOutputStream] close];
 		[self setFileDownloadOutputStream:nil];
-		
-		[[self inflatedFileDownloadOutputStream] close];
-		[self setInflatedFileDownloadOutputStream:nil];
-		
-		// If we haven't said we might want to resume, let's remove the temporary file too
-		if (![self complete]) {
-			if (![self allowResumeForFileDownloads]) {
-				[self removeTemporaryDownloadFile];
-			}
-			[self removeTemporaryUncompressedDownloadFile];
+		[self setResponseHeaders:nil];
+		[self main];
+
+	} else if ([leader error]) {
+		[self failWithError:[leader error]];
+
+	} else {
+		if (![self responseHeaders]) {
+			[self takeResponseHeadersFromRequest:leader];
 		}
+		[self handleStreamComplete];
 	}
-	
-	// Clean up any temporary file used to store request body for streaming
-	if (![self authenticationNeeded] && ![self willRetryRequest] && [self didCreateTemporaryPostDataFile]) {
-		[self removeTemporaryUploadFile];
-		[self removeTemporaryCompressedUploadFile];
-		[self setDidCreateTemporaryPostDataFile:NO];
+	[[self cancelledLock] unlock];
+}
+
+// Called when we are finished, either to pass our response on to requests waiting for it, or to stop waiting for another request's response
+- (void)stopCoalescing
+{
+	[coalescableRequestsLock lock];
+	if ([self coalescingLeader]) {
+		[[[self coalescingLeader] coalescedRequests] removeObject:self];
+		[self setCoalescingLeader:nil];
+		[self setCoalescingThread:nil];
+	}
+	if ([self coalescingKey]) {
+		if ([coalescableRequests objectForKey:[self coalescingKey]] == self) {
+			[coalescableRequests removeObjectForKey:[self coalescingKey]];
+		}
+		[self setCoalescingKey:nil];
+	}
+	for (ASIHTTPRequest *follower in [self coalescedRequests]) {
+		[follower performSelector:@selector(finishWithResponseOfRequest:) onThread:[follower coalescingThread] withObject:self waitUntilDone:NO modes:[NSArray arrayWithObject:[follower runLoopMode]]];
 	}
+	[self setCoalescedRequests:nil];
+	[coalescableRequestsLock unlock];
 }
 
 #pragma mark HEAD request
@@ -1647,6 +2450,7 @@ static NSOperationQueue *sharedQueue = nil;
 	[headRequest setPACurl:[self PACurl]];
 	[headRequest setShouldPresentCredentialsBeforeChallenge:[self shouldPresentCredentialsBeforeChallenge]];
 	[headRequest setNumberOfTimesToRetryOnTimeout:[self numberOfTimesToRetryOnTimeout]];
+	[headRequest setRetryPolicy:[self retryPolicy]];
 	[headRequest setShouldUseRFC2616RedirectBehaviour:[self shouldUseRFC2616RedirectBehaviour]];
 	[headRequest setShouldAttemptPersistentConnection:[self shouldAttemptPersistentConnection]];
 	[headRequest setPersistentConnectionTimeoutSeconds:[self persistentConnectionTimeoutSeconds]];
@@ -1668,6 +2472,8 @@ static NSOperationQueue *sharedQueue = nil;
 			[self updateUploadProgress];
 			[self updateDownloadProgress];
 		}
+		// Progress that was held back because we sent an update recently will go out on a later call, or when the request completes
+		[self scheduleProgressDelivery:[self complete]];
 	}
 }
 
@@ -1737,20 +2543,31 @@ static NSOperationQueue *sharedQueue = nil;
 		return;
 	}
 
-	[ASIHTTPRequest performSelector:@selector(request:didReceiveBytes:) onTarget:&queue withObject:self amount:&value callerToRetain:self];
-	[ASIHTTPRequest performSelector:@selector(request:didReceiveBytes:) onTarget:&downloadProgressDelegate withObject:self amount:&value callerToRetain:self];
-
-	[ASIHTTPRequest updateProgressIndicator:&downloadProgressDelegate withProgress:[self totalBytesRead]+[self partialDownloadSize] ofTotal:[self contentLength]+[self partialDownloadSize]];
+	// Just add this to the progress we have collected so far - it will be sent to the main thread by scheduleProgressDelivery:
+	[[self cancelledLock] lock];
+	pendingBytesReceived += (long long)value;
+	pendingDownloadProgress = bytesReadSoFar;
+	pendingDownloadTotal = [self contentLength]+[self partialDownloadSize];
+	downloadIndicatorNeedsUpdate = YES;
+	[[self cancelledLock] unlock];
 
-	#if NS_BLOCKS_AVAILABLE
-    if (bytesReceivedBlock) {
-		unsigned long long totalSize = [self contentLength] + [self partialDownloadSize];
-		[self performBlockOnMainThread:^{ if (bytesReceivedBlock) { bytesReceivedBlock(value, totalSize); }}];
-    }
-	#endif
 	[self setLastBytesRead:bytesReadSoFar];
 }
 
+- (void)updateTotalBytesSent
+{
+	// Requests that used the response of an identical request never had a stream of their own
+	if (![self readStream]) {
+		return;
+	}
+	// A chunked compressed body doesn't have a length until it has been sent, so postLength and our progress are measured in uncompressed bytes
+	if ([self shouldSendCompressedPostBodyChunked] && [self postBodyReadStream]) {
+		[self setTotalBytesSent:[(ASIInputStream *)[self postBodyReadStream] uncompressedBytesRead]];
+	} else {
+		[self setTotalBytesSent:[[NSMakeCollectable(CFReadStreamCopyProperty((CFReadStreamRef)[self readStream], kCFStreamPropertyHTTPRequestBytesWrittenCount)) autorelease] unsignedLongLongValue]];
+	}
+}
+
 - (void)updateUploadProgress
 {
 	if ([self isCancelled] || [self totalBytesSent] == 0) {
@@ -1781,71 +2598,147 @@ static NSOperationQueue *sharedQueue = nil;
 	if (!value) {
 		return;
 	}
-	
-	[ASIHTTPRequest performSelector:@selector(request:didSendBytes:) onTarget:&queue withObject:self amount:&value callerToRetain:self];
-	[ASIHTTPRequest performSelector:@selector(request:didSendBytes:) onTarget:&uploadProgressDelegate withObject:self amount:&value callerToRetain:self];
-	[ASIHTTPRequest updateProgressIndicator:&uploadProgressDelegate withProgress:[self totalBytesSent]-[self uploadBufferSize] ofTotal:[self postLength]-[self uploadBufferSize]];
 
-	#if NS_BLOCKS_AVAILABLE
-    if(bytesSentBlock){
-		unsigned long long totalSize = [self postLength];
-		[self performBlockOnMainThread:^{ if (bytesSentBlock) { bytesSentBlock(value, totalSize); }}];
-	}
-	#endif
+	[[self cancelledLock] lock];
+	pendingBytesSent += (long long)value;
+	pendingUploadProgress = [self totalBytesSent]-[self uploadBufferSize];
+	pendingUploadTotal = [self postLength]-[self uploadBufferSize];
+	uploadIndicatorNeedsUpdate = YES;
+	[[self cancelledLock] unlock];
 }
 
 
 - (void)incrementDownloadSizeBy:(long long)length
 {
-	[ASIHTTPRequest performSelector:@selector(request:incrementDownloadSizeBy:) onTarget:&queue withObject:self amount:&length callerToRetain:self];
-	[ASIHTTPRequest performSelector:@selector(request:incrementDownloadSizeBy:) onTarget:&downloadProgressDelegate withObject:self amount:&length callerToRetain:self];
+	[[self cancelledLock] lock];
+	pendingDownloadSizeIncrement += length;
+	[[self cancelledLock] unlock];
 
-	#if NS_BLOCKS_AVAILABLE
-    if(downloadSizeIncrementedBlock){
-		[self performBlockOnMainThread:^{ if (downloadSizeIncrementedBlock) { downloadSizeIncrementedBlock(length); }}];
-    }
-	#endif
+	// The queue needs to know how much there is to download before it can show progress, so we don't hold this back
+	[self scheduleProgressDelivery:YES];
 }
 
 - (void)incrementUploadSizeBy:(long long)length
 {
-	[ASIHTTPRequest performSelector:@selector(request:incrementUploadSizeBy:) onTarget:&queue withObject:self amount:&length callerToRetain:self];
-	[ASIHTTPRequest performSelector:@selector(request:incrementUploadSizeBy:) onTarget:&uploadProgressDelegate withObject:self amount:&length callerToRetain:self];
-
-	#if NS_BLOCKS_AVAILABLE
-    if(uploadSizeIncrementedBlock) {
-		[self performBlockOnMainThread:^{ if (uploadSizeIncrementedBlock) { uploadSizeIncrementedBlock(length); }}];
-    }
-	#endif
+	[[self cancelledLock] lock];
+	pendingUploadSizeIncrement += length;
+	[[self cancelledLock] unlock];
+	[self scheduleProgressDelivery:YES];
 }
 
 
 -(void)removeUploadProgressSoFar
 {
-	long long progressToRemove = -(long long)[self totalBytesSent];
-	[ASIHTTPRequest performSelector:@selector(request:didSendBytes:) onTarget:&queue withObject:self amount:&progressToRemove callerToRetain:self];
-	[ASIHTTPRequest performSelector:@selector(request:didSendBytes:) onTarget:&uploadProgressDelegate withObject:self amount:&progressToRemove callerToRetain:self];
-	[ASIHTTPRequest updateProgressIndicator:&uploadProgressDelegate withProgress:0 ofTotal:[self postLength]];
+	[[self cancelledLock] lock];
+	pendingBytesSent -= (long long)[self totalBytesSent];
+	pendingUploadProgress = 0;
+	pendingUploadTotal = [self postLength];
+	uploadIndicatorNeedsUpdate = YES;
+	[[self cancelledLock] unlock];
+	[self scheduleProgressDelivery:YES];
+}
+
+- (void)scheduleProgressDelivery:(BOOL)immediately
+{
+	NSTimeInterval now = ASIMonotonicTime();
+	BOOL shouldDeliver = NO;
 
-	#if NS_BLOCKS_AVAILABLE
-    if(bytesSentBlock){
-		unsigned long long totalSize = [self postLength];
-		[self performBlockOnMainThread:^{  if (bytesSentBlock) { bytesSentBlock((unsigned long long)progressToRemove, totalSize); }}];
+	[[self cancelledLock] lock];
+	if (!progressDeliveryScheduled && (pendingBytesReceived || pendingBytesSent || pendingDownloadSizeIncrement || pendingUploadSizeIncrement || downloadIndicatorNeedsUpdate || uploadIndicatorNeedsUpdate)) {
+		if (immediately || now-lastProgressDeliveryTime >= [self progressUpdateInterval]) {
+			progressDeliveryScheduled = YES;
+			lastProgressDeliveryTime = now;
+			shouldDeliver = YES;
+		}
+	}
+	[[self cancelledLock] unlock];
+
+	// If an update is already waiting to run, it will pick up whatever we have just added
+	// We are retained until deliverProgress has run
+	if (shouldDeliver) {
+		[self performCallback:@selector(deliverProgress) onTarget:self withObject:nil waitUntilDone:YES];
 	}
-	#endif
 }
 
-#if NS_BLOCKS_AVAILABLE
-- (void)performBlockOnMainThread:(ASIBasicBlock)block
+// Calls a progress delegate method that takes a request and a number of bytes directly, rather than building an NSInvocation each time
+static void ASICallProgressDelegate(id target, SEL selector, ASIHTTPRequest *request, long long bytes)
 {
-	[self performSelectorOnMainThread:@selector(callBlock:) withObject:[[block copy] autorelease] waitUntilDone:[NSThread isMainThread]];
+	if (target && [target respondsToSelector:selector]) {
+		void (*method)(id, SEL, ASIHTTPRequest *, long long) = (void (*)(id, SEL, ASIHTTPRequest *, long long))[target methodForSelector:selector];
+		method(target, selector, request, bytes);
+	}
 }
 
-- (void)callBlock:(ASIBasicBlock)block
+/* ALWAYS CALLED WHERE CALLBACKS ARE DELIVERED (see callbackMode) */
+// Passes on all the progress collected since the last update to the queue, progress delegates and progress blocks
+- (void)deliverProgress
 {
-	block();
+	[[self cancelledLock] lock];
+	long long bytesReceived = pendingBytesReceived;
+	long long bytesSent = pendingBytesSent;
+	long long downloadSizeIncrement = pendingDownloadSizeIncrement;
+	long long uploadSizeIncrement = pendingUploadSizeIncrement;
+	unsigned long long downloadProgress = pendingDownloadProgress;
+	unsigned long long downloadTotal = pendingDownloadTotal;
+	unsigned long long uploadProgress = pendingUploadProgress;
+	unsigned long long uploadTotal = pendingUploadTotal;
+	BOOL updateDownloadIndicator = downloadIndicatorNeedsUpdate;
+	BOOL updateUploadIndicator = uploadIndicatorNeedsUpdate;
+	pendingBytesReceived = 0;
+	pendingBytesSent = 0;
+	pendingDownloadSizeIncrement = 0;
+	pendingUploadSizeIncrement = 0;
+	downloadIndicatorNeedsUpdate = NO;
+	uploadIndicatorNeedsUpdate = NO;
+	progressDeliveryScheduled = NO;
+	[[self cancelledLock] unlock];
+
+	// Sizes go first, so the queue knows the total before it is told about the bytes that count towards it
+	if (downloadSizeIncrement) {
+		ASICallProgressDelegate(queue, @selector(request:incrementDownloadSizeBy:), self, downloadSizeIncrement);
+		ASICallProgressDelegate(downloadProgressDelegate, @selector(request:incrementDownloadSizeBy:), self, downloadSizeIncrement);
+		#if NS_BLOCKS_AVAILABLE
+		if (downloadSizeIncrementedBlock) {
+			downloadSizeIncrementedBlock(downloadSizeIncrement);
+		}
+		#endif
+	}
+	if (uploadSizeIncrement) {
+		ASICallProgressDelegate(queue, @selector(request:incrementUploadSizeBy:), self, uploadSizeIncrement);
+		ASICallProgressDelegate(uploadProgressDelegate, @selector(request:incrementUploadSizeBy:), self, uploadSizeIncrement);
+		#if NS_BLOCKS_AVAILABLE
+		if (uploadSizeIncrementedBlock) {
+			uploadSizeIncrementedBlock(uploadSizeIncrement);
+		}
+		#endif
+	}
+
+	if (bytesSent) {
+		ASICallProgressDelegate(queue, @selector(request:didSendBytes:), self, bytesSent);
+		ASICallProgressDelegate(uploadProgressDelegate, @selector(request:didSendBytes:), self, bytesSent);
+	}
+	if (updateUploadIndicator) {
+		[ASIHTTPRequest updateProgressIndicator:&uploadProgressDelegate withProgress:uploadProgress ofTotal:uploadTotal];
+	}
+	#if NS_BLOCKS_AVAILABLE
+	if (bytesSent && bytesSentBlock) {
+		bytesSentBlock((unsigned long long)bytesSent, uploadTotal);
+	}
+	#endif
+
+	if (bytesReceived) {
+		ASICallProgressDelegate(queue, @selector(request:didReceiveBytes:), self, bytesReceived);
+		ASICallProgressDelegate(downloadProgressDelegate, @selector(request:didReceiveBytes:), self, bytesReceived);
+	}
+	if (updateDownloadIndicator) {
+		[ASIHTTPRequest updateProgressIndicator:&downloadProgressDelegate withProgress:downloadProgress ofTotal:downloadTotal];
+	}
+	#if NS_BLOCKS_AVAILABLE
+	if (bytesReceived && bytesReceivedBlock) {
+		bytesReceivedBlock((unsigned long long)bytesReceived, downloadTotal);
+	}
+	#endif
 }
-#endif
 
 
 + (void)performSelector:(SEL)selector onTarget:(id *)target withObject:(id)object amount:(void *)amount callerToRetain:(id)callerToRetain
@@ -1920,6 +2813,17 @@ static NSOperationQueue *sharedQueue = nil;
 	if (![*indicator respondsToSelector:selector]) {
 		return;
 	}
+
+	// We're already on the main thread, so there's no need to build an invocation to get there
+	if ([NSThread isMainThread]) {
+		#if TARGET_OS_IPHONE
+		void (*method)(id, SEL, float) = (void (*)(id, SEL, float))[*indicator methodForSelector:selector];
+		#else
+		void (*method)(id, SEL, double) = (void (*)(id, SEL, double))[*indicator methodForSelector:selector];
+		#endif
+		method(*indicator, selector, progressAmount);
+		return;
+	}
 	
 	[progressLock lock];
 	[ASIHTTPRequest performSelector:selector onTarget:indicator withObject:nil amount:&progressAmount callerToRetain:nil];
@@ -1929,7 +2833,69 @@ static NSOperationQueue *sharedQueue = nil;
 
 #pragma mark talking to delegates / calling blocks
 
-/* ALWAYS CALLED ON MAIN THREAD! */
+- (void)performCallback:(SEL)selector onTarget:(id)target withObject:(id)object waitUntilDone:(BOOL)wait
+{
+	ASICallbackMode mode = [self callbackMode];
+
+	#if NS_BLOCKS_AVAILABLE
+	dispatch_queue_t dispatchQueue = [self callbackDispatchQueue];
+	if (mode == ASIDispatchQueueCallbackMode && dispatchQueue) {
+		// The block retains target and object until it has run
+		dispatch_async(dispatchQueue, ^{
+			[target performSelector:selector withObject:object];
+		});
+		return;
+	}
+	#endif
+
+	NSOperationQueue *operationQueue = [self callbackOperationQueue];
+	if (mode == ASIOperationQueueCallbackMode && operationQueue) {
+		if (wait && [NSOperationQueue currentQueue] == operationQueue) {
+			[target performSelector:selector withObject:object];
+		} else {
+			[operationQueue addOperation:[[[NSInvocationOperation alloc] initWithTarget:target selector:selector object:object] autorelease]];
+		}
+		return;
+	}
+
+	if (mode == ASINetworkThreadCallbackMode) {
+		if (wait) {
+			[target performSelector:selector withObject:object];
+		} else {
+			[target performSelector:selector withObject:object afterDelay:0 inModes:[NSArray arrayWithObject:[self runLoopMode]]];
+		}
+		return;
+	}
+
+	// If we were asked to use a queue we haven't been given, we fall back to the main thread
+	[target performSelectorOnMainThread:selector withObject:object waitUntilDone:(wait && [NSThread isMainThread])];
+}
+
+#if NS_BLOCKS_AVAILABLE
+- (dispatch_queue_t)callbackDispatchQueue
+{
+	[[self cancelledLock] lock];
+	dispatch_queue_t dispatchQueue = callbackDispatchQueue;
+	[[self cancelledLock] unlock];
+	return dispatchQueue;
+}
+
+- (void)setCallbackDispatchQueue:(dispatch_queue_t)newQueue
+{
+	[[self cancelledLock] lock];
+	if (newQueue) {
+		dispatch_retain(newQueue);
+	}
+	if (callbackDispatchQueue) {
+		dispatch_release(callbackDispatchQueue);
+	}
+	callbackDispatchQueue = newQueue;
+	[[self cancelledLock] unlock];
+}
+#endif
+
+
+/* ALWAYS CALLED WHERE CALLBACKS ARE DELIVERED (see callbackMode) */
 - (void)requestStarted
 {
 	if ([self error] || [self mainRequest]) {
@@ -1948,7 +2914,7 @@ static NSOperationQueue *sharedQueue = nil;
 	}
 }
 
-/* ALWAYS CALLED ON MAIN THREAD! */
+/* ALWAYS CALLED WHERE CALLBACKS ARE DELIVERED (see callbackMode) */
 - (void)requestRedirected
 {
 	if ([self error] || [self mainRequest]) {
@@ -1967,7 +2933,7 @@ static NSOperationQueue *sharedQueue = nil;
 }
 
 
-/* ALWAYS CALLED ON MAIN THREAD! */
+/* ALWAYS CALLED WHERE CALLBACKS ARE DELIVERED (see callbackMode) */
 - (void)requestReceivedResponseHeaders:(NSMutableDictionary *)newResponseHeaders
 {
 	if ([self error] || [self mainRequest]) {
@@ -1989,7 +2955,7 @@ static NSOperationQueue *sharedQueue = nil;
 	}
 }
 
-/* ALWAYS CALLED ON MAIN THREAD! */
+/* ALWAYS CALLED WHERE CALLBACKS ARE DELIVERED (see callbackMode) */
 - (void)requestWillRedirectToURL:(NSURL *)newURL
 {
 	if ([self error] || [self mainRequest]) {
@@ -2016,11 +2982,11 @@ static NSOperationQueue *sharedQueue = nil;
 	if ([self isPACFileRequest]) {
 		[self reportFinished];
 	} else {
-		[self performSelectorOnMainThread:@selector(reportFinished) withObject:nil waitUntilDone:[NSThread isMainThread]];
+		[self performCallback:@selector(reportFinished) onTarget:self withObject:nil waitUntilDone:YES];
 	}
 }
 
-/* ALWAYS CALLED ON MAIN THREAD! */
+/* ALWAYS CALLED WHERE CALLBACKS ARE DELIVERED (see callbackMode) */
 - (void)reportFinished
 {
 	if (delegate && [delegate respondsToSelector:didFinishSelector]) {
@@ -2038,7 +3004,7 @@ static NSOperationQueue *sharedQueue = nil;
 	}
 }
 
-/* ALWAYS CALLED ON MAIN THREAD! */
+/* ALWAYS CALLED WHERE CALLBACKS ARE DELIVERED (see callbackMode) */
 - (void)reportFailure
 {
 	if (delegate && [delegate respondsToSelector:didFailSelector]) {
@@ -2056,7 +3022,7 @@ static NSOperationQueue *sharedQueue = nil;
 	}
 }
 
-/* ALWAYS CALLED ON MAIN THREAD! */
+/* ALWAYS CALLED WHERE CALLBACKS ARE DELIVERED (see callbackMode) */
 - (void)passOnReceivedData:(NSData *)data
 {
 	if (delegate && [delegate respondsToSelector:didReceiveDataSelector]) {
@@ -2081,17 +3047,20 @@ static NSOperationQueue *sharedQueue = nil;
 	
 	// Invalidate the current connection so subsequent requests don't attempt to reuse it
 	if (theError && [theError code] != ASIAuthenticationErrorType && [theError code] != ASITooMuchRedirectionErrorType) {
-		[connectionsLock lock];
 		#if DEBUG_PERSISTENT_CONNECTIONS
-		ASI_DEBUG_LOG(@"[CONNECTION] Request #%@ failed and will invalidate connection #%@",[self requestID],[[self connectionInfo] objectForKey:@"id"]);
+		ASI_DEBUG_LOG(@"[CONNECTION] Request #%@ failed and will invalidate connection #%@",[self requestID],[[self connectionInfo] connectionID]);
 		#endif
-		[[self connectionInfo] removeObjectForKey:@"request"];
-		[persistentConnectionsPool removeObject:[self connectionInfo]];
-		[connectionsLock unlock];
+		[ASIHTTPRequest startRequestWaitingForConnection:[[ASIConnectionPool sharedPool] removeConnection:[self connectionInfo] usedByRequestWithID:[self requestID]]];
 		[self destroyReadStream];
 	}
 	if ([self connectionCanBeReused]) {
-		[[self connectionInfo] setObject:[NSDate dateWithTimeIntervalSinceNow:[self persistentConnectionTimeoutSeconds]] forKey:@"expires"];
+		[[self connectionInfo] setExpires:[NSDate timeIntervalSinceReferenceDate]+[self persistentConnectionTimeoutSeconds]];
+	}
+
+	// We don't need a connection any more
+	if ([self connectionWaitThread]) {
+		[[ASIConnectionPool sharedPool] removeWaitingRequest:self];
+		[self setConnectionWaitThread:nil];
 	}
 	
     if ([self isCancelled] || [self error]) {
@@ -2120,7 +3089,7 @@ static NSOperationQueue *sharedQueue = nil;
 	if ([self isPACFileRequest]) {
 		[failedRequest reportFailure];
 	} else {
-		[failedRequest performSelectorOnMainThread:@selector(reportFailure) withObject:nil waitUntilDone:[NSThread isMainThread]];
+		[failedRequest performCallback:@selector(reportFailure) onTarget:failedRequest withObject:nil waitUntilDone:YES];
 	}
 	
     if (!inProgress)
@@ -2248,6 +3217,12 @@ static NSOperationQueue *sharedQueue = nil;
 				if ([self showAccurateProgress] && [self shouldResetDownloadProgress]) {
 					[theRequest incrementDownloadSizeBy:(long long)[theRequest contentLength]+(long long)[theRequest partialDownloadSize]];
 				}
+
+				// Make room for the whole body, so it doesn't need to be copied as it grows
+				// We can't do this when we inflate the response as it arrives, as the Content-Length is the size of the compressed body
+				if (![[self requestMethod] isEqualToString:@"HEAD"] && !([self isResponseCompressed] && ![self shouldWaitToInflateCompressedResponses])) {
+					[[self responseBuffer] reserveCapacity:length];
+				}
 			}
 
 		} else if ([self showAccurateProgress] && [self shouldResetDownloadProgress]) {
@@ -2301,7 +3276,7 @@ static NSOperationQueue *sharedQueue = nil;
 	}
 
 	CFRelease(message);
-	[self performSelectorOnMainThread:@selector(requestReceivedResponseHeaders:) withObject:[[[self responseHeaders] copy] autorelease] waitUntilDone:[NSThread isMainThread]];
+	[self performCallback:@selector(requestReceivedResponseHeaders:) onTarget:self withObject:[[[self responseHeaders] copy] autorelease] waitUntilDone:YES];
 }
 
 - (BOOL)willRedirect
@@ -2317,7 +3292,7 @@ static NSOperationQueue *sharedQueue = nil;
 		return NO;
 	}
 
-	[self performSelectorOnMainThread:@selector(requestRedirected) withObject:nil waitUntilDone:[NSThread isMainThread]];
+	[self performCallback:@selector(requestRedirected) onTarget:self withObject:nil waitUntilDone:YES];
 
 	// By default, we redirect 301 and 302 response codes as GET requests
 	// According to RFC 2616 this is wrong, but this is what most browsers do, so it's probably what you're expecting to happen
@@ -2327,6 +3302,7 @@ static NSOperationQueue *sharedQueue = nil;
 	if (responseCode != 307 && (![self shouldUseRFC2616RedirectBehaviour] || responseCode == 303)) {
 		[self setRequestMethod:@"GET"];
 		[self setPostBody:nil];
+		[self setPostBodyParts:nil];
 		[self setPostLength:0];
 
 		// Perhaps there are other headers we should be preserving, but it's hard to know what we need to keep and what to throw away.
@@ -2684,13 +3660,13 @@ static NSOperationQueue *sharedQueue = nil;
 	#endif
 
 	if (delegateOrBlockWillHandleAuthentication) {
-		[self performSelectorOnMainThread:@selector(askDelegateForProxyCredentials) withObject:nil waitUntilDone:NO];
+		[self performCallback:@selector(askDelegateForProxyCredentials) onTarget:self withObject:nil waitUntilDone:NO];
 	}
 	
 	return delegateOrBlockWillHandleAuthentication;
 }
 
-/* ALWAYS CALLED ON MAIN THREAD! */
+/* ALWAYS CALLED WHERE CALLBACKS ARE DELIVERED (see callbackMode) */
 - (void)askDelegateForProxyCredentials
 {
 	id authenticationDelegate = [self delegate];
@@ -2735,12 +3711,12 @@ static NSOperationQueue *sharedQueue = nil;
 	#endif
 
 	if (delegateOrBlockWillHandleAuthentication) {
-		[self performSelectorOnMainThread:@selector(askDelegateForCredentials) withObject:nil waitUntilDone:NO];
+		[self performCallback:@selector(askDelegateForCredentials) onTarget:self withObject:nil waitUntilDone:NO];
 	}
 	return delegateOrBlockWillHandleAuthentication;
 }
 
-/* ALWAYS CALLED ON MAIN THREAD! */
+/* ALWAYS CALLED WHERE CALLBACKS ARE DELIVERED (see callbackMode) */
 - (void)askDelegateForCredentials
 {
 	id authenticationDelegate = [self delegate];
@@ -2823,7 +3799,7 @@ static NSOperationQueue *sharedQueue = nil;
 				}
 			}
 			
-			[self setLastActivityTime:nil];
+			[self setLastActivityTime:0];
 			
 			if ([self willAskDelegateForProxyCredentials]) {
 				[self attemptToApplyProxyCredentialsAndResume];
@@ -3029,7 +4005,7 @@ static NSOperationQueue *sharedQueue = nil;
 				}
 			}
 			
-			[self setLastActivityTime:nil];
+			[self setLastActivityTime:0];
 			
 			if ([self willAskDelegateForCredentials]) {
 
@@ -3228,7 +4204,7 @@ static NSOperationQueue *sharedQueue = nil;
 	[[self cancelledLock] lock];
 
 	// Here we perform an initial check to see if either the delegate or the queue wants to be asked about the redirect, because if not we should redirect straight away
-	// We will check again on the main thread later
+	// We will check again later, when we call the delegate
 	BOOL needToAskDelegateAboutRedirect = (([self delegate] && [[self delegate] respondsToSelector:[self willRedirectSelector]]) || ([self queue] && [[self queue] respondsToSelector:@selector(request:willRedirectToURL:)]));
 
 	[[self cancelledLock] unlock];
@@ -3237,7 +4213,7 @@ static NSOperationQueue *sharedQueue = nil;
 	if (needToAskDelegateAboutRedirect) {
 		NSURL *newURL = [[[self redirectURL] copy] autorelease];
 		[self setRedirectURL:nil];
-		[self performSelectorOnMainThread:@selector(requestWillRedirectToURL:) withObject:newURL waitUntilDone:[NSThread isMainThread]];
+		[self performCallback:@selector(requestWillRedirectToURL:) onTarget:self withObject:newURL waitUntilDone:YES];
 		return true;
 	}
 	return false;
@@ -3247,6 +4223,11 @@ static NSOperationQueue *sharedQueue = nil;
 {
 	if (![self responseHeaders]) {
 		[self readResponseHeaders];
+
+		// Retry before we read the body of an unsuccessful response, so it doesn't end up in a download we might resume
+		if ([self responseHeaders] && ![self complete] && [self retryWithPolicyAfterError:nil]) {
+			return;
+		}
 	}
 	
 	// If we've cancelled the load part way through (for example, after deciding to use a cached version)
@@ -3261,135 +4242,229 @@ static NSOperationQueue *sharedQueue = nil;
 		return;
 	}
 
-	long long bufferSize = 16384;
-	if (contentLength > 262144) {
-		bufferSize = 262144;
-	} else if (contentLength > 65536) {
-		bufferSize = 65536;
-	}
-	
-	// Reduce the buffer size if we're receiving data too quickly when bandwidth throttling is active
-	// This just augments the throttling done in measureBandwidthUsage to reduce the amount we go over the limit
-	
-	if ([[self class] isBandwidthThrottled]) {
-		[bandwidthThrottlingLock lock];
-		if (maxBandwidthPerSecond > 0) {
-			long long maxiumumSize  = (long long)maxBandwidthPerSecond-(long long)bandwidthUsedInLastSecond;
-			if (maxiumumSize < 0) {
-				// We aren't supposed to read any more data right now, but we'll read a single byte anyway so the CFNetwork's buffer isn't full
-				bufferSize = 1;
-			} else if (maxiumumSize/4 < bufferSize) {
-				// We were going to fetch more data that we should be allowed, so we'll reduce the size of our read
-				bufferSize = maxiumumSize/4;
+	// Keep reading until the stream has nothing more for us, so a fast connection isn't held back to one read per pass of the runloop
+	// We stop after a few reads so other requests on this thread get a look in
+	ASIReadBufferPool *pool = [ASIReadBufferPool readBufferPoolForCurrentThread];
+	ASIBandwidthClass *throttlingClass = [self effectiveBandwidthClass];
+	NSUInteger reads = 0;
+	while (1) {
+		if (!readBufferSize) {
+			[self setReadBufferSize:[ASIReadBufferPool bufferSizeForSize:contentLength/16]];
+		}
+		NSUInteger bufferSize = [self readBufferSize];
+		NSUInteger maxLength = bufferSize;
+
+		// Don't read more than our share of what our bandwidth class allows when throttling is active
+		// This just augments the throttling done in performThrottling to reduce the amount we go over the limit
+		if ([throttlingClass isThrottled]) {
+			long long available = [throttlingClass availableBytes];
+			if (available < (long long)maxLength) {
+				// If we aren't supposed to read any more data right now, we'll read a single byte anyway so the CFNetwork's buffer isn't full
+				maxLength = (available > 0 ? (NSUInteger)available : 1);
 			}
 		}
-		if (bufferSize < 1) {
-			bufferSize = 1;
+
+		void *buffer = [pool takeBufferOfSize:bufferSize];
+		NSInteger bytesRead = [[self readStream] read:buffer maxLength:maxLength];
+
+		// Less than zero is an error
+		if (bytesRead < 0) {
+			[pool returnBuffer:buffer ofSize:bufferSize];
+			[self handleStreamError];
+			return;
+
+		// If zero bytes were read, wait for the EOF to come.
+		} else if (!bytesRead) {
+			[pool returnBuffer:buffer ofSize:bufferSize];
+			return;
+		}
+		[self adjustReadBufferSizeAfterReading:(NSUInteger)bytesRead maxLength:maxLength];
+
+		// For bandwidth measurement / throttling
+		// Only bytes we read from the network count, not those a coalescing leader passes on to us
+		[self incrementBandwidthUsedBy:(unsigned long)bytesRead];
+
+		// The data takes over the buffer, and gives it back to the pool when it is released
+		NSData *data = [pool newDataWithBuffer:buffer ofSize:bufferSize length:(NSUInteger)bytesRead];
+		[self handleBytesRead:data];
+		[data release];
+
+		reads++;
+		if (reads == ASIMaximumReadsPerCallback || [self complete] || ![self readStream] || ![self readStreamIsScheduled] || !CFReadStreamHasBytesAvailable((CFReadStreamRef)[self readStream])) {
+			return;
+		}
+		if ([throttlingClass isThrottled] && [throttlingClass availableBytes] <= 0) {
+			return;
+		}
+	}
+}
+
+// Reads grow while the stream fills our buffer, and shrink again when it keeps handing us much less than the buffer holds
+- (void)adjustReadBufferSizeAfterReading:(NSUInteger)bytesRead maxLength:(NSUInteger)maxLength
+{
+	NSUInteger bufferSize = [self readBufferSize];
+	if (bytesRead == bufferSize) {
+		smallReadCount = 0;
+		if (bufferSize < ASIReadBufferMaximumSize) {
+			[self setReadBufferSize:bufferSize*2];
+		}
+	} else if (bytesRead < bufferSize/4 && maxLength == bufferSize) {
+		smallReadCount++;
+		if (smallReadCount == 4 && bufferSize > ASIReadBufferMinimumSize) {
+			smallReadCount = 0;
+			[self setReadBufferSize:bufferSize/2];
+		}
+	} else {
+		smallReadCount = 0;
+	}
+}
+
+// Deals with a chunk of the response body we have just read
+- (void)handleBytesRead:(NSData *)readData
+{
+	const void *buffer = [readData bytes];
+	NSUInteger bytesRead = [readData length];
+
+	BOOL dataWillBeHandledExternally = NO;
+	if ([[self delegate] respondsToSelector:[self didReceiveDataSelector]]) {
+		dataWillBeHandledExternally = YES;
+	}
+	#if NS_BLOCKS_AVAILABLE
+	if (dataReceivedBlock) {
+		dataWillBeHandledExternally = YES;
+	}
+	#endif
+
+	// If we are inflating the response on the fly
+	BOOL inflateAsItArrives = [self shouldInflateResponseAsItArrivesForDelegate:dataWillBeHandledExternally];
+	NSData *inflatedData = nil;
+	if (inflateAsItArrives) {
+		if (![self dataDecompressor]) {
+			[self setDataDecompressor:[self responseDecompressor]];
+		}
+		NSError *err = nil;
+		inflatedData = [[self dataDecompressor] uncompressBytes:(Bytef *)buffer length:bytesRead error:&err];
+		if (err) {
+			[self failWithError:err];
+			return;
 		}
-		[bandwidthThrottlingLock unlock];
 	}
 	
+	[self setTotalBytesRead:[self totalBytesRead]+bytesRead];
+	[self setLastActivityTime:ASIMonotonicTime()];
 	
-    UInt8 buffer[bufferSize];
-    NSInteger bytesRead = [[self readStream] read:buffer maxLength:sizeof(buffer)];
+	// Pass the data on to any identical requests that are waiting for our response
+	if ([self coalescingKey] && ![self needsRedirect] && ![self authenticationNeeded]) {
+		[self forwardDataToCoalescedRequests:readData];
+	}
 
-    // Less than zero is an error
-    if (bytesRead < 0) {
-        [self handleStreamError];
-		
-	// If zero bytes were read, wait for the EOF to come.
-    } else if (bytesRead) {
-
-		// If we are inflating the response on the fly
-		NSData *inflatedData = nil;
-		if ([self isResponseCompressed] && ![self shouldWaitToInflateCompressedResponses]) {
-			if (![self dataDecompressor]) {
-				[self setDataDecompressor:[ASIDataDecompressor decompressor]];
-			}
-			NSError *err = nil;
-			inflatedData = [[self dataDecompressor] uncompressBytes:buffer length:(NSUInteger)bytesRead error:&err];
-			if (err) {
-				[self failWithError:err];
-				return;
-			}
-		}
-		
-		[self setTotalBytesRead:[self totalBytesRead]+(NSUInteger)bytesRead];
-		[self setLastActivityTime:[NSDate date]];
+	// If we need to redirect, and have automatic redirect on, and might be resuming a download, let's do nothing with the content
+	if ([self needsRedirect] && [self shouldRedirect] && [self allowResumeForFileDownloads]) {
+		return;
+	}
 
-		// For bandwidth measurement / throttling
-		[ASIHTTPRequest incrementBandwidthUsedInLastSecond:(NSUInteger)bytesRead];
-		
-		// If we need to redirect, and have automatic redirect on, and might be resuming a download, let's do nothing with the content
-		if ([self needsRedirect] && [self shouldRedirect] && [self allowResumeForFileDownloads]) {
-			return;
+	// Does the delegate want to handle the data manually?
+	if (dataWillBeHandledExternally) {
+
+		// The data we pass on wraps the read buffer rather than copying it
+		NSData *data = nil;
+		if (inflateAsItArrives) {
+			data = inflatedData;
+		} else {
+			data = readData;
 		}
+		[self performCallback:@selector(passOnReceivedData:) onTarget:self withObject:data waitUntilDone:YES];
 		
-		BOOL dataWillBeHandledExternally = NO;
-		if ([[self delegate] respondsToSelector:[self didReceiveDataSelector]]) {
-			dataWillBeHandledExternally = YES;
-		}
-		#if NS_BLOCKS_AVAILABLE
-		if (dataReceivedBlock) {
-			dataWillBeHandledExternally = YES;
-		}
-		#endif
-		// Does the delegate want to handle the data manually?
-		if (dataWillBeHandledExternally) {
-
-			NSData *data = nil;
-			if ([self isResponseCompressed] && ![self shouldWaitToInflateCompressedResponses]) {
-				data = inflatedData;
-			} else {
-				data = [NSData dataWithBytes:buffer length:(NSUInteger)bytesRead];
-			}
-			[self performSelectorOnMainThread:@selector(passOnReceivedData:) withObject:data waitUntilDone:[NSThread isMainThread]];
-			
-		// Are we downloading to a file?
-		} else if ([self downloadDestinationPath]) {
-			BOOL append = NO;
-			if (![self fileDownloadOutputStream]) {
-				if (![self temporaryFileDownloadPath]) {
-					[self setTemporaryFileDownloadPath:[NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]]];
-				} else if ([self allowResumeForFileDownloads] && [[self requestHeaders] objectForKey:@"Range"]) {
-					if ([[self responseHeaders] objectForKey:@"Content-Range"]) {
-						append = YES;
-					} else {
-						[self incrementDownloadSizeBy:-(long long)[self partialDownloadSize]];
-						[self setPartialDownloadSize:0];
+	// Are we downloading to a file?
+	} else if ([self downloadDestinationPath]) {
+		BOOL append = NO;
+		if (![self fileDownloadOutputStream]) {
+			if (![self temporaryFileDownloadPath]) {
+				[self setTemporaryFileDownloadPath:[NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]]];
+			} else if ([self allowResumeForFileDownloads] && [self partialDownloadSize]) {
+				NSString *contentRange = [[self responseHeaders] objectForKey:@"Content-Range"];
+				if (contentRange) {
+
+					// Content-Range looks like 'bytes 1000-4999/5000'
+					// We only append when the response starts where the partial download ends
+					// When the server gave us no validator to send with If-Range, a different length is the only sign the file has changed
+					// Either way, we can't start again part way through a response, so we throw away the partial download and send the request again
+					unsigned long long rangeStart = 0;
+					NSScanner *scanner = [NSScanner scannerWithString:contentRange];
+					BOOL startsAtEndOfPartialDownload = ([scanner scanString:@"bytes" intoString:NULL] && [scanner scanUnsignedLongLong:&rangeStart] && rangeStart == [self partialDownloadSize]);
+					NSString *totalLength = [[contentRange componentsSeparatedByString:@"/"] lastObject];
+					NSNumber *expectedLength = [[self resumeManifest] objectForKey:@"ExpectedLength"];
+					if (!startsAtEndOfPartialDownload || (expectedLength && ![totalLength isEqualToString:@"*"] && (unsigned long long)[totalLength longLongValue] != [expectedLength unsignedLongLongValue])) {
+						[self restartDownloadFromBeginning];
+						return;
+					}
+					append = YES;
+					if ([self resumeManifest] && [self contentLength]) {
+						[[self resumeManifest] setObject:[NSNumber numberWithUnsignedLongLong:[self partialDownloadSize]+[self contentLength]] forKey:@"ExpectedLength"];
 					}
+				} else {
+					// The file has changed since we started downloading it (or the server ignored our Range header), so we start again
+					[self incrementDownloadSizeBy:-(long long)[self partialDownloadSize]];
+					[self setPartialDownloadSize:0];
 				}
+			}
 
-				[self setFileDownloadOutputStream:[[[NSOutputStream alloc] initToFileAtPath:[self temporaryFileDownloadPath] append:append] autorelease]];
-				[[self fileDownloadOutputStream] open];
+			[self setFileDownloadOutputStream:[[[NSOutputStream alloc] initToFileAtPath:[self temporaryFileDownloadPath] append:append] autorelease]];
+			[[self fileDownloadOutputStream] open];
 
+			// We're only getting the end of the file, so we can't work out a digest for it
+			if (append) {
+				[self setResponseDigest:nil];
 			}
-			[[self fileDownloadOutputStream] write:buffer maxLength:(NSUInteger)bytesRead];
-
-			if ([self isResponseCompressed] && ![self shouldWaitToInflateCompressedResponses]) {
-				
-				if (![self inflatedFileDownloadOutputStream]) {
-					if (![self temporaryUncompressedDataDownloadPath]) {
-						[self setTemporaryUncompressedDataDownloadPath:[NSTemporaryDirectory() stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]]];
-					}
-					
-					[self setInflatedFileDownloadOutputStream:[[[NSOutputStream alloc] initToFileAtPath:[self temporaryUncompressedDataDownloadPath] append:append] autorelease]];
-					[[self inflatedFileDownloadOutputStream] open];
-				}
 
-				[[self inflatedFileDownloadOutputStream] write:[inflatedData bytes] maxLength:[inflatedData length]];
+			if ([self allowResumeForFileDownloads] && !append) {
+				[self startResumeManifest];
 			}
 
-			
-		//Otherwise, let's add the data to our in-memory store
+		}
+
+		// Only the inflated data is written to disk - the compressed data is thrown away once it has been inflated
+		if (inflateAsItArrives) {
+			if ([inflatedData length]) {
+				[[self fileDownloadOutputStream] write:[inflatedData bytes] maxLength:[inflatedData length]];
+			}
 		} else {
-			if ([self isResponseCompressed] && ![self shouldWaitToInflateCompressedResponses]) {
-				[rawResponseData appendData:inflatedData];
-			} else {
-				[rawResponseData appendBytes:buffer length:(NSUInteger)bytesRead];
+			[[self fileDownloadOutputStream] write:buffer maxLength:bytesRead];
+			if ([self resumeManifest]) {
+				resumeChecksum = crc32(resumeChecksum, buffer, (uInt)bytesRead);
+				resumeChecksumLength += (unsigned long long)bytesRead;
+				if (resumeChecksumLength-resumeManifestSavedLength >= ASIResumeManifestSaveInterval) {
+					[self saveResumeManifest];
+				}
 			}
 		}
-    }
+		
+	//Otherwise, let's add the data to our in-memory store
+	// Another thread may be asking for the data so far (see rawResponseData), so we append under the same lock
+	} else {
+		[[self cancelledLock] lock];
+		if (inflateAsItArrives) {
+			[[self responseBuffer] appendData:inflatedData];
+		} else {
+			[[self responseBuffer] appendBytes:buffer length:bytesRead];
+		}
+		[[self cancelledLock] unlock];
+	}
+
+	[[self responseDigest] updateWithBytes:buffer length:bytesRead];
+}
+
+- (BOOL)shouldInflateResponseAsItArrivesForDelegate:(BOOL)dataWillBeHandledExternally
+{
+	if (![self isResponseCompressed]) {
+		return NO;
+	}
+	// File downloads are inflated as they arrive, so we only write the inflated data to disk
+	// Downloads that might be resumed keep the compressed data instead, because we can't start inflating part way through a response
+	if ([self downloadDestinationPath] && !dataWillBeHandledExternally) {
+		return ![self allowResumeForFileDownloads];
+	}
+	return ![self shouldWaitToInflateCompressedResponses];
 }
 
 - (void)handleStreamComplete
@@ -3398,17 +4473,23 @@ static NSOperationQueue *sharedQueue = nil;
 #if DEBUG_REQUEST_STATUS
 	ASI_DEBUG_LOG(@"[STATUS] Request %@ finished downloading data (%qu bytes)",self, [self totalBytesRead]);
 #endif
-	[self setStatusTimer:nil];
-	[self setDownloadComplete:YES];
-	
 	if (![self responseHeaders]) {
 		[self readResponseHeaders];
+		if ([self responseHeaders] && ![self complete] && [self retryWithPolicyAfterError:nil]) {
+			return;
+		}
 	}
 
+	[self stopStatusChecks];
+	[self setDownloadComplete:YES];
+
 	[progressLock lock];	
 	// Find out how much data we've uploaded so far
 	[self setLastBytesSent:totalBytesSent];	
-	[self setTotalBytesSent:[[NSMakeCollectable(CFReadStreamCopyProperty((CFReadStreamRef)[self readStream], kCFStreamPropertyHTTPRequestBytesWrittenCount)) autorelease] unsignedLongLongValue]];
+	[self updateTotalBytesSent];
+	if ([self shouldSendCompressedPostBodyChunked] && [(ASIInputStream *)[self postBodyReadStream] uncompressedBytesRead]) {
+		[self setRequestBodyCompressionRatio:(double)[(ASIInputStream *)[self postBodyReadStream] compressedBytesWritten]/(double)[(ASIInputStream *)[self postBodyReadStream] uncompressedBytesRead]];
+	}
 	[self setComplete:YES];
 	if (![self contentLength]) {
 		[self setContentLength:[self totalBytesRead]];
@@ -3421,12 +4502,15 @@ static NSOperationQueue *sharedQueue = nil;
 	
 	[self setDataDecompressor:nil];
 
+	// Check the bodies against the digests the server sent, before we put a downloaded file where it is supposed to go
 	NSError *fileError = nil;
+	if (![self needsRedirect] && ![self authenticationNeeded] && ![self didUseCachedResponse]) {
+		fileError = [self digestMismatchError];
+	}
 	
 	// Delete up the request body temporary file, if it exists
 	if ([self didCreateTemporaryPostDataFile] && ![self authenticationNeeded]) {
 		[self removeTemporaryUploadFile];
-		[self removeTemporaryCompressedUploadFile];
 	}
 	
 	// Close the output stream as we're done writing to the file
@@ -3435,28 +4519,17 @@ static NSOperationQueue *sharedQueue = nil;
 		[[self fileDownloadOutputStream] close];
 		[self setFileDownloadOutputStream:nil];
 
-		[[self inflatedFileDownloadOutputStream] close];
-		[self setInflatedFileDownloadOutputStream:nil];
-
 		// If we are going to redirect and we are resuming, let's ignore this download
 		if ([self shouldRedirect] && [self needsRedirect] && [self allowResumeForFileDownloads]) {
-		
-		} else if ([self isResponseCompressed]) {
-			
-			// Decompress the file directly to the destination path
-			if ([self shouldWaitToInflateCompressedResponses]) {
-				[ASIDataDecompressor uncompressDataFromFile:[self temporaryFileDownloadPath] toFile:[self downloadDestinationPath] error:&fileError];
-
-			// Response should already have been inflated, move the temporary file to the destination path
-			} else {
-				NSError *moveError = nil;
-				[[[[NSFileManager alloc] init] autorelease] moveItemAtPath:[self temporaryUncompressedDataDownloadPath] toPath:[self downloadDestinationPath] error:&moveError];
-				if (moveError) {
-					fileError = [NSError errorWithDomain:NetworkRequestErrorDomain code:ASIFileManagementError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:[NSString stringWithFormat:@"Failed to move file from '%@' to '%@'",[self temporaryFileDownloadPath],[self downloadDestinationPath]],NSLocalizedDescriptionKey,moveError,NSUnderlyingErrorKey,nil]];
-				}
-				[self setTemporaryUncompressedDataDownloadPath:nil];
 
-			}
+		// The file we downloaded is corrupt, so we throw it away (including any partial download we resumed from)
+		} else if (fileError) {
+			[self removeTemporaryDownloadFile];
+		
+		// Downloads that might have been resumed are stored compressed, so decompress the file directly to the destination path
+		// Other compressed downloads were inflated as they arrived (see shouldInflateResponseAsItArrivesForDelegate:), so they are moved like any other download
+		} else if ([self isResponseCompressed] && ![self shouldInflateResponseAsItArrivesForDelegate:NO]) {
+			[[self responseDecompressor] uncompressFile:[self temporaryFileDownloadPath] toFile:[self downloadDestinationPath] error:&fileError];
 			[self removeTemporaryDownloadFile];
 
 		} else {
@@ -3474,6 +4547,7 @@ static NSOperationQueue *sharedQueue = nil;
 				if (moveError) {
 					fileError = [NSError errorWithDomain:NetworkRequestErrorDomain code:ASIFileManagementError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:[NSString stringWithFormat:@"Failed to move file from '%@' to '%@'",[self temporaryFileDownloadPath],[self downloadDestinationPath]],NSLocalizedDescriptionKey,moveError,NSUnderlyingErrorKey,nil]];
 				}
+				[self removeResumeManifest];
 				[self setTemporaryFileDownloadPath:nil];
 			}
 			
@@ -3481,25 +4555,22 @@ static NSOperationQueue *sharedQueue = nil;
 	}
 	
 	// Save to the cache
-	if ([self downloadCache] && ![self didUseCachedResponse]) {
+	if ([self downloadCache] && ![self didUseCachedResponse] && !fileError) {
 		[[self downloadCache] storeResponseForRequest:self maxAge:[self secondsToCache]];
 	}
 	
 	[progressLock unlock];
 
 	
-	[connectionsLock lock];
 	if (![self connectionCanBeReused]) {
 		[self unscheduleReadStream];
 	}
 	#if DEBUG_PERSISTENT_CONNECTIONS
 	if ([self requestID]) {
-		ASI_DEBUG_LOG(@"[CONNECTION] Request #%@ finished using connection #%@",[self requestID], [[self connectionInfo] objectForKey:@"id"]);
+		ASI_DEBUG_LOG(@"[CONNECTION] Request #%@ finished using connection #%@",[self requestID], [[self connectionInfo] connectionID]);
 	}
 	#endif
-	[[self connectionInfo] removeObjectForKey:@"request"];
-	[[self connectionInfo] setObject:[NSDate dateWithTimeIntervalSinceNow:[self persistentConnectionTimeoutSeconds]] forKey:@"expires"];
-	[connectionsLock unlock];
+	[ASIHTTPRequest startRequestWaitingForConnection:[[ASIConnectionPool sharedPool] releaseConnection:[self connectionInfo] fromRequestWithID:[self requestID] expiresIn:[self persistentConnectionTimeoutSeconds]]];
 	
 	if (![self authenticationNeeded]) {
 		[self destroyReadStream];
@@ -3558,6 +4629,15 @@ static NSOperationQueue *sharedQueue = nil;
     if (!wasFinished)
         [self didChangeValueForKey:@"isFinished"];
 
+	// This request no longer counts towards the load on its network thread
+	[self releaseNetworkThread];
+
+	// Let our timer wheel release us now, rather than when it next checks on us
+	[self stopStatusChecks];
+
+	// Pass our response on to any requests waiting for it, or stop waiting for someone else's
+	[self stopCoalescing];
+
 	#if TARGET_OS_IPHONE && __IPHONE_OS_VERSION_MAX_ALLOWED >= __IPHONE_4_0
 	if ([ASIHTTPRequest isMultitaskingSupported] && [self shouldContinueWhenAppEntersBackground]) {
 		dispatch_async(dispatch_get_main_queue(), ^{
@@ -3633,23 +4713,116 @@ static NSOperationQueue *sharedQueue = nil;
 		[self setWillRetryRequest:NO];
 
 		#if DEBUG_PERSISTENT_CONNECTIONS
-			ASI_DEBUG_LOG(@"[CONNECTION] Request attempted to use connection #%@, but it has been closed - will retry with a new connection", [[self connectionInfo] objectForKey:@"id"]);
+			ASI_DEBUG_LOG(@"[CONNECTION] Request attempted to use connection #%@, but it has been closed - will retry with a new connection", [[self connectionInfo] connectionID]);
 		#endif
-		[connectionsLock lock];
-		[[self connectionInfo] removeObjectForKey:@"request"];
-		[persistentConnectionsPool removeObject:[self connectionInfo]];
+		[ASIHTTPRequest startRequestWaitingForConnection:[[ASIConnectionPool sharedPool] removeConnection:[self connectionInfo] usedByRequestWithID:[self requestID]]];
 		[self setConnectionInfo:nil];
-		[connectionsLock unlock];
 		[self setRetryCount:[self retryCount]+1];
 		[self startRequest];
 		return YES;
 	}
 	#if DEBUG_PERSISTENT_CONNECTIONS
-		ASI_DEBUG_LOG(@"[CONNECTION] Request attempted to use connection #%@, but it has been closed - we have already retried with a new connection, so we must give up", [[self connectionInfo] objectForKey:@"id"]);
+		ASI_DEBUG_LOG(@"[CONNECTION] Request attempted to use connection #%@, but it has been closed - we have already retried with a new connection, so we must give up", [[self connectionInfo] connectionID]);
 	#endif	
 	return NO;
 }
 
+- (void)updateRangeHeaderForRetry
+{
+	// Only resumed downloads need a new Range header - one set by whoever made the request (eg for a segment of an ASISegmentedDownload) is sent again as it was
+	if (![self allowResumeForFileDownloads]) {
+		return;
+	}
+
+	// We may need to update the Range header to take account of data we've just downloaded
+	// We close the file, so the next response decides whether we append to it or start again
+	if ([self fileDownloadOutputStream]) {
+		[[self fileDownloadOutputStream] close];
+		[self setFileDownloadOutputStream:nil];
+	}
+	[self updatePartialDownloadSize];
+
+	// requestHeaders must match the message we send, as handleBytesRead: looks at them to decide whether to append to the partial download
+	if ([self partialDownloadSize] && ([self rangeHeaderIsForResume] || ![[self requestHeaders] objectForKey:@"Range"])) {
+		[self addRequestHeader:@"Range" value:[NSString stringWithFormat:@"bytes=%llu-",[self partialDownloadSize]]];
+		if ([self resumeValidator]) {
+			[self addRequestHeader:@"If-Range" value:[self resumeValidator]];
+		} else {
+			[[self requestHeaders] removeObjectForKey:@"If-Range"];
+		}
+		[self setRangeHeaderIsForResume:YES];
+	} else if (![self partialDownloadSize] && [self rangeHeaderIsForResume]) {
+		[[self requestHeaders] removeObjectForKey:@"Range"];
+		[[self requestHeaders] removeObjectForKey:@"If-Range"];
+		[self setRangeHeaderIsForResume:NO];
+	} else {
+		return;
+	}
+	CFHTTPMessageSetHeaderFieldValue(request, (CFStringRef)@"Range", (CFStringRef)[[self requestHeaders] objectForKey:@"Range"]);
+	CFHTTPMessageSetHeaderFieldValue(request, (CFStringRef)@"If-Range", (CFStringRef)[[self requestHeaders] objectForKey:@"If-Range"]);
+}
+
+- (BOOL)retryWithPolicyAfterError:(NSError *)theError
+{
+	NSTimeInterval delay = 0;
+	if (![self retryPolicy] || [self isCancelled] || [self error] || ![[self retryPolicy] shouldRetryRequest:self error:theError delay:&delay]) {
+		return NO;
+	}
+	[self setPolicyRetryCount:[self policyRetryCount]+1];
+
+	#if DEBUG_REQUEST_STATUS
+	ASI_DEBUG_LOG(@"[STATUS] Request %@ will retry in %f seconds (%@)",self,delay,(theError ? [theError localizedDescription] : [self responseStatusMessage]));
+	#endif
+
+	[self stopLoadingForRetry];
+	[self updateRangeHeaderForRetry];
+
+	[self performSelector:@selector(retryAfterPolicyDelay) withObject:nil afterDelay:delay inModes:[NSArray arrayWithObject:[self runLoopMode]]];
+	return YES;
+}
+
+- (void)stopLoadingForRetry
+{
+	// We may not have read the whole of the last response, so the connection can't be used again
+	[self setConnectionCanBeReused:NO];
+	[self setWillRetryRequest:YES];
+	[self cancelLoad];
+	[self setWillRetryRequest:NO];
+	[ASIHTTPRequest startRequestWaitingForConnection:[[ASIConnectionPool sharedPool] removeConnection:[self connectionInfo] usedByRequestWithID:[self requestID]]];
+	[self setConnectionInfo:nil];
+
+	[self setResponseHeaders:nil];
+	[self setResponseStatusCode:0];
+	[self setResponseStatusMessage:nil];
+}
+
+- (void)restartDownloadFromBeginning
+{
+	#if DEBUG_REQUEST_STATUS
+	ASI_DEBUG_LOG(@"[STATUS] Request %@ got a range of a different file than its partial download, will start again",self);
+	#endif
+	[self stopLoadingForRetry];
+	[[self class] removeFileAtPath:[self temporaryFileDownloadPath] error:NULL];
+	[self removeResumeManifest];
+	[self incrementDownloadSizeBy:-(long long)[self partialDownloadSize]];
+	[self setPartialDownloadSize:0];
+	[self updateRangeHeaderForRetry];
+
+	// We're in the middle of reading the old response, so we start again once it has been dealt with
+	[self performSelector:@selector(retryAfterPolicyDelay) withObject:nil afterDelay:0 inModes:[NSArray arrayWithObject:[self runLoopMode]]];
+}
+
+- (void)retryAfterPolicyDelay
+{
+	[[self cancelledLock] lock];
+	if ([self isCancelled] || [self complete]) {
+		[[self cancelledLock] unlock];
+		return;
+	}
+	[[self cancelledLock] unlock];
+	[self startRequest];
+}
+
 - (void)handleStreamError
 
 {
@@ -3679,8 +4852,12 @@ static NSOperationQueue *sharedQueue = nil;
 				reason = [NSString stringWithFormat:@"%@: SSL problem (Possible causes may include a bad/expired/self-signed certificate, clock set to wrong date)",reason];
 			}
 		}
+		NSError *connectionError = [NSError errorWithDomain:NetworkRequestErrorDomain code:ASIConnectionFailureErrorType userInfo:[NSDictionary dictionaryWithObjectsAndKeys:reason,NSLocalizedDescriptionKey,underlyingError,NSUnderlyingErrorKey,nil]];
+		if ([self retryWithPolicyAfterError:connectionError]) {
+			return;
+		}
 		[self cancelLoad];
-		[self failWithError:[NSError errorWithDomain:NetworkRequestErrorDomain code:ASIConnectionFailureErrorType userInfo:[NSDictionary dictionaryWithObjectsAndKeys:reason,NSLocalizedDescriptionKey,underlyingError,NSUnderlyingErrorKey,nil]]];
+		[self failWithError:connectionError];
 	} else {
 		[self cancelLoad];
 	}
@@ -3713,7 +4890,7 @@ static NSOperationQueue *sharedQueue = nil;
 		[connectionsLock unlock];
 
 		// Reset the timeout
-		[self setLastActivityTime:[NSDate date]];
+		[self setLastActivityTime:ASIMonotonicTime()];
 		CFStreamClientContext ctxt = {0, self, NULL, NULL, NULL};
 		CFReadStreamSetClient((CFReadStreamRef)[self readStream], kNetworkEvents, ReadStreamClientCallBack, &ctxt);
 		[[self readStream] scheduleInRunLoop:[NSRunLoop currentRunLoop] forMode:[self runLoopMode]];
@@ -3752,6 +4929,7 @@ static NSOperationQueue *sharedQueue = nil;
 		if (![[self class] removeFileAtPath:[self temporaryFileDownloadPath] error:&err]) {
 			[self failWithError:err];
 		}
+		[self removeResumeManifest];
 		[self setTemporaryFileDownloadPath:nil];
 	}
 	return (!err);
@@ -3783,14 +4961,7 @@ static NSOperationQueue *sharedQueue = nil;
 
 - (BOOL)removeTemporaryCompressedUploadFile
 {
-	NSError *err = nil;
-	if ([self compressedPostBodyFilePath]) {
-		if (![[self class] removeFileAtPath:[self compressedPostBodyFilePath] error:&err]) {
-			[self failWithError:err];
-		}
-		[self setCompressedPostBodyFilePath:nil];
-	}
-	return (!err);
+	return YES;
 }
 
 + (BOOL)removeFileAtPath:(NSString *)path error:(NSError **)err
@@ -4023,28 +5194,33 @@ static NSOperationQueue *sharedQueue = nil;
 
 - (NSNumber *)connectionID
 {
-	return [[self connectionInfo] objectForKey:@"id"];
+	return [[self connectionInfo] connectionID];
 }
 
 + (void)expirePersistentConnections
 {
-	[connectionsLock lock];
-	NSUInteger i;
-	for (i=0; i<[persistentConnectionsPool count]; i++) {
-		NSDictionary *existingConnection = [persistentConnectionsPool objectAtIndex:i];
-		if (![existingConnection objectForKey:@"request"] && [[existingConnection objectForKey:@"expires"] timeIntervalSinceNow] <= 0) {
-#if DEBUG_PERSISTENT_CONNECTIONS
-			ASI_DEBUG_LOG(@"[CONNECTION] Closing connection #%i because it has expired",[[existingConnection objectForKey:@"id"] intValue]);
-#endif
-			NSInputStream *stream = [existingConnection objectForKey:@"stream"];
-			if (stream) {
-				[stream close];
-			}
-			[persistentConnectionsPool removeObject:existingConnection];
-			i--;
+	[[ASIConnectionPool sharedPool] expireIdleConnections];
+}
+
++ (NSUInteger)maxConnectionsPerHost
+{
+	return [[ASIConnectionPool sharedPool] maxConnectionsPerHost];
+}
+
++ (void)setMaxConnectionsPerHost:(NSUInteger)max
+{
+	[[ASIConnectionPool sharedPool] setMaxConnectionsPerHost:max];
+}
+
+// Called when the connection pool tells us a request that was waiting for a connection can try again
++ (void)startRequestWaitingForConnection:(ASIHTTPRequest *)waitingRequest
+{
+	if (waitingRequest) {
+		NSThread *thread = [waitingRequest connectionWaitThread];
+		if (thread) {
+			[waitingRequest performSelector:@selector(startRequest) onThread:thread withObject:nil waitUntilDone:NO modes:[NSArray arrayWithObject:[waitingRequest runLoopMode]]];
 		}
-	}	
-	[connectionsLock unlock];
+	}
 }
 
 #pragma mark NSCopying
@@ -4053,9 +5229,33 @@ static NSOperationQueue *sharedQueue = nil;
 	// Don't forget - this will return a retained copy!
 	ASIHTTPRequest *newRequest = [[[self class] alloc] initWithURL:[self url]];
 	[newRequest setDelegate:[self delegate]];
+	[newRequest setCallbackMode:[self callbackMode]];
+	[newRequest setCallbackOperationQueue:[self callbackOperationQueue]];
+	#if NS_BLOCKS_AVAILABLE
+	[newRequest setCallbackDispatchQueue:[self callbackDispatchQueue]];
+	#endif
+	[newRequest setBandwidthClass:[self bandwidthClass]];
 	[newRequest setRequestMethod:[self requestMethod]];
 	[newRequest setPostBody:[self postBody]];
+	// Parts we are still appending to are copied, so appending to one request's body doesn't change the other's
+	// Data appended in place is immutable (or mustn't be changed), so copying it is just a retain
+	if ([self postBodyParts]) {
+		NSMutableArray *parts = [NSMutableArray arrayWithCapacity:[[self postBodyParts] count]+1];
+		for (id part in [self postBodyParts]) {
+			[parts addObject:[[part copyWithZone:zone] autorelease]];
+		}
+		if (![[parts lastObject] isKindOfClass:[NSString class]]) {
+			[parts addObject:[NSMutableData data]];
+		}
+		[newRequest setPostBodyParts:parts];
+	}
 	[newRequest setShouldStreamPostDataFromDisk:[self shouldStreamPostDataFromDisk]];
+	[newRequest setShouldMemoryMapPostBodyFile:[self shouldMemoryMapPostBodyFile]];
+	[newRequest setRequestBodyDigestAlgorithms:[self requestBodyDigestAlgorithms]];
+	[newRequest setResponseDigestAlgorithms:[self responseDigestAlgorithms]];
+	[newRequest setShouldVerifyResponseDigest:[self shouldVerifyResponseDigest]];
+	[newRequest setShouldVerifyDigestsAgainstETag:[self shouldVerifyDigestsAgainstETag]];
+	[newRequest setShouldCoalesceIdenticalRequests:[self shouldCoalesceIdenticalRequests]];
 	[newRequest setPostBodyFilePath:[self postBodyFilePath]];
 	[newRequest setRequestHeaders:[[[self requestHeaders] mutableCopyWithZone:zone] autorelease]];
 	[newRequest setRequestCookies:[[[self requestCookies] mutableCopyWithZone:zone] autorelease]];
@@ -4063,6 +5263,10 @@ static NSOperationQueue *sharedQueue = nil;
 	[newRequest setUseKeychainPersistence:[self useKeychainPersistence]];
 	[newRequest setUseSessionPersistence:[self useSessionPersistence]];
 	[newRequest setAllowCompressedResponse:[self allowCompressedResponse]];
+	[newRequest setShouldCompressRequestBody:[self shouldCompressRequestBody]];
+	[newRequest setShouldPrecomputeCompressedPostLength:[self shouldPrecomputeCompressedPostLength]];
+	[newRequest setShouldAutomaticallyCompressRequestBody:[self shouldAutomaticallyCompressRequestBody]];
+	[newRequest setRequestBodyCompressionLevel:[self requestBodyCompressionLevel]];
 	[newRequest setDownloadDestinationPath:[self downloadDestinationPath]];
 	[newRequest setTemporaryFileDownloadPath:[self temporaryFileDownloadPath]];
 	[newRequest setUsername:[self username]];
@@ -4084,6 +5288,7 @@ static NSOperationQueue *sharedQueue = nil;
 	[newRequest setDidFinishSelector:[self didFinishSelector]];
 	[newRequest setDidFailSelector:[self didFailSelector]];
 	[newRequest setTimeOutSeconds:[self timeOutSeconds]];
+	[newRequest setProgressUpdateInterval:[self progressUpdateInterval]];
 	[newRequest setShouldResetDownloadProgress:[self shouldResetDownloadProgress]];
 	[newRequest setShouldResetUploadProgress:[self shouldResetUploadProgress]];
 	[newRequest setShowAccurateProgress:[self showAccurateProgress]];
@@ -4099,6 +5304,7 @@ static NSOperationQueue *sharedQueue = nil;
 	[newRequest setPACurl:[self PACurl]];
 	[newRequest setShouldPresentCredentialsBeforeChallenge:[self shouldPresentCredentialsBeforeChallenge]];
 	[newRequest setNumberOfTimesToRetryOnTimeout:[self numberOfTimesToRetryOnTimeout]];
+	[newRequest setRetryPolicy:[self retryPolicy]];
 	[newRequest setShouldUseRFC2616RedirectBehaviour:[self shouldUseRFC2616RedirectBehaviour]];
 	[newRequest setShouldAttemptPersistentConnection:[self shouldAttemptPersistentConnection]];
 	[newRequest setPersistentConnectionTimeoutSeconds:[self persistentConnectionTimeoutSeconds]];
@@ -4118,6 +5324,18 @@ static NSOperationQueue *sharedQueue = nil;
 	defaultTimeOutSeconds = newTimeOutSeconds;
 }
 
+#pragma mark default progress update interval
+
++ (NSTimeInterval)defaultProgressUpdateInterval
+{
+	return defaultProgressUpdateInterval;
+}
+
++ (void)setDefaultProgressUpdateInterval:(NSTimeInterval)newInterval
+{
+	defaultProgressUpdateInterval = newInterval;
+}
+
 
 #pragma mark client certificate
 
@@ -4482,27 +5700,26 @@ static NSOperationQueue *sharedQueue = nil;
 		return;
 	}
 	[ASIHTTPRequest measureBandwidthUsage];
-	if ([ASIHTTPRequest isBandwidthThrottled]) {
-		[bandwidthThrottlingLock lock];
-		// Handle throttling
-		if (throttleWakeUpTime) {
-			if ([throttleWakeUpTime timeIntervalSinceDate:[NSDate date]] > 0) {
-				if ([self readStreamIsScheduled]) {
-					[self unscheduleReadStream];
-					#if DEBUG_THROTTLING
-					ASI_DEBUG_LOG(@"[THROTTLING] Sleeping request %@ until after %@",self,throttleWakeUpTime);
-					#endif
-				}
-			} else {
-				if (![self readStreamIsScheduled]) {
-					[self scheduleReadStream];
-					#if DEBUG_THROTTLING
-					ASI_DEBUG_LOG(@"[THROTTLING] Waking up request %@",self);
-					#endif
-				}
+	ASIBandwidthClass *throttlingClass = [self effectiveBandwidthClass];
+	if ([throttlingClass isThrottled]) {
+
+		// Sleep while our bandwidth class, or a class above it, has used more than its allowance
+		// scheduleStatusCheck will have us checked again once the debt has been paid off
+		if ([throttlingClass availableBytes] <= 0) {
+			if ([self readStreamIsScheduled]) {
+				[self unscheduleReadStream];
+				#if DEBUG_THROTTLING
+				ASI_DEBUG_LOG(@"[THROTTLING] Sleeping request %@ in %@ for %f seconds",self,throttlingClass,[throttlingClass wakeUpTime]-ASIMonotonicTime());
+				#endif
 			}
-		} 
-		[bandwidthThrottlingLock unlock];
+		} else {
+			if (![self readStreamIsScheduled]) {
+				[self scheduleReadStream];
+				#if DEBUG_THROTTLING
+				ASI_DEBUG_LOG(@"[THROTTLING] Waking up request %@",self);
+				#endif
+			}
+		}
 		
 	// Bandwidth throttling must have been turned off since we last looked, let's re-schedule the stream
 	} else if (![self readStreamIsScheduled]) {
@@ -4510,20 +5727,19 @@ static NSOperationQueue *sharedQueue = nil;
 	}
 }
 
-+ (BOOL)isBandwidthThrottled
+- (ASIBandwidthClass *)effectiveBandwidthClass
 {
-#if TARGET_OS_IPHONE
-	[bandwidthThrottlingLock lock];
+	ASIBandwidthClass *theClass = [self bandwidthClass];
+	if (!theClass) {
+		return [ASIBandwidthClass globalBandwidthClass];
+	}
+	return theClass;
+}
 
-	BOOL throttle = isBandwidthThrottled || (!shouldThrottleBandwidthForWWANOnly && (maxBandwidthPerSecond > 0));
-	[bandwidthThrottlingLock unlock];
-	return throttle;
-#else
-	[bandwidthThrottlingLock lock];
-	BOOL throttle = (maxBandwidthPerSecond > 0);
-	[bandwidthThrottlingLock unlock];
-	return throttle;
-#endif
++ (BOOL)isBandwidthThrottled
+{
+	// The global class is only limited when throttling is in use (see updateGlobalBandwidthLimit)
+	return [[ASIBandwidthClass globalBandwidthClass] isThrottled];
 }
 
 + (unsigned long)maxBandwidthPerSecond
@@ -4539,101 +5755,103 @@ static NSOperationQueue *sharedQueue = nil;
 	[bandwidthThrottlingLock lock];
 	maxBandwidthPerSecond = bytes;
 	[bandwidthThrottlingLock unlock];
+	[ASIHTTPRequest updateGlobalBandwidthLimit];
 }
 
-+ (void)incrementBandwidthUsedInLastSecond:(unsigned long)bytes
+// Works out the limit all requests combined should currently be held to, and applies it to the global bandwidth class
++ (void)updateGlobalBandwidthLimit
 {
 	[bandwidthThrottlingLock lock];
-	bandwidthUsedInLastSecond += bytes;
+	unsigned long limit = maxBandwidthPerSecond;
+	#if TARGET_OS_IPHONE
+	// When we only throttle WWAN connections, the limit only applies while we are connected via WWAN
+	if (shouldThrottleBandwidthForWWANOnly && !isBandwidthThrottled) {
+		limit = 0;
+	}
+	#endif
+	[[ASIBandwidthClass globalBandwidthClass] setMaxBandwidthPerSecond:limit];
 	[bandwidthThrottlingLock unlock];
 }
 
++ (void)incrementBandwidthUsedInLastSecond:(unsigned long)bytes
+{
+	OSAtomicAdd64((int64_t)bytes, &totalBandwidthUsed);
+	[[ASIBandwidthClass globalBandwidthClass] consumeBytes:bytes];
+}
+
+- (void)incrementBandwidthUsedBy:(unsigned long)bytes
+{
+	OSAtomicAdd64((int64_t)bytes, &totalBandwidthUsed);
+	[[self effectiveBandwidthClass] consumeBytes:bytes];
+}
+
+// Adds a measurement of the total bandwidth used to our ring buffer, and works out the average since the oldest measurement we still have
 + (void)recordBandwidthUsage
 {
-	if (bandwidthUsedInLastSecond == 0) {
-		[bandwidthUsageTracker removeAllObjects];
-	} else {
-		NSTimeInterval interval = [bandwidthMeasurementDate timeIntervalSinceNow];
-		while ((interval < 0 || [bandwidthUsageTracker count] > 5) && [bandwidthUsageTracker count] > 0) {
-			[bandwidthUsageTracker removeObjectAtIndex:0];
-			interval++;
-		}
+	if (!OSSpinLockTry(&bandwidthMeasurementLock)) {
+		return;
+	}
+	NSTimeInterval now = ASIMonotonicTime();
+	if (now < nextBandwidthMeasurementTime) {
+		OSSpinLockUnlock(&bandwidthMeasurementLock);
+		return;
 	}
+	int64_t totalBytes = OSAtomicAdd64Barrier(0, &totalBandwidthUsed);
+
+	NSUInteger newest = (nextBandwidthMeasurement+ASIBandwidthMeasurementCount-1) % ASIBandwidthMeasurementCount;
 	#if DEBUG_THROTTLING
-	ASI_DEBUG_LOG(@"[THROTTLING] ===Used: %u bytes of bandwidth in last measurement period===",bandwidthUsedInLastSecond);
+	if (bandwidthMeasurements[newest].time > 0) {
+		ASI_DEBUG_LOG(@"[THROTTLING] ===Used: %lld bytes of bandwidth in last measurement period===",totalBytes-bandwidthMeasurements[newest].totalBytes);
+	}
 	#endif
-	[bandwidthUsageTracker addObject:[NSNumber numberWithUnsignedLong:bandwidthUsedInLastSecond]];
-	[bandwidthMeasurementDate release];
-	bandwidthMeasurementDate = [[NSDate dateWithTimeIntervalSinceNow:1] retain];
-	bandwidthUsedInLastSecond = 0;
-	
-	NSUInteger measurements = [bandwidthUsageTracker count];
-	unsigned long totalBytes = 0;
-	for (NSNumber *bytes in bandwidthUsageTracker) {
-		totalBytes += [bytes unsignedLongValue];
+
+	// If nothing has been measured for a while, the old measurements tell us nothing about what is happening now
+	if (bandwidthMeasurements[newest].time > 0 && now-bandwidthMeasurements[newest].time > ASIBandwidthMeasurementCount) {
+		memset(bandwidthMeasurements, 0, sizeof(bandwidthMeasurements));
 	}
-	if (measurements > 0)
-		averageBandwidthUsedPerSecond = totalBytes/measurements;
+
+	bandwidthMeasurements[nextBandwidthMeasurement].time = now;
+	bandwidthMeasurements[nextBandwidthMeasurement].totalBytes = totalBytes;
+	nextBandwidthMeasurement = (nextBandwidthMeasurement+1) % ASIBandwidthMeasurementCount;
+
+	// The slot we will overwrite next holds the oldest measurement (unless we haven't filled the buffer yet)
+	NSUInteger oldest = nextBandwidthMeasurement;
+	while (bandwidthMeasurements[oldest].time == 0 && oldest != newest) {
+		oldest = (oldest+1) % ASIBandwidthMeasurementCount;
+	}
+	NSTimeInterval elapsed = now-bandwidthMeasurements[oldest].time;
+	if (elapsed > 0) {
+		averageBandwidthUsedPerSecond = (unsigned long)((totalBytes-bandwidthMeasurements[oldest].totalBytes)/elapsed);
+	} else {
+		averageBandwidthUsedPerSecond = 0;
+	}
+	nextBandwidthMeasurementTime = now+1;
+	OSSpinLockUnlock(&bandwidthMeasurementLock);
 }
 
 + (unsigned long)averageBandwidthUsedPerSecond
 {
-	[bandwidthThrottlingLock lock];
-	unsigned long amount = 	averageBandwidthUsedPerSecond;
-	[bandwidthThrottlingLock unlock];
-	return amount;
+	[ASIHTTPRequest measureBandwidthUsage];
+	return averageBandwidthUsedPerSecond;
 }
 
 + (void)measureBandwidthUsage
 {
-	// Other requests may have to wait for this lock if we're sleeping, but this is fine, since in that case we already know they shouldn't be sending or receiving data
-	[bandwidthThrottlingLock lock];
-
-	if (!bandwidthMeasurementDate || [bandwidthMeasurementDate timeIntervalSinceNow] < -0) {
+	// This is called every time a request sends or receives data, so we only do anything once a second
+	if (ASIMonotonicTime() >= nextBandwidthMeasurementTime) {
 		[ASIHTTPRequest recordBandwidthUsage];
 	}
-	
-	// Are we performing bandwidth throttling?
-	if (
-	#if TARGET_OS_IPHONE
-	isBandwidthThrottled || (!shouldThrottleBandwidthForWWANOnly && (maxBandwidthPerSecond))
-	#else
-	maxBandwidthPerSecond
-	#endif
-	) {
-		// How much data can we still send or receive this second?
-		long long bytesRemaining = (long long)maxBandwidthPerSecond - (long long)bandwidthUsedInLastSecond;
-			
-		// Have we used up our allowance?
-		if (bytesRemaining < 0) {
-			
-			// Yes, put this request to sleep until a second is up, with extra added punishment sleeping time for being very naughty (we have used more bandwidth than we were allowed)
-			double extraSleepyTime = (-bytesRemaining/(maxBandwidthPerSecond*1.0));
-			[throttleWakeUpTime release];
-			throttleWakeUpTime = [[NSDate alloc] initWithTimeInterval:extraSleepyTime sinceDate:bandwidthMeasurementDate];
-		}
-	}
-	[bandwidthThrottlingLock unlock];
 }
 	
 + (unsigned long)maxUploadReadLength
 {
-	[bandwidthThrottlingLock lock];
-	
-	// We'll split our bandwidth allowance into 4 (which is the default for an ASINetworkQueue's max concurrent operations count) to give all running requests a fighting chance of reading data this cycle
-	long long toRead = maxBandwidthPerSecond/4;
-	if (maxBandwidthPerSecond > 0 && (bandwidthUsedInLastSecond + toRead > maxBandwidthPerSecond)) {
-		toRead = (long long)maxBandwidthPerSecond-(long long)bandwidthUsedInLastSecond;
-		if (toRead < 0) {
-			toRead = 0;
-		}
+	if (![ASIHTTPRequest isBandwidthThrottled]) {
+		return ULONG_MAX;
 	}
-	
-	if (toRead == 0 || !bandwidthMeasurementDate || [bandwidthMeasurementDate timeIntervalSinceNow] < -0) {
-		[throttleWakeUpTime release];
-		throttleWakeUpTime = [bandwidthMeasurementDate retain];
+	long long toRead = [[ASIBandwidthClass globalBandwidthClass] availableBytes];
+	if (toRead < 0) {
+		toRead = 0;
 	}
-	[bandwidthThrottlingLock unlock];	
 	return (unsigned long)toRead;
 }
 	
@@ -4645,11 +5863,11 @@ static NSOperationQueue *sharedQueue = nil;
 		[ASIHTTPRequest throttleBandwidthForWWANUsingLimit:ASIWWANBandwidthThrottleAmount];
 	} else {
 		[ASIHTTPRequest unsubscribeFromNetworkReachabilityNotifications];
-		[ASIHTTPRequest setMaxBandwidthPerSecond:0];
 		[bandwidthThrottlingLock lock];
 		isBandwidthThrottled = NO;
 		shouldThrottleBandwidthForWWANOnly = NO;
 		[bandwidthThrottlingLock unlock];
+		[ASIHTTPRequest setMaxBandwidthPerSecond:0];
 	}
 }
 
@@ -4687,6 +5905,7 @@ static NSOperationQueue *sharedQueue = nil;
 	[bandwidthThrottlingLock lock];
 	isBandwidthThrottled = [ASIHTTPRequest isNetworkReachableViaWWAN];
 	[bandwidthThrottlingLock unlock];
+	[ASIHTTPRequest updateGlobalBandwidthLimit];
 }
 #endif
 
@@ -4768,7 +5987,7 @@ static NSOperationQueue *sharedQueue = nil;
 
 #pragma mark threading behaviour
 
-// In the default implementation, all requests run in a single background thread
+// In the default implementation, requests are spread across a pool of background threads (see numberOfNetworkThreads and networkThreadPolicy)
 // Advanced users only: Override this method in a subclass for a different threading behaviour
 // Eg: return [NSThread mainThread] to run all requests in the main thread
 // Alternatively, you can create a thread on demand, or manage a pool of threads
@@ -4777,15 +5996,110 @@ static NSOperationQueue *sharedQueue = nil;
 // If you have multiple requests sharing the thread or you want to re-use the thread, you'll need to restart the runloop
 + (NSThread *)threadForRequest:(ASIHTTPRequest *)request
 {
-	if (networkThread == nil) {
-		@synchronized(self) {
-			if (networkThread == nil) {
-				networkThread = [[NSThread alloc] initWithTarget:self selector:@selector(runRequests) object:nil];
-				[networkThread start];
+	// Once a request has been given a thread, it stays there
+	NSThread *thread = [request requestThread];
+	if (thread) {
+		return thread;
+	}
+	[networkThreadsLock lock];
+
+	// Check again now we hold the lock, in case we raced with another thread asking for the same request
+	thread = [request requestThread];
+	if (!thread) {
+		NSUInteger threadIndex = [self networkThreadIndexForRequest:request];
+
+		// Create threads on demand, up to the one we need
+		while ([networkThreads count] <= threadIndex) {
+			NSThread *newThread = [[[NSThread alloc] initWithTarget:self selector:@selector(runRequests) object:nil] autorelease];
+			[newThread setName:[NSString stringWithFormat:@"ASIHTTPRequest network thread %lu",(unsigned long)[networkThreads count]]];
+			[networkThreads addObject:newThread];
+			[newThread start];
+		}
+		thread = [networkThreads objectAtIndex:threadIndex];
+		networkThreadLoad[threadIndex]++;
+		[request setRequestThread:thread];
+		[request setNetworkThreadIndex:(NSInteger)threadIndex];
+	}
+	[networkThreadsLock unlock];
+	return thread;
+}
+
+// Called with networkThreadsLock held
++ (NSUInteger)networkThreadIndexForRequest:(ASIHTTPRequest *)request
+{
+	if (numberOfNetworkThreads < 2) {
+		return 0;
+	}
+	if (networkThreadPolicy == ASILeastLoadedNetworkThreadPolicy) {
+		NSUInteger bestIndex = 0;
+		NSUInteger i;
+		for (i=1; i<numberOfNetworkThreads; i++) {
+			if (networkThreadLoad[i] < networkThreadLoad[bestIndex]) {
+				bestIndex = i;
 			}
 		}
+		return bestIndex;
+	}
+
+	// Host affinity - requests to the same server always end up on the same thread, so they can share its persistent connections
+	NSURL *theURL = [request url];
+	NSString *scheme = [[theURL scheme] lowercaseString];
+	NSNumber *port = [theURL port];
+	if (!port) {
+		port = [NSNumber numberWithInt:([scheme isEqualToString:@"https"] ? 443 : 80)];
+	}
+	NSString *origin = [NSString stringWithFormat:@"%@://%@:%@",scheme,[[theURL host] lowercaseString],port];
+	return [origin hash] % numberOfNetworkThreads;
+}
+
+- (void)releaseNetworkThread
+{
+	[networkThreadsLock lock];
+	if ([self networkThreadIndex] >= 0) {
+		if (networkThreadLoad[[self networkThreadIndex]] > 0) {
+			networkThreadLoad[[self networkThreadIndex]]--;
+		}
+		[self setNetworkThreadIndex:-1];
+
+		// If we're asked for our thread again, we'll be given one (and counted against it) afresh
+		[self setRequestThread:nil];
+	}
+	[networkThreadsLock unlock];
+}
+
++ (NSUInteger)numberOfNetworkThreads
+{
+	[networkThreadsLock lock];
+	NSUInteger count = numberOfNetworkThreads;
+	[networkThreadsLock unlock];
+	return count;
+}
+
++ (void)setNumberOfNetworkThreads:(NSUInteger)count
+{
+	if (count < 1) {
+		count = 1;
+	} else if (count > ASIMaximumNetworkThreads) {
+		count = ASIMaximumNetworkThreads;
 	}
-	return networkThread;
+	[networkThreadsLock lock];
+	numberOfNetworkThreads = count;
+	[networkThreadsLock unlock];
+}
+
++ (ASINetworkThreadPolicy)networkThreadPolicy
+{
+	[networkThreadsLock lock];
+	ASINetworkThreadPolicy policy = networkThreadPolicy;
+	[networkThreadsLock unlock];
+	return policy;
+}
+
++ (void)setNetworkThreadPolicy:(ASINetworkThreadPolicy)policy
+{
+	[networkThreadsLock lock];
+	networkThreadPolicy = policy;
+	[networkThreadsLock unlock];
 }
 
 + (void)runRequests
@@ -5045,14 +6359,20 @@ static NSOperationQueue *sharedQueue = nil;
 @synthesize requestCookies;
 @synthesize requestCredentials;
 @synthesize responseStatusCode;
-@synthesize rawResponseData;
+@synthesize responseBuffer;
+@synthesize readBufferSize;
 @synthesize lastActivityTime;
 @synthesize timeOutSeconds;
+@synthesize progressUpdateInterval;
+@synthesize callbackMode;
+@synthesize callbackOperationQueue;
+@synthesize bandwidthClass;
 @synthesize requestMethod;
 @synthesize postBody;
-@synthesize compressedPostBody;
+@synthesize postBodyParts;
 @synthesize contentLength;
 @synthesize partialDownloadSize;
+@synthesize rangeHeaderIsForResume;
 @synthesize postLength;
 @synthesize shouldResetDownloadProgress;
 @synthesize shouldResetUploadProgress;
@@ -5068,10 +6388,22 @@ static NSOperationQueue *sharedQueue = nil;
 @synthesize userInfo;
 @synthesize tag;
 @synthesize postBodyFilePath;
-@synthesize compressedPostBodyFilePath;
 @synthesize postBodyWriteStream;
 @synthesize postBodyReadStream;
 @synthesize shouldStreamPostDataFromDisk;
+@synthesize shouldMemoryMapPostBodyFile;
+@synthesize requestBodyDigestAlgorithms;
+@synthesize responseDigestAlgorithms;
+@synthesize requestBodyDigest;
+@synthesize responseDigest;
+@synthesize shouldVerifyResponseDigest;
+@synthesize shouldVerifyDigestsAgainstETag;
+@synthesize shouldCoalesceIdenticalRequests;
+@synthesize coalescedRequests;
+@synthesize coalescingKey;
+@synthesize coalescingLeader;
+@synthesize coalescingThread;
+@synthesize coalescingPort;
 @synthesize didCreateTemporaryPostDataFile;
 @synthesize useHTTPVersionOne;
 @synthesize lastBytesRead;
@@ -5079,7 +6411,6 @@ static NSOperationQueue *sharedQueue = nil;
 @synthesize cancelledLock;
 @synthesize haveBuiltPostBody;
 @synthesize fileDownloadOutputStream;
-@synthesize inflatedFileDownloadOutputStream;
 @synthesize authenticationRetryCount;
 @synthesize proxyAuthenticationRetryCount;
 @synthesize updatedProgress;
@@ -5088,6 +6419,10 @@ static NSOperationQueue *sharedQueue = nil;
 @synthesize needsRedirect;
 @synthesize redirectCount;
 @synthesize shouldCompressRequestBody;
+@synthesize shouldPrecomputeCompressedPostLength;
+@synthesize shouldAutomaticallyCompressRequestBody;
+@synthesize requestBodyCompressionLevel;
+@synthesize requestBodyCompressionRatio;
 @synthesize proxyCredentials;
 @synthesize proxyHost;
 @synthesize proxyPort;
@@ -5104,18 +6439,21 @@ static NSOperationQueue *sharedQueue = nil;
 @synthesize inProgress;
 @synthesize numberOfTimesToRetryOnTimeout;
 @synthesize retryCount;
+@synthesize retryPolicy;
+@synthesize policyRetryCount;
 @synthesize willRetryRequest;
 @synthesize shouldAttemptPersistentConnection;
 @synthesize persistentConnectionTimeoutSeconds;
 @synthesize connectionCanBeReused;
 @synthesize connectionInfo;
+@synthesize connectionWaitThread;
 @synthesize readStream;
 @synthesize readStreamIsScheduled;
 @synthesize shouldUseRFC2616RedirectBehaviour;
 @synthesize downloadComplete;
 @synthesize requestID;
 @synthesize runLoopMode;
-@synthesize statusTimer;
+@synthesize statusTimerWheel;
 @synthesize downloadCache;
 @synthesize cachePolicy;
 @synthesize cacheStoragePolicy;
@@ -5135,4 +6473,7 @@ static NSOperationQueue *sharedQueue = nil;
 @synthesize PACFileData;
 
 @synthesize isSynchronous;
+@synthesize requestThread;
+@synthesize networkThreadIndex;
+@synthesize resumeManifest;
 @end
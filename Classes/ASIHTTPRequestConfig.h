@@ -7,6 +7,29 @@
 //
 
 
+// ======
+// Optional features
+// ======
+
+// When set to 1, ASIHTTPRequests will accept and decode brotli ('br') compressed responses
+// You'll need to add the brotli decoder (libbrotlidec and libbrotlicommon) to your project, and its headers to your header search path
+#ifndef ASI_BROTLI_SUPPORT
+	#define ASI_BROTLI_SUPPORT 0
+#endif
+
+// When set to 1, ASIDataCompressor and ASIDataDecompressor will use libdeflate to compress and inflate whole gzipped buffers in one go
+// libdeflate is much faster than zlib for this, especially when built with SSE4 / AVX2 / NEON. Data that arrives in chunks still goes through zlib
+// You'll need to add libdeflate to your project, and its headers to your header search path
+#ifndef ASI_LIBDEFLATE_SUPPORT
+	#define ASI_LIBDEFLATE_SUPPORT 0
+#endif
+
+// When set to 1, ASIHTTPRequests will accept and decode zstd compressed responses
+// You'll need to add libzstd to your project, and its headers to your header search path
+#ifndef ASI_ZSTD_SUPPORT
+	#define ASI_ZSTD_SUPPORT 0
+#endif
+
 // ======
 // Debug output configuration options
 // ======
@@ -9,18 +9,76 @@
 #import <Foundation/Foundation.h>
 
 @class ASIHTTPRequest;
+@class ASIDataCompressor;
+@class ASIDigest;
 
 // This is a wrapper for NSInputStream that pretends to be an NSInputStream itself
 // Subclassing NSInputStream seems to be tricky, and may involve overriding undocumented methods, so we'll cheat instead.
 // It is used by ASIHTTPRequest whenever we have a request body, and handles measuring and throttling the bandwidth used for uploading
+//
+// A compressed input stream gzips the request body as CFNetwork reads it, so the compressed body is never stored in memory or on disk
+// A multipart input stream sends a body made of several parts (NSData objects and files) one after another, reading each file in place
+// In both cases, the body is written into one half of a bound stream pair whenever there is room, and CFNetwork reads it from the other half
 
 @interface ASIInputStream : NSObject {
 	NSInputStream *stream;
 	ASIHTTPRequest *request;
+
+	// The pieces of the (uncompressed) request body, read in order when we are writing it into writeStream
+	NSArray *sourceStreams;
+	NSUInteger sourceStreamIndex;
+
+	// The other half of stream - we write the body here for CFNetwork to read
+	NSOutputStream *writeStream;
+
+	// Only set when we are compressing the body
+	ASIDataCompressor *compressor;
+
+	// Data waiting for room in writeStream, and how much of it we've written so far
+	NSData *pendingData;
+	NSUInteger pendingDataOffset;
+
+	// Set when we have read everything in sourceStreams
+	BOOL sourceStreamFinished;
+
+	// The number of bytes read from sourceStreams so far, and the number of bytes they turned into once compressed
+	unsigned long long uncompressedBytesRead;
+	unsigned long long compressedBytesWritten;
+
+	// Set if reading or compressing the request body failed
+	NSError *bodyError;
+
+	// When set, everything CFNetwork reads from us (ie the body as it is sent, after any compression) is added to this digest
+	ASIDigest *digest;
 }
 + (id)inputStreamWithFileAtPath:(NSString *)path request:(ASIHTTPRequest *)request;
 + (id)inputStreamWithData:(NSData *)data request:(ASIHTTPRequest *)request;
 
+// Returns a stream that reads the file through a memory mapping, so it is never copied into a buffer of its own on the way to CFNetwork
+// The file is read in the normal way instead when it isn't on a local volume, when mapping it fails,
+// or on 32-bit systems when it is bigger than 64MB (so it doesn't use up the address space). Turn on DEBUG_REQUEST_STATUS to see when this happens
+// The file must not be truncated while the request is running
++ (id)inputStreamWithMappedFileAtPath:(NSString *)path request:(ASIHTTPRequest *)request;
+
+// Returns a stream that gzips the file or data as it is read, at the request's requestBodyCompressionLevel
++ (id)compressedInputStreamWithFileAtPath:(NSString *)path request:(ASIHTTPRequest *)request;
++ (id)compressedInputStreamWithData:(NSData *)data request:(ASIHTTPRequest *)request;
+
+// Returns a stream that sends each of parts in turn - each part is either an NSData, or an NSString with the path of a file to read when we get to it
+// Pass a nil request to read the body without measuring or throttling bandwidth (eg to work out how big it is once compressed)
++ (id)inputStreamWithParts:(NSArray *)parts request:(ASIHTTPRequest *)request;
+
+// As above, but gzips the parts as they are read
++ (id)compressedInputStreamWithParts:(NSArray *)parts request:(ASIHTTPRequest *)request;
+
+// For compressed input streams, the number of bytes of the uncompressed request body compressed so far
+// This runs slightly ahead of what has actually been sent, by however much compressed data is waiting to be read
+- (unsigned long long)uncompressedBytesRead;
+
+// For compressed input streams, the size of the compressed data produced so far
+- (unsigned long long)compressedBytesWritten;
+
 @property (retain, nonatomic) NSInputStream *stream;
 @property (assign, nonatomic) ASIHTTPRequest *request;
+@property (retain, nonatomic) ASIDigest *digest;
 @end
@@ -8,18 +8,31 @@
 
 #import "ASIInputStream.h"
 #import "ASIHTTPRequest.h"
+#import "ASIBandwidthClass.h"
+#import "ASIDataCompressor.h"
+#import "ASIDigest.h"
+#import <sys/param.h>
+#import <sys/mount.h>
 
-// Used to ensure only one request can read data at once
-static NSLock *readLock = nil;
+// The size of the buffer between a compressed or multipart input stream and CFNetwork
+#define BOUND_STREAM_BUFFER_SIZE 65536
 
-@implementation ASIInputStream
+// We read (and compress) the body from its source streams this much at a time
+#define BODY_CHUNK_SIZE 32768
 
-+ (void)initialize
-{
-	if (self == [ASIInputStream class]) {
-		readLock = [[NSLock alloc] init];
-	}
-}
+// On 32-bit systems, mapping a large file could use up the address space, so we read files bigger than this in the normal way
+#if !__LP64__
+	#define MAXIMUM_MAPPED_FILE_SIZE (64*1024*1024)
+#endif
+
+@interface ASIInputStream ()
++ (id)inputStreamWithSourceStreams:(NSArray *)sources compress:(BOOL)shouldCompress request:(ASIHTTPRequest *)theRequest;
++ (NSArray *)sourceStreamsForParts:(NSArray *)parts;
+- (void)writeBodyData;
+- (void)stopWritingBodyWithError:(NSError *)theError;
+@end
+
+@implementation ASIInputStream
 
 + (id)inputStreamWithFileAtPath:(NSString *)path request:(ASIHTTPRequest *)theRequest
 {
@@ -37,34 +50,268 @@ static NSLock *readLock = nil;
 	return theStream;
 }
 
++ (id)inputStreamWithMappedFileAtPath:(NSString *)path request:(ASIHTTPRequest *)theRequest
+{
+	// NSDataReadingMappedIfSafe quietly reads the whole file into memory when it decides mapping isn't safe, so we check for ourselves and insist on a mapping
+	// A file on a network volume could go away underneath the mapping, and we'd crash reading it
+	NSString *reason = nil;
+	struct statfs fileSystem;
+	if (statfs([path fileSystemRepresentation], &fileSystem) != 0 || !(fileSystem.f_flags & MNT_LOCAL)) {
+		reason = @"it isn't on a local volume";
+	}
+#if !__LP64__
+	if (!reason) {
+		unsigned long long fileSize = [[[[[NSFileManager alloc] init] autorelease] attributesOfItemAtPath:path error:NULL] fileSize];
+		if (fileSize > MAXIMUM_MAPPED_FILE_SIZE) {
+			reason = @"it is too big to map on a 32-bit system";
+		}
+	}
+#endif
+	NSData *mappedData = nil;
+	if (!reason) {
+		mappedData = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedAlways error:NULL];
+		if (!mappedData) {
+			reason = @"mapping it failed";
+		}
+	}
+	if (reason) {
+		#if DEBUG_REQUEST_STATUS
+		ASI_DEBUG_LOG(@"[STATUS] Reading %@ without a memory mapping, because %@",path,reason);
+		#endif
+		return [self inputStreamWithFileAtPath:path request:theRequest];
+	}
+	return [self inputStreamWithData:mappedData request:theRequest];
+}
+
++ (id)compressedInputStreamWithFileAtPath:(NSString *)path request:(ASIHTTPRequest *)theRequest
+{
+	return [self inputStreamWithSourceStreams:[NSArray arrayWithObject:[NSInputStream inputStreamWithFileAtPath:path]] compress:YES request:theRequest];
+}
+
++ (id)compressedInputStreamWithData:(NSData *)data request:(ASIHTTPRequest *)theRequest
+{
+	return [self inputStreamWithSourceStreams:[NSArray arrayWithObject:[NSInputStream inputStreamWithData:data]] compress:YES request:theRequest];
+}
+
++ (id)inputStreamWithParts:(NSArray *)parts request:(ASIHTTPRequest *)theRequest
+{
+	return [self inputStreamWithSourceStreams:[self sourceStreamsForParts:parts] compress:NO request:theRequest];
+}
+
++ (id)compressedInputStreamWithParts:(NSArray *)parts request:(ASIHTTPRequest *)theRequest
+{
+	return [self inputStreamWithSourceStreams:[self sourceStreamsForParts:parts] compress:YES request:theRequest];
+}
+
++ (NSArray *)sourceStreamsForParts:(NSArray *)parts
+{
+	NSMutableArray *sources = [NSMutableArray arrayWithCapacity:[parts count]];
+	for (id part in parts) {
+		if ([part isKindOfClass:[NSString class]]) {
+			[sources addObject:[NSInputStream inputStreamWithFileAtPath:part]];
+		} else {
+			[sources addObject:[NSInputStream inputStreamWithData:part]];
+		}
+	}
+	return sources;
+}
+
++ (id)inputStreamWithSourceStreams:(NSArray *)sources compress:(BOOL)shouldCompress request:(ASIHTTPRequest *)theRequest
+{
+	CFReadStreamRef boundReadStream = NULL;
+	CFWriteStreamRef boundWriteStream = NULL;
+	CFStreamCreateBoundPair(kCFAllocatorDefault, &boundReadStream, &boundWriteStream, BOUND_STREAM_BUFFER_SIZE);
+	if (!boundReadStream || !boundWriteStream) {
+		if (boundReadStream) {
+			CFRelease(boundReadStream);
+		}
+		if (boundWriteStream) {
+			CFRelease(boundWriteStream);
+		}
+		return nil;
+	}
+	ASIInputStream *theStream = [[[self alloc] init] autorelease];
+	[theStream setRequest:theRequest];
+	[theStream setStream:[NSMakeCollectable(boundReadStream) autorelease]];
+	theStream->writeStream = (NSOutputStream *)boundWriteStream;
+	[theStream->writeStream setDelegate:theStream];
+	theStream->sourceStreams = [sources retain];
+	theStream->sourceStreamFinished = ([sources count] == 0);
+	if (shouldCompress) {
+		theStream->compressor = [[ASIDataCompressor compressorWithLevel:[theRequest requestBodyCompressionLevel]] retain];
+	}
+	return theStream;
+}
+
 - (void)dealloc
 {
+	[writeStream setDelegate:nil];
+	[writeStream close];
+	[writeStream release];
+	for (NSInputStream *sourceStream in sourceStreams) {
+		[sourceStream close];
+	}
+	[sourceStreams release];
+	[compressor release];
+	[pendingData release];
+	[bodyError release];
+	[digest release];
 	[stream release];
 	[super dealloc];
 }
 
+#pragma mark writing the body
+
+// Reads (and compresses) as much of the request body as there is room for in writeStream, moving on to the next source stream when each one runs out
+// Called when we are opened, and every time CFNetwork reads from us, so the body keeps flowing even though CFNetwork only schedules stream
+// (It schedules us through private methods that are forwarded to stream, so writeStream never gets space available events of its own)
+- (void)writeBodyData
+{
+	if (!writeStream || bodyError) {
+		return;
+	}
+	while ([writeStream hasSpaceAvailable]) {
+		if (!pendingData) {
+			// Once everything has been written, closing our end tells CFNetwork it has reached the end of the body
+			if (sourceStreamFinished) {
+				[writeStream setDelegate:nil];
+				[writeStream close];
+				[writeStream release];
+				writeStream = nil;
+				return;
+			}
+			NSInputStream *sourceStream = [sourceStreams objectAtIndex:sourceStreamIndex];
+			uint8_t buffer[BODY_CHUNK_SIZE];
+			NSInteger readLength = [sourceStream read:buffer maxLength:BODY_CHUNK_SIZE];
+			if (readLength < 0 || [sourceStream streamStatus] == NSStreamStatusError) {
+				if (compressor) {
+					[self stopWritingBodyWithError:[NSError errorWithDomain:NetworkRequestErrorDomain code:ASICompressionError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:@"Compression of the request body failed because we were unable to read it",NSLocalizedDescriptionKey,[sourceStream streamError],NSUnderlyingErrorKey,nil]]];
+				} else {
+					[self stopWritingBodyWithError:[NSError errorWithDomain:NetworkRequestErrorDomain code:ASIFileManagementError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:@"Failed to read part of the request body",NSLocalizedDescriptionKey,[sourceStream streamError],NSUnderlyingErrorKey,nil]]];
+				}
+				return;
+			}
+			if (readLength == 0) {
+				[sourceStream close];
+				sourceStreamIndex++;
+				if (sourceStreamIndex < [sourceStreams count]) {
+					[[sourceStreams objectAtIndex:sourceStreamIndex] open];
+					continue;
+				}
+				sourceStreamFinished = YES;
+			}
+			uncompressedBytesRead += (unsigned long long)readLength;
+
+			NSData *data;
+			if (compressor) {
+				NSError *theError = nil;
+				data = [compressor compressBytes:buffer length:(NSUInteger)readLength error:&theError shouldFinish:sourceStreamFinished];
+				if (theError) {
+					[self stopWritingBodyWithError:theError];
+					return;
+				}
+			} else {
+				data = [NSData dataWithBytes:buffer length:(NSUInteger)readLength];
+			}
+			if (![data length]) {
+				continue;
+			}
+			pendingData = [data retain];
+			pendingDataOffset = 0;
+			compressedBytesWritten += [data length];
+		}
+		NSInteger written = [writeStream write:(const uint8_t *)[pendingData bytes]+pendingDataOffset maxLength:[pendingData length]-pendingDataOffset];
+		if (written <= 0) {
+			[self stopWritingBodyWithError:[NSError errorWithDomain:NetworkRequestErrorDomain code:(compressor ? ASICompressionError : ASIInternalErrorWhileBuildingRequestType) userInfo:[NSDictionary dictionaryWithObjectsAndKeys:@"Unable to pass the request body on to be sent",NSLocalizedDescriptionKey,[writeStream streamError],NSUnderlyingErrorKey,nil]]];
+			return;
+		}
+		pendingDataOffset += (NSUInteger)written;
+		if (pendingDataOffset == [pendingData length]) {
+			[pendingData release];
+			pendingData = nil;
+		}
+	}
+}
+
+// We report the error from read:maxLength: / streamStatus / streamError, so CFNetwork fails the request rather than sending a truncated body
+- (void)stopWritingBodyWithError:(NSError *)theError
+{
+	bodyError = [theError retain];
+	[writeStream setDelegate:nil];
+	[writeStream close];
+	[writeStream release];
+	writeStream = nil;
+}
+
+- (void)stream:(NSStream *)theStream handleEvent:(NSStreamEvent)eventCode
+{
+	if (eventCode == NSStreamEventHasSpaceAvailable) {
+		[self writeBodyData];
+	}
+}
+
+- (unsigned long long)uncompressedBytesRead
+{
+	return uncompressedBytesRead;
+}
+
+- (unsigned long long)compressedBytesWritten
+{
+	return compressedBytesWritten;
+}
+
+#pragma mark reading
+
 // Called when CFNetwork wants to read more of our request body
-// When throttling is on, we ask ASIHTTPRequest for the maximum amount of data we can read
+// When throttling is on, we ask the request's bandwidth class for the maximum amount of data we can read
+// The bandwidth allowance is shared without a lock, so several requests can read at once
 - (NSInteger)read:(uint8_t *)buffer maxLength:(NSUInteger)len
 {
-	[readLock lock];
-	unsigned long toRead = len;
-	if ([ASIHTTPRequest isBandwidthThrottled]) {
-		toRead = [ASIHTTPRequest maxUploadReadLength];
-		if (toRead > len) {
-			toRead = len;
-		} else if (toRead == 0) {
-			toRead = 1;
+	if (bodyError) {
+		return -1;
+	}
+	if (writeStream && ![stream hasBytesAvailable]) {
+		[self writeBodyData];
+	}
+	NSUInteger toRead = len;
+	ASIBandwidthClass *bandwidthClass = [request effectiveBandwidthClass];
+	if ([bandwidthClass isThrottled]) {
+		long long available = [bandwidthClass availableBytes];
+		if (available < (long long)len) {
+			toRead = (available > 0 ? (NSUInteger)available : 1);
 		}
 		[request performThrottling];
 	}
-	[readLock unlock];
 	NSInteger rv = [stream read:buffer maxLength:toRead];
-	if (rv > 0)
-		[ASIHTTPRequest incrementBandwidthUsedInLastSecond:(NSUInteger)rv];
+	if (rv > 0) {
+		[request incrementBandwidthUsedBy:(unsigned long)rv];
+		[digest updateWithBytes:buffer length:(NSUInteger)rv];
+	}
+
+	// Refill the space we just made, so stream tells CFNetwork there is more to read
+	if (writeStream) {
+		[self writeBodyData];
+	}
 	return rv;
 }
 
+// Lets CFNetwork send the body straight out of our stream's buffer (eg a memory mapped file) rather than reading a copy of it
+// Throttled requests don't allow this, because we can't limit how much CFNetwork takes at once, and nor do requests that are hashing their body
+// The bytes we hand over count as read, so we count them towards bandwidth used here, as read:maxLength: does
+- (BOOL)getBuffer:(uint8_t **)buffer length:(NSUInteger *)len
+{
+	if (sourceStreams || bodyError || digest || [[request effectiveBandwidthClass] isThrottled]) {
+		return NO;
+	}
+	if (![stream getBuffer:buffer length:len]) {
+		return NO;
+	}
+	if (*len > 0) {
+		[request incrementBandwidthUsedBy:(unsigned long)*len];
+	}
+	return YES;
+}
+
 /*
  * Implement NSInputStream mandatory methods to make sure they are implemented
  * (necessary for MacRuby for example) and avoid the overhead of method
@@ -73,13 +320,35 @@ static NSLock *readLock = nil;
 - (void)open
 {
     [stream open];
+	if (writeStream) {
+		if ([sourceStreams count]) {
+			[[sourceStreams objectAtIndex:0] open];
+		}
+		[writeStream open];
+		[self writeBodyData];
+	}
 }
 
 - (void)close
 {
+	[writeStream setDelegate:nil];
+	[writeStream close];
+	[writeStream release];
+	writeStream = nil;
+	for (NSInputStream *sourceStream in sourceStreams) {
+		[sourceStream close];
+	}
     [stream close];
 }
 
+- (BOOL)hasBytesAvailable
+{
+	if (writeStream && ![stream hasBytesAvailable]) {
+		[self writeBodyData];
+	}
+	return [stream hasBytesAvailable];
+}
+
 - (id)delegate
 {
     return [stream delegate];
@@ -93,11 +362,13 @@ static NSLock *readLock = nil;
 - (void)scheduleInRunLoop:(NSRunLoop *)aRunLoop forMode:(NSString *)mode
 {
     [stream scheduleInRunLoop:aRunLoop forMode:mode];
+	[writeStream scheduleInRunLoop:aRunLoop forMode:mode];
 }
 
 - (void)removeFromRunLoop:(NSRunLoop *)aRunLoop forMode:(NSString *)mode
 {
     [stream removeFromRunLoop:aRunLoop forMode:mode];
+	[writeStream removeFromRunLoop:aRunLoop forMode:mode];
 }
 
 - (id)propertyForKey:(NSString *)key
@@ -112,11 +383,17 @@ static NSLock *readLock = nil;
 
 - (NSStreamStatus)streamStatus
 {
+	if (bodyError) {
+		return NSStreamStatusError;
+	}
     return [stream streamStatus];
 }
 
 - (NSError *)streamError
 {
+	if (bodyError) {
+		return bodyError;
+	}
     return [stream streamError];
 }
 
@@ -135,4 +412,5 @@ static NSLock *readLock = nil;
 
 @synthesize stream;
 @synthesize request;
+@synthesize digest;
 @end
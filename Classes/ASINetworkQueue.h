@@ -9,6 +9,13 @@
 #import <Foundation/Foundation.h>
 #import "ASIHTTPRequestDelegate.h"
 #import "ASIProgressDelegate.h"
+#import "ASIHTTPRequest.h"
+
+@class ASIConcurrencyLimiter;
+@class ASIRetryPolicy;
+
+// By default, a request that has waited this many seconds to start is treated as if its queuePriority were one level higher
+#define ASINetworkQueueDefaultPriorityAgingInterval 5
 
 @interface ASINetworkQueue : NSOperationQueue <ASIProgressDelegate, ASIHTTPRequestDelegate, NSCopying> {
 	
@@ -69,7 +76,90 @@
 
 	// Storage container for additional queue information.
 	NSDictionary *userInfo;
-	
+
+	// Requests in the queue each pass on progress at most once every progressUpdateInterval seconds, so a busy queue may hear about progress many times in that period
+	// We update our progress indicators at most once every progressUpdateInterval seconds, or straight away when everything has been sent or received
+	// Default is [ASIHTTPRequest defaultProgressUpdateInterval]
+	NSTimeInterval progressUpdateInterval;
+
+	// The monotonic times we last updated our progress indicators (see ASIMonotonicTime in ASITimerWheel.h)
+	NSTimeInterval lastUploadProgressUpdate;
+	NSTimeInterval lastDownloadProgressUpdate;
+
+	// YES when we have held back an update to a progress indicator, and will update it shortly
+	BOOL uploadProgressUpdateScheduled;
+	BOOL downloadProgressUpdateScheduled;
+
+	// Where requests added to this queue deliver their callbacks, unless they have been told otherwise (see ASICallbackMode in ASIHTTPRequest.h)
+	// The queue's own delegate methods are called from there too
+	// The queue expects to be called back by one request at a time, so use a serial dispatch queue or an operation queue with a maxConcurrentOperationCount of 1
+	// ASINetworkThreadCallbackMode is only safe for a queue when requests run on a single network thread
+	ASICallbackMode callbackMode;
+	NSOperationQueue *callbackOperationQueue;
+	#if NS_BLOCKS_AVAILABLE
+	dispatch_queue_t callbackDispatchQueue;
+	#endif
+
+	// The bandwidth class requests added to this queue are counted against, unless they already have one (see ASIBandwidthClass.h)
+	// When nil (the default), requests only count against the global class
+	ASIBandwidthClass *bandwidthClass;
+
+	// When YES, requests added to this queue are counted against a child of bandwidthClass named after their host
+	// so each host gets its own share of the queue's bandwidth. Use [[queue bandwidthClass] childWithName:host] to give a host its own limit or weight
+	// Default is NO
+	BOOL shouldShareBandwidthByHost;
+
+	// The retry policy given to requests added to this queue, unless they already have one (see ASIRetryPolicy.h)
+	// Requests in the queue share the policy's retry budget. Default is nil
+	ASIRetryPolicy *retryPolicy;
+
+	// When YES, the queue decides which request to start next itself, instead of leaving it to NSOperationQueue:
+	// - Requests with a higher queuePriority start first. HEAD requests used for showAccurateProgress are NSOperationQueuePriorityVeryHigh
+	// - A request that has waited priorityAgingInterval seconds is treated as one priority level higher, and so on, so low priority requests can't be held back forever
+	// - A request won't start while its host already has maxConcurrentRequestsPerHost requests running, so one slow server can't take every slot
+	// - Of requests with the same priority, those to a server that has an idle persistent connection start first (see ASIConnectionPool.h)
+	// maxConcurrentOperationCount still limits the total number of requests running
+	// Requests only start once their dependencies have finished. We look for requests to start when one of our own requests finishes, so dependencies on operations in other queues may hold a request up until then
+	// Set this before adding requests. Default is NO
+	BOOL shouldScheduleRequests;
+
+	// The most requests to a single host we run at once when shouldScheduleRequests is YES. 0 (the default) means no limit
+	NSUInteger maxConcurrentRequestsPerHost;
+
+	// How long a request waits before it is treated as one priority level higher. 0 turns aging off
+	// Default is ASINetworkQueueDefaultPriorityAgingInterval
+	NSTimeInterval priorityAgingInterval;
+
+	// Requests waiting to be started by the scheduler, oldest first (see ASIScheduledRequest in ASINetworkQueue.m)
+	NSMutableArray *scheduledRequests;
+
+	// Requests the scheduler has started that haven't finished yet
+	NSMutableArray *runningScheduledRequests;
+
+	// The number of requests in runningScheduledRequests for each host
+	NSMutableDictionary *runningRequestsPerHost;
+
+	// Mediates access to the scheduler's lists - requests finish on their network threads
+	NSRecursiveLock *schedulerLock;
+
+	// When YES, the queue works out how many requests to run at once from how quickly responses arrive (see ASIConcurrencyLimiter.h)
+	// maxConcurrentOperationCount is still the most we will run, so set it higher than you would otherwise if you want the queue to be able to use more connections
+	// Requests are scheduled as described above even if shouldScheduleRequests is NO. Default is NO
+	BOOL shouldAdaptConcurrency;
+
+	// When YES, each host also gets its own limit worked out from how quickly it responds, as well as maxConcurrentRequestsPerHost (if set)
+	// Requests are scheduled as described above even if shouldScheduleRequests is NO. Default is NO
+	BOOL shouldAdaptConcurrencyPerHost;
+
+	// Works out the queue's limit when shouldAdaptConcurrency is YES
+	ASIConcurrencyLimiter *concurrencyLimiter;
+
+	// Limiters for each host when shouldAdaptConcurrencyPerHost is YES, keyed by lowercased host
+	NSMutableDictionary *hostConcurrencyLimiters;
+
+	// The monotonic time each running request started (or last restarted, eg after a redirect), keyed by request
+	// Used to measure how long responses take when adapting concurrency
+	NSMutableDictionary *requestStartTimes;
 }
 
 // Convenience constructor
@@ -85,6 +175,19 @@
 // This method will start the queue
 - (void)go;
 
+// The limiter for host used when shouldAdaptConcurrencyPerHost is YES, created if it doesn't exist yet
+// Use this to set a host's minimum or maximum limit, or to read its limit and response times for monitoring
+- (ASIConcurrencyLimiter *)concurrencyLimiterForHost:(NSString *)host;
+
+// The limiters for every host we've seen a response from so far, keyed by lowercased host
+- (NSDictionary *)hostConcurrencyLimiters;
+
+#if NS_BLOCKS_AVAILABLE
+// The queue requests deliver their callbacks on when callbackMode is ASIDispatchQueueCallbackMode (retained by the queue)
+- (dispatch_queue_t)callbackDispatchQueue;
+- (void)setCallbackDispatchQueue:(dispatch_queue_t)newQueue;
+#endif
+
 @property (assign, nonatomic, setter=setUploadProgressDelegate:) id uploadProgressDelegate;
 @property (assign, nonatomic, setter=setDownloadProgressDelegate:) id downloadProgressDelegate;
 
@@ -99,6 +202,18 @@
 @property (assign, atomic) BOOL showAccurateProgress;
 @property (assign, atomic, readonly) int requestsCount;
 @property (retain, atomic) NSDictionary *userInfo;
+@property (assign, atomic) NSTimeInterval progressUpdateInterval;
+@property (assign, atomic) ASICallbackMode callbackMode;
+@property (retain, atomic) NSOperationQueue *callbackOperationQueue;
+@property (retain, atomic) ASIBandwidthClass *bandwidthClass;
+@property (assign, atomic) BOOL shouldShareBandwidthByHost;
+@property (retain, atomic) ASIRetryPolicy *retryPolicy;
+@property (assign, atomic) BOOL shouldScheduleRequests;
+@property (assign, atomic) NSUInteger maxConcurrentRequestsPerHost;
+@property (assign, atomic) NSTimeInterval priorityAgingInterval;
+@property (assign, atomic) BOOL shouldAdaptConcurrency;
+@property (assign, atomic) BOOL shouldAdaptConcurrencyPerHost;
+@property (retain, atomic, readonly) ASIConcurrencyLimiter *concurrencyLimiter;
 
 @property (assign, atomic) unsigned long long bytesUploadedSoFar;
 @property (assign, atomic) unsigned long long totalBytesToUpload;
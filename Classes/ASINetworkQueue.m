@@ -8,10 +8,58 @@
 
 #import "ASINetworkQueue.h"
 #import "ASIHTTPRequest.h"
+#import "ASITimerWheel.h"
+#import "ASIBandwidthClass.h"
+#import "ASIConnectionPool.h"
+#import "ASIConcurrencyLimiter.h"
+#import "ASIRetryPolicy.h"
+
+// Used to recognise isFinished notifications from requests the scheduler started
+static void *ASIScheduledRequestContext = &ASIScheduledRequestContext;
+
+// A request waiting to be started by the scheduler, or one it has started
+@interface ASIScheduledRequest : NSObject {
+@public
+	ASIHTTPRequest *request;
+
+	// The lowercased host the request is counted against for maxConcurrentRequestsPerHost (nil for urls without one)
+	NSString *host;
+
+	// The monotonic time the request was added to the queue
+	NSTimeInterval addedAt;
+}
+@end
+
+@implementation ASIScheduledRequest
+
+- (void)dealloc
+{
+	[request release];
+	[host release];
+	[super dealloc];
+}
+
+@end
 
 // Private stuff
 @interface ASINetworkQueue ()
 	- (void)resetProgressDelegate:(id *)progressDelegate;
+	- (void)scheduleUploadProgressUpdate;
+	- (void)scheduleDownloadProgressUpdate;
+	- (void)updateUploadProgressIndicator;
+	- (void)updateDownloadProgressIndicator;
+	- (void)applyCallbackSettingsToRequest:(ASIHTTPRequest *)request;
+	- (void)applyBandwidthClassToRequest:(ASIHTTPRequest *)request;
+	- (void)applyRetryPolicyToRequest:(ASIHTTPRequest *)request;
+	- (void)scheduleRequest:(ASIHTTPRequest *)request;
+	- (void)startScheduledRequests;
+	- (ASIScheduledRequest *)nextScheduledRequest;
+	- (void)scheduledRequestFinished:(ASIHTTPRequest *)request;
+	- (ASIScheduledRequest *)runningScheduledRequestForRequest:(ASIHTTPRequest *)request;
+	- (BOOL)isSchedulingRequests;
+	- (BOOL)isAdaptingConcurrency;
+	- (void)recordResponseTimeForRequest:(ASIHTTPRequest *)request;
+	@property (retain, atomic, readwrite) ASIConcurrencyLimiter *concurrencyLimiter;
 	@property (assign) int requestsCount;
 @end
 
@@ -22,6 +70,15 @@
 	self = [super init];
 	[self setShouldCancelAllRequestsOnFailure:YES];
 	[self setMaxConcurrentOperationCount:4];
+	[self setProgressUpdateInterval:[ASIHTTPRequest defaultProgressUpdateInterval]];
+	[self setPriorityAgingInterval:ASINetworkQueueDefaultPriorityAgingInterval];
+	scheduledRequests = [[NSMutableArray alloc] init];
+	runningScheduledRequests = [[NSMutableArray alloc] init];
+	runningRequestsPerHost = [[NSMutableDictionary alloc] init];
+	schedulerLock = [[NSRecursiveLock alloc] init];
+	[self setConcurrencyLimiter:[ASIConcurrencyLimiter limiter]];
+	hostConcurrencyLimiters = [[NSMutableDictionary alloc] init];
+	requestStartTimes = [[NSMutableDictionary alloc] init];
 	[self setSuspended:YES];
 	
 	return self;
@@ -38,13 +95,34 @@
 	for (ASIHTTPRequest *request in [self operations]) {
 		[request setQueue:nil];
 	}
+	for (ASIScheduledRequest *scheduledRequest in runningScheduledRequests) {
+		[scheduledRequest->request removeObserver:self forKeyPath:@"isFinished"];
+	}
+	[scheduledRequests release];
+	[runningScheduledRequests release];
+	[runningRequestsPerHost release];
+	[schedulerLock release];
+	[concurrencyLimiter release];
+	[hostConcurrencyLimiters release];
+	[requestStartTimes release];
 	[userInfo release];
+	[callbackOperationQueue release];
+	[bandwidthClass release];
+	[retryPolicy release];
+	#if NS_BLOCKS_AVAILABLE
+	if (callbackDispatchQueue) {
+		dispatch_release(callbackDispatchQueue);
+	}
+	#endif
 	[super dealloc];
 }
 
 - (void)setSuspended:(BOOL)suspend
 {
 	[super setSuspended:suspend];
+	if (!suspend) {
+		[self startScheduledRequests];
+	}
 }
 
 - (void)reset
@@ -73,9 +151,53 @@
 	[self setTotalBytesToUpload:0];
 	[self setBytesDownloadedSoFar:0];
 	[self setTotalBytesToDownload:0];
+
+	// Requests the scheduler hasn't started yet are handed to NSOperationQueue to be cancelled like any other request that hasn't started
+	[schedulerLock lock];
+	NSArray *waitingRequests = [[scheduledRequests copy] autorelease];
+	[scheduledRequests removeAllObjects];
+	[schedulerLock unlock];
+	for (ASIScheduledRequest *scheduledRequest in waitingRequests) {
+		[super addOperation:scheduledRequest->request];
+	}
 	[super cancelAllOperations];
 }
 
+// Include requests the scheduler hasn't started yet
+- (NSArray *)operations
+{
+	[schedulerLock lock];
+	NSMutableArray *operations = [NSMutableArray arrayWithArray:[super operations]];
+	for (ASIScheduledRequest *scheduledRequest in scheduledRequests) {
+		[operations addObject:scheduledRequest->request];
+	}
+	[schedulerLock unlock];
+	return operations;
+}
+
+- (NSUInteger)operationCount
+{
+	[schedulerLock lock];
+	NSUInteger count = [super operationCount]+[scheduledRequests count];
+	[schedulerLock unlock];
+	return count;
+}
+
+- (void)waitUntilAllOperationsAreFinished
+{
+	while (1) {
+		[super waitUntilAllOperationsAreFinished];
+		[schedulerLock lock];
+		NSUInteger waiting = [scheduledRequests count];
+		[schedulerLock unlock];
+		if (!waiting) {
+			break;
+		}
+		// The scheduler starts more requests as others finish, so we should only get here briefly (or if the queue is suspended)
+		[NSThread sleepForTimeInterval:0.01];
+	}
+}
+
 - (void)setUploadProgressDelegate:(id)newDelegate
 {
 	uploadProgressDelegate = newDelegate;
@@ -118,12 +240,15 @@
 		
 		ASIHTTPRequest *request = (ASIHTTPRequest *)operation;
 		[request setRequestMethod:@"HEAD"];
-		[request setQueuePriority:10];
+		[request setQueuePriority:NSOperationQueuePriorityVeryHigh];
 		[request setShowAccurateProgress:YES];
 		[request setQueue:self];
+		[self applyCallbackSettingsToRequest:request];
+		[self applyBandwidthClassToRequest:request];
+		[self applyRetryPolicyToRequest:request];
 		
-		// Important - we are calling NSOperation's add method - we don't want to add this as a normal request!
-		[super addOperation:request];
+		// Important - we don't want to add this as a normal request!
+		[self scheduleRequest:request];
 	}
 }
 
@@ -175,12 +300,309 @@
 	[request setShowAccurateProgress:[self showAccurateProgress]];
 	
 	[request setQueue:self];
-	[super addOperation:request];
+	[self applyCallbackSettingsToRequest:request];
+	[self applyBandwidthClassToRequest:request];
+	[self applyRetryPolicyToRequest:request];
+	[self scheduleRequest:request];
+
+}
+
+- (void)applyCallbackSettingsToRequest:(ASIHTTPRequest *)request
+{
+	// Requests that have been given somewhere else to call back keep it
+	if ([self callbackMode] == ASIMainThreadCallbackMode || [request callbackMode] != ASIMainThreadCallbackMode) {
+		return;
+	}
+	[request setCallbackMode:[self callbackMode]];
+	[request setCallbackOperationQueue:[self callbackOperationQueue]];
+	#if NS_BLOCKS_AVAILABLE
+	[request setCallbackDispatchQueue:[self callbackDispatchQueue]];
+	#endif
+}
+
+- (void)applyBandwidthClassToRequest:(ASIHTTPRequest *)request
+{
+	// Requests that have been given a bandwidth class keep it
+	if ([request bandwidthClass] || (![self bandwidthClass] && ![self shouldShareBandwidthByHost])) {
+		return;
+	}
+	ASIBandwidthClass *theClass = [self bandwidthClass];
+	if (!theClass) {
+		theClass = [ASIBandwidthClass globalBandwidthClass];
+	}
+	NSString *host = [[[request url] host] lowercaseString];
+	if ([self shouldShareBandwidthByHost] && host) {
+		theClass = [theClass childWithName:host];
+	}
+	[request setBandwidthClass:theClass];
+}
+
+- (void)applyRetryPolicyToRequest:(ASIHTTPRequest *)request
+{
+	// Requests that have been given a retry policy keep it
+	if (![request retryPolicy]) {
+		[request setRetryPolicy:[self retryPolicy]];
+	}
+}
+
+#pragma mark scheduling
+
+- (BOOL)isSchedulingRequests
+{
+	return ([self shouldScheduleRequests] || [self isAdaptingConcurrency]);
+}
+
+- (BOOL)isAdaptingConcurrency
+{
+	return ([self shouldAdaptConcurrency] || [self shouldAdaptConcurrencyPerHost]);
+}
+
+- (void)scheduleRequest:(ASIHTTPRequest *)request
+{
+	if (![self isSchedulingRequests]) {
+		[super addOperation:request];
+		return;
+	}
+	ASIScheduledRequest *scheduledRequest = [[[ASIScheduledRequest alloc] init] autorelease];
+	scheduledRequest->request = [request retain];
+	scheduledRequest->host = [[[[request url] host] lowercaseString] retain];
+	scheduledRequest->addedAt = ASIMonotonicTime();
+	[schedulerLock lock];
+	[scheduledRequests addObject:scheduledRequest];
+	[schedulerLock unlock];
+	[self startScheduledRequests];
+}
+
+// Starts as many waiting requests as we are allowed to run
+// Requests are handed to NSOperationQueue once we've let go of schedulerLock, as NSOperationQueue has locks of its own
+- (void)startScheduledRequests
+{
+	NSMutableArray *requestsToStart = [NSMutableArray array];
+	[schedulerLock lock];
+	while ([scheduledRequests count] && ![self isSuspended]) {
+		NSInteger maxCount = [self maxConcurrentOperationCount];
+		if (maxCount != NSOperationQueueDefaultMaxConcurrentOperationCount && [runningScheduledRequests count] >= (NSUInteger)maxCount) {
+			break;
+		}
+		if ([self shouldAdaptConcurrency] && [runningScheduledRequests count] >= [[self concurrencyLimiter] limit]) {
+			break;
+		}
+		ASIScheduledRequest *scheduledRequest = [self nextScheduledRequest];
+		if (!scheduledRequest) {
+			break;
+		}
+		[runningScheduledRequests addObject:scheduledRequest];
+		[scheduledRequests removeObjectIdenticalTo:scheduledRequest];
+		if (scheduledRequest->host) {
+			NSUInteger running = [[runningRequestsPerHost objectForKey:scheduledRequest->host] unsignedIntegerValue];
+			[runningRequestsPerHost setObject:[NSNumber numberWithUnsignedInteger:running+1] forKey:scheduledRequest->host];
+		}
+		[scheduledRequest->request addObserver:self forKeyPath:@"isFinished" options:0 context:ASIScheduledRequestContext];
+		[requestsToStart addObject:scheduledRequest->request];
+	}
+	[schedulerLock unlock];
+	for (ASIHTTPRequest *request in requestsToStart) {
+		[super addOperation:request];
+	}
+}
+
+// Returns the waiting request that should start next, or nil if none of them can start yet
+- (ASIScheduledRequest *)nextScheduledRequest
+{
+	NSTimeInterval now = ASIMonotonicTime();
+	NSTimeInterval agingInterval = [self priorityAgingInterval];
+	NSUInteger maxPerHost = [self maxConcurrentRequestsPerHost];
+	BOOL adaptPerHost = [self shouldAdaptConcurrencyPerHost];
+	NSMutableDictionary *warmHosts = [NSMutableDictionary dictionary];
+
+	ASIScheduledRequest *bestRequest = nil;
+	NSInteger bestLevel = 0;
+	BOOL bestIsWarm = NO;
+
+	// scheduledRequests is oldest first, so we only replace bestRequest with a request that is strictly better
+	for (ASIScheduledRequest *scheduledRequest in scheduledRequests) {
+		ASIHTTPRequest *request = scheduledRequest->request;
+
+		BOOL waitingForDependency = NO;
+		for (NSOperation *dependency in [request dependencies]) {
+			if (![dependency isFinished]) {
+				waitingForDependency = YES;
+				break;
+			}
+		}
+		if (waitingForDependency) {
+			continue;
+		}
+		if (scheduledRequest->host) {
+			NSUInteger hostLimit = maxPerHost;
+			if (adaptPerHost) {
+				NSUInteger adaptiveLimit = [[self concurrencyLimiterForHost:scheduledRequest->host] limit];
+				hostLimit = (hostLimit ? MIN(hostLimit, adaptiveLimit) : adaptiveLimit);
+			}
+			if (hostLimit && [[runningRequestsPerHost objectForKey:scheduledRequest->host] unsignedIntegerValue] >= hostLimit) {
+				continue;
+			}
+		}
+
+		// NSOperationQueuePriorityVeryLow (-8) to NSOperationQueuePriorityVeryHigh (8) become levels 0 to 4
+		NSInteger level = ([request queuePriority]-NSOperationQueuePriorityVeryLow)/4;
+		if (agingInterval > 0) {
+			level += (NSInteger)((now-scheduledRequest->addedAt)/agingInterval);
+		}
+		if (bestRequest && level < bestLevel) {
+			continue;
+		}
+
+		BOOL isWarm = NO;
+		if (scheduledRequest->host) {
+			NSNumber *warm = [warmHosts objectForKey:scheduledRequest->host];
+			if (!warm) {
+				warm = [NSNumber numberWithBool:[[ASIConnectionPool sharedPool] hasIdleConnectionForURL:[request url]]];
+				[warmHosts setObject:warm forKey:scheduledRequest->host];
+			}
+			isWarm = [warm boolValue];
+		}
+		if (!bestRequest || level > bestLevel || (isWarm && !bestIsWarm)) {
+			bestRequest = scheduledRequest;
+			bestLevel = level;
+			bestIsWarm = isWarm;
+		}
+	}
+	return bestRequest;
+}
+
+- (void)observeValueForKeyPath:(NSString *)keyPath ofObject:(id)object change:(NSDictionary *)change context:(void *)context
+{
+	if (context != ASIScheduledRequestContext) {
+		[super observeValueForKeyPath:keyPath ofObject:object change:change context:context];
+		return;
+	}
+	if ([object isFinished]) {
+		[self scheduledRequestFinished:object];
+	}
+}
+
+// Called on the request's network thread when a request the scheduler started finishes
+- (void)scheduledRequestFinished:(ASIHTTPRequest *)request
+{
+	[schedulerLock lock];
+	[requestStartTimes removeObjectForKey:[NSValue valueWithNonretainedObject:request]];
+	ASIScheduledRequest *scheduledRequest = [self runningScheduledRequestForRequest:request];
+	if (scheduledRequest) {
+		[[scheduledRequest retain] autorelease];
+		[runningScheduledRequests removeObjectIdenticalTo:scheduledRequest];
+		if (scheduledRequest->host) {
+			NSUInteger running = [[runningRequestsPerHost objectForKey:scheduledRequest->host] unsignedIntegerValue];
+			if (running > 1) {
+				[runningRequestsPerHost setObject:[NSNumber numberWithUnsignedInteger:running-1] forKey:scheduledRequest->host];
+			} else {
+				[runningRequestsPerHost removeObjectForKey:scheduledRequest->host];
+			}
+		}
+		[request removeObserver:self forKeyPath:@"isFinished"];
+	}
+	[schedulerLock unlock];
+	if (scheduledRequest) {
+		[self startScheduledRequests];
+	}
+}
 
+// Call with schedulerLock held
+- (ASIScheduledRequest *)runningScheduledRequestForRequest:(ASIHTTPRequest *)request
+{
+	for (ASIScheduledRequest *runningRequest in runningScheduledRequests) {
+		if (runningRequest->request == request) {
+			return runningRequest;
+		}
+	}
+	return nil;
+}
+
+#pragma mark adapting concurrency
+
+- (ASIConcurrencyLimiter *)concurrencyLimiterForHost:(NSString *)host
+{
+	host = [host lowercaseString];
+	if (!host) {
+		return nil;
+	}
+	[schedulerLock lock];
+	ASIConcurrencyLimiter *limiter = [hostConcurrencyLimiters objectForKey:host];
+	if (!limiter) {
+		limiter = [ASIConcurrencyLimiter limiter];
+		[hostConcurrencyLimiters setObject:limiter forKey:host];
+	}
+	[schedulerLock unlock];
+	return limiter;
+}
+
+- (NSDictionary *)hostConcurrencyLimiters
+{
+	[schedulerLock lock];
+	NSDictionary *limiters = [NSDictionary dictionaryWithDictionary:hostConcurrencyLimiters];
+	[schedulerLock unlock];
+	return limiters;
 }
 
+// Tells our limiters how long request took to receive response headers
+- (void)recordResponseTimeForRequest:(ASIHTTPRequest *)request
+{
+	NSValue *key = [NSValue valueWithNonretainedObject:request];
+	[schedulerLock lock];
+	NSNumber *startTime = [[[requestStartTimes objectForKey:key] retain] autorelease];
+	[requestStartTimes removeObjectForKey:key];
+	ASIScheduledRequest *scheduledRequest = [[[self runningScheduledRequestForRequest:request] retain] autorelease];
+	NSUInteger running = [runningScheduledRequests count];
+	NSUInteger runningForHost = 0;
+	if (scheduledRequest && scheduledRequest->host) {
+		runningForHost = [[runningRequestsPerHost objectForKey:scheduledRequest->host] unsignedIntegerValue];
+	}
+	[schedulerLock unlock];
+
+	if (!startTime || !scheduledRequest) {
+		return;
+	}
+	NSTimeInterval responseTime = ASIMonotonicTime()-[startTime doubleValue];
+	if ([self shouldAdaptConcurrency]) {
+		[[self concurrencyLimiter] recordResponseTime:responseTime statusCode:[request responseStatusCode] requestsInProgress:running];
+	}
+	if ([self shouldAdaptConcurrencyPerHost] && scheduledRequest->host) {
+		[[self concurrencyLimiterForHost:scheduledRequest->host] recordResponseTime:responseTime statusCode:[request responseStatusCode] requestsInProgress:runningForHost];
+	}
+
+	// Our limits may have grown
+	[self startScheduledRequests];
+}
+
+#if NS_BLOCKS_AVAILABLE
+- (dispatch_queue_t)callbackDispatchQueue
+{
+	@synchronized (self) {
+		return callbackDispatchQueue;
+	}
+}
+
+- (void)setCallbackDispatchQueue:(dispatch_queue_t)newQueue
+{
+	@synchronized (self) {
+		if (newQueue) {
+			dispatch_retain(newQueue);
+		}
+		if (callbackDispatchQueue) {
+			dispatch_release(callbackDispatchQueue);
+		}
+		callbackDispatchQueue = newQueue;
+	}
+}
+#endif
+
 - (void)requestStarted:(ASIHTTPRequest *)request
 {
+	if ([self isAdaptingConcurrency]) {
+		[schedulerLock lock];
+		[requestStartTimes setObject:[NSNumber numberWithDouble:ASIMonotonicTime()] forKey:[NSValue valueWithNonretainedObject:request]];
+		[schedulerLock unlock];
+	}
 	if ([self requestDidStartSelector]) {
 		[[self delegate] performSelector:[self requestDidStartSelector] withObject:request];
 	}
@@ -188,6 +610,9 @@
 
 - (void)request:(ASIHTTPRequest *)request didReceiveResponseHeaders:(NSDictionary *)responseHeaders
 {
+	if ([self isAdaptingConcurrency]) {
+		[self recordResponseTimeForRequest:request];
+	}
 	if ([self requestDidReceiveResponseHeadersSelector]) {
 		[[self delegate] performSelector:[self requestDidReceiveResponseHeadersSelector] withObject:request withObject:responseHeaders];
 	}
@@ -215,6 +640,17 @@
 
 - (void)requestFailed:(ASIHTTPRequest *)request
 {
+	// Timeouts and failures to connect are often a sign we are asking too much of the server or the network
+	NSInteger errorCode = [[request error] code];
+	if ([self isAdaptingConcurrency] && (errorCode == ASIRequestTimedOutErrorType || errorCode == ASIConnectionFailureErrorType)) {
+		if ([self shouldAdaptConcurrency]) {
+			[[self concurrencyLimiter] recordFailure];
+		}
+		NSString *host = [[request url] host];
+		if ([self shouldAdaptConcurrencyPerHost] && host) {
+			[[self concurrencyLimiterForHost:host] recordFailure];
+		}
+	}
 	[self setRequestsCount:[self requestsCount]-1];
 	if ([self requestDidFailSelector]) {
 		[[self delegate] performSelector:[self requestDidFailSelector] withObject:request];
@@ -234,8 +670,17 @@
 - (void)request:(ASIHTTPRequest *)request didReceiveBytes:(long long)bytes
 {
 	[self setBytesDownloadedSoFar:[self bytesDownloadedSoFar]+(unsigned long long)bytes];
+	if ([self isAdaptingConcurrency] && bytes > 0) {
+		if ([self shouldAdaptConcurrency]) {
+			[[self concurrencyLimiter] recordBytesReceived:(unsigned long long)bytes];
+		}
+		NSString *host = [[request url] host];
+		if ([self shouldAdaptConcurrencyPerHost] && host) {
+			[[self concurrencyLimiterForHost:host] recordBytesReceived:(unsigned long long)bytes];
+		}
+	}
 	if ([self downloadProgressDelegate]) {
-		[ASIHTTPRequest updateProgressIndicator:&downloadProgressDelegate withProgress:[self bytesDownloadedSoFar] ofTotal:[self totalBytesToDownload]];
+		[self scheduleDownloadProgressUpdate];
 	}
 }
 
@@ -243,10 +688,61 @@
 {
 	[self setBytesUploadedSoFar:[self bytesUploadedSoFar]+(unsigned long long)bytes];
 	if ([self uploadProgressDelegate]) {
-		[ASIHTTPRequest updateProgressIndicator:&uploadProgressDelegate withProgress:[self bytesUploadedSoFar] ofTotal:[self totalBytesToUpload]];
+		[self scheduleUploadProgressUpdate];
 	}
 }
 
+// These are called wherever requests deliver their callbacks (usually the main thread)
+// We can only hold back an update to call it later when we have a runloop to do it with, otherwise we skip it and catch up next time
+
+- (void)scheduleDownloadProgressUpdate
+{
+	if (downloadProgressUpdateScheduled) {
+		return;
+	}
+	NSTimeInterval wait = lastDownloadProgressUpdate+[self progressUpdateInterval]-ASIMonotonicTime();
+	if (wait <= 0 || [self bytesDownloadedSoFar] >= [self totalBytesToDownload]) {
+		[self updateDownloadProgressIndicator];
+		return;
+	}
+	if (![NSThread isMainThread]) {
+		return;
+	}
+	downloadProgressUpdateScheduled = YES;
+	[self performSelector:@selector(updateDownloadProgressIndicator) withObject:nil afterDelay:wait];
+}
+
+- (void)scheduleUploadProgressUpdate
+{
+	if (uploadProgressUpdateScheduled) {
+		return;
+	}
+	NSTimeInterval wait = lastUploadProgressUpdate+[self progressUpdateInterval]-ASIMonotonicTime();
+	if (wait <= 0 || [self bytesUploadedSoFar] >= [self totalBytesToUpload]) {
+		[self updateUploadProgressIndicator];
+		return;
+	}
+	if (![NSThread isMainThread]) {
+		return;
+	}
+	uploadProgressUpdateScheduled = YES;
+	[self performSelector:@selector(updateUploadProgressIndicator) withObject:nil afterDelay:wait];
+}
+
+- (void)updateDownloadProgressIndicator
+{
+	downloadProgressUpdateScheduled = NO;
+	lastDownloadProgressUpdate = ASIMonotonicTime();
+	[ASIHTTPRequest updateProgressIndicator:&downloadProgressDelegate withProgress:[self bytesDownloadedSoFar] ofTotal:[self totalBytesToDownload]];
+}
+
+- (void)updateUploadProgressIndicator
+{
+	uploadProgressUpdateScheduled = NO;
+	lastUploadProgressUpdate = ASIMonotonicTime();
+	[ASIHTTPRequest updateProgressIndicator:&uploadProgressDelegate withProgress:[self bytesUploadedSoFar] ofTotal:[self totalBytesToUpload]];
+}
+
 - (void)request:(ASIHTTPRequest *)request incrementDownloadSizeBy:(long long)newLength
 {
 	[self setTotalBytesToDownload:[self totalBytesToDownload]+(unsigned long long)newLength];
@@ -318,12 +814,38 @@
 	[newQueue setDownloadProgressDelegate:[self downloadProgressDelegate]];
 	[newQueue setShouldCancelAllRequestsOnFailure:[self shouldCancelAllRequestsOnFailure]];
 	[newQueue setShowAccurateProgress:[self showAccurateProgress]];
+	[newQueue setProgressUpdateInterval:[self progressUpdateInterval]];
+	[newQueue setCallbackMode:[self callbackMode]];
+	[newQueue setCallbackOperationQueue:[self callbackOperationQueue]];
+	#if NS_BLOCKS_AVAILABLE
+	[newQueue setCallbackDispatchQueue:[self callbackDispatchQueue]];
+	#endif
+	[newQueue setBandwidthClass:[self bandwidthClass]];
+	[newQueue setShouldShareBandwidthByHost:[self shouldShareBandwidthByHost]];
+	[newQueue setRetryPolicy:[self retryPolicy]];
+	[newQueue setShouldScheduleRequests:[self shouldScheduleRequests]];
+	[newQueue setMaxConcurrentRequestsPerHost:[self maxConcurrentRequestsPerHost]];
+	[newQueue setPriorityAgingInterval:[self priorityAgingInterval]];
+	[newQueue setShouldAdaptConcurrency:[self shouldAdaptConcurrency]];
+	[newQueue setShouldAdaptConcurrencyPerHost:[self shouldAdaptConcurrencyPerHost]];
 	[newQueue setUserInfo:[[[self userInfo] copyWithZone:zone] autorelease]];
 	return newQueue;
 }
 
 
 @synthesize requestsCount;
+@synthesize progressUpdateInterval;
+@synthesize callbackMode;
+@synthesize callbackOperationQueue;
+@synthesize bandwidthClass;
+@synthesize shouldShareBandwidthByHost;
+@synthesize retryPolicy;
+@synthesize shouldScheduleRequests;
+@synthesize maxConcurrentRequestsPerHost;
+@synthesize priorityAgingInterval;
+@synthesize shouldAdaptConcurrency;
+@synthesize shouldAdaptConcurrencyPerHost;
+@synthesize concurrencyLimiter;
 @synthesize bytesUploadedSoFar;
 @synthesize totalBytesToUpload;
 @synthesize bytesDownloadedSoFar;
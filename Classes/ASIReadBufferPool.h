@@ -0,0 +1,76 @@
+//
+//  ASIReadBufferPool.h
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import <libkern/OSAtomic.h>
+
+// The smallest and largest buffers requests read response data into
+// Buffer sizes are always a power of two between these
+#define ASIReadBufferMinimumSize 16384
+#define ASIReadBufferMaximumSize 1048576
+
+// The number of different buffer sizes (16KB, 32KB ... 1MB)
+#define ASIReadBufferSizeClasses 7
+
+// The most free buffers of each size we keep hold of
+#define ASIReadBufferMaximumFreeBuffers 4
+
+// We free all our spare buffers when we haven't handed one out for this many seconds
+#define ASIReadBufferIdleTime 10
+
+// Data shorter than 1/ASIReadBufferCopyFraction of its buffer is copied into data of its own, rather than wrapping the buffer (unless the buffer is the smallest size)
+#define ASIReadBufferCopyFraction 4
+
+// A read buffer pool hands out buffers for requests to read response data into, so we don't allocate a new one for every read
+// (and don't need to put large buffers on the network thread's stack)
+//
+// Data read into a buffer can be handed to delegates as an NSData that wraps the buffer, rather than copying it
+// The buffer goes back to the pool when the NSData is deallocated, so a delegate that keeps hold of the data keeps the buffer
+// A small read in a big buffer is copied instead, so a delegate keeping a few bytes doesn't keep a buffer of up to 1MB
+//
+// Spare buffers are freed when the pool hasn't been used for ASIReadBufferIdleTime seconds, and (on iOS) when the app receives a memory warning
+//
+// Each network thread has its own pool. Buffers must only be taken from a pool on its own thread,
+// but they can be given back on any thread (eg when a delegate releases data on the main thread)
+@interface ASIReadBufferPool : NSObject {
+
+	// Mediates access to freeBuffers
+	OSSpinLock lock;
+
+	// Buffers that aren't being used, one list for each size
+	CFMutableArrayRef freeBuffers[ASIReadBufferSizeClasses];
+
+	// The monotonic time we last handed out a buffer
+	NSTimeInterval lastTakeTime;
+
+	// Fires on our own thread to free our spare buffers once we've been idle for a while
+	NSTimer *idleTimer;
+}
+
+// Returns the pool for the current thread, creating one if needed
++ (ASIReadBufferPool *)readBufferPoolForCurrentThread;
+
+// Returns the buffer size (see above) closest to size
++ (NSUInteger)bufferSizeForSize:(unsigned long long)size;
+
+// Returns a buffer of size bytes, which must be a size returned by bufferSizeForSize:
+- (void *)takeBufferOfSize:(NSUInteger)size;
+
+// Gives a buffer back to the pool, or frees it if we already have enough of that size
+- (void)returnBuffer:(void *)buffer ofSize:(NSUInteger)size;
+
+// Returns a new NSData (which you must release) holding the first length bytes of buffer
+// The data takes over the buffer, and gives it back to this pool when it is deallocated
+// If length is small compared to size, the data is a copy, and the buffer goes back to the pool straight away
+- (NSData *)newDataWithBuffer:(void *)buffer ofSize:(NSUInteger)size length:(NSUInteger)length;
+
+// Frees all the spare buffers in the pool. Can be called on any thread
+- (void)trim;
+
+// The number of free buffers in the pool
+- (NSUInteger)freeBufferCount;
+@end
@@ -0,0 +1,211 @@
+//
+//  ASIReadBufferPool.m
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import "ASIReadBufferPool.h"
+#import "ASITimerWheel.h"
+#if TARGET_OS_IPHONE
+	#import <UIKit/UIKit.h>
+#endif
+
+// Returns the index in freeBuffers for buffers of size bytes
+static NSUInteger ASIReadBufferSizeClass(NSUInteger size)
+{
+	NSUInteger sizeClass = 0;
+	while (size > ASIReadBufferMinimumSize && sizeClass < ASIReadBufferSizeClasses-1) {
+		size /= 2;
+		sizeClass++;
+	}
+	return sizeClass;
+}
+
+// Wraps a buffer from a pool without copying it, and gives the buffer back when it is deallocated
+@interface ASIPooledData : NSData {
+	ASIReadBufferPool *pool;
+	void *buffer;
+	NSUInteger size;
+	NSUInteger length;
+}
+- (id)initWithBuffer:(void *)newBuffer ofSize:(NSUInteger)newSize length:(NSUInteger)newLength pool:(ASIReadBufferPool *)newPool;
+@end
+
+@implementation ASIPooledData
+
+- (id)initWithBuffer:(void *)newBuffer ofSize:(NSUInteger)newSize length:(NSUInteger)newLength pool:(ASIReadBufferPool *)newPool
+{
+	self = [super init];
+	buffer = newBuffer;
+	size = newSize;
+	length = newLength;
+	pool = [newPool retain];
+	return self;
+}
+
+- (void)dealloc
+{
+	[pool returnBuffer:buffer ofSize:size];
+	[pool release];
+	[super dealloc];
+}
+
+- (const void *)bytes
+{
+	return buffer;
+}
+
+- (NSUInteger)length
+{
+	return length;
+}
+
+@end
+
+
+@interface ASIReadBufferPool ()
+- (void)idleTimerFired:(NSTimer *)timer;
+@end
+
+@implementation ASIReadBufferPool
+
++ (ASIReadBufferPool *)readBufferPoolForCurrentThread
+{
+	NSMutableDictionary *threadDictionary = [[NSThread currentThread] threadDictionary];
+	ASIReadBufferPool *pool = [threadDictionary objectForKey:@"ASIReadBufferPool"];
+	if (!pool) {
+		pool = [[[self alloc] init] autorelease];
+		[threadDictionary setObject:pool forKey:@"ASIReadBufferPool"];
+	}
+	return pool;
+}
+
++ (NSUInteger)bufferSizeForSize:(unsigned long long)size
+{
+	NSUInteger bufferSize = ASIReadBufferMinimumSize;
+	while (bufferSize < size && bufferSize < ASIReadBufferMaximumSize) {
+		bufferSize *= 2;
+	}
+	return bufferSize;
+}
+
+- (id)init
+{
+	self = [super init];
+	lock = OS_SPINLOCK_INIT;
+	NSUInteger i;
+	for (i=0; i<ASIReadBufferSizeClasses; i++) {
+		freeBuffers[i] = CFArrayCreateMutable(kCFAllocatorDefault, 0, NULL);
+	}
+	#if TARGET_OS_IPHONE
+	[[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(trim) name:UIApplicationDidReceiveMemoryWarningNotification object:nil];
+	#endif
+	return self;
+}
+
+- (void)dealloc
+{
+	#if TARGET_OS_IPHONE
+	[[NSNotificationCenter defaultCenter] removeObserver:self];
+	#endif
+	NSUInteger i;
+	for (i=0; i<ASIReadBufferSizeClasses; i++) {
+		CFIndex b;
+		for (b=0; b<CFArrayGetCount(freeBuffers[i]); b++) {
+			free((void *)CFArrayGetValueAtIndex(freeBuffers[i], b));
+		}
+		CFRelease(freeBuffers[i]);
+	}
+	[super dealloc];
+}
+
+- (void *)takeBufferOfSize:(NSUInteger)size
+{
+	CFMutableArrayRef buffers = freeBuffers[ASIReadBufferSizeClass(size)];
+	void *buffer = NULL;
+	OSSpinLockLock(&lock);
+	CFIndex count = CFArrayGetCount(buffers);
+	if (count) {
+		buffer = (void *)CFArrayGetValueAtIndex(buffers, count-1);
+		CFArrayRemoveValueAtIndex(buffers, count-1);
+	}
+	OSSpinLockUnlock(&lock);
+	if (!buffer) {
+		buffer = malloc(size);
+	}
+
+	// We're only used on our own thread, so the timer fires there too
+	lastTakeTime = ASIMonotonicTime();
+	if (!idleTimer) {
+		idleTimer = [NSTimer scheduledTimerWithTimeInterval:ASIReadBufferIdleTime target:self selector:@selector(idleTimerFired:) userInfo:nil repeats:NO];
+	}
+	return buffer;
+}
+
+- (void)idleTimerFired:(NSTimer *)timer
+{
+	idleTimer = nil;
+	NSTimeInterval idleTime = ASIMonotonicTime()-lastTakeTime;
+	if (idleTime >= ASIReadBufferIdleTime) {
+		[self trim];
+	} else {
+		idleTimer = [NSTimer scheduledTimerWithTimeInterval:ASIReadBufferIdleTime-idleTime target:self selector:@selector(idleTimerFired:) userInfo:nil repeats:NO];
+	}
+}
+
+- (void)trim
+{
+	NSUInteger i;
+	for (i=0; i<ASIReadBufferSizeClasses; i++) {
+		OSSpinLockLock(&lock);
+		CFArrayRef buffers = CFArrayCreateCopy(kCFAllocatorDefault, freeBuffers[i]);
+		CFArrayRemoveAllValues(freeBuffers[i]);
+		OSSpinLockUnlock(&lock);
+
+		// We free them without holding the lock, as other threads spin while waiting for it
+		CFIndex b;
+		for (b=0; b<CFArrayGetCount(buffers); b++) {
+			free((void *)CFArrayGetValueAtIndex(buffers, b));
+		}
+		CFRelease(buffers);
+	}
+}
+
+- (void)returnBuffer:(void *)buffer ofSize:(NSUInteger)size
+{
+	CFMutableArrayRef buffers = freeBuffers[ASIReadBufferSizeClass(size)];
+	OSSpinLockLock(&lock);
+	if (CFArrayGetCount(buffers) < ASIReadBufferMaximumFreeBuffers) {
+		CFArrayAppendValue(buffers, buffer);
+		buffer = NULL;
+	}
+	OSSpinLockUnlock(&lock);
+	if (buffer) {
+		free(buffer);
+	}
+}
+
+- (NSData *)newDataWithBuffer:(void *)buffer ofSize:(NSUInteger)size length:(NSUInteger)length
+{
+	if (size > ASIReadBufferMinimumSize && length < size/ASIReadBufferCopyFraction) {
+		NSData *data = [[NSData alloc] initWithBytes:buffer length:length];
+		[self returnBuffer:buffer ofSize:size];
+		return data;
+	}
+	return [[ASIPooledData alloc] initWithBuffer:buffer ofSize:size length:length pool:self];
+}
+
+- (NSUInteger)freeBufferCount
+{
+	NSUInteger count = 0;
+	OSSpinLockLock(&lock);
+	NSUInteger i;
+	for (i=0; i<ASIReadBufferSizeClasses; i++) {
+		count += (NSUInteger)CFArrayGetCount(freeBuffers[i]);
+	}
+	OSSpinLockUnlock(&lock);
+	return count;
+}
+
+@end
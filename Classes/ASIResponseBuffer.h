@@ -0,0 +1,62 @@
+//
+//  ASIResponseBuffer.h
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+// The size of each segment used when we don't know how big a response will be
+#define ASIResponseBufferSegmentSize 65536
+
+// We won't trust a Content-Length bigger than this enough to allocate that much memory up front
+#define ASIResponseBufferMaxReservation (512*1024*1024)
+
+// ASIResponseBuffer stores a response body in memory as it arrives, without repeatedly growing (and copying) a single NSMutableData
+//
+// When we know how big the body will be, it is read straight into a single block of that size, and handed out as an NSMutableData without copying it
+// Otherwise, the body is stored in a chain of fixed-size segments, which are only joined together when someone asks for the data
+// (a body that fits in a single segment is handed out without copying it)
+//
+// Once data has been asked for, anything that arrives afterwards is appended to it, so the data returned always contains the whole body
+// Like NSMutableData, a buffer should only be used from one thread at a time
+@interface ASIResponseBuffer : NSObject {
+
+	// The number of bytes we expect to receive, or 0 when we don't know
+	NSUInteger expectedLength;
+
+	// The single block used when expectedLength is set, created the first time data is appended
+	unsigned char *block;
+	NSUInteger blockLength;
+
+	// NSMutableData objects of ASIResponseBufferSegmentSize capacity, used when we didn't know how much to expect or received more than we expected
+	NSMutableArray *segments;
+
+	// The total number of bytes appended so far
+	NSUInteger length;
+
+	// Set once someone has asked for the data - everything is appended here from then on
+	NSMutableData *data;
+}
+
++ (id)buffer;
+
+// Tell the buffer how many bytes to expect (eg from a Content-Length header)
+// Must be called before any data is appended, otherwise it does nothing
+// Nothing is allocated until data is appended, so it doesn't matter if the data never arrives
+- (void)reserveCapacity:(unsigned long long)capacity;
+
+- (void)appendBytes:(const void *)bytes length:(NSUInteger)len;
+- (void)appendData:(NSData *)newData;
+
+// Returns everything appended so far as a single contiguous NSMutableData
+// Copies the data only when it was stored in more than one piece, and only the first time it is called
+- (NSMutableData *)data;
+
+// Returns a new copy of everything appended so far, without changing how the buffer stores it
+// Use this to look at a body that is still arriving
+- (NSMutableData *)copyOfData;
+
+- (NSUInteger)length;
+@end
@@ -0,0 +1,156 @@
+//
+//  ASIResponseBuffer.m
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import "ASIResponseBuffer.h"
+
+@interface ASIResponseBuffer ()
+- (void)appendBytesToSegments:(const unsigned char *)bytes length:(NSUInteger)len;
+@end
+
+@implementation ASIResponseBuffer
+
++ (id)buffer
+{
+	return [[[self alloc] init] autorelease];
+}
+
+- (void)dealloc
+{
+	if (block) {
+		free(block);
+	}
+	[segments release];
+	[data release];
+	[super dealloc];
+}
+
+- (void)reserveCapacity:(unsigned long long)capacity
+{
+	if (length || data || capacity > ASIResponseBufferMaxReservation) {
+		return;
+	}
+	expectedLength = (NSUInteger)capacity;
+}
+
+- (void)appendData:(NSData *)newData
+{
+	[self appendBytes:[newData bytes] length:[newData length]];
+}
+
+- (void)appendBytes:(const void *)bytes length:(NSUInteger)len
+{
+	if (!len) {
+		return;
+	}
+	length += len;
+	if (data) {
+		[data appendBytes:bytes length:len];
+		return;
+	}
+
+	// Read into the single block as long as there is room
+	// If we can't get a block that big, we'll just use segments instead
+	if (expectedLength && !block && !segments) {
+		block = malloc(expectedLength);
+		if (!block) {
+			expectedLength = 0;
+		}
+	}
+	if (block && blockLength < expectedLength) {
+		NSUInteger toCopy = expectedLength-blockLength;
+		if (toCopy > len) {
+			toCopy = len;
+		}
+		memcpy(block+blockLength, bytes, toCopy);
+		blockLength += toCopy;
+		bytes = (const unsigned char *)bytes+toCopy;
+		len -= toCopy;
+		if (!len) {
+			return;
+		}
+	}
+
+	// The server sent more than it said it would, or we didn't know how much to expect
+	[self appendBytesToSegments:bytes length:len];
+}
+
+- (void)appendBytesToSegments:(const unsigned char *)bytes length:(NSUInteger)len
+{
+	if (!segments) {
+		segments = [[NSMutableArray alloc] init];
+	}
+	while (len) {
+		NSMutableData *segment = [segments lastObject];
+		if (!segment || [segment length] == ASIResponseBufferSegmentSize) {
+			segment = [[[NSMutableData alloc] initWithCapacity:ASIResponseBufferSegmentSize] autorelease];
+			[segments addObject:segment];
+		}
+		NSUInteger toCopy = ASIResponseBufferSegmentSize-[segment length];
+		if (toCopy > len) {
+			toCopy = len;
+		}
+		[segment appendBytes:bytes length:toCopy];
+		bytes += toCopy;
+		len -= toCopy;
+	}
+}
+
+- (NSMutableData *)data
+{
+	if (data) {
+		return data;
+	}
+	if (block) {
+		// Give back any space we reserved but didn't use (eg because the connection closed early)
+		if (blockLength < expectedLength) {
+			unsigned char *shrunk = realloc(block, blockLength ? blockLength : 1);
+			if (shrunk) {
+				block = shrunk;
+			}
+		}
+		// The data takes ownership of the block, so there's no copy
+		data = [[NSMutableData alloc] initWithBytesNoCopy:block length:blockLength freeWhenDone:YES];
+		block = NULL;
+		for (NSData *segment in segments) {
+			[data appendData:segment];
+		}
+
+	} else if ([segments count] == 1) {
+		data = [[segments objectAtIndex:0] retain];
+
+	} else {
+		data = [[NSMutableData alloc] initWithCapacity:length];
+		for (NSData *segment in segments) {
+			[data appendData:segment];
+		}
+	}
+	[segments release];
+	segments = nil;
+	return data;
+}
+
+- (NSMutableData *)copyOfData
+{
+	if (data) {
+		return [data mutableCopy];
+	}
+	NSMutableData *copy = [[NSMutableData alloc] initWithCapacity:length];
+	if (block) {
+		[copy appendBytes:block length:blockLength];
+	}
+	for (NSData *segment in segments) {
+		[copy appendData:segment];
+	}
+	return copy;
+}
+
+- (NSUInteger)length
+{
+	return length;
+}
+
+@end
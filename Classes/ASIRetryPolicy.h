@@ -0,0 +1,91 @@
+//
+//  ASIRetryPolicy.h
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+@class ASIHTTPRequest;
+
+// An ASIRetryPolicy decides whether a request that failed (or got an error response from the server) should try again, and how long it should wait first
+//
+// By default, we retry:
+// - Connection failures (apart from SSL errors) and timeouts
+// - Responses with a status code in retryableStatusCodes (408, 429, 500, 502, 503 and 504)
+// Only requests using idempotent methods (GET, HEAD, PUT, DELETE, OPTIONS and TRACE) are retried, unless shouldRetryNonIdempotentRequests is YES
+//
+// We wait a random time between 0 and baseDelay * 2^(retries so far), up to maximumDelay, so requests that failed together don't all come back together
+// When the server sends a Retry-After header, we wait as long as it asks instead (or give up if that is longer than maximumRetryAfterDelay)
+//
+// Every retry takes a token from a bucket that holds retryBudget tokens, and refills at retryBudgetRefillRate tokens per second
+// When the bucket is empty, requests fail rather than retrying, so a server that is down isn't hammered by every request that uses this policy
+// Share one policy between requests to the same backend (eg by setting it on an ASINetworkQueue) so they share a budget
+//
+// Subclass and override shouldRetryRequest:error:delay: to make different decisions
+// All the methods here can be called from any thread
+@interface ASIRetryPolicy : NSObject {
+
+	// Mediates access to the retry budget
+	NSLock *budgetLock;
+
+	// The most times a request using this policy will retry. Default is 3
+	NSUInteger maximumRetries;
+
+	// The longest we will wait before the first retry, and before any retry. Defaults are 0.5 seconds and 30 seconds
+	NSTimeInterval baseDelay;
+	NSTimeInterval maximumDelay;
+
+	// When YES (the default), we wait for as long as a Retry-After header asks
+	BOOL shouldHonourRetryAfter;
+
+	// We won't retry if a Retry-After header asks us to wait longer than this. Default is 120 seconds
+	NSTimeInterval maximumRetryAfterDelay;
+
+	// Responses with these status codes are retried
+	NSSet *retryableStatusCodes;
+
+	// When YES, POST requests and others using methods that aren't idempotent are retried too. Default is NO
+	// Only turn this on if the server can cope with receiving the same request twice
+	BOOL shouldRetryNonIdempotentRequests;
+
+	// How many tokens the retry budget holds, and how many are added back each second. Defaults are 10 and 1
+	double retryBudget;
+	double retryBudgetRefillRate;
+
+	// The tokens left in the bucket when we last took one, and the monotonic time we did so
+	double retryTokens;
+	NSTimeInterval lastRetryTime;
+}
+
++ (id)retryPolicy;
+
+// Called by a request that failed, or received a response with an unsuccessful status code
+// error is nil when the request received a response - look at the request's responseStatusCode and responseHeaders
+// Return YES to make the request retry, after setting delay to the number of seconds it should wait first
+// The default implementation also takes a token from the retry budget when it returns YES
+- (BOOL)shouldRetryRequest:(ASIHTTPRequest *)request error:(NSError *)error delay:(NSTimeInterval *)delay;
+
+// Returns YES if request's method is idempotent, so sending it again won't do anything sending it once didn't
+- (BOOL)isRequestIdempotent:(ASIHTTPRequest *)request;
+
+// Returns the number of seconds the server asked us to wait with a Retry-After header, or a negative number if it didn't send one we understand
+- (NSTimeInterval)retryAfterDelayForRequest:(ASIHTTPRequest *)request;
+
+// Takes a token from the retry budget, returning NO if there isn't one to take
+- (BOOL)takeRetryToken;
+
+// The number of tokens left in the retry budget
+- (double)availableRetryTokens;
+
+@property (assign) NSUInteger maximumRetries;
+@property (assign) NSTimeInterval baseDelay;
+@property (assign) NSTimeInterval maximumDelay;
+@property (assign) BOOL shouldHonourRetryAfter;
+@property (assign) NSTimeInterval maximumRetryAfterDelay;
+@property (retain) NSSet *retryableStatusCodes;
+@property (assign) BOOL shouldRetryNonIdempotentRequests;
+@property (assign) double retryBudget;
+@property (assign) double retryBudgetRefillRate;
+@end
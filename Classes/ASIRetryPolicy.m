@@ -0,0 +1,192 @@
+//
+//  ASIRetryPolicy.m
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import "ASIRetryPolicy.h"
+#import "ASIHTTPRequest.h"
+#import "ASITimerWheel.h"
+
+static NSSet *idempotentMethods = nil;
+
+@implementation ASIRetryPolicy
+
++ (void)initialize
+{
+	if (self == [ASIRetryPolicy class]) {
+		idempotentMethods = [[NSSet alloc] initWithObjects:@"GET",@"HEAD",@"PUT",@"DELETE",@"OPTIONS",@"TRACE",nil];
+	}
+}
+
++ (id)retryPolicy
+{
+	return [[[self alloc] init] autorelease];
+}
+
+- (id)init
+{
+	self = [super init];
+	budgetLock = [[NSLock alloc] init];
+	[self setMaximumRetries:3];
+	[self setBaseDelay:0.5];
+	[self setMaximumDelay:30];
+	[self setShouldHonourRetryAfter:YES];
+	[self setMaximumRetryAfterDelay:120];
+	[self setRetryableStatusCodes:[NSSet setWithObjects:[NSNumber numberWithInt:408],[NSNumber numberWithInt:429],[NSNumber numberWithInt:500],[NSNumber numberWithInt:502],[NSNumber numberWithInt:503],[NSNumber numberWithInt:504],nil]];
+	[self setRetryBudget:10];
+	[self setRetryBudgetRefillRate:1];
+	retryTokens = retryBudget;
+	return self;
+}
+
+- (void)dealloc
+{
+	[budgetLock release];
+	[retryableStatusCodes release];
+	[super dealloc];
+}
+
+- (BOOL)shouldRetryRequest:(ASIHTTPRequest *)request error:(NSError *)error delay:(NSTimeInterval *)delay
+{
+	if ((NSUInteger)[request policyRetryCount] >= [self maximumRetries]) {
+		return NO;
+	}
+	if (![self shouldRetryNonIdempotentRequests] && ![self isRequestIdempotent:request]) {
+		return NO;
+	}
+
+	if (error) {
+		if (![[error domain] isEqualToString:NetworkRequestErrorDomain]) {
+			return NO;
+		}
+		if ([error code] == ASIConnectionFailureErrorType) {
+			// Trying the same certificate again won't help
+			NSError *underlyingError = [[error userInfo] objectForKey:NSUnderlyingErrorKey];
+			if ([[underlyingError domain] isEqualToString:NSOSStatusErrorDomain] && [underlyingError code] <= -9800 && [underlyingError code] >= -9818) {
+				return NO;
+			}
+		} else if ([error code] != ASIRequestTimedOutErrorType) {
+			return NO;
+		}
+	} else if (![[self retryableStatusCodes] containsObject:[NSNumber numberWithInt:[request responseStatusCode]]]) {
+		return NO;
+	}
+
+	// Back off exponentially, picking a random time up to the limit for this retry
+	NSTimeInterval backoff = MIN([self maximumDelay], [self baseDelay]*pow(2, [request policyRetryCount]));
+	NSTimeInterval wait = backoff*((double)arc4random()/(double)UINT32_MAX);
+
+	if (!error && [self shouldHonourRetryAfter]) {
+		NSTimeInterval retryAfter = [self retryAfterDelayForRequest:request];
+		if (retryAfter > [self maximumRetryAfterDelay]) {
+			return NO;
+		} else if (retryAfter >= 0) {
+			wait = retryAfter;
+		}
+	}
+
+	if (![self takeRetryToken]) {
+		return NO;
+	}
+	if (delay) {
+		*delay = wait;
+	}
+	return YES;
+}
+
+- (BOOL)isRequestIdempotent:(ASIHTTPRequest *)request
+{
+	return [idempotentMethods containsObject:[[request requestMethod] uppercaseString]];
+}
+
+- (NSTimeInterval)retryAfterDelayForRequest:(ASIHTTPRequest *)request
+{
+	NSString *retryAfter = [[[request responseHeaders] objectForKey:@"Retry-After"] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+	if (![retryAfter length]) {
+		return -1;
+	}
+
+	// Retry-After is either a number of seconds, or an HTTP date
+	NSScanner *scanner = [NSScanner scannerWithString:retryAfter];
+	int seconds;
+	if ([scanner scanInt:&seconds] && [scanner isAtEnd]) {
+		return MAX(seconds, 0);
+	}
+	NSDate *date = [ASIHTTPRequest dateFromRFC1123String:retryAfter];
+	if (!date) {
+		return -1;
+	}
+	return MAX([date timeIntervalSinceNow], 0);
+}
+
+#pragma mark retry budget
+
+- (BOOL)takeRetryToken
+{
+	BOOL tookToken = NO;
+	[budgetLock lock];
+	NSTimeInterval now = ASIMonotonicTime();
+	if (lastRetryTime > 0) {
+		retryTokens = MIN(retryBudget, retryTokens+(now-lastRetryTime)*retryBudgetRefillRate);
+	}
+	lastRetryTime = now;
+	if (retryTokens >= 1) {
+		retryTokens -= 1;
+		tookToken = YES;
+	}
+	[budgetLock unlock];
+	return tookToken;
+}
+
+- (double)availableRetryTokens
+{
+	[budgetLock lock];
+	double tokens = retryTokens;
+	if (lastRetryTime > 0) {
+		tokens = MIN(retryBudget, tokens+(ASIMonotonicTime()-lastRetryTime)*retryBudgetRefillRate);
+	}
+	[budgetLock unlock];
+	return tokens;
+}
+
+- (double)retryBudget
+{
+	[budgetLock lock];
+	double budget = retryBudget;
+	[budgetLock unlock];
+	return budget;
+}
+
+- (void)setRetryBudget:(double)newBudget
+{
+	[budgetLock lock];
+	retryBudget = newBudget;
+	retryTokens = MIN(retryTokens, retryBudget);
+	[budgetLock unlock];
+}
+
+- (double)retryBudgetRefillRate
+{
+	[budgetLock lock];
+	double rate = retryBudgetRefillRate;
+	[budgetLock unlock];
+	return rate;
+}
+
+- (void)setRetryBudgetRefillRate:(double)newRate
+{
+	[budgetLock lock];
+	retryBudgetRefillRate = newRate;
+	[budgetLock unlock];
+}
+
+@synthesize maximumRetries;
+@synthesize baseDelay;
+@synthesize maximumDelay;
+@synthesize shouldHonourRetryAfter;
+@synthesize maximumRetryAfterDelay;
+@synthesize retryableStatusCodes;
+@synthesize shouldRetryNonIdempotentRequests;
+@end
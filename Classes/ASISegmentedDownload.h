@@ -0,0 +1,127 @@
+//
+//  ASISegmentedDownload.h
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import "ASIHTTPRequest.h"
+#import "ASIHTTPRequestDelegate.h"
+
+// By default, we download in up to this many pieces at once
+#define ASISegmentedDownloadDefaultNumberOfSegments 4
+
+// We never split a download into pieces smaller than this (and the first piece is always this big)
+#define ASISegmentedDownloadDefaultMinimumSegmentSize (1024*1024)
+
+// ASISegmentedDownload downloads a large file over several connections at once, using Range requests
+// On high-latency links, a single connection often can't use all the bandwidth available, even when the server can
+//
+// The first request asks for the first piece of the file. If the server answers with a 206 response, we learn how big the file is from its Content-Range header,
+// make a file that size, and start requests for the rest of it straight away. Each piece is written straight into the file where it belongs
+// When a request runs out of work, it takes half of whatever is left of the slowest piece, so a slow connection doesn't hold up the whole download
+// If the server doesn't support ranges, the first request just downloads the whole thing
+// If it sends a range without saying how big the file is, we start again and download the whole thing with a single request
+//
+// Each request is a copy of the request you pass in, so headers, credentials, timeouts and so on are used for all of them
+// The file is written to the request's temporaryFileDownloadPath (or a .download file next to downloadDestinationPath), and moved to downloadDestinationPath when it is complete
+// Delegate methods, blocks and progress are delivered on the main thread
+@interface ASISegmentedDownload : NSObject <ASIHTTPRequestDelegate> {
+
+	// Every request we make is a copy of this one
+	ASIHTTPRequest *request;
+
+	// Runs our requests
+	NSOperationQueue *queue;
+
+	// The pieces of the file, in no particular order (see ASIDownloadSegment in ASISegmentedDownload.m)
+	NSMutableArray *segments;
+
+	// Mediates access to segments, and to the progress counts below
+	// Our requests tell us about data they receive on their network threads
+	NSRecursiveLock *segmentsLock;
+
+	// The file we are writing to, and its path
+	int fileDescriptor;
+	NSString *temporaryFileDownloadPath;
+
+	// The ETag or Last-Modified date from the first response, sent as If-Range with the other requests so they fail if the file changes
+	NSString *rangeValidator;
+
+	// The most requests we run at once. Default is ASISegmentedDownloadDefaultNumberOfSegments
+	NSUInteger numberOfSegments;
+
+	// We don't split pieces that are smaller than this. Default is ASISegmentedDownloadDefaultMinimumSegmentSize
+	unsigned long long minimumSegmentSize;
+
+	// The size of the file, once we know it
+	unsigned long long contentLength;
+
+	// The number of bytes written into the file so far
+	unsigned long long totalBytesRead;
+
+	// The status code of the first response
+	int responseStatusCode;
+
+	// Set if the download failed
+	NSError *error;
+
+	BOOL started;
+	BOOL complete;
+
+	// True until we've seen the response headers for the first request, and know whether the server will send us ranges
+	BOOL probing;
+
+	// Delegate will get didFinish / didFail messages
+	id delegate;
+	SEL didFinishSelector;
+	SEL didFailSelector;
+
+	// Receives setProgress: / setDoubleValue: messages, like an ASIHTTPRequest's downloadProgressDelegate
+	id downloadProgressDelegate;
+
+	// The monotonic time we last updated downloadProgressDelegate
+	NSTimeInterval lastProgressUpdate;
+
+	#if NS_BLOCKS_AVAILABLE
+	ASIBasicBlock completionBlock;
+	ASIBasicBlock failureBlock;
+	ASIProgressBlock downloadProgressBlock;
+	#endif
+
+	// Storage container for additional information
+	NSDictionary *userInfo;
+}
+
+// request must have a url and a downloadDestinationPath
++ (id)downloadWithRequest:(ASIHTTPRequest *)request;
+- (id)initWithRequest:(ASIHTTPRequest *)request;
+
+// Start downloading - returns immediately
+- (void)start;
+
+// Stop downloading, and tell the delegate it failed with ASIRequestCancelledErrorType
+// If you cancel before calling start, the delegate is still told, and start does nothing
+- (void)cancel;
+
+#if NS_BLOCKS_AVAILABLE
+- (void)setCompletionBlock:(ASIBasicBlock)aCompletionBlock;
+- (void)setFailedBlock:(ASIBasicBlock)aFailedBlock;
+- (void)setDownloadProgressBlock:(ASIProgressBlock)aDownloadProgressBlock;
+#endif
+
+@property (retain, readonly) ASIHTTPRequest *request;
+@property (assign) NSUInteger numberOfSegments;
+@property (assign) unsigned long long minimumSegmentSize;
+@property (assign, readonly) unsigned long long contentLength;
+@property (assign, readonly) unsigned long long totalBytesRead;
+@property (assign, readonly) int responseStatusCode;
+@property (retain, readonly) NSError *error;
+@property (assign, readonly) BOOL complete;
+@property (assign) id delegate;
+@property (assign) SEL didFinishSelector;
+@property (assign) SEL didFailSelector;
+@property (assign) id downloadProgressDelegate;
+@property (retain) NSDictionary *userInfo;
+@end
@@ -0,0 +1,620 @@
+//
+//  ASISegmentedDownload.m
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import "ASISegmentedDownload.h"
+#import "ASITimerWheel.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Used as the end of a segment when we don't know how big the file is (because the server sent the whole thing)
+#define ASIUnknownSegmentEnd ULLONG_MAX
+
+// A piece of the file, and the request downloading it
+// Only touched while holding the download's segmentsLock
+@interface ASIDownloadSegment : NSObject {
+@public
+	// The offset of the first byte of the piece, and the offset after its last byte
+	// end moves back when another request takes over the rest of the piece
+	unsigned long long start;
+	unsigned long long end;
+
+	// The end we asked the server for
+	unsigned long long requestedEnd;
+
+	// The number of bytes we've written into the file so far
+	unsigned long long received;
+
+	ASIHTTPRequest *request;
+	BOOL complete;
+}
+@end
+
+@implementation ASIDownloadSegment
+
+- (void)dealloc
+{
+	[request release];
+	[super dealloc];
+}
+
+@end
+
+
+@interface ASISegmentedDownload ()
+- (ASIDownloadSegment *)segmentForRequest:(ASIHTTPRequest *)theRequest;
+- (ASIDownloadSegment *)addSegmentFrom:(unsigned long long)start to:(unsigned long long)end;
+- (void)startRequestForSegment:(ASIDownloadSegment *)segment;
+- (void)startSegmentsAfterProbe:(ASIDownloadSegment *)probe;
+- (void)segmentCompleted:(ASIDownloadSegment *)segment;
+- (void)finish;
+- (void)failWithError:(NSError *)theError;
+- (void)closeFile;
+- (void)scheduleProgressUpdate;
+- (void)updateProgress;
+- (void)reportFinished;
+- (void)reportFailure;
+#if NS_BLOCKS_AVAILABLE
+- (void)releaseBlocks;
+#endif
+
+@property (retain, readwrite) ASIHTTPRequest *request;
+@property (retain, readwrite) NSError *error;
+@property (retain, nonatomic) NSString *temporaryFileDownloadPath;
+@property (retain, nonatomic) NSString *rangeValidator;
+@end
+
+@implementation ASISegmentedDownload
+
++ (id)downloadWithRequest:(ASIHTTPRequest *)newRequest
+{
+	return [[[self alloc] initWithRequest:newRequest] autorelease];
+}
+
+- (id)initWithRequest:(ASIHTTPRequest *)newRequest
+{
+	self = [super init];
+	[self setRequest:newRequest];
+	[self setNumberOfSegments:ASISegmentedDownloadDefaultNumberOfSegments];
+	[self setMinimumSegmentSize:ASISegmentedDownloadDefaultMinimumSegmentSize];
+	[self setDidFinishSelector:@selector(segmentedDownloadFinished:)];
+	[self setDidFailSelector:@selector(segmentedDownloadFailed:)];
+	segments = [[NSMutableArray alloc] init];
+	segmentsLock = [[NSRecursiveLock alloc] init];
+	queue = [[NSOperationQueue alloc] init];
+	fileDescriptor = -1;
+	return self;
+}
+
+- (void)dealloc
+{
+	for (ASIDownloadSegment *segment in segments) {
+		[segment->request clearDelegatesAndCancel];
+	}
+	[self closeFile];
+	#if NS_BLOCKS_AVAILABLE
+	[self releaseBlocks];
+	#endif
+	[request release];
+	[queue release];
+	[segments release];
+	[segmentsLock release];
+	[temporaryFileDownloadPath release];
+	[rangeValidator release];
+	[error release];
+	[userInfo release];
+	[super dealloc];
+}
+
+#pragma mark starting and stopping
+
+- (void)start
+{
+	[segmentsLock lock];
+	if (started) {
+		[segmentsLock unlock];
+		return;
+	}
+	started = YES;
+	probing = YES;
+
+	// We keep ourselves alive until we've told the delegate how things went
+	[self retain];
+
+	[queue setMaxConcurrentOperationCount:(NSInteger)[self numberOfSegments]];
+
+	NSString *path = [[self request] temporaryFileDownloadPath];
+	if (!path) {
+		path = [[[self request] downloadDestinationPath] stringByAppendingPathExtension:@"download"];
+	}
+	[self setTemporaryFileDownloadPath:path];
+	fileDescriptor = open([path fileSystemRepresentation], O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fileDescriptor < 0) {
+		[self failWithError:[NSError errorWithDomain:NetworkRequestErrorDomain code:ASIFileManagementError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:[NSString stringWithFormat:@"Failed to create a file at '%@'",path],NSLocalizedDescriptionKey,[NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil],NSUnderlyingErrorKey,nil]]];
+		[segmentsLock unlock];
+		return;
+	}
+
+	// Ask for the first piece of the file - the response tells us whether the server supports ranges, and how big the file is
+	[self startRequestForSegment:[self addSegmentFrom:0 to:[self minimumSegmentSize]]];
+	[segmentsLock unlock];
+}
+
+- (void)cancel
+{
+	[self failWithError:[NSError errorWithDomain:NetworkRequestErrorDomain code:ASIRequestCancelledErrorType userInfo:[NSDictionary dictionaryWithObjectsAndKeys:@"The request was cancelled",NSLocalizedDescriptionKey,nil]]];
+}
+
+#pragma mark segments
+
+- (ASIDownloadSegment *)segmentForRequest:(ASIHTTPRequest *)theRequest
+{
+	for (ASIDownloadSegment *segment in segments) {
+		if (segment->request == theRequest) {
+			return segment;
+		}
+	}
+	return nil;
+}
+
+- (ASIDownloadSegment *)addSegmentFrom:(unsigned long long)start to:(unsigned long long)end
+{
+	ASIDownloadSegment *segment = [[[ASIDownloadSegment alloc] init] autorelease];
+	segment->start = start;
+	segment->end = end;
+	segment->requestedEnd = end;
+	[segments addObject:segment];
+	return segment;
+}
+
+- (void)startRequestForSegment:(ASIDownloadSegment *)segment
+{
+	ASIHTTPRequest *segmentRequest = [[[self request] copy] autorelease];
+	[segmentRequest setRequestMethod:@"GET"];
+
+	// We write what we receive into the file ourselves
+	[segmentRequest setDownloadDestinationPath:nil];
+	[segmentRequest setTemporaryFileDownloadPath:nil];
+	[segmentRequest setAllowResumeForFileDownloads:NO];
+	[segmentRequest setDownloadCache:nil];
+
+	// A compressed response would have different offsets to the file
+	[segmentRequest setAllowCompressedResponse:NO];
+
+	// We are only told about data as it arrives on the request's own network thread, so we write it without waiting for the main thread
+	[segmentRequest setDelegate:self];
+	[segmentRequest setQueue:nil];
+	[segmentRequest setDownloadProgressDelegate:nil];
+	[segmentRequest setUploadProgressDelegate:nil];
+	[segmentRequest setCallbackMode:ASINetworkThreadCallbackMode];
+	[segmentRequest setDidStartSelector:NULL];
+	[segmentRequest setDidReceiveResponseHeadersSelector:@selector(request:didReceiveResponseHeaders:)];
+	[segmentRequest setDidReceiveDataSelector:@selector(request:didReceiveData:)];
+	[segmentRequest setDidFinishSelector:@selector(requestFinished:)];
+	[segmentRequest setDidFailSelector:@selector(requestFailed:)];
+
+	// A segment with no end is the whole file, fetched with a single request
+	if (segment->requestedEnd != ASIUnknownSegmentEnd) {
+		[segmentRequest addRequestHeader:@"Range" value:[NSString stringWithFormat:@"bytes=%llu-%llu",segment->start,segment->requestedEnd-1]];
+		if ([self rangeValidator]) {
+			[segmentRequest addRequestHeader:@"If-Range" value:[self rangeValidator]];
+		}
+	}
+
+	[segment->request release];
+	segment->request = [segmentRequest retain];
+	[queue addOperation:segmentRequest];
+}
+
+// Called once we know how big the file is - we split everything after the first piece between our other requests
+- (void)startSegmentsAfterProbe:(ASIDownloadSegment *)probe
+{
+	if (probe->end >= contentLength) {
+		return;
+	}
+	unsigned long long remaining = contentLength-probe->end;
+	unsigned long long count = (remaining+[self minimumSegmentSize]-1)/[self minimumSegmentSize];
+	unsigned long long maximumCount = ([self numberOfSegments] > 1 ? [self numberOfSegments]-1 : 1);
+	if (count > maximumCount) {
+		count = maximumCount;
+	}
+	unsigned long long segmentSize = remaining/count;
+	unsigned long long i;
+	for (i=0; i<count; i++) {
+		unsigned long long start = probe->end+(i*segmentSize);
+		unsigned long long end = (i == count-1 ? contentLength : start+segmentSize);
+		[self startRequestForSegment:[self addSegmentFrom:start to:end]];
+	}
+}
+
+// When a request has finished its piece, it takes over the second half of whatever is left of the piece with the most left to download
+// The request for that piece carries on, but we stop it when it reaches the new end of its piece
+- (void)segmentCompleted:(ASIDownloadSegment *)segment
+{
+	segment->complete = YES;
+	[segment->request release];
+	segment->request = nil;
+
+	ASIDownloadSegment *slowestSegment = nil;
+	unsigned long long mostRemaining = 0;
+	BOOL allComplete = YES;
+	for (ASIDownloadSegment *otherSegment in segments) {
+		if (otherSegment->complete) {
+			continue;
+		}
+		allComplete = NO;
+		unsigned long long remaining = otherSegment->end-otherSegment->start-otherSegment->received;
+		if (otherSegment->end != ASIUnknownSegmentEnd && remaining > mostRemaining) {
+			mostRemaining = remaining;
+			slowestSegment = otherSegment;
+		}
+	}
+	if (allComplete) {
+		[self finish];
+		return;
+	}
+	if (slowestSegment && mostRemaining >= [self minimumSegmentSize]*2) {
+		unsigned long long splitPoint = slowestSegment->end-(mostRemaining/2);
+		ASIDownloadSegment *newSegment = [self addSegmentFrom:splitPoint to:slowestSegment->end];
+		slowestSegment->end = splitPoint;
+		[self startRequestForSegment:newSegment];
+	}
+}
+
+#pragma mark request delegate (called on the requests' network threads)
+
+- (void)request:(ASIHTTPRequest *)theRequest didReceiveResponseHeaders:(NSDictionary *)responseHeaders
+{
+	[segmentsLock lock];
+	ASIDownloadSegment *segment = [self segmentForRequest:theRequest];
+	if (!segment || complete) {
+		[segmentsLock unlock];
+		return;
+	}
+
+	// A request that is retried starts its piece again
+	totalBytesRead -= segment->received;
+	segment->received = 0;
+
+	int statusCode = [theRequest responseStatusCode];
+
+	// Content-Range looks like 'bytes 0-1048575/5000000'
+	long long rangeStart = -1;
+	long long rangeTotal = -1;
+	NSString *contentRange = [responseHeaders objectForKey:@"Content-Range"];
+	if (contentRange) {
+		NSScanner *scanner = [NSScanner scannerWithString:contentRange];
+		long long rangeEnd;
+		if (![scanner scanString:@"bytes" intoString:NULL] || ![scanner scanLongLong:&rangeStart] || ![scanner scanString:@"-" intoString:NULL] || ![scanner scanLongLong:&rangeEnd] || ![scanner scanString:@"/" intoString:NULL] || ![scanner scanLongLong:&rangeTotal]) {
+			rangeStart = -1;
+			rangeTotal = -1;
+		}
+	}
+
+	if (probing) {
+		probing = NO;
+		responseStatusCode = statusCode;
+		if (statusCode == 206 && rangeStart == 0 && rangeTotal >= 0) {
+			contentLength = (unsigned long long)rangeTotal;
+			if (segment->end > contentLength) {
+				segment->end = contentLength;
+				segment->requestedEnd = contentLength;
+			}
+			if (ftruncate(fileDescriptor, (off_t)contentLength) != 0) {
+				[self failWithError:[NSError errorWithDomain:NetworkRequestErrorDomain code:ASIFileManagementError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:[NSString stringWithFormat:@"Failed to make space for the download at '%@'",[self temporaryFileDownloadPath]],NSLocalizedDescriptionKey,[NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil],NSUnderlyingErrorKey,nil]]];
+				[segmentsLock unlock];
+				return;
+			}
+
+			// If-Range needs a strong validator
+			NSString *etag = [responseHeaders objectForKey:@"Etag"];
+			if (etag && ![etag hasPrefix:@"W/"]) {
+				[self setRangeValidator:etag];
+			} else {
+				[self setRangeValidator:[responseHeaders objectForKey:@"Last-Modified"]];
+			}
+			[self startSegmentsAfterProbe:segment];
+
+		// An empty file
+		} else if (statusCode == 416 && [contentRange hasSuffix:@"/0"]) {
+			contentLength = 0;
+			segment->end = 0;
+
+		// The server sent a piece of the file without saying how big the whole file is (eg 'bytes 0-1048575/*'), so we can't split it up
+		// We start again and fetch the whole file with a single request
+		} else if (statusCode == 206) {
+			if (segment->requestedEnd == ASIUnknownSegmentEnd) {
+				[self failWithError:[NSError errorWithDomain:NetworkRequestErrorDomain code:ASIUnexpectedRangeErrorType userInfo:[NSDictionary dictionaryWithObjectsAndKeys:@"The server sent part of the file when we asked for all of it",NSLocalizedDescriptionKey,nil]]];
+				[segmentsLock unlock];
+				return;
+			}
+			ASIHTTPRequest *probeRequest = [[segment->request retain] autorelease];
+			probing = YES;
+			segment->end = ASIUnknownSegmentEnd;
+			segment->requestedEnd = ASIUnknownSegmentEnd;
+			[self startRequestForSegment:segment];
+			[probeRequest clearDelegatesAndCancel];
+
+		// The server doesn't support ranges, so it's sending the whole response
+		} else {
+			contentLength = [theRequest contentLength];
+			segment->end = ASIUnknownSegmentEnd;
+		}
+		[segmentsLock unlock];
+		return;
+	}
+
+	// The other requests must get exactly the range they asked for, or the file has changed since we started
+	if (statusCode != 206 || rangeStart != (long long)segment->start || rangeTotal != (long long)contentLength) {
+		[self failWithError:[NSError errorWithDomain:NetworkRequestErrorDomain code:ASIUnexpectedRangeErrorType userInfo:[NSDictionary dictionaryWithObjectsAndKeys:@"The server didn't send the part of the file we asked for - it may have changed since the download started",NSLocalizedDescriptionKey,nil]]];
+	}
+	[segmentsLock unlock];
+}
+
+- (void)request:(ASIHTTPRequest *)theRequest didReceiveData:(NSData *)data
+{
+	[segmentsLock lock];
+	ASIDownloadSegment *segment = [self segmentForRequest:theRequest];
+	if (!segment || segment->complete || complete || probing) {
+		[segmentsLock unlock];
+		return;
+	}
+
+	// Anything past the end of the piece now belongs to another request
+	unsigned long long wanted = segment->end-segment->start-segment->received;
+	NSUInteger length = [data length];
+	if (length > wanted) {
+		length = (NSUInteger)wanted;
+	}
+	const char *bytes = [data bytes];
+	NSUInteger written = 0;
+	while (written < length) {
+		ssize_t result = pwrite(fileDescriptor, bytes+written, length-written, (off_t)(segment->start+segment->received+written));
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			[self failWithError:[NSError errorWithDomain:NetworkRequestErrorDomain code:ASIFileManagementError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:[NSString stringWithFormat:@"Failed to write to the file at '%@'",[self temporaryFileDownloadPath]],NSLocalizedDescriptionKey,[NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil],NSUnderlyingErrorKey,nil]]];
+			[segmentsLock unlock];
+			return;
+		}
+		written += (NSUInteger)result;
+	}
+	segment->received += length;
+	totalBytesRead += length;
+
+	// This request has done its part, but another request took over the end of its range, so we stop it rather than letting it download that part too
+	if (segment->end != segment->requestedEnd && segment->received == segment->end-segment->start) {
+		ASIHTTPRequest *segmentRequest = [[segment->request retain] autorelease];
+		[self segmentCompleted:segment];
+		[segmentRequest clearDelegatesAndCancel];
+	}
+	[self scheduleProgressUpdate];
+	[segmentsLock unlock];
+}
+
+- (void)requestFinished:(ASIHTTPRequest *)theRequest
+{
+	[segmentsLock lock];
+	ASIDownloadSegment *segment = [self segmentForRequest:theRequest];
+	if (!segment || segment->complete || complete) {
+		[segmentsLock unlock];
+		return;
+	}
+	if (segment->end == ASIUnknownSegmentEnd) {
+		segment->end = segment->start+segment->received;
+		contentLength = segment->end;
+	}
+	if (segment->received != segment->end-segment->start) {
+		[self failWithError:[NSError errorWithDomain:NetworkRequestErrorDomain code:ASIUnexpectedRangeErrorType userInfo:[NSDictionary dictionaryWithObjectsAndKeys:@"The server sent less of the file than we asked for",NSLocalizedDescriptionKey,nil]]];
+		[segmentsLock unlock];
+		return;
+	}
+	[self segmentCompleted:segment];
+	[self scheduleProgressUpdate];
+	[segmentsLock unlock];
+}
+
+- (void)requestFailed:(ASIHTTPRequest *)theRequest
+{
+	[segmentsLock lock];
+	ASIDownloadSegment *segment = [self segmentForRequest:theRequest];
+	if (segment && !segment->complete && !complete) {
+		[self failWithError:[theRequest error]];
+	}
+	[segmentsLock unlock];
+}
+
+#pragma mark finishing
+
+- (void)closeFile
+{
+	if (fileDescriptor >= 0) {
+		close(fileDescriptor);
+		fileDescriptor = -1;
+	}
+}
+
+- (void)finish
+{
+	complete = YES;
+	[self closeFile];
+
+	NSError *fileError = nil;
+	if ([ASIHTTPRequest removeFileAtPath:[[self request] downloadDestinationPath] error:&fileError]) {
+		NSError *moveError = nil;
+		[[[[NSFileManager alloc] init] autorelease] moveItemAtPath:[self temporaryFileDownloadPath] toPath:[[self request] downloadDestinationPath] error:&moveError];
+		if (moveError) {
+			fileError = [NSError errorWithDomain:NetworkRequestErrorDomain code:ASIFileManagementError userInfo:[NSDictionary dictionaryWithObjectsAndKeys:[NSString stringWithFormat:@"Failed to move file from '%@' to '%@'",[self temporaryFileDownloadPath],[[self request] downloadDestinationPath]],NSLocalizedDescriptionKey,moveError,NSUnderlyingErrorKey,nil]];
+		}
+	}
+	if (fileError) {
+		[self setError:fileError];
+		[self performSelectorOnMainThread:@selector(reportFailure) withObject:nil waitUntilDone:NO];
+	} else {
+		[self performSelectorOnMainThread:@selector(reportFinished) withObject:nil waitUntilDone:NO];
+	}
+}
+
+- (void)failWithError:(NSError *)theError
+{
+	[segmentsLock lock];
+	if (complete) {
+		[segmentsLock unlock];
+		return;
+	}
+
+	// Cancelled before we started - we still tell the delegate, and keep ourselves alive until we have
+	if (!started) {
+		started = YES;
+		[self retain];
+	}
+	complete = YES;
+	[self setError:theError];
+	for (ASIDownloadSegment *segment in segments) {
+		[segment->request clearDelegatesAndCancel];
+		[segment->request release];
+		segment->request = nil;
+	}
+	[self closeFile];
+	if ([self temporaryFileDownloadPath]) {
+		[ASIHTTPRequest removeFileAtPath:[self temporaryFileDownloadPath] error:NULL];
+	}
+	[segmentsLock unlock];
+	[self performSelectorOnMainThread:@selector(reportFailure) withObject:nil waitUntilDone:NO];
+}
+
+#pragma mark talking to delegates (on the main thread)
+
+- (void)scheduleProgressUpdate
+{
+	NSTimeInterval now = ASIMonotonicTime();
+	if (now-lastProgressUpdate < [[self request] progressUpdateInterval]) {
+		return;
+	}
+	lastProgressUpdate = now;
+	[self performSelectorOnMainThread:@selector(updateProgress) withObject:nil waitUntilDone:NO];
+}
+
+- (void)updateProgress
+{
+	[segmentsLock lock];
+	unsigned long long done = totalBytesRead;
+	unsigned long long total = contentLength;
+	[segmentsLock unlock];
+	if (!total) {
+		return;
+	}
+	[ASIHTTPRequest updateProgressIndicator:&downloadProgressDelegate withProgress:done ofTotal:total];
+	#if NS_BLOCKS_AVAILABLE
+	if (downloadProgressBlock) {
+		downloadProgressBlock(done, total);
+	}
+	#endif
+}
+
+- (void)reportFinished
+{
+	[self updateProgress];
+	if (delegate && [delegate respondsToSelector:didFinishSelector]) {
+		[delegate performSelector:didFinishSelector withObject:self];
+	}
+	#if NS_BLOCKS_AVAILABLE
+	if (completionBlock) {
+		completionBlock();
+	}
+	[self releaseBlocks];
+	#endif
+	[self autorelease];
+}
+
+- (void)reportFailure
+{
+	if (delegate && [delegate respondsToSelector:didFailSelector]) {
+		[delegate performSelector:didFailSelector withObject:self];
+	}
+	#if NS_BLOCKS_AVAILABLE
+	if (failureBlock) {
+		failureBlock();
+	}
+	[self releaseBlocks];
+	#endif
+	[self autorelease];
+}
+
+#pragma mark blocks
+
+#if NS_BLOCKS_AVAILABLE
+- (void)setCompletionBlock:(ASIBasicBlock)aCompletionBlock
+{
+	[completionBlock release];
+	completionBlock = [aCompletionBlock copy];
+}
+
+- (void)setFailedBlock:(ASIBasicBlock)aFailedBlock
+{
+	[failureBlock release];
+	failureBlock = [aFailedBlock copy];
+}
+
+- (void)setDownloadProgressBlock:(ASIProgressBlock)aDownloadProgressBlock
+{
+	[downloadProgressBlock release];
+	downloadProgressBlock = [aDownloadProgressBlock copy];
+}
+
+// Blocks often retain whoever created them, so we let go of them once we're done
+- (void)releaseBlocks
+{
+	[completionBlock release];
+	completionBlock = nil;
+	[failureBlock release];
+	failureBlock = nil;
+	[downloadProgressBlock release];
+	downloadProgressBlock = nil;
+}
+#endif
+
+#pragma mark accessors
+
+- (unsigned long long)contentLength
+{
+	[segmentsLock lock];
+	unsigned long long length = contentLength;
+	[segmentsLock unlock];
+	return length;
+}
+
+- (unsigned long long)totalBytesRead
+{
+	[segmentsLock lock];
+	unsigned long long bytes = totalBytesRead;
+	[segmentsLock unlock];
+	return bytes;
+}
+
+- (BOOL)complete
+{
+	[segmentsLock lock];
+	BOOL isComplete = complete;
+	[segmentsLock unlock];
+	return isComplete;
+}
+
+@synthesize request;
+@synthesize numberOfSegments;
+@synthesize minimumSegmentSize;
+@synthesize responseStatusCode;
+@synthesize error;
+@synthesize delegate;
+@synthesize didFinishSelector;
+@synthesize didFailSelector;
+@synthesize downloadProgressDelegate;
+@synthesize userInfo;
+@synthesize temporaryFileDownloadPath;
+@synthesize rangeValidator;
+@end
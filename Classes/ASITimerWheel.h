@@ -0,0 +1,94 @@
+//
+//  ASITimerWheel.h
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+// The resolution of a timer wheel - targets are never called back more often than this
+#define ASITimerWheelTickInterval 0.25
+
+// The number of slots in each level of the wheel
+#define ASITimerWheelSlots 64
+
+// Returns the number of seconds since an arbitrary point in the past (usually boot)
+// Unlike [NSDate date], this never jumps backwards or forwards when the user or the network changes the system clock
+NSTimeInterval ASIMonotonicTime(void);
+
+@class ASITimerWheel;
+
+@protocol ASITimerWheelTarget <NSObject>
+// Called on the wheel's thread when the time the target was scheduled for has passed
+// The target is no longer scheduled when this is called - schedule it again for another callback
+- (void)timerWheelFired:(ASITimerWheel *)timerWheel;
+@end
+
+// A timer wheel keeps track of when lots of objects need to be woken up, using a single NSTimer
+// ASIHTTPRequest uses one per network thread to time out requests, wake up throttled requests and sample progress,
+// rather than creating a repeating timer for every request
+//
+// Targets due in the next 16 seconds live in a wheel of 64 quarter-second slots, targets due in the next ~17 minutes in a wheel of 64 16-second slots,
+// and anything later in an overflow list. Targets move down to the finer wheel as their time approaches.
+// When nothing is due in the next 16 seconds, the wheel's timer sleeps until the next time it needs to move targets down.
+//
+// Each wheel belongs to a single thread and runloop mode, and must only be used from that thread
+// The wheel retains its targets until they fire or are unscheduled
+@interface ASITimerWheel : NSObject {
+
+	// The thread this wheel belongs to (not retained - the thread keeps hold of the wheel in its thread dictionary)
+	NSThread *thread;
+
+	// The runloop mode our timer is scheduled in
+	NSString *runLoopMode;
+
+	// Fires every tick while targets are due soon
+	// It calls us through a proxy that does not retain us, so it does not keep us alive once our thread lets go of us
+	NSTimer *timer;
+
+	// The monotonic time of tick 0
+	NSTimeInterval startTime;
+
+	// The last tick we have processed
+	unsigned long long currentTick;
+
+	// The tick our timer will next fire for
+	unsigned long long timerTick;
+
+	// The finer wheel (one tick per slot) and the coarser wheel (64 ticks per slot)
+	// Each slot is an array of targets. Slots don't retain their targets (scheduledTicks does), so a target that is
+	// unscheduled can be released straight away, rather than when its old slot comes round
+	CFMutableArrayRef nearSlots[ASITimerWheelSlots];
+	CFMutableArrayRef farSlots[ASITimerWheelSlots];
+
+	// Targets due more than 4096 ticks from now
+	CFMutableArrayRef overflow;
+
+	// The number of entries in nearSlots, including those for targets that have since been rescheduled
+	NSUInteger nearSlotEntries;
+
+	// Maps each scheduled target to the tick it is due, and retains the target
+	// Slots may still contain targets that have been rescheduled or unscheduled - we check against this when a slot fires and skip them
+	CFMutableDictionaryRef scheduledTicks;
+
+	// YES while we are calling targets
+	BOOL isFiring;
+}
+
+// Returns the timer wheel for the current thread and the supplied runloop mode, creating one if needed
++ (ASITimerWheel *)timerWheelForCurrentThreadInMode:(NSString *)mode;
+
+// Call timerWheelFired: on target at (or shortly after) the supplied monotonic time (see ASIMonotonicTime)
+// Replaces any time the target was scheduled for previously
+- (void)scheduleTarget:(id <ASITimerWheelTarget>)target atTime:(NSTimeInterval)time;
+
+// Stop calling target (does nothing if it isn't scheduled)
+- (void)unscheduleTarget:(id <ASITimerWheelTarget>)target;
+
+// The number of targets currently scheduled
+- (NSUInteger)scheduledTargetCount;
+
+@property (assign, nonatomic, readonly) NSThread *thread;
+@property (retain, nonatomic, readonly) NSString *runLoopMode;
+@end
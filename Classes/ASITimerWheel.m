@@ -0,0 +1,310 @@
+//
+//  ASITimerWheel.m
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import "ASITimerWheel.h"
+#import <mach/mach_time.h>
+
+// Each slot in the far wheel covers 64 ticks, so the far wheel covers 4096 ticks
+#define ASITimerWheelSlotBits 6
+#define ASITimerWheelSlotMask (ASITimerWheelSlots-1)
+#define ASITimerWheelFarSpan (ASITimerWheelSlots*ASITimerWheelSlots)
+
+NSTimeInterval ASIMonotonicTime(void)
+{
+	static double secondsPerUnit = 0;
+	if (secondsPerUnit == 0) {
+		mach_timebase_info_data_t info;
+		mach_timebase_info(&info);
+		secondsPerUnit = ((double)info.numer/(double)info.denom)/1.0e9;
+	}
+	return (NSTimeInterval)mach_absolute_time()*secondsPerUnit;
+}
+
+// Targets are compared by pointer, and only the dictionary holding their due ticks retains them
+static const CFDictionaryKeyCallBacks ASITimerWheelKeyCallBacks = {0, NULL, NULL, NULL, NULL, NULL};
+
+@interface ASITimerWheel ()
+- (id)initWithRunLoopMode:(NSString *)mode;
+- (unsigned long long)tickForTime:(NSTimeInterval)time;
+- (void)placeTarget:(id)target atTick:(unsigned long long)tick;
+- (BOOL)getTick:(unsigned long long *)tick forTarget:(id)target;
+- (void)cascadeSlot:(CFMutableArrayRef)slot onlyForFarBlock:(BOOL)checkBlock;
+- (void)fireNearSlot;
+- (void)tick:(NSTimer *)theTimer;
+- (void)updateTimer;
+@property (retain, nonatomic) NSString *runLoopMode;
+@property (retain, nonatomic) NSTimer *timer;
+@end
+
+// An NSTimer retains its target, so a wheel whose timer called it directly would never be deallocated while the timer was running
+// Our timer calls this instead, which doesn't retain the wheel. The wheel invalidates the timer when it is deallocated, so this never outlives it in use
+@interface ASITimerWheelTimerTarget : NSObject {
+	ASITimerWheel *timerWheel;
+}
+- (id)initWithTimerWheel:(ASITimerWheel *)wheel;
+- (void)tick:(NSTimer *)theTimer;
+@end
+
+@implementation ASITimerWheelTimerTarget
+
+- (id)initWithTimerWheel:(ASITimerWheel *)wheel
+{
+	self = [super init];
+	timerWheel = wheel;
+	return self;
+}
+
+- (void)tick:(NSTimer *)theTimer
+{
+	[timerWheel tick:theTimer];
+}
+
+@end
+
+@implementation ASITimerWheel
+
++ (ASITimerWheel *)timerWheelForCurrentThreadInMode:(NSString *)mode
+{
+	NSMutableDictionary *threadDictionary = [[NSThread currentThread] threadDictionary];
+	NSString *key = [@"ASITimerWheel-" stringByAppendingString:mode];
+	ASITimerWheel *timerWheel = [threadDictionary objectForKey:key];
+	if (!timerWheel) {
+		timerWheel = [[[self alloc] initWithRunLoopMode:mode] autorelease];
+		[threadDictionary setObject:timerWheel forKey:key];
+	}
+	return timerWheel;
+}
+
+- (id)initWithRunLoopMode:(NSString *)mode
+{
+	self = [super init];
+	[self setRunLoopMode:mode];
+	thread = [NSThread currentThread];
+	startTime = ASIMonotonicTime();
+	NSUInteger i;
+	for (i=0; i<ASITimerWheelSlots; i++) {
+		nearSlots[i] = CFArrayCreateMutable(kCFAllocatorDefault, 0, NULL);
+		farSlots[i] = CFArrayCreateMutable(kCFAllocatorDefault, 0, NULL);
+	}
+	overflow = CFArrayCreateMutable(kCFAllocatorDefault, 0, NULL);
+	scheduledTicks = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &ASITimerWheelKeyCallBacks, NULL);
+	return self;
+}
+
+- (void)dealloc
+{
+	[timer invalidate];
+	[timer release];
+	[runLoopMode release];
+	NSUInteger i;
+	for (i=0; i<ASITimerWheelSlots; i++) {
+		CFRelease(nearSlots[i]);
+		CFRelease(farSlots[i]);
+	}
+	CFRelease(overflow);
+
+	// Release all the targets we are still holding on to
+	CFIndex count = CFDictionaryGetCount(scheduledTicks);
+	if (count) {
+		const void **targets = malloc(sizeof(void *)*(size_t)count);
+		CFDictionaryGetKeysAndValues(scheduledTicks, targets, NULL);
+		CFIndex t;
+		for (t=0; t<count; t++) {
+			CFRelease(targets[t]);
+		}
+		free(targets);
+	}
+	CFRelease(scheduledTicks);
+	[super dealloc];
+}
+
+#pragma mark scheduling
+
+- (unsigned long long)tickForTime:(NSTimeInterval)time
+{
+	if (time <= startTime) {
+		return 0;
+	}
+	return (unsigned long long)ceil((time-startTime)/ASITimerWheelTickInterval);
+}
+
+- (BOOL)getTick:(unsigned long long *)tick forTarget:(id)target
+{
+	const void *value = NULL;
+	if (!CFDictionaryGetValueIfPresent(scheduledTicks, target, &value)) {
+		return NO;
+	}
+	*tick = (unsigned long long)(uintptr_t)value;
+	return YES;
+}
+
+- (void)scheduleTarget:(id <ASITimerWheelTarget>)target atTime:(NSTimeInterval)time
+{
+	unsigned long long tick = [self tickForTime:time];
+	if (tick <= currentTick) {
+		tick = currentTick+1;
+	}
+	unsigned long long existingTick;
+	BOOL wasScheduled = [self getTick:&existingTick forTarget:target];
+	if (wasScheduled && existingTick == tick) {
+		return;
+	}
+	if (!wasScheduled) {
+		CFRetain(target);
+	}
+	CFDictionarySetValue(scheduledTicks, target, (const void *)(uintptr_t)tick);
+	[self placeTarget:target atTick:tick];
+
+	// If our timer is asleep until later than this, wake it up sooner
+	if (!isFiring && (![self timer] || tick < timerTick)) {
+		[self updateTimer];
+	}
+}
+
+- (void)unscheduleTarget:(id <ASITimerWheelTarget>)target
+{
+	unsigned long long tick;
+	if ([self getTick:&tick forTarget:target]) {
+		CFDictionaryRemoveValue(scheduledTicks, target);
+		CFRelease(target);
+
+		// Don't keep a timer running for nothing
+		if (!isFiring && !CFDictionaryGetCount(scheduledTicks)) {
+			[self updateTimer];
+		}
+	}
+}
+
+- (NSUInteger)scheduledTargetCount
+{
+	return (NSUInteger)CFDictionaryGetCount(scheduledTicks);
+}
+
+- (void)placeTarget:(id)target atTick:(unsigned long long)tick
+{
+	if (tick < currentTick) {
+		tick = currentTick;
+	}
+	unsigned long long ticksUntilDue = tick-currentTick;
+	if (ticksUntilDue < ASITimerWheelSlots) {
+		CFArrayAppendValue(nearSlots[tick & ASITimerWheelSlotMask], target);
+		nearSlotEntries++;
+	} else if (ticksUntilDue < ASITimerWheelFarSpan) {
+		CFArrayAppendValue(farSlots[(tick >> ASITimerWheelSlotBits) & ASITimerWheelSlotMask], target);
+	} else {
+		CFArrayAppendValue(overflow, target);
+	}
+}
+
+#pragma mark firing
+
+// Move targets from a far slot or the overflow list to wherever they belong now time has moved on
+// When checkBlock is YES, targets that aren't due in the block of 64 ticks starting now must have been rescheduled since they were put in this slot, so we drop them
+- (void)cascadeSlot:(CFMutableArrayRef)slot onlyForFarBlock:(BOOL)checkBlock
+{
+	CFIndex count = CFArrayGetCount(slot);
+	if (!count) {
+		return;
+	}
+	CFArrayRef targets = CFArrayCreateCopy(kCFAllocatorDefault, slot);
+	CFArrayRemoveAllValues(slot);
+	CFIndex i;
+	for (i=0; i<count; i++) {
+		id target = (id)CFArrayGetValueAtIndex(targets, i);
+		unsigned long long tick;
+		if ([self getTick:&tick forTarget:target]) {
+			if (checkBlock && (tick >> ASITimerWheelSlotBits) != (currentTick >> ASITimerWheelSlotBits)) {
+				continue;
+			}
+			[self placeTarget:target atTick:tick];
+		}
+	}
+	CFRelease(targets);
+}
+
+- (void)fireNearSlot
+{
+	CFMutableArrayRef slot = nearSlots[currentTick & ASITimerWheelSlotMask];
+	CFIndex count = CFArrayGetCount(slot);
+	if (!count) {
+		return;
+	}
+	CFArrayRef targets = CFArrayCreateCopy(kCFAllocatorDefault, slot);
+	CFArrayRemoveAllValues(slot);
+	nearSlotEntries -= (NSUInteger)count;
+	CFIndex i;
+	for (i=0; i<count; i++) {
+		id target = (id)CFArrayGetValueAtIndex(targets, i);
+		unsigned long long tick;
+		if ([self getTick:&tick forTarget:target] && tick == currentTick) {
+			// Take the target out before calling it, so it can schedule itself again
+			CFDictionaryRemoveValue(scheduledTicks, target);
+			[target timerWheelFired:self];
+			CFRelease(target);
+		}
+	}
+	CFRelease(targets);
+}
+
+- (void)tick:(NSTimer *)theTimer
+{
+	NSTimeInterval now = ASIMonotonicTime();
+	unsigned long long dueTick = (now > startTime ? (unsigned long long)floor((now-startTime)/ASITimerWheelTickInterval) : 0);
+
+	isFiring = YES;
+	while (currentTick < dueTick) {
+
+		// Nothing is due before we next need to move targets down from the far wheel, so skip straight there
+		if (!nearSlotEntries) {
+			unsigned long long lastTickBeforeCascade = currentTick | ASITimerWheelSlotMask;
+			if (lastTickBeforeCascade >= dueTick) {
+				currentTick = dueTick;
+				break;
+			}
+			currentTick = lastTickBeforeCascade;
+		}
+		currentTick++;
+		if ((currentTick & (ASITimerWheelFarSpan-1)) == 0) {
+			[self cascadeSlot:overflow onlyForFarBlock:NO];
+		}
+		if ((currentTick & ASITimerWheelSlotMask) == 0) {
+			[self cascadeSlot:farSlots[(currentTick >> ASITimerWheelSlotBits) & ASITimerWheelSlotMask] onlyForFarBlock:YES];
+		}
+		[self fireNearSlot];
+	}
+	isFiring = NO;
+	[self updateTimer];
+}
+
+// Sets our timer to fire when the next slot with targets in it comes round, or when we next need to move targets down from the far wheel
+// If there is nothing scheduled at all, the timer is removed
+- (void)updateTimer
+{
+	if (!CFDictionaryGetCount(scheduledTicks)) {
+		[[self timer] invalidate];
+		[self setTimer:nil];
+		return;
+	}
+	if (nearSlotEntries) {
+		timerTick = currentTick+1;
+	} else {
+		timerTick = (currentTick | ASITimerWheelSlotMask)+1;
+	}
+	NSDate *fireDate = [NSDate dateWithTimeIntervalSinceNow:(startTime+(timerTick*ASITimerWheelTickInterval))-ASIMonotonicTime()];
+	if (![self timer]) {
+		ASITimerWheelTimerTarget *timerTarget = [[[ASITimerWheelTimerTarget alloc] initWithTimerWheel:self] autorelease];
+		[self setTimer:[[[NSTimer alloc] initWithFireDate:fireDate interval:ASITimerWheelTickInterval target:timerTarget selector:@selector(tick:) userInfo:nil repeats:YES] autorelease]];
+		[[NSRunLoop currentRunLoop] addTimer:[self timer] forMode:[self runLoopMode]];
+	} else {
+		[[self timer] setFireDate:fireDate];
+	}
+}
+
+@synthesize thread;
+@synthesize runLoopMode;
+@synthesize timer;
+@end
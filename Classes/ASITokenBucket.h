@@ -0,0 +1,52 @@
+//
+//  ASITokenBucket.h
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+// A token bucket limits how quickly bytes can be sent or received, while still allowing short bursts
+// Bytes flow into the bucket at a steady rate up to its capacity, and are taken out as data is transferred
+// A transfer can take the bucket into debt - requests stop reading and writing until the debt has been paid off
+//
+// Rather than storing the number of bytes in the bucket, we store the time at which it would be empty (no bytes and no debt)
+// Taking bytes out just moves this time forward, which we can do with a single compare-and-swap
+// Refilling happens implicitly as time passes, so nothing needs to top the bucket up, and there is no one-second measurement window
+//
+// All the functions below can be used from any thread without a lock
+typedef struct _ASITokenBucket {
+
+	// Bytes added to the bucket per second, 0 when the bucket isn't limiting anything
+	volatile long rate;
+
+	// The most bytes the bucket will hold, which is the largest burst we allow after a quiet period
+	volatile long capacity;
+
+	// The monotonic time (in microseconds, see ASIMonotonicTime in ASITimerWheel.h) when the bucket would be empty
+	// Any time more than capacity/rate seconds in the past means the bucket is full
+	volatile int64_t emptyTime;
+} ASITokenBucket;
+
+// Returns YES if the bucket is limiting anything
+// This is just a read of the rate, so it costs next to nothing when no limit is set
+static inline BOOL ASITokenBucketIsLimited(ASITokenBucket *bucket)
+{
+	return (bucket->rate != 0);
+}
+
+// Sets how many bytes per second the bucket allows (0 to turn off the limit)
+// The bucket holds a quarter of a second's worth of bytes, and starts off full
+void ASITokenBucketSetRate(ASITokenBucket *bucket, unsigned long bytesPerSecond);
+
+// Take bytes that have been sent or received out of the bucket (does nothing when the bucket is not limited)
+void ASITokenBucketConsume(ASITokenBucket *bucket, unsigned long bytes);
+
+// The number of bytes that can be transferred right now
+// Negative when the bucket is in debt, LLONG_MAX when the bucket is not limited
+long long ASITokenBucketAvailableBytes(ASITokenBucket *bucket);
+
+// The monotonic time at which the bucket's debt will have been paid off, and requests can transfer data again
+// Returns the current time if the bucket is not in debt
+NSTimeInterval ASITokenBucketWakeUpTime(ASITokenBucket *bucket);
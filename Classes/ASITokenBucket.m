@@ -0,0 +1,94 @@
+//
+//  ASITokenBucket.m
+//  Part of ASIHTTPRequest -> http://allseeing-i.com/ASIHTTPRequest
+//
+//  Copyright 2010 All-Seeing Interactive. All rights reserved.
+//
+
+#import "ASITokenBucket.h"
+#import "ASITimerWheel.h"
+#import <libkern/OSAtomic.h>
+
+#define ASIMicrosecondsPerSecond 1000000LL
+
+static int64_t ASIMonotonicMicroseconds(void)
+{
+	return (int64_t)(ASIMonotonicTime()*ASIMicrosecondsPerSecond);
+}
+
+// On 32-bit platforms a 64-bit read can tear, so we read emptyTime with an atomic operation everywhere except inside a compare-and-swap loop
+static int64_t ASITokenBucketReadEmptyTime(ASITokenBucket *bucket)
+{
+	return OSAtomicAdd64Barrier(0, &bucket->emptyTime);
+}
+
+void ASITokenBucketSetRate(ASITokenBucket *bucket, unsigned long bytesPerSecond)
+{
+	long rate = (long)bytesPerSecond;
+	if (rate < 0) {
+		rate = LONG_MAX;
+	}
+	if (rate == bucket->rate) {
+		return;
+	}
+	long capacity = rate/4;
+	if (capacity < 1) {
+		capacity = 1;
+	}
+
+	// Turn the limit off while we change the bucket, so nobody sees a rate that doesn't match the capacity
+	bucket->rate = 0;
+	OSMemoryBarrier();
+	bucket->capacity = capacity;
+	int64_t oldEmptyTime;
+	do {
+		oldEmptyTime = bucket->emptyTime;
+	} while (!OSAtomicCompareAndSwap64Barrier(oldEmptyTime, 0, &bucket->emptyTime));
+	OSMemoryBarrier();
+	bucket->rate = rate;
+}
+
+void ASITokenBucketConsume(ASITokenBucket *bucket, unsigned long bytes)
+{
+	long rate = bucket->rate;
+	if (!rate || !bytes) {
+		return;
+	}
+	int64_t now = ASIMonotonicMicroseconds();
+	int64_t fullTime = now-((int64_t)bucket->capacity*ASIMicrosecondsPerSecond)/rate;
+	int64_t cost = ((int64_t)bytes*ASIMicrosecondsPerSecond)/rate;
+
+	int64_t oldEmptyTime, newEmptyTime;
+	do {
+		oldEmptyTime = bucket->emptyTime;
+
+		// A bucket can't hold more than its capacity, however long it has been since anyone used it
+		newEmptyTime = (oldEmptyTime < fullTime ? fullTime : oldEmptyTime)+cost;
+	} while (!OSAtomicCompareAndSwap64Barrier(oldEmptyTime, newEmptyTime, &bucket->emptyTime));
+}
+
+long long ASITokenBucketAvailableBytes(ASITokenBucket *bucket)
+{
+	long rate = bucket->rate;
+	if (!rate) {
+		return LLONG_MAX;
+	}
+	long capacity = bucket->capacity;
+	int64_t elapsed = ASIMonotonicMicroseconds()-ASITokenBucketReadEmptyTime(bucket);
+
+	// Check for a full bucket first, so a bucket that hasn't been used for a long time can't overflow the multiplication below
+	if (elapsed >= ((int64_t)capacity*ASIMicrosecondsPerSecond)/rate) {
+		return capacity;
+	}
+	return (elapsed*rate)/ASIMicrosecondsPerSecond;
+}
+
+NSTimeInterval ASITokenBucketWakeUpTime(ASITokenBucket *bucket)
+{
+	NSTimeInterval now = ASIMonotonicTime();
+	if (!bucket->rate) {
+		return now;
+	}
+	NSTimeInterval emptyTime = (NSTimeInterval)ASITokenBucketReadEmptyTime(bucket)/ASIMicrosecondsPerSecond;
+	return (emptyTime > now ? emptyTime : now);
+}
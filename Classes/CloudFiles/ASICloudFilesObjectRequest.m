@@ -180,6 +180,7 @@
 	}	
 	
 	[request setShouldStreamPostDataFromDisk:YES];
+	[request setShouldMemoryMapPostBodyFile:YES];
 	[request setPostBodyFilePath:filePath];
 	return request;	
 }
@@ -58,6 +58,7 @@ extern NSString *const ASIS3StorageClassReducedRedundancy;
 + (id)PUTRequestForFile:(NSString *)filePath withBucket:(NSString *)bucket key:(NSString *)key;
 
 // Create a PUT request using the supplied NSData as the body (set the mime-type manually with setMimeType: if necessary)
+// The request sends a Content-MD5 header, so S3 will reject the data if it arrives damaged
 + (id)PUTRequestForData:(NSData *)data withBucket:(NSString *)bucket key:(NSString *)key;
 
 // Create a DELETE request for the object at path
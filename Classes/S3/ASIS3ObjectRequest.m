@@ -26,6 +26,9 @@ NSString *const ASIS3StorageClassReducedRedundancy = @"REDUCED_REDUNDANCY";
 	ASIS3ObjectRequest *newRequest = [[[self alloc] initWithURL:nil] autorelease];
 	[newRequest setBucket:theBucket];
 	[newRequest setKey:theKey];
+	// S3 sends the MD5 of the object as its ETag, so we can check uploads and downloads as they happen
+	// (Except for objects uploaded in parts, or encrypted with SSE-KMS or SSE-C - see responseETagIsMD5OfBody:)
+	[newRequest setShouldVerifyDigestsAgainstETag:YES];
 	return newRequest;
 }
 
@@ -51,6 +54,7 @@ NSString *const ASIS3StorageClassReducedRedundancy = @"REDUCED_REDUNDANCY";
 	ASIS3ObjectRequest *newRequest = [self requestWithBucket:theBucket key:theKey];
 	[newRequest setPostBodyFilePath:filePath];
 	[newRequest setShouldStreamPostDataFromDisk:YES];
+	[newRequest setShouldMemoryMapPostBodyFile:YES];
 	[newRequest setRequestMethod:@"PUT"];
 	[newRequest setMimeType:[ASIHTTPRequest mimeTypeForFileAtPath:filePath]];
 	return newRequest;
@@ -145,11 +149,39 @@ NSString *const ASIS3StorageClassReducedRedundancy = @"REDUCED_REDUNDANCY";
 	return headers;
 }
 
+// Objects encrypted with a KMS key or a key we supplied (SSE-KMS / SSE-C) have ETags that aren't an MD5 of their contents
+- (BOOL)responseETagIsMD5OfBody:(NSString *)eTag
+{
+	NSArray *headerSets = [NSArray arrayWithObjects:([self requestHeaders] ? [self requestHeaders] : [NSDictionary dictionary]),[self responseHeaders],nil];
+	for (NSDictionary *headers in headerSets) {
+		for (NSString *header in headers) {
+			NSString *name = [header lowercaseString];
+			if ([name hasPrefix:@"x-amz-server-side-encryption-customer-"]) {
+				return NO;
+			}
+			if ([name isEqualToString:@"x-amz-server-side-encryption"] && [[headers objectForKey:header] hasPrefix:@"aws:kms"]) {
+				return NO;
+			}
+		}
+	}
+	return [super responseETagIsMD5OfBody:eTag];
+}
+
 - (NSString *)stringToSignForHeaders:(NSString *)canonicalizedAmzHeaders resource:(NSString *)canonicalizedResource
 {
 	if ([[self requestMethod] isEqualToString:@"PUT"] && ![self sourceKey]) {
 		[self addRequestHeader:@"Content-Type" value:[self mimeType]];
-		return [NSString stringWithFormat:@"PUT\n\n%@\n%@\n%@%@",[self mimeType],dateString,canonicalizedAmzHeaders,canonicalizedResource];
+
+		// When the body is already in memory, we can send Content-MD5 so S3 refuses to store it if it is damaged on the way
+		// Bodies streamed from disk are checked against the ETag S3 sends back instead (see shouldVerifyDigestsAgainstETag), so we don't read them twice
+		NSString *contentMD5 = @"";
+		if ([[self postBody] length] && ![self shouldStreamPostDataFromDisk] && ![self postBodyParts] && ![self shouldCompressRequestBody]) {
+			ASIDigest *digest = [ASIDigest digestWithAlgorithms:ASIMD5DigestAlgorithm];
+			[digest updateWithBytes:[[self postBody] bytes] length:[[self postBody] length]];
+			contentMD5 = [ASIHTTPRequest base64forData:[digest digestForAlgorithm:ASIMD5DigestAlgorithm]];
+			[self addRequestHeader:@"Content-MD5" value:contentMD5];
+		}
+		return [NSString stringWithFormat:@"PUT\n%@\n%@\n%@\n%@%@",contentMD5,[self mimeType],dateString,canonicalizedAmzHeaders,canonicalizedResource];
 	} 
 	return [super stringToSignForHeaders:canonicalizedAmzHeaders resource:canonicalizedResource];
 }
@@ -35,6 +35,8 @@ static NSString *sharedSecretAccessKey = nil;
 	// After a bit of experimentation/guesswork, this number seems to reduce the chance of a 'RequestTimeout' error
 	[self setPersistentConnectionTimeoutSeconds:20];
 	[self setRequestScheme:ASIS3RequestSchemeHTTP];
+	// S3 won't accept a PUT without a Content-Length, so compressed bodies can't be sent chunked
+	[self setShouldPrecomputeCompressedPostLength:YES];
 	return self;
 }
 
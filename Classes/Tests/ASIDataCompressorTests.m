@@ -12,6 +12,20 @@
 #import "ASIDataDecompressor.h"
 #import "ASIHTTPRequest.h"
 
+#if ASI_BROTLI_SUPPORT
+// We don't link the brotli encoder, so we wrap data in an uncompressed meta-block followed by an empty last one (data must be 1-65536 bytes)
+static NSData *ASIUncompressedBrotliData(NSData *data)
+{
+	NSUInteger lengthMinusOne = [data length]-1;
+	unsigned char header[3] = {(unsigned char)((lengthMinusOne & 0xF) << 4), (unsigned char)((lengthMinusOne >> 4) & 0xFF), (unsigned char)(((lengthMinusOne >> 12) & 0xF) | 0x10)};
+	NSMutableData *brotliData = [NSMutableData dataWithBytes:header length:sizeof(header)];
+	[brotliData appendData:data];
+	unsigned char lastMetaBlock = 0x03;
+	[brotliData appendBytes:&lastMetaBlock length:1];
+	return brotliData;
+}
+#endif
+
 @implementation ASIDataCompressorTests
 
 - (void)setUp
@@ -176,4 +190,237 @@
 
 }
 
+- (void)testParallelDeflateFile
+{
+	// Big enough to be compressed in parallel, and not a whole number of blocks
+	NSString *filePath = [[self filePathForTemporaryTestFiles] stringByAppendingPathComponent:@"big_story.txt"];
+	NSString *gzippedFilePath = [[self filePathForTemporaryTestFiles] stringByAppendingPathComponent:@"big_story.txt.gz"];
+	NSString *inflatedFilePath = [[self filePathForTemporaryTestFiles] stringByAppendingPathComponent:@"big_story_inflated.txt"];
+	NSData *story = [NSData dataWithContentsOfFile:[[self filePathForTemporaryTestFiles] stringByAppendingPathComponent:@"story.txt"]];
+	NSMutableData *originalData = [NSMutableData data];
+	while ([originalData length] < 12*1024*1024) {
+		[originalData appendData:story];
+	}
+	[originalData appendBytes:"The end" length:7];
+	[originalData writeToFile:filePath atomically:NO];
+
+	NSError *error = nil;
+	if (![ASIDataCompressor compressDataFromFile:filePath toFile:gzippedFilePath error:&error]) {
+		GHFail(@"Deflate failed because %@",error);
+	}
+
+	// Make sure gzip can read it
+	NSTask *task = [[[NSTask alloc] init] autorelease];
+	[task setLaunchPath:@"/usr/bin/gzip"];
+	[task setArguments:[NSArray arrayWithObjects:@"-t",gzippedFilePath,nil]];
+	[task launch];
+	[task waitUntilExit];
+	BOOL success = ([task terminationStatus] == 0);
+	GHAssertTrue(success,@"gzip could not read data deflated in parallel");
+
+	if (![ASIDataDecompressor uncompressDataFromFile:gzippedFilePath toFile:inflatedFilePath error:&error]) {
+		GHFail(@"Inflate failed because %@",error);
+	}
+	success = [[NSData dataWithContentsOfFile:inflatedFilePath] isEqualToData:originalData];
+	GHAssertTrue(success,@"Data deflated in parallel did not inflate to the original data");
+
+	// Splitting the file up shouldn't cost much compression
+	unsigned long long gzippedFileSize = [[[NSFileManager defaultManager] attributesOfItemAtPath:gzippedFilePath error:NULL] fileSize];
+	success = (gzippedFileSize < [originalData length]/2);
+	GHAssertTrue(success,@"Data deflated in parallel was not compressed well enough");
+
+	[ASIHTTPRequest removeFileAtPath:filePath error:NULL];
+	[ASIHTTPRequest removeFileAtPath:gzippedFilePath error:NULL];
+	[ASIHTTPRequest removeFileAtPath:inflatedFilePath error:NULL];
+}
+
+- (void)testContentEncodings
+{
+	BOOL success = ([ASIDataDecompressor decompressorClassForContentEncoding:@"gzip"] == [ASIDataDecompressor class]);
+	GHAssertTrue(success,@"Failed to find a decompressor for gzip");
+
+	success = ([ASIDataDecompressor decompressorClassForContentEncoding:@" X-GZip "] == [ASIDataDecompressor class]);
+	GHAssertTrue(success,@"Failed to find a decompressor for x-gzip");
+
+	success = ([ASIDataDecompressor decompressorClassForContentEncoding:@"deflate"] == [ASIDataDecompressor class]);
+	GHAssertTrue(success,@"Failed to find a decompressor for deflate");
+
+	success = ([ASIDataDecompressor decompressorClassForContentEncoding:@"compress"] == nil);
+	GHAssertTrue(success,@"Returned a decompressor for an encoding we can't decode");
+
+	success = ([ASIDataDecompressor decompressorClassForContentEncoding:nil] == nil);
+	GHAssertTrue(success,@"Returned a decompressor when there was no encoding");
+
+	// Every encoding we ask for must be one we can decode, and x-gzip shouldn't be asked for
+	NSArray *encodings = [ASIDataDecompressor supportedContentEncodings];
+	for (NSString *encoding in encodings) {
+		success = ([ASIDataDecompressor decompressorClassForContentEncoding:encoding] != nil);
+		GHAssertTrue(success,@"Advertised an encoding we can't decode");
+	}
+	success = ([encodings containsObject:@"gzip"] && ![encodings containsObject:@"x-gzip"]);
+	GHAssertTrue(success,@"Advertised the wrong encodings");
+
+	#if ASI_BROTLI_SUPPORT
+	success = ([encodings containsObject:@"br"]);
+	GHAssertTrue(success,@"Failed to advertise brotli");
+	#endif
+	#if ASI_ZSTD_SUPPORT
+	success = ([encodings containsObject:@"zstd"]);
+	GHAssertTrue(success,@"Failed to advertise zstd");
+	#endif
+
+	NSString *originalString = @"The quick brown fox jumped over the lazy dog. The quick brown fox jumped over the lazy dog.";
+	NSData *deflatedData = [ASIDataCompressor compressData:[originalString dataUsingEncoding:NSUTF8StringEncoding] error:NULL];
+	NSData *inflatedData = [[ASIDataDecompressor decompressorClassForContentEncoding:@"gzip"] uncompressData:deflatedData error:NULL];
+	NSString *inflatedString = [[[NSString alloc] initWithBytes:[inflatedData bytes] length:[inflatedData length] encoding:NSUTF8StringEncoding] autorelease];
+	success = ([inflatedString isEqualToString:originalString]);
+	GHAssertTrue(success,@"Failed to inflate data using the decompressor for gzip");
+}
+
+- (void)testMultipleContentEncodings
+{
+	NSData *originalData = [@"The quick brown fox jumped over the lazy dog. The quick brown fox jumped over the lazy dog." dataUsingEncoding:NSUTF8StringEncoding];
+
+	BOOL success = ([ASIDataDecompressor canDecodeContentEncoding:@"gzip, deflate"] && [ASIDataDecompressor canDecodeContentEncoding:@"gzip, identity"]);
+	GHAssertTrue(success,@"Failed to decode a list of encodings");
+	success = (![ASIDataDecompressor canDecodeContentEncoding:@"gzip, compress"] && ![ASIDataDecompressor canDecodeContentEncoding:@"identity"] && ![ASIDataDecompressor decompressorForContentEncoding:@"gzip, compress"]);
+	GHAssertTrue(success,@"Claimed to decode a list of encodings including one we can't decode");
+
+	// Gzipped twice
+	NSData *encodedData = [ASIDataCompressor compressData:[ASIDataCompressor compressData:originalData error:NULL] error:NULL];
+	NSData *decodedData = [[ASIDataDecompressor decompressorForContentEncoding:@"gzip, x-gzip"] uncompressAllBytes:(Bytef *)[encodedData bytes] length:[encodedData length] error:NULL];
+	success = [decodedData isEqualToData:originalData];
+	GHAssertTrue(success,@"Failed to undo two encodings");
+
+	// In small pieces, as it would arrive from the network
+	ASIDataDecompressor *decompressor = [ASIDataDecompressor decompressorForContentEncoding:@"gzip, gzip"];
+	NSMutableData *streamedData = [NSMutableData data];
+	NSUInteger offset;
+	for (offset=0; offset<[encodedData length]; offset+=7) {
+		NSError *error = nil;
+		NSData *piece = [decompressor uncompressBytes:(Bytef *)[encodedData bytes]+offset length:MIN((NSUInteger)7,[encodedData length]-offset) error:&error];
+		GHAssertNil(error,@"Failed to undo two encodings in pieces");
+		[streamedData appendData:piece];
+	}
+	success = [streamedData isEqualToData:originalData];
+	GHAssertTrue(success,@"Failed to undo two encodings in pieces");
+
+	#if ASI_BROTLI_SUPPORT
+	encodedData = ASIUncompressedBrotliData([ASIDataCompressor compressData:originalData error:NULL]);
+	decodedData = [[ASIDataDecompressor decompressorForContentEncoding:@"gzip, br"] uncompressAllBytes:(Bytef *)[encodedData bytes] length:[encodedData length] error:NULL];
+	success = [decodedData isEqualToData:originalData];
+	GHAssertTrue(success,@"Failed to undo gzip and brotli");
+	#endif
+}
+
+- (void)testInflateAllBytes
+{
+	NSData *firstData = [@"The quick brown fox jumped over the lazy dog. " dataUsingEncoding:NSUTF8StringEncoding];
+	NSData *secondData = [@"The lazy dog didn't notice." dataUsingEncoding:NSUTF8StringEncoding];
+
+	// Two gzip members one after another, as you'd get from concatenating two gzip files
+	NSMutableData *gzippedData = [NSMutableData dataWithData:[ASIDataCompressor compressData:firstData error:NULL]];
+	[gzippedData appendData:[ASIDataCompressor compressData:secondData error:NULL]];
+	NSMutableData *expectedData = [NSMutableData dataWithData:firstData];
+	[expectedData appendData:secondData];
+
+	NSError *error = nil;
+	NSData *inflatedData = [[ASIDataDecompressor decompressor] uncompressAllBytes:(Bytef *)[gzippedData bytes] length:[gzippedData length] error:&error];
+	BOOL success = (!error && [inflatedData isEqualToData:expectedData]);
+	GHAssertTrue(success,@"Failed to inflate every member of a multi-member gzip file");
+
+	// Highly compressible data really can be much bigger than we are willing to allocate up front, so the buffer has to grow
+	NSMutableData *zeros = [NSMutableData dataWithLength:4*1024*1024];
+	NSData *compressedZeros = [ASIDataCompressor compressData:zeros error:NULL];
+	inflatedData = [[ASIDataDecompressor decompressor] uncompressAllBytes:(Bytef *)[compressedZeros bytes] length:[compressedZeros length] error:&error];
+	success = (!error && [inflatedData isEqualToData:zeros]);
+	GHAssertTrue(success,@"Failed to inflate data that expands more than we allocate for up front");
+}
+
+- (void)testRawDeflate
+{
+	NSData *originalData = [@"The quick brown fox jumped over the lazy dog. The quick brown fox jumped over the lazy dog." dataUsingEncoding:NSUTF8StringEncoding];
+
+	// The string above, deflated without a zlib header (as some servers send 'deflate' responses)
+	unsigned char rawDeflate[] = {0x0b,0xc9,0x48,0x55,0x28,0x2c,0xcd,0x4c,0xce,0x56,0x48,0x2a,0xca,0x2f,0xcf,0x53,0x48,0xcb,0xaf,0x50,0xc8,0x2a,0xcd,0x2d,0x48,0x4d,0x51,0xc8,0x2f,0x4b,0x2d,0x52,0x28,0x01,0xca,0xe7,0x24,0x56,0x55,0x2a,0xa4,0xe4,0xa7,0xeb,0x29,0x84,0x90,0xa2,0x1a,0x00};
+
+	NSError *error = nil;
+	NSData *inflatedData = [ASIDataDecompressor uncompressData:[NSData dataWithBytes:rawDeflate length:sizeof(rawDeflate)] error:&error];
+	BOOL success = (!error && [inflatedData isEqualToData:originalData]);
+	GHAssertTrue(success,@"Failed to inflate raw deflate data");
+
+	ASIDataDecompressor *decompressor = [ASIDataDecompressor decompressorForContentEncoding:@"deflate"];
+	NSMutableData *streamedData = [NSMutableData data];
+	[streamedData appendData:[decompressor uncompressBytes:rawDeflate length:20 error:&error]];
+	[streamedData appendData:[decompressor uncompressBytes:rawDeflate+20 length:sizeof(rawDeflate)-20 error:&error]];
+	success = (!error && [streamedData isEqualToData:originalData]);
+	GHAssertTrue(success,@"Failed to inflate raw deflate data in pieces");
+
+	// Data that is neither should still fail
+	unsigned char garbage[] = {0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff};
+	error = nil;
+	[ASIDataDecompressor uncompressData:[NSData dataWithBytes:garbage length:sizeof(garbage)] error:&error];
+	GHAssertNotNil(error,@"Failed to report an error for data that isn't compressed");
+}
+
+#if ASI_BROTLI_SUPPORT
+- (void)testBrotliDecoding
+{
+	NSData *originalData = [@"The quick brown fox jumped over the lazy dog. The quick brown fox jumped over the lazy dog." dataUsingEncoding:NSUTF8StringEncoding];
+	NSData *encodedData = ASIUncompressedBrotliData(originalData);
+
+	Class decompressorClass = [ASIDataDecompressor decompressorClassForContentEncoding:@"br"];
+	NSError *error = nil;
+	NSData *decodedData = [decompressorClass uncompressData:encodedData error:&error];
+	BOOL success = (!error && [decodedData isEqualToData:originalData]);
+	GHAssertTrue(success,@"Failed to decode brotli data");
+
+	ASIDataDecompressor *decompressor = [decompressorClass decompressor];
+	NSMutableData *streamedData = [NSMutableData data];
+	NSUInteger offset;
+	for (offset=0; offset<[encodedData length]; offset+=5) {
+		[streamedData appendData:[decompressor uncompressBytes:(Bytef *)[encodedData bytes]+offset length:MIN((NSUInteger)5,[encodedData length]-offset) error:&error]];
+	}
+	success = (!error && [streamedData isEqualToData:originalData]);
+	GHAssertTrue(success,@"Failed to decode brotli data in pieces");
+
+	// An uncompressed meta-block holding 'hello', but with a padding bit set, which brotli doesn't allow
+	unsigned char badPadding[] = {0x40,0x00,0x30,0x68,0x65,0x6c,0x6c,0x6f,0x03};
+	error = nil;
+	[decompressorClass uncompressData:[NSData dataWithBytes:badPadding length:sizeof(badPadding)] error:&error];
+	GHAssertNotNil(error,@"Failed to report an error for bad brotli data");
+}
+#endif
+
+#if ASI_ZSTD_SUPPORT
+- (void)testZstdDecoding
+{
+	NSData *originalData = [@"The quick brown fox jumped over the lazy dog. The quick brown fox jumped over the lazy dog." dataUsingEncoding:NSUTF8StringEncoding];
+
+	// The string above, compressed by the zstd command line tool (the frame records its size)
+	unsigned char zstdFrame[] = {0x28,0xb5,0x2f,0xfd,0x00,0x68,0xbd,0x01,0x00,0xf4,0x02,0x54,0x68,0x65,0x20,0x71,0x75,0x69,0x63,0x6b,0x20,0x62,0x72,0x6f,0x77,0x6e,0x20,0x66,0x6f,0x78,0x20,0x6a,0x75,0x6d,0x70,0x65,0x64,0x20,0x6f,0x76,0x65,0x72,0x20,0x74,0x68,0x65,0x20,0x6c,0x61,0x7a,0x79,0x20,0x64,0x6f,0x67,0x2e,0x20,0x54,0x01,0x00,0x2f,0x9a,0xaa,0x0c};
+	NSData *encodedData = [NSData dataWithBytes:zstdFrame length:sizeof(zstdFrame)];
+
+	Class decompressorClass = [ASIDataDecompressor decompressorClassForContentEncoding:@"zstd"];
+	NSError *error = nil;
+	NSData *decodedData = [decompressorClass uncompressData:encodedData error:&error];
+	BOOL success = (!error && [decodedData isEqualToData:originalData]);
+	GHAssertTrue(success,@"Failed to decode zstd data");
+
+	ASIDataDecompressor *decompressor = [decompressorClass decompressor];
+	NSMutableData *streamedData = [NSMutableData data];
+	NSUInteger offset;
+	for (offset=0; offset<[encodedData length]; offset+=5) {
+		[streamedData appendData:[decompressor uncompressBytes:(Bytef *)[encodedData bytes]+offset length:MIN((NSUInteger)5,[encodedData length]-offset) error:&error]];
+	}
+	success = (!error && [streamedData isEqualToData:originalData]);
+	GHAssertTrue(success,@"Failed to decode zstd data in pieces");
+
+	unsigned char garbage[] = {0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff};
+	error = nil;
+	[decompressorClass uncompressData:[NSData dataWithBytes:garbage length:sizeof(garbage)] error:&error];
+	GHAssertNotNil(error,@"Failed to report an error for bad zstd data");
+}
+#endif
+
 @end
@@ -14,9 +14,12 @@
 
 - (void)testDefaultMethod;
 - (void)testPostWithFileUpload;
+- (void)testFileUploadWithoutTemporaryFile;
+- (void)testDataUploadInPlace;
 - (void)testEmptyData;
 - (void)testSubclass;
 - (void)testURLEncodedPost;
+- (void)testURLEncodedBodyEscaping;
 - (void)testCharset;
 - (void)testPUT;
 - (void)testCopy;
@@ -108,6 +108,65 @@
 	
 }
 
+- (void)testFileUploadWithoutTemporaryFile
+{
+	NSURL *url = [NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/post"];
+
+	unsigned int size = 1024*512;
+	NSMutableData *data = [NSMutableData dataWithLength:size];
+	NSString *path = [[self filePathForTemporaryTestFiles] stringByAppendingPathComponent:@"bigfile"];
+	[data writeToFile:path atomically:NO];
+
+	ASIFormDataRequest *request = [ASIFormDataRequest requestWithURL:url];
+	[request setPostValue:@"foo" forKey:@"post_var"];
+	[request setFile:path forKey:@"file"];
+	[request buildPostBody];
+
+	// The file should be sent from where it is, with the boundaries and headers around it kept in memory
+	BOOL success = (![request postBodyFilePath] && ![request didCreateTemporaryPostDataFile]);
+	GHAssertTrue(success,@"Copied an attached file into a temporary file");
+	success = ([[request postBodyParts] count] == 3 && [[[request postBodyParts] objectAtIndex:1] isEqualToString:path]);
+	GHAssertTrue(success,@"Failed to send an attached file in place");
+
+	unsigned long long partsLength = size+[[[request postBodyParts] objectAtIndex:0] length]+[[[request postBodyParts] objectAtIndex:2] length];
+	success = ([request postLength] == partsLength && [[[request requestHeaders] objectForKey:@"Content-Length"] isEqualToString:[NSString stringWithFormat:@"%llu",partsLength]]);
+	GHAssertTrue(success,@"Got the wrong length for a body made of several parts");
+
+	[request startSynchronous];
+	success = ([[request responseString] isEqualToString:[NSString stringWithFormat:@"post_var: %@\r\nfile_name: %@\r\nfile_size: %u\r\ncontent_type: %@",@"foo",@"bigfile",size,@"application/octet-stream"]]);
+	GHAssertTrue(success,@"Failed to upload the correct data");
+	success = ([request totalBytesSent] == partsLength);
+	GHAssertTrue(success,@"Failed to send the whole body");
+}
+
+- (void)testDataUploadInPlace
+{
+	NSURL *url = [NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/post"];
+
+	unsigned int size = 1024*512;
+	NSData *data = [NSData dataWithData:[NSMutableData dataWithLength:size]];
+
+	ASIFormDataRequest *request = [ASIFormDataRequest requestWithURL:url];
+	[request setPostValue:@"foo" forKey:@"post_var"];
+	[request setData:data forKey:@"file"];
+	[request buildPostBody];
+
+	// The data should be sent from where it is, rather than copied into the body
+	BOOL success = ([[request postBodyParts] count] == 3 && [[request postBodyParts] objectAtIndex:1] == data);
+	GHAssertTrue(success,@"Copied attached data into the body");
+
+	// Appending to a copy's body shouldn't change ours
+	ASIFormDataRequest *request2 = [[request copy] autorelease];
+	NSUInteger lastPartLength = [[[request postBodyParts] lastObject] length];
+	[request2 appendPostData:[@"more" dataUsingEncoding:NSUTF8StringEncoding]];
+	success = ([[[request postBodyParts] lastObject] length] == lastPartLength);
+	GHAssertTrue(success,@"Appending to a copy of a request changed the original's body");
+
+	[request startSynchronous];
+	success = ([[request responseString] isEqualToString:[NSString stringWithFormat:@"post_var: %@\r\nfile_name: %@\r\nfile_size: %u\r\ncontent_type: %@",@"foo",@"file",size,@"application/octet-stream"]]);
+	GHAssertTrue(success,@"Failed to upload the correct data");
+}
+
 // Test fix for bug where setting an empty string for a form post value would cause the rest of the post body to be ignored (because an NSOutputStream won't like it if you try to write 0 bytes)
 - (void)testEmptyData
 {
@@ -150,6 +209,43 @@
 	GHAssertTrue(success,@"Failed to send the correct post data");			
 }
 
+// URL-encoded bodies are escaped a byte at a time - make sure we get exactly what CFURLCreateStringByAddingPercentEscapes would give us
+- (void)testURLEncodedBodyEscaping
+{
+	NSMutableString *allASCII = [NSMutableString string];
+	unichar c;
+	for (c=1; c<128; c++) {
+		[allASCII appendFormat:@"%C",c];
+	}
+	NSArray *strings = [NSArray arrayWithObjects:@"plain_key-1.0",allASCII,@"£100.00",@"&??aaa=//ciaoèèè",@"日本語",@"\U0001F600",@"",nil];
+	NSStringEncoding encodings[2] = {NSUTF8StringEncoding, NSISOLatin1StringEncoding};
+
+	NSUInteger e;
+	for (e=0; e<2; e++) {
+		ASIFormDataRequest *request = [ASIFormDataRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com"]];
+		[request setStringEncoding:encodings[e]];
+		NSMutableString *expectedBody = [NSMutableString string];
+		NSUInteger i;
+		for (i=0; i<[strings count]; i++) {
+			NSString *string = [strings objectAtIndex:i];
+			[request addPostValue:string forKey:string];
+
+			// Strings that can't be represented in the encoding are left out, as before
+			NSString *escaped = [(NSString *)CFURLCreateStringByAddingPercentEscapes(kCFAllocatorDefault, (CFStringRef)string, NULL, CFSTR(":/?#[]@!$ &'()*+,;=\"<>%{}|\\^~`"), CFStringConvertNSStringEncodingToEncoding(encodings[e])) autorelease];
+			if (!escaped) {
+				escaped = @"";
+			}
+			[expectedBody appendFormat:@"%@=%@%@",escaped,escaped,(i<[strings count]-1 ? @"&" : @"")];
+
+			BOOL success = [[request encodeURL:string] isEqualToString:escaped];
+			GHAssertTrue(success,@"Escaped a string incorrectly");
+		}
+		[request buildPostBody];
+		BOOL success = [[request postBody] isEqualToData:[expectedBody dataUsingEncoding:NSASCIIStringEncoding]];
+		GHAssertTrue(success,@"Built the wrong URL-encoded body");
+	}
+}
+
 - (void)testCharset
 {
 	NSURL *url = [NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/formdata-charset"];
@@ -31,6 +31,15 @@
 - (void)testAutomaticRedirection;
 - (void)test30xCrash;
 - (void)testUploadContentLength;
+- (void)testResumeManifest;
+- (void)testMappedFileUpload;
+- (void)testDigests;
+- (void)testDigestVerification;
+- (void)testCoalescedRequests;
+- (void)testRetryPolicy;
+- (void)testRetryPolicyStatusCodes;
+- (void)testRetryResumesPartialDownload;
+- (void)testRetryKeepsRequestedRange;
 - (void)testDownloadContentLength;
 - (void)testFileDownload;
 - (void)testDownloadProgress;
@@ -43,6 +52,8 @@
 - (void)testCharacterEncoding;
 - (void)testCompressedResponse;
 - (void)testCompressedResponseDownloadToFile;
+- (void)testSegmentedDownload;
+- (void)testSegmentedDownloadCancelledBeforeStart;
 - (void)test000SSL;
 - (void)testRedirectPreservesSession;
 - (void)testTooMuchRedirection;
@@ -59,6 +70,15 @@
 - (void)testCloseConnection;
 - (void)testPersistentConnections;
 - (void)testNilPortCredentialsMatching;
+- (void)testNetworkThreadPool;
+- (void)testConnectionPool;
+- (void)testTimerWheel;
+- (void)testCoalescedProgress;
+- (void)testCallbackModes;
+- (void)testTokenBucket;
+- (void)testBandwidthClasses;
+- (void)testResponseBuffer;
+- (void)testReadBufferPool;
 
 @property (retain, nonatomic) NSMutableData *responseData;
 @end
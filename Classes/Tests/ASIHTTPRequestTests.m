@@ -10,6 +10,15 @@
 #import "ASIHTTPRequest.h"
 #import "ASINetworkQueue.h"
 #import "ASIFormDataRequest.h"
+#import "ASIConnectionPool.h"
+#import "ASITimerWheel.h"
+#import "ASITokenBucket.h"
+#import "ASIBandwidthClass.h"
+#import "ASIResponseBuffer.h"
+#import "ASIReadBufferPool.h"
+#import "ASIDataCompressor.h"
+#import "ASISegmentedDownload.h"
+#import "ASIRetryPolicy.h"
 #import <SystemConfiguration/SystemConfiguration.h>
 #import <unistd.h>
 
@@ -25,6 +34,30 @@
 }
 @end
 
+// Used for timer wheel test
+@interface ASITimerWheelTestTarget : NSObject <ASITimerWheelTarget> {
+	NSTimeInterval fireTime;
+}
+@property (assign) NSTimeInterval fireTime;
+@end
+@implementation ASITimerWheelTestTarget
+- (void)timerWheelFired:(ASITimerWheel *)timerWheel
+{
+	[self setFireTime:ASIMonotonicTime()];
+}
+@synthesize fireTime;
+@end
+
+
+// Lets us make a request retry part way through a download, as it would after a timeout, compare coalescing keys, and check digests against made up responses
+@interface ASIHTTPRequest (ASIPrivateTesting)
+- (BOOL)retryWithPolicyAfterError:(NSError *)theError;
+- (NSString *)coalescingKeyForRequest;
+- (NSError *)digestMismatchError;
+- (void)setResponseStatusCode:(int)newStatusCode;
+- (void)setRequestBodyDigest:(ASIDigest *)newDigest;
+- (void)setResponseDigest:(ASIDigest *)newDigest;
+@end
 
 // Stop clang complaining about undeclared selectors
 @interface ASIHTTPRequestTests ()
@@ -653,6 +686,84 @@
 	
 }
 
+- (void)testResumeManifest
+{
+	NSURL *url = [NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/the_great_american_novel.txt"];
+	NSString *temporaryPath = [[self filePathForTemporaryTestFiles] stringByAppendingPathComponent:@"manifest.temp"];
+	NSString *manifestPath = [temporaryPath stringByAppendingPathExtension:@"asiresume"];
+	NSString *downloadPath = [[self filePathForTemporaryTestFiles] stringByAppendingPathComponent:@"manifest.txt"];
+	[ASIHTTPRequest removeFileAtPath:temporaryPath error:NULL];
+	[ASIHTTPRequest removeFileAtPath:manifestPath error:NULL];
+
+	// Download part of the file
+	ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:url];
+	[request setTemporaryFileDownloadPath:temporaryPath];
+	[request setDownloadDestinationPath:downloadPath];
+	[request setAllowResumeForFileDownloads:YES];
+	[request setAllowCompressedResponse:NO];
+	[request startAsynchronous];
+	while (1) {
+		[[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.25]];
+		if ([request totalBytesRead] > 32*1024) {
+			[request cancel];
+			break;
+		}
+	}
+	unsigned long long partialFileSize = [[[NSFileManager defaultManager] attributesOfItemAtPath:temporaryPath error:NULL] fileSize];
+	NSDictionary *manifest = [NSDictionary dictionaryWithContentsOfFile:manifestPath];
+	GHAssertNotNil(manifest,@"Failed to write a resume manifest when the download was cancelled");
+
+	BOOL success = ([[manifest objectForKey:@"VerifiedLength"] unsignedLongLongValue] == partialFileSize);
+	GHAssertTrue(success,@"Resume manifest doesn't cover the partial download");
+
+	success = [[manifest objectForKey:@"URL"] isEqualToString:[url absoluteString]];
+	GHAssertTrue(success,@"Resume manifest has the wrong url");
+
+	// A partial download that matches its manifest is resumed
+	request = [ASIHTTPRequest requestWithURL:url];
+	[request setTemporaryFileDownloadPath:temporaryPath];
+	[request setDownloadDestinationPath:downloadPath];
+	[request setAllowResumeForFileDownloads:YES];
+	[request buildRequestHeaders];
+	success = ([request partialDownloadSize] == partialFileSize);
+	GHAssertTrue(success,@"Failed to resume a partial download that matched its manifest");
+
+	success = ([[manifest objectForKey:@"ETag"] || [manifest objectForKey:@"Last-Modified"]]) == ([[request requestHeaders] objectForKey:@"If-Range"] != nil);
+	GHAssertTrue(success,@"Failed to send the validator from the manifest as If-Range");
+
+	// Corrupt a byte of the partial download - we should start again
+	NSFileHandle *fileHandle = [NSFileHandle fileHandleForUpdatingAtPath:temporaryPath];
+	[fileHandle seekToFileOffset:partialFileSize/2];
+	[fileHandle writeData:[@"#" dataUsingEncoding:NSUTF8StringEncoding]];
+	[fileHandle closeFile];
+
+	request = [ASIHTTPRequest requestWithURL:url];
+	[request setTemporaryFileDownloadPath:temporaryPath];
+	[request setDownloadDestinationPath:downloadPath];
+	[request setAllowResumeForFileDownloads:YES];
+	[request buildRequestHeaders];
+	success = ([request partialDownloadSize] == 0 && ![[request requestHeaders] objectForKey:@"Range"]);
+	GHAssertTrue(success,@"Resumed a partial download that didn't match its checksum");
+
+	success = (![[NSFileManager defaultManager] fileExistsAtPath:temporaryPath] && ![[NSFileManager defaultManager] fileExistsAtPath:manifestPath]);
+	GHAssertTrue(success,@"Failed to remove a partial download we couldn't resume");
+
+	// A partial download without a manifest isn't trusted either
+	[@"This is not the file you are looking for" writeToFile:temporaryPath atomically:NO encoding:NSUTF8StringEncoding error:NULL];
+	request = [ASIHTTPRequest requestWithURL:url];
+	[request setTemporaryFileDownloadPath:temporaryPath];
+	[request setDownloadDestinationPath:downloadPath];
+	[request setAllowResumeForFileDownloads:YES];
+	[request startSynchronous];
+
+	GHAssertNil([request error],@"Request failed");
+	success = ([[[NSFileManager defaultManager] attributesOfItemAtPath:downloadPath error:NULL] fileSize] == [request contentLength]);
+	GHAssertTrue(success,@"Failed to start again when a partial download had no manifest");
+
+	success = ![[NSFileManager defaultManager] fileExistsAtPath:manifestPath];
+	GHAssertTrue(success,@"Failed to remove the resume manifest when the download completed");
+}
+
 - (void)testUploadContentLength
 {
 	//This url will return the contents of the Content-Length request header
@@ -665,6 +776,435 @@
 	GHAssertTrue(success,@"Sent wrong content length");
 }
 
+- (void)testDigests
+{
+	// Known answers
+	ASIDigest *digest = [ASIDigest digestWithAlgorithms:(ASIMD5DigestAlgorithm|ASISHA256DigestAlgorithm)];
+	[digest updateWithBytes:"a" length:1];
+	[digest updateWithBytes:"bc" length:2];
+	BOOL success = [[digest hexDigestForAlgorithm:ASIMD5DigestAlgorithm] isEqualToString:@"900150983cd24fb0d6963f7d28e17f72"];
+	GHAssertTrue(success,@"Wrong MD5 digest");
+	success = [[digest hexDigestForAlgorithm:ASISHA256DigestAlgorithm] isEqualToString:@"ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"];
+	GHAssertTrue(success,@"Wrong SHA-256 digest");
+	GHAssertNil([digest digestForAlgorithm:ASICRC32CDigestAlgorithm],@"Returned a digest for an algorithm we didn't ask for");
+
+	digest = [ASIDigest digestWithAlgorithms:ASICRC32CDigestAlgorithm];
+	[digest updateWithBytes:"123456789" length:9];
+	success = [[digest hexDigestForAlgorithm:ASICRC32CDigestAlgorithm] isEqualToString:@"e3069283"];
+	GHAssertTrue(success,@"Wrong CRC32C digest");
+
+	// Digests worked out while the request is running should match the bodies
+	NSURL *url = [NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/the_great_american_novel.txt"];
+	NSMutableData *body = [NSMutableData dataWithLength:1024*256];
+	memset([body mutableBytes], 'x', [body length]);
+	ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:url];
+	[request setRequestMethod:@"PUT"];
+	[request setPostBody:body];
+	[request setAllowCompressedResponse:NO];
+	[request setRequestBodyDigestAlgorithms:ASISHA256DigestAlgorithm];
+	[request setResponseDigestAlgorithms:ASIMD5DigestAlgorithm];
+	[request startSynchronous];
+	GHAssertNil([request error],@"Request failed, cannot proceed with this test");
+
+	digest = [ASIDigest digestWithAlgorithms:ASISHA256DigestAlgorithm];
+	[digest updateWithBytes:[body bytes] length:[body length]];
+	success = [[[request requestBodyDigest] digestForAlgorithm:ASISHA256DigestAlgorithm] isEqualToData:[digest digestForAlgorithm:ASISHA256DigestAlgorithm]];
+	GHAssertTrue(success,@"Request body digest doesn't match the body");
+
+	digest = [ASIDigest digestWithAlgorithms:ASIMD5DigestAlgorithm];
+	[digest updateWithBytes:[[request responseData] bytes] length:[[request responseData] length]];
+	success = [[[request responseDigest] digestForAlgorithm:ASIMD5DigestAlgorithm] isEqualToData:[digest digestForAlgorithm:ASIMD5DigestAlgorithm]];
+	GHAssertTrue(success,@"Response digest doesn't match the response");
+}
+
+- (void)testDigestVerification
+{
+	NSURL *url = [NSURL URLWithString:@"http://allseeing-i.com"];
+	NSData *body = [@"This is the body" dataUsingEncoding:NSUTF8StringEncoding];
+	ASIDigest *digest = [ASIDigest digestWithAlgorithms:ASIMD5DigestAlgorithm];
+	[digest updateWithBytes:[body bytes] length:[body length]];
+	NSString *md5 = [digest hexDigestForAlgorithm:ASIMD5DigestAlgorithm];
+	ASIDigest *otherDigest = [ASIDigest digestWithAlgorithms:ASIMD5DigestAlgorithm];
+	[otherDigest updateWithBytes:"abc" length:3];
+
+	// Content-MD5
+	ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:url];
+	[request setShouldVerifyResponseDigest:YES];
+	[request setResponseStatusCode:200];
+	[request setResponseDigest:digest];
+	[request setResponseHeaders:[NSDictionary dictionaryWithObject:[ASIHTTPRequest base64forData:[digest digestForAlgorithm:ASIMD5DigestAlgorithm]] forKey:@"Content-MD5"]];
+	GHAssertNil([request digestMismatchError],@"Failed to accept a response body that matched its Content-MD5");
+
+	[request setResponseHeaders:[NSDictionary dictionaryWithObject:[ASIHTTPRequest base64forData:[otherDigest digestForAlgorithm:ASIMD5DigestAlgorithm]] forKey:@"Content-MD5"]];
+	BOOL success = ([[request digestMismatchError] code] == ASIDigestMismatchErrorType);
+	GHAssertTrue(success,@"Failed to notice a response body that didn't match its Content-MD5");
+
+	// ETags of downloads
+	request = [ASIHTTPRequest requestWithURL:url];
+	[request setShouldVerifyDigestsAgainstETag:YES];
+	[request setResponseStatusCode:200];
+	[request setResponseDigest:digest];
+	[request setResponseHeaders:[NSDictionary dictionaryWithObject:[NSString stringWithFormat:@"\"%@\"",md5] forKey:@"Etag"]];
+	GHAssertNil([request digestMismatchError],@"Failed to accept a response body that matched its ETag");
+
+	[request setResponseHeaders:[NSDictionary dictionaryWithObject:[NSString stringWithFormat:@"\"%@\"",[otherDigest hexDigestForAlgorithm:ASIMD5DigestAlgorithm]] forKey:@"Etag"]];
+	success = ([[request digestMismatchError] code] == ASIDigestMismatchErrorType);
+	GHAssertTrue(success,@"Failed to notice a response body that didn't match its ETag");
+
+	// ETags that aren't an MD5 (eg for objects uploaded in parts) should be ignored
+	[request setResponseHeaders:[NSDictionary dictionaryWithObject:[NSString stringWithFormat:@"\"%@-2\"",[otherDigest hexDigestForAlgorithm:ASIMD5DigestAlgorithm]] forKey:@"Etag"]];
+	GHAssertNil([request digestMismatchError],@"Compared a response body with an ETag that isn't an MD5");
+
+	// ETags of uploads
+	request = [ASIHTTPRequest requestWithURL:url];
+	[request setRequestMethod:@"PUT"];
+	[request setShouldVerifyDigestsAgainstETag:YES];
+	[request setResponseStatusCode:200];
+	[request setRequestBodyDigest:digest];
+	[request setResponseHeaders:[NSDictionary dictionaryWithObject:[otherDigest hexDigestForAlgorithm:ASIMD5DigestAlgorithm] forKey:@"Etag"]];
+	success = ([[request digestMismatchError] code] == ASIDigestMismatchErrorType);
+	GHAssertTrue(success,@"Failed to notice the server's ETag didn't match the request body we sent");
+
+	// Unsuccessful responses aren't checked
+	[request setResponseStatusCode:500];
+	GHAssertNil([request digestMismatchError],@"Compared an error response with the request body");
+}
+
+- (void)testCoalescedRequests
+{
+	NSURL *url = [NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/the_great_american_novel.txt"];
+	ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:url];
+	[request startSynchronous];
+	NSData *expectedData = [request responseData];
+	GHAssertNil([request error],@"Request failed, cannot proceed with this test");
+
+	// Identical requests should all get the whole response, whichever one actually fetches it
+	ASIConnectionPool *pool = [ASIConnectionPool sharedPool];
+	unsigned long long connectionsUsed = [pool connectionsCreated]+[pool connectionsReused];
+	NSMutableArray *requests = [NSMutableArray array];
+	NSUInteger i;
+	for (i=0; i<4; i++) {
+		request = [ASIHTTPRequest requestWithURL:url];
+		[request setShouldCoalesceIdenticalRequests:YES];
+		[request startAsynchronous];
+		[requests addObject:request];
+	}
+	request = [ASIHTTPRequest requestWithURL:url];
+	[request setShouldCoalesceIdenticalRequests:YES];
+	[request startSynchronous];
+	[requests addObject:request];
+	for (request in requests) {
+		while (![request isFinished]) {
+			[[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.25]];
+		}
+		GHAssertNil([request error],@"Coalesced request failed");
+		BOOL success = [[request responseData] isEqualToData:expectedData] && [request responseStatusCode] == 200;
+		GHAssertTrue(success,@"Coalesced request got the wrong response");
+	}
+
+	// Only one of them should have used a connection to fetch the response
+	BOOL success = ([pool connectionsCreated]+[pool connectionsReused]-connectionsUsed == 1);
+	GHAssertTrue(success,@"More than one of the identical requests fetched the response");
+
+	// Requests that would trust the server differently shouldn't share a response
+	ASIHTTPRequest *otherRequest = [ASIHTTPRequest requestWithURL:url];
+	[otherRequest setValidatesSecureCertificate:NO];
+	request = [ASIHTTPRequest requestWithURL:url];
+	success = ![[otherRequest coalescingKeyForRequest] isEqualToString:[request coalescingKeyForRequest]];
+	GHAssertTrue(success,@"Requests that validate certificates differently have the same coalescing key");
+
+	[otherRequest setValidatesSecureCertificate:YES];
+	[otherRequest setProxyHost:@"proxy.example.com"];
+	[otherRequest setProxyPort:8080];
+	success = ![[otherRequest coalescingKeyForRequest] isEqualToString:[request coalescingKeyForRequest]];
+	GHAssertTrue(success,@"Requests that use different proxies have the same coalescing key");
+
+	// Requests waiting for a request that is cancelled should fetch the response themselves
+	ASIHTTPRequest *leader = [ASIHTTPRequest requestWithURL:url];
+	[leader setShouldCoalesceIdenticalRequests:YES];
+	[leader startAsynchronous];
+	request = [ASIHTTPRequest requestWithURL:url];
+	[request setShouldCoalesceIdenticalRequests:YES];
+	[request startAsynchronous];
+	[leader cancel];
+	while (![request isFinished]) {
+		[[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.25]];
+	}
+	GHAssertNil([request error],@"Request failed because the request it was waiting for was cancelled");
+	success = [[request responseData] isEqualToData:expectedData];
+	GHAssertTrue(success,@"Request got the wrong response after the request it was waiting for was cancelled");
+}
+
+- (void)testRetryPolicy
+{
+	NSURL *url = [NSURL URLWithString:@"http://there-is-no-spoon.allseeing-i.com"];
+	ASIRetryPolicy *policy = [ASIRetryPolicy retryPolicy];
+	[policy setMaximumRetries:2];
+	[policy setBaseDelay:0.01];
+
+	// Connection failures should be retried until we reach maximumRetries
+	ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:url];
+	[request setRetryPolicy:policy];
+	[request startSynchronous];
+	BOOL success = ([[request error] code] == ASIConnectionFailureErrorType);
+	GHAssertTrue(success,@"Request should have failed");
+	success = ([request policyRetryCount] == 2);
+	GHAssertTrue(success,@"Request failed to retry the right number of times");
+
+	// POST requests aren't idempotent, so they shouldn't be retried by default
+	request = [ASIHTTPRequest requestWithURL:url];
+	[request setRequestMethod:@"POST"];
+	[request setRetryPolicy:policy];
+	[request startSynchronous];
+	success = ([request policyRetryCount] == 0);
+	GHAssertTrue(success,@"Retried a request that isn't idempotent");
+
+	[policy setShouldRetryNonIdempotentRequests:YES];
+	request = [ASIHTTPRequest requestWithURL:url];
+	[request setRequestMethod:@"POST"];
+	[request setRetryPolicy:policy];
+	[request startSynchronous];
+	success = ([request policyRetryCount] == 2);
+	GHAssertTrue(success,@"Failed to retry a POST request when told to");
+
+	// Once the budget has been used up, requests shouldn't retry until it refills
+	policy = [ASIRetryPolicy retryPolicy];
+	[policy setBaseDelay:0.01];
+	[policy setRetryBudget:1];
+	[policy setRetryBudgetRefillRate:0];
+	request = [ASIHTTPRequest requestWithURL:url];
+	[request setRetryPolicy:policy];
+	[request startSynchronous];
+	success = ([request policyRetryCount] == 1);
+	GHAssertTrue(success,@"Failed to use the retry budget");
+	request = [ASIHTTPRequest requestWithURL:url];
+	[request setRetryPolicy:policy];
+	[request startSynchronous];
+	success = ([request policyRetryCount] == 0);
+	GHAssertTrue(success,@"Retried when the retry budget had been used up");
+
+	// Copies should use the same policy, so they share its budget
+	success = ([[[request copy] autorelease] retryPolicy] == policy);
+	GHAssertTrue(success,@"Copy of a request failed to keep its retry policy");
+
+	// Successful responses shouldn't be retried
+	request = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/first"]];
+	[request setRetryPolicy:[ASIRetryPolicy retryPolicy]];
+	[request startSynchronous];
+	success = (![request error] && [request policyRetryCount] == 0);
+	GHAssertTrue(success,@"Retried a successful request");
+
+	// A request cancelled while waiting to retry should fail straight away
+	policy = [ASIRetryPolicy retryPolicy];
+	[policy setBaseDelay:60];
+	[policy setMaximumDelay:60];
+	request = [ASIHTTPRequest requestWithURL:url];
+	[request setRetryPolicy:policy];
+	[request startAsynchronous];
+	NSDate *dateStarted = [NSDate date];
+	while (![request policyRetryCount] && [dateStarted timeIntervalSinceNow] > -20) {
+		[[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+	}
+	[request cancel];
+	while (![request isFinished] && [dateStarted timeIntervalSinceNow] > -30) {
+		[[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+	}
+	success = ([[request error] code] == ASIRequestCancelledErrorType);
+	GHAssertTrue(success,@"Failed to cancel a request waiting to retry");
+}
+
+- (void)testRetryPolicyStatusCodes
+{
+	NSURL *url = [NSURL URLWithString:@"http://allseeing-i.com"];
+	ASIRetryPolicy *policy = [ASIRetryPolicy retryPolicy];
+	[policy setBaseDelay:1];
+	[policy setRetryBudgetRefillRate:0];
+	[policy setRetryBudget:100];
+
+	// Responses with a retryable status code are retried, others aren't
+	ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:url];
+	NSTimeInterval delay = -1;
+	int statusCodes[] = {408,429,500,502,503,504};
+	NSUInteger i;
+	for (i=0; i<sizeof(statusCodes)/sizeof(int); i++) {
+		[request setResponseStatusCode:statusCodes[i]];
+		BOOL success = ([policy shouldRetryRequest:request error:nil delay:&delay] && delay >= 0 && delay <= 1);
+		GHAssertTrue(success,@"Failed to retry a response with status code %d",statusCodes[i]);
+	}
+	[request setResponseStatusCode:404];
+	GHAssertFalse([policy shouldRetryRequest:request error:nil delay:&delay],@"Retried a response with status code 404");
+	[request setResponseStatusCode:501];
+	GHAssertFalse([policy shouldRetryRequest:request error:nil delay:&delay],@"Retried a response with status code 501");
+
+	[policy setRetryableStatusCodes:[NSSet setWithObject:[NSNumber numberWithInt:404]]];
+	[request setResponseStatusCode:404];
+	GHAssertTrue([policy shouldRetryRequest:request error:nil delay:&delay],@"Failed to retry a status code we added to retryableStatusCodes");
+	[request setResponseStatusCode:503];
+	GHAssertFalse([policy shouldRetryRequest:request error:nil delay:&delay],@"Retried a status code we removed from retryableStatusCodes");
+
+	// Retry-After can be a number of seconds
+	policy = [ASIRetryPolicy retryPolicy];
+	[policy setRetryBudgetRefillRate:0];
+	[policy setRetryBudget:100];
+	[request setResponseStatusCode:503];
+	[request setResponseHeaders:[NSDictionary dictionaryWithObject:@" 7 " forKey:@"Retry-After"]];
+	BOOL success = ([policy retryAfterDelayForRequest:request] == 7);
+	GHAssertTrue(success,@"Failed to read a Retry-After header in seconds");
+	success = ([policy shouldRetryRequest:request error:nil delay:&delay] && delay == 7);
+	GHAssertTrue(success,@"Failed to wait as long as Retry-After asked");
+
+	// Or an HTTP date
+	NSDateFormatter *formatter = [[[NSDateFormatter alloc] init] autorelease];
+	[formatter setLocale:[[[NSLocale alloc] initWithLocaleIdentifier:@"en_US_POSIX"] autorelease]];
+	[formatter setTimeZone:[NSTimeZone timeZoneWithAbbreviation:@"GMT"]];
+	[formatter setDateFormat:@"EEE, dd MMM yyyy HH:mm:ss 'GMT'"];
+	[request setResponseHeaders:[NSDictionary dictionaryWithObject:[formatter stringFromDate:[NSDate dateWithTimeIntervalSinceNow:60]] forKey:@"Retry-After"]];
+	delay = [policy retryAfterDelayForRequest:request];
+	success = (delay > 55 && delay <= 60);
+	GHAssertTrue(success,@"Failed to read a Retry-After header with a date");
+
+	// Dates in the past mean we can retry straight away
+	[request setResponseHeaders:[NSDictionary dictionaryWithObject:[formatter stringFromDate:[NSDate dateWithTimeIntervalSinceNow:-60]] forKey:@"Retry-After"]];
+	success = ([policy retryAfterDelayForRequest:request] == 0);
+	GHAssertTrue(success,@"Failed to treat a Retry-After date in the past as no wait");
+
+	// Values we don't understand are ignored
+	[request setResponseHeaders:[NSDictionary dictionaryWithObject:@"soon" forKey:@"Retry-After"]];
+	success = ([policy retryAfterDelayForRequest:request] < 0);
+	GHAssertTrue(success,@"Failed to ignore a Retry-After header we couldn't read");
+
+	// We give up rather than waiting longer than maximumRetryAfterDelay
+	[policy setMaximumRetryAfterDelay:30];
+	[request setResponseHeaders:[NSDictionary dictionaryWithObject:@"31" forKey:@"Retry-After"]];
+	GHAssertFalse([policy shouldRetryRequest:request error:nil delay:&delay],@"Retried when Retry-After asked us to wait longer than maximumRetryAfterDelay");
+
+	// Unless we've been told not to honour it
+	[policy setShouldHonourRetryAfter:NO];
+	success = ([policy shouldRetryRequest:request error:nil delay:&delay] && delay <= [policy baseDelay]);
+	GHAssertTrue(success,@"Waited for Retry-After when told not to honour it");
+}
+
+- (void)testRetryResumesPartialDownload
+{
+	NSURL *url = [NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/the_great_american_novel.txt"];
+	ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:url];
+	[request setAllowCompressedResponse:NO];
+	[request startSynchronous];
+	NSData *expectedData = [request responseData];
+	GHAssertNil([request error],@"Request failed, cannot proceed with this test");
+
+	NSString *temporaryPath = [[self filePathForTemporaryTestFiles] stringByAppendingPathComponent:@"retry-resume.temp"];
+	NSString *downloadPath = [[self filePathForTemporaryTestFiles] stringByAppendingPathComponent:@"retry-resume.txt"];
+	[ASIHTTPRequest removeFileAtPath:temporaryPath error:NULL];
+	[ASIHTTPRequest removeFileAtPath:[temporaryPath stringByAppendingPathExtension:@"asiresume"] error:NULL];
+
+	ASIRetryPolicy *policy = [ASIRetryPolicy retryPolicy];
+	[policy setBaseDelay:0];
+
+	// Throttle the download so we can make it retry part way through
+	[ASIHTTPRequest setMaxBandwidthPerSecond:ASIWWANBandwidthThrottleAmount];
+	request = [ASIHTTPRequest requestWithURL:url];
+	[request setTemporaryFileDownloadPath:temporaryPath];
+	[request setDownloadDestinationPath:downloadPath];
+	[request setAllowResumeForFileDownloads:YES];
+	[request setAllowCompressedResponse:NO];
+	[request setShouldAttemptPersistentConnection:NO];
+	[request setRetryPolicy:policy];
+	[request startAsynchronous];
+
+	NSDate *dateStarted = [NSDate date];
+	while ([request totalBytesRead] < 32*1024 && ![request isFinished] && [dateStarted timeIntervalSinceNow] > -30) {
+		[[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+	}
+	GHAssertFalse([request isFinished],@"Downloaded whole file too quickly, cannot proceed with this test");
+
+	NSError *timeoutError = [NSError errorWithDomain:NetworkRequestErrorDomain code:ASIRequestTimedOutErrorType userInfo:nil];
+	[request performSelector:@selector(retryWithPolicyAfterError:) onThread:[ASIHTTPRequest threadForRequest:request] withObject:timeoutError waitUntilDone:YES];
+	[ASIHTTPRequest setMaxBandwidthPerSecond:0];
+
+	while (![request isFinished] && [dateStarted timeIntervalSinceNow] > -120) {
+		[[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+	}
+	GHAssertNil([request error],@"Request failed");
+
+	BOOL success = ([request policyRetryCount] == 1 && [[[request requestHeaders] objectForKey:@"Range"] hasPrefix:@"bytes="] && [[request responseHeaders] objectForKey:@"Content-Range"]);
+	GHAssertTrue(success,@"Failed to ask for the rest of the file when retrying");
+
+	success = [[NSData dataWithContentsOfFile:downloadPath] isEqualToData:expectedData];
+	GHAssertTrue(success,@"Retrying corrupted the downloaded file");
+}
+
+- (void)testRetryKeepsRequestedRange
+{
+	NSURL *url = [NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/the_great_american_novel.txt"];
+	ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:url];
+	[request setAllowCompressedResponse:NO];
+	[request startSynchronous];
+	NSData *expectedData = [[request responseData] subdataWithRange:NSMakeRange(1024, 128*1024)];
+	GHAssertNil([request error],@"Request failed, cannot proceed with this test");
+
+	ASIRetryPolicy *policy = [ASIRetryPolicy retryPolicy];
+	[policy setBaseDelay:0];
+
+	// Ask for part of the file ourselves, as a segment of an ASISegmentedDownload would
+	[ASIHTTPRequest setMaxBandwidthPerSecond:ASIWWANBandwidthThrottleAmount];
+	request = [ASIHTTPRequest requestWithURL:url];
+	[request addRequestHeader:@"Range" value:@"bytes=1024-132095"];
+	[request setAllowCompressedResponse:NO];
+	[request setShouldAttemptPersistentConnection:NO];
+	[request setRetryPolicy:policy];
+	[request startAsynchronous];
+
+	NSDate *dateStarted = [NSDate date];
+	while ([request totalBytesRead] < 16*1024 && ![request isFinished] && [dateStarted timeIntervalSinceNow] > -30) {
+		[[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+	}
+	GHAssertFalse([request isFinished],@"Downloaded the range too quickly, cannot proceed with this test");
+
+	NSError *timeoutError = [NSError errorWithDomain:NetworkRequestErrorDomain code:ASIRequestTimedOutErrorType userInfo:nil];
+	[request performSelector:@selector(retryWithPolicyAfterError:) onThread:[ASIHTTPRequest threadForRequest:request] withObject:timeoutError waitUntilDone:YES];
+	[ASIHTTPRequest setMaxBandwidthPerSecond:0];
+
+	while (![request isFinished] && [dateStarted timeIntervalSinceNow] > -120) {
+		[[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+	}
+	GHAssertNil([request error],@"Request failed");
+
+	BOOL success = ([request policyRetryCount] == 1 && [[[request requestHeaders] objectForKey:@"Range"] isEqualToString:@"bytes=1024-132095"] && [request responseStatusCode] == 206);
+	GHAssertTrue(success,@"Failed to ask for the same range when retrying");
+
+	success = [[request responseData] isEqualToData:expectedData];
+	GHAssertTrue(success,@"Got the wrong data after retrying a ranged request");
+}
+
+- (void)testMappedFileUpload
+{
+	NSString *path = [[self filePathForTemporaryTestFiles] stringByAppendingPathComponent:@"mapped-upload"];
+	NSMutableData *data = [NSMutableData dataWithLength:1024*256];
+	unsigned char *bytes = [data mutableBytes];
+	NSUInteger i;
+	for (i=0; i<[data length]; i++) {
+		bytes[i] = (unsigned char)(i%251);
+	}
+	[data writeToFile:path atomically:NO];
+
+	NSURL *url = [NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/content-length"];
+	ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:url];
+	[request setShouldStreamPostDataFromDisk:YES];
+	[request setPostBodyFilePath:path];
+	[request setShouldMemoryMapPostBodyFile:YES];
+	[request startSynchronous];
+
+	BOOL success = ([[request responseString] isEqualToString:[NSString stringWithFormat:@"%lu",(unsigned long)[data length]]]);
+	GHAssertTrue(success,@"Sent wrong content length");
+	success = ([request totalBytesSent] == [request postLength]);
+	GHAssertTrue(success,@"Failed to send the whole of a mapped file");
+
+	// Copies of a request should still use a mapping
+	success = [[[request copy] autorelease] shouldMemoryMapPostBodyFile];
+	GHAssertTrue(success,@"Failed to copy shouldMemoryMapPostBodyFile");
+}
+
 - (void)testDownloadContentLength
 {
 	NSURL *url = [[[NSURL alloc] initWithString:@"http://allseeing-i.com/i/logo.png"] autorelease];
@@ -694,6 +1234,77 @@
 }
 
 
+- (void)testSegmentedDownload
+{
+	// Download the file in one go to compare against
+	NSURL *url = [NSURL URLWithString:@"http://allseeing-i.com/i/logo.png"];
+	ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:url];
+	[request startSynchronous];
+	NSData *expectedData = [request responseData];
+
+	// Small segments, so the file is split between all our requests, and requests that finish early take work from the others
+	NSString *path = [[self filePathForTemporaryTestFiles] stringByAppendingPathComponent:@"segmented-logo.png"];
+	request = [ASIHTTPRequest requestWithURL:url];
+	[request setDownloadDestinationPath:path];
+	ASISegmentedDownload *download = [ASISegmentedDownload downloadWithRequest:request];
+	[download setNumberOfSegments:4];
+	[download setMinimumSegmentSize:2048];
+	[download setDelegate:self];
+	finished = NO;
+	failed = NO;
+	[download start];
+
+	NSDate *startDate = [NSDate date];
+	while (!finished && !failed && [startDate timeIntervalSinceNow] > -30) {
+		[[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+	}
+	GHAssertTrue(finished,@"Segmented download failed to finish");
+
+	BOOL success = ([download responseStatusCode] == 206);
+	GHAssertTrue(success,@"Server didn't send a range");
+	success = ([download contentLength] == [expectedData length] && [download totalBytesRead] == [expectedData length]);
+	GHAssertTrue(success,@"Got the wrong length for a segmented download");
+	success = [[NSData dataWithContentsOfFile:path] isEqualToData:expectedData];
+	GHAssertTrue(success,@"Segmented download produced the wrong file");
+	success = ![[[[NSFileManager alloc] init] autorelease] fileExistsAtPath:[path stringByAppendingPathExtension:@"download"]];
+	GHAssertTrue(success,@"Failed to move the temporary file");
+}
+
+- (void)testSegmentedDownloadCancelledBeforeStart
+{
+	ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/i/logo.png"]];
+	[request setDownloadDestinationPath:[[self filePathForTemporaryTestFiles] stringByAppendingPathComponent:@"cancelled-logo.png"]];
+	ASISegmentedDownload *download = [ASISegmentedDownload downloadWithRequest:request];
+	[download setDelegate:self];
+	finished = NO;
+	failed = NO;
+	[download cancel];
+
+	NSDate *startDate = [NSDate date];
+	while (!finished && !failed && [startDate timeIntervalSinceNow] > -5) {
+		[[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+	}
+	GHAssertTrue(failed,@"Failed to tell the delegate a download was cancelled before it started");
+	BOOL success = ([[download error] code] == ASIRequestCancelledErrorType);
+	GHAssertTrue(success,@"Got the wrong error for a cancelled download");
+
+	// Starting afterwards does nothing
+	failed = NO;
+	[download start];
+	[[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.5]];
+	GHAssertFalse(finished || failed,@"A cancelled download started anyway");
+}
+
+- (void)segmentedDownloadFinished:(ASISegmentedDownload *)download
+{
+	finished = YES;
+}
+
+- (void)segmentedDownloadFailed:(ASISegmentedDownload *)download
+{
+	failed = YES;
+}
+
 - (void)testCompressedResponseDownloadToFile
 {
 	NSString *path = [[self filePathForTemporaryTestFiles] stringByAppendingPathComponent:@"testfile"];
@@ -726,6 +1337,22 @@
 
 	success = [[NSString stringWithContentsOfFile:path encoding:NSUTF8StringEncoding error:NULL] isEqualToString:@"This is the expected content for the first string"];
 	GHAssertTrue(success,@"Failed to download data to a file");
+
+	// Downloads that may be resumed keep the compressed data until the request completes
+	[ASIHTTPRequest removeFileAtPath:path error:&error];
+	tempPath = [[self filePathForTemporaryTestFiles] stringByAppendingPathComponent:@"testfile.download"];
+	[ASIHTTPRequest removeFileAtPath:tempPath error:&error];
+	request = [[[ASIHTTPRequest alloc] initWithURL:url] autorelease];
+	[request setDownloadDestinationPath:path];
+	[request setTemporaryFileDownloadPath:tempPath];
+	[request setAllowResumeForFileDownloads:YES];
+	[request startSynchronous];
+
+	success = ![[[[NSFileManager alloc] init] autorelease] fileExistsAtPath:tempPath];
+	GHAssertTrue(success,@"Failed to clean up temporary download file");
+
+	success = [[NSString stringWithContentsOfFile:path encoding:NSUTF8StringEncoding error:NULL] isEqualToString:@"This is the expected content for the first string"];
+	GHAssertTrue(success,@"Failed to inflate a resumable download");
 }
 
 - (void)request:(ASIHTTPRequest *)request didGetMoreData:(NSData *)data
@@ -1495,9 +2122,84 @@
 	BOOL success = ([[request responseString] isEqualToString:content]);
 	GHAssertTrue(success,@"Failed to compress the body, or server failed to decompress it");
 
+	// The body is compressed as it is sent, so there's no Content-Length
+	success = (![[request requestHeaders] objectForKey:@"Content-Length"]);
+	GHAssertTrue(success,@"Sent a Content-Length for a compressed body sent with chunked transfer encoding");
+
+	success = ([request totalBytesSent] == [data length]);
+	GHAssertTrue(success,@"Failed to report progress in uncompressed bytes");
+
+	// Test an in-memory body, working out the length of the compressed body first
+	request = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/compressed_post_body"]];
+	[request setRequestMethod:@"PUT"];
+	[request setShouldCompressRequestBody:YES];
+	[request setShouldPrecomputeCompressedPostLength:YES];
+	[request appendPostData:data];
+	[request startSynchronous];
+
+	success = ([[request responseString] isEqualToString:content]);
+	GHAssertTrue(success,@"Failed to compress the body, or server failed to decompress it");
+
+	unsigned long long compressedLength = [ASIDataCompressor compressedLengthOfDataFromStream:[NSInputStream inputStreamWithData:data] level:[request requestBodyCompressionLevel] error:NULL];
+	success = (compressedLength > 0 && [[[request requestHeaders] objectForKey:@"Content-Length"] isEqualToString:[NSString stringWithFormat:@"%llu",compressedLength]]);
+	GHAssertTrue(success,@"Sent the wrong Content-Length for a compressed body");
 }
 
 
+- (void)testAutomaticRequestBodyCompression
+{
+	// A body that is already compressed
+	NSMutableData *randomData = [NSMutableData dataWithLength:131072];
+	u_int32_t *randomWords = (u_int32_t *)[randomData mutableBytes];
+	NSUInteger i;
+	for (i=0; i<[randomData length]/sizeof(u_int32_t); i++) {
+		randomWords[i] = arc4random();
+	}
+	NSString *filePath = [[self filePathForTemporaryTestFiles] stringByAppendingPathComponent:@"photo.jpg"];
+	[randomData writeToFile:filePath atomically:NO];
+
+	ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/compressed_post_body"]];
+	[request setShouldStreamPostDataFromDisk:YES];
+	[request setPostBodyFilePath:filePath];
+	[request setShouldAutomaticallyCompressRequestBody:YES];
+	[request buildPostBody];
+	BOOL success = (![request shouldCompressRequestBody]);
+	GHAssertTrue(success,@"Chose to compress a JPEG");
+
+	// A body that looks random
+	request = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/compressed_post_body"]];
+	[request appendPostData:randomData];
+	[request setShouldAutomaticallyCompressRequestBody:YES];
+	[request buildPostBody];
+	success = (![request shouldCompressRequestBody]);
+	GHAssertTrue(success,@"Chose to compress random data");
+
+	// A body that is worth compressing
+	NSMutableString *content = [NSMutableString string];
+	while ([content length] < 131072) {
+		[content appendString:@"This is the test content. "];
+	}
+	NSData *data = [content dataUsingEncoding:NSUTF8StringEncoding];
+	request = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/compressed_post_body"]];
+	[request setRequestMethod:@"PUT"];
+	[request appendPostData:data];
+	[request setShouldAutomaticallyCompressRequestBody:YES];
+	[request setShouldPrecomputeCompressedPostLength:YES];
+	[request startSynchronous];
+	success = ([request shouldCompressRequestBody]);
+	GHAssertTrue(success,@"Failed to compress text");
+
+	int level = [request requestBodyCompressionLevel];
+	success = (level == -1 || (level >= 1 && level <= 9));
+	GHAssertTrue(success,@"Chose an invalid compression level");
+
+	success = ([request requestBodyCompressionRatio] > 0 && [request requestBodyCompressionRatio] < 0.1);
+	GHAssertTrue(success,@"Reported the wrong compression ratio");
+
+	success = ([[request responseString] isEqualToString:content]);
+	GHAssertTrue(success,@"Failed to compress the body, or server failed to decompress it");
+}
+
 // Ensure class convenience constructor returns an instance of our subclass
 - (void)testSubclass
 {
@@ -1997,5 +2699,412 @@
 	[request redirectToURL:[NSURL URLWithString:@"http://allseeing-i.com"]];
 }
 
+- (void)testNetworkThreadPool
+{
+	NSUInteger oldCount = [ASIHTTPRequest numberOfNetworkThreads];
+	ASINetworkThreadPolicy oldPolicy = [ASIHTTPRequest networkThreadPolicy];
+	[ASIHTTPRequest setNumberOfNetworkThreads:4];
+	[ASIHTTPRequest setNetworkThreadPolicy:ASIHostAffinityNetworkThreadPolicy];
+
+	// Requests to the same server should always share a thread
+	ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/first"]];
+	ASIHTTPRequest *request2 = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://ALLSEEING-I.com:80/ASIHTTPRequest/tests/second"]];
+	NSThread *thread = [ASIHTTPRequest threadForRequest:request];
+	BOOL success = (thread == [ASIHTTPRequest threadForRequest:request2]);
+	GHAssertTrue(success,@"Requests to the same server were placed on different threads");
+
+	// A request should stay on the thread it was given, even if the policy changes
+	[ASIHTTPRequest setNetworkThreadPolicy:ASILeastLoadedNetworkThreadPolicy];
+	success = (thread == [ASIHTTPRequest threadForRequest:request]);
+	GHAssertTrue(success,@"Request moved to a different thread");
+
+	// With least-loaded, a new request should not join the thread that already has two requests
+	ASIHTTPRequest *request3 = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/third"]];
+	success = (thread != [ASIHTTPRequest threadForRequest:request3]);
+	GHAssertTrue(success,@"Least loaded policy picked the busiest thread");
+
+	[ASIHTTPRequest setNumberOfNetworkThreads:0];
+	success = ([ASIHTTPRequest numberOfNetworkThreads] == 1);
+	GHAssertTrue(success,@"Allowed an empty thread pool");
+
+	[ASIHTTPRequest setNumberOfNetworkThreads:oldCount];
+	[ASIHTTPRequest setNetworkThreadPolicy:oldPolicy];
+}
+
+- (void)testConnectionPool
+{
+	ASIConnectionPool *pool = [[[ASIConnectionPool alloc] init] autorelease];
+	[pool setMaxConnectionsPerHost:1];
+
+	ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/first"]];
+	ASIHTTPRequest *request2 = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/second"]];
+	ASIHTTPRequest *request3 = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"https://allseeing-i.com/ASIHTTPRequest/tests/third"]];
+
+	ASIPersistentConnection *connection = [pool checkOutConnectionForRequest:request requestID:[NSNumber numberWithInt:1] previousConnection:nil];
+	GHAssertNotNil(connection,@"Failed to get a connection from an empty pool");
+
+	// The server is at its limit, so the second request should have to wait
+	ASIPersistentConnection *connection2 = [pool checkOutConnectionForRequest:request2 requestID:[NSNumber numberWithInt:2] previousConnection:nil];
+	BOOL success = (!connection2 && [pool waitingRequestCount] == 1);
+	GHAssertTrue(success,@"Request did not wait for a connection when the server was at its connection limit");
+
+	// A different server should be unaffected
+	ASIPersistentConnection *connection3 = [pool checkOutConnectionForRequest:request3 requestID:[NSNumber numberWithInt:3] previousConnection:nil];
+	GHAssertNotNil(connection3,@"Connection limit was applied to the wrong server");
+
+	// Releasing the connection with the wrong request id should do nothing
+	success = ([pool releaseConnection:connection fromRequestWithID:[NSNumber numberWithInt:2] expiresIn:60] == nil && [pool idleConnectionCount] == 0);
+	GHAssertTrue(success,@"Released a connection that belonged to another request");
+
+	success = ([pool releaseConnection:connection fromRequestWithID:[NSNumber numberWithInt:1] expiresIn:60] == request2);
+	GHAssertTrue(success,@"Failed to hand back the waiting request when a connection was released");
+
+	connection2 = [pool checkOutConnectionForRequest:request2 requestID:[NSNumber numberWithInt:2] previousConnection:nil];
+	success = (connection2 == connection);
+	GHAssertTrue(success,@"Failed to reuse an idle connection");
+
+	success = ([pool connectionsCreated] == 2 && [pool connectionsReused] == 1 && [pool connectionCount] == 2 && [pool waitingRequestCount] == 0);
+	GHAssertTrue(success,@"Pool statistics were wrong");
+
+	// Expired connections should be closed
+	[pool releaseConnection:connection2 fromRequestWithID:[NSNumber numberWithInt:2] expiresIn:0];
+	[pool expireIdleConnections];
+	success = ([pool connectionCount] == 1 && [pool idleConnectionCount] == 0);
+	GHAssertTrue(success,@"Failed to remove an expired connection");
+}
+
+- (void)testTimerWheel
+{
+	NSString *mode = @"ASITimerWheelTestRunLoopMode";
+	ASITimerWheel *timerWheel = [ASITimerWheel timerWheelForCurrentThreadInMode:mode];
+	NSTimeInterval start = ASIMonotonicTime();
+
+	ASITimerWheelTestTarget *soon = [[[ASITimerWheelTestTarget alloc] init] autorelease];
+	ASITimerWheelTestTarget *later = [[[ASITimerWheelTestTarget alloc] init] autorelease];
+	ASITimerWheelTestTarget *rescheduled = [[[ASITimerWheelTestTarget alloc] init] autorelease];
+	ASITimerWheelTestTarget *unscheduled = [[[ASITimerWheelTestTarget alloc] init] autorelease];
+	ASITimerWheelTestTarget *farAway = [[[ASITimerWheelTestTarget alloc] init] autorelease];
+
+	[timerWheel scheduleTarget:soon atTime:start+0.5];
+	[timerWheel scheduleTarget:later atTime:start+1.5];
+	[timerWheel scheduleTarget:rescheduled atTime:start+0.25];
+	[timerWheel scheduleTarget:rescheduled atTime:start+1];
+	[timerWheel scheduleTarget:unscheduled atTime:start+0.5];
+	[timerWheel unscheduleTarget:unscheduled];
+	[timerWheel scheduleTarget:farAway atTime:start+3600];
+
+	BOOL success = ([timerWheel scheduledTargetCount] == 4);
+	GHAssertTrue(success,@"Wrong number of targets scheduled");
+
+	while (ASIMonotonicTime() < start+2) {
+		[[NSRunLoop currentRunLoop] runMode:mode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+	}
+
+	success = ([soon fireTime] >= start+0.5 && [soon fireTime] < start+1);
+	GHAssertTrue(success,@"Target fired at the wrong time");
+
+	success = ([later fireTime] >= start+1.5 && [later fireTime] < start+2);
+	GHAssertTrue(success,@"Target fired at the wrong time");
+
+	success = ([rescheduled fireTime] >= start+1);
+	GHAssertTrue(success,@"Rescheduled target fired at the time it was first scheduled for");
+
+	success = ([unscheduled fireTime] == 0 && [farAway fireTime] == 0);
+	GHAssertTrue(success,@"Fired a target that should not have fired");
+
+	success = ([timerWheel scheduledTargetCount] == 1);
+	GHAssertTrue(success,@"Targets were not removed after firing");
+	[timerWheel unscheduleTarget:farAway];
+
+	// A wheel whose timer is running goes away once its thread lets go of it, and releases the targets it was holding on to
+	NSString *otherMode = @"ASITimerWheelReleaseTestRunLoopMode";
+	ASITimerWheelTestTarget *target = [[ASITimerWheelTestTarget alloc] init];
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	[[ASITimerWheel timerWheelForCurrentThreadInMode:otherMode] scheduleTarget:target atTime:start+3600];
+	[[[NSThread currentThread] threadDictionary] removeObjectForKey:[@"ASITimerWheel-" stringByAppendingString:otherMode]];
+	[pool drain];
+
+	success = ([target retainCount] == 1);
+	GHAssertTrue(success,@"Timer wheel was not deallocated when its thread let go of it");
+	[target release];
+}
+
+- (void)testCoalescedProgress
+{
+	// Run on the main thread so all progress updates have been delivered by the time the request finishes
+	[self performSelectorOnMainThread:@selector(performCoalescedProgressTest) withObject:nil waitUntilDone:YES];
+}
+
+- (void)performCoalescedProgressTest
+{
+#if NS_BLOCKS_AVAILABLE
+	__block unsigned long long bytesReceived = 0;
+	__block unsigned long long downloadSize = 0;
+	__block int updates = 0;
+
+	ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/the_great_american_novel.txt"]];
+	[request setProgressUpdateInterval:60];
+	[request setBytesReceivedBlock:^(unsigned long long size, unsigned long long total) {
+		bytesReceived += size;
+		updates++;
+	}];
+	[request setDownloadSizeIncrementedBlock:^(long long size) {
+		downloadSize += (unsigned long long)size;
+	}];
+	[request startSynchronous];
+
+	BOOL success = (bytesReceived == [request contentLength]);
+	GHAssertTrue(success,@"Progress was lost when coalescing updates");
+
+	// One update when the first data arrives, and one with everything else when the request completes
+	success = (updates <= 2);
+	GHAssertTrue(success,@"Sent progress more often than progressUpdateInterval allows");
+
+	success = (downloadSize == [request contentLength]);
+	GHAssertTrue(success,@"Failed to pass on the download size");
+#endif
+}
+
+- (void)testCallbackModes
+{
+#if NS_BLOCKS_AVAILABLE
+	__block BOOL finished = NO;
+	__block BOOL finishedOnMainThread = YES;
+	dispatch_queue_t callbackQueue = dispatch_queue_create("com.allseeing-i.asihttprequest.tests.callbacks", NULL);
+
+	ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com"]];
+	[request setCallbackMode:ASIDispatchQueueCallbackMode];
+	[request setCallbackDispatchQueue:callbackQueue];
+	[request setCompletionBlock:^{
+		finished = YES;
+		finishedOnMainThread = [NSThread isMainThread];
+	}];
+	[request startSynchronous];
+
+	// Wait for the callbacks already queued to run
+	dispatch_sync(callbackQueue, ^{});
+	dispatch_release(callbackQueue);
+
+	BOOL success = (finished && !finishedOnMainThread);
+	GHAssertTrue(success,@"Failed to call the completion block on the dispatch queue");
+
+	// Synchronous requests run on the current thread, so that's where the callbacks should arrive
+	__block NSThread *callbackThread = nil;
+	request = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com"]];
+	[request setCallbackMode:ASINetworkThreadCallbackMode];
+	[request setCompletionBlock:^{
+		callbackThread = [NSThread currentThread];
+	}];
+	[request startSynchronous];
+
+	success = (callbackThread == [NSThread currentThread]);
+	GHAssertTrue(success,@"Failed to call the completion block on the thread that ran the request");
+#endif
+}
+
+- (void)testTokenBucket
+{
+	ASITokenBucket bucket;
+	memset(&bucket, 0, sizeof(bucket));
+
+	BOOL success = !ASITokenBucketIsLimited(&bucket) && ASITokenBucketAvailableBytes(&bucket) == LLONG_MAX;
+	GHAssertTrue(success,@"An empty bucket should not limit anything");
+
+	// Consuming from an unlimited bucket does nothing
+	ASITokenBucketConsume(&bucket, 100000);
+	success = (ASITokenBucketAvailableBytes(&bucket) == LLONG_MAX);
+	GHAssertTrue(success,@"Consuming from an unlimited bucket should not limit it");
+
+	// A bucket holds a quarter of a second's worth of bytes, and starts off full
+	ASITokenBucketSetRate(&bucket, 1000);
+	success = ASITokenBucketIsLimited(&bucket) && ASITokenBucketAvailableBytes(&bucket) == 250;
+	GHAssertTrue(success,@"Failed to start off with a full bucket");
+
+	success = (ASITokenBucketWakeUpTime(&bucket)-ASIMonotonicTime() < 0.01);
+	GHAssertTrue(success,@"A bucket that isn't in debt should not make requests sleep");
+
+	// Going into debt
+	ASITokenBucketConsume(&bucket, 1000);
+	long long available = ASITokenBucketAvailableBytes(&bucket);
+	success = (available <= -740 && available >= -750);
+	GHAssertTrue(success,@"Failed to go into debt");
+
+	NSTimeInterval sleepFor = ASITokenBucketWakeUpTime(&bucket)-ASIMonotonicTime();
+	success = (sleepFor > 0.7 && sleepFor <= 0.75);
+	GHAssertTrue(success,@"Got the wrong wake up time for a bucket in debt");
+
+	// Refilling as time passes
+	[NSThread sleepForTimeInterval:1];
+	success = (ASITokenBucketAvailableBytes(&bucket) == 250);
+	GHAssertTrue(success,@"Failed to refill the bucket up to its capacity");
+
+	// Turning off the limit
+	ASITokenBucketSetRate(&bucket, 0);
+	success = !ASITokenBucketIsLimited(&bucket) && ASITokenBucketAvailableBytes(&bucket) == LLONG_MAX;
+	GHAssertTrue(success,@"Failed to turn off the limit");
+}
+
+- (void)testBandwidthClasses
+{
+	ASIBandwidthClass *global = [ASIBandwidthClass globalBandwidthClass];
+	ASIBandwidthClass *bulk = [global childWithName:@"test-bulk"];
+	BOOL success = ([global childWithName:@"test-bulk"] == bulk && [bulk parent] == global);
+	GHAssertTrue(success,@"Failed to reuse a named bandwidth class");
+
+	// A limit only applies to the class it was set on and the classes below it
+	[bulk setMaxBandwidthPerSecond:1000];
+	ASIBandwidthClass *host = [bulk childWithName:@"allseeing-i.com"];
+	ASIBandwidthClass *interactive = [global childWithName:@"test-interactive"];
+	success = ([bulk isThrottled] && [host isThrottled] && ![interactive isThrottled] && [interactive availableBytes] == LLONG_MAX);
+	GHAssertTrue(success,@"Limit applied to the wrong bandwidth classes");
+	[bulk setMaxBandwidthPerSecond:0];
+
+	// Siblings share what a limited parent allows in proportion to their weights
+	ASIBandwidthClass *parent = [ASIBandwidthClass bandwidthClassWithName:@"parent" parent:nil];
+	[parent setMaxBandwidthPerSecond:4000];
+	ASIBandwidthClass *heavy = [ASIBandwidthClass bandwidthClassWithName:@"heavy" parent:parent];
+	[heavy setWeight:3];
+	ASIBandwidthClass *light = [ASIBandwidthClass bandwidthClassWithName:@"light" parent:parent];
+
+	// Only one child is using bandwidth, so it can have everything
+	[heavy consumeBytes:0];
+	success = ([heavy availableBytes] == 1000);
+	GHAssertTrue(success,@"A child should get all of its parent's bandwidth when its siblings are idle");
+
+	[light consumeBytes:0];
+	success = ([heavy availableBytes] == 750 && [light availableBytes] == 250);
+	GHAssertTrue(success,@"Failed to share bandwidth according to weight");
+
+	// Debt is not shared - all children wait until it has been paid off
+	[heavy consumeBytes:2000];
+	success = ([light availableBytes] <= 0 && [light wakeUpTime] > ASIMonotonicTime()+0.2);
+	GHAssertTrue(success,@"A child of a class that is in debt should have to wait");
+
+	// Queues put requests in their bandwidth class, or a class for each host
+	ASINetworkQueue *queue = [ASINetworkQueue queue];
+	[queue setBandwidthClass:bulk];
+	[queue setShouldShareBandwidthByHost:YES];
+	ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com"]];
+	[queue addOperation:request];
+	success = ([request bandwidthClass] == host);
+	GHAssertTrue(success,@"Failed to put a request in the bandwidth class for its host");
+
+	// Requests that already have a class keep it
+	request = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com"]];
+	[request setBandwidthClass:light];
+	[queue addOperation:request];
+	success = ([request bandwidthClass] == light);
+	GHAssertTrue(success,@"Queue replaced a request's bandwidth class");
+	[queue reset];
+}
+
+- (void)testResponseBuffer
+{
+	// When we know how much to expect, the data is stored in one piece and handed out without copying
+	ASIResponseBuffer *buffer = [ASIResponseBuffer buffer];
+	[buffer reserveCapacity:10];
+	[buffer appendBytes:"hello" length:5];
+	[buffer appendBytes:"world" length:5];
+	NSMutableData *data = [buffer data];
+	BOOL success = ([data length] == 10 && memcmp([data bytes], "helloworld", 10) == 0);
+	GHAssertTrue(success,@"Failed to store data of a known length");
+
+	success = ([buffer data] == data);
+	GHAssertTrue(success,@"Buffer should only put its data together once");
+
+	// Anything appended afterwards is added to the data we handed out
+	[buffer appendBytes:"!" length:1];
+	success = ([data length] == 11 && [buffer length] == 11);
+	GHAssertTrue(success,@"Failed to append to data that had already been handed out");
+
+	// Servers may send more than they said they would
+	buffer = [ASIResponseBuffer buffer];
+	[buffer reserveCapacity:4];
+	[buffer appendBytes:"helloworld" length:10];
+	success = ([[buffer data] length] == 10 && memcmp([[buffer data] bytes], "helloworld", 10) == 0);
+	GHAssertTrue(success,@"Failed to store more data than we expected");
+
+	// Data of an unknown length is stored in segments
+	NSMutableData *expected = [NSMutableData dataWithLength:ASIResponseBufferSegmentSize*3+123];
+	unsigned char *bytes = [expected mutableBytes];
+	NSUInteger i;
+	for (i=0; i<[expected length]; i++) {
+		bytes[i] = (unsigned char)(i % 251);
+	}
+	buffer = [ASIResponseBuffer buffer];
+	for (i=0; i<[expected length]; i+=1000) {
+		NSUInteger chunk = MIN(1000, [expected length]-i);
+		[buffer appendBytes:bytes+i length:chunk];
+	}
+	success = [[buffer data] isEqualToData:expected];
+	GHAssertTrue(success,@"Failed to store data of an unknown length");
+
+	// Requests read into the buffer (we turn off compression so the Content-Length is the size of the body we store)
+	ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/the_great_american_novel_(abridged).txt"]];
+	[request setAllowCompressedResponse:NO];
+	[request startSynchronous];
+	success = ([[request responseData] length] == [request contentLength] && [request contentLength] > 0);
+	GHAssertTrue(success,@"Failed to store the response in memory");
+}
+
+- (void)testReadBufferPool
+{
+	BOOL success = ([ASIReadBufferPool bufferSizeForSize:0] == ASIReadBufferMinimumSize && [ASIReadBufferPool bufferSizeForSize:40000] == 65536 && [ASIReadBufferPool bufferSizeForSize:1000000000] == ASIReadBufferMaximumSize);
+	GHAssertTrue(success,@"Got the wrong buffer size");
+
+	ASIReadBufferPool *pool = [[[ASIReadBufferPool alloc] init] autorelease];
+	void *buffer = [pool takeBufferOfSize:65536];
+	[pool returnBuffer:buffer ofSize:65536];
+	success = ([pool freeBufferCount] == 1 && [pool takeBufferOfSize:65536] == buffer);
+	GHAssertTrue(success,@"Failed to reuse a buffer");
+
+	// Data wraps the buffer without copying it, and gives it back when it is released
+	memcpy(buffer, "hello", 5);
+	NSData *data = [pool newDataWithBuffer:buffer ofSize:65536 length:32768];
+	success = ([data bytes] == buffer && [data length] == 32768 && memcmp([data bytes], "hello", 5) == 0);
+	GHAssertTrue(success,@"Data should wrap the buffer");
+	success = ([pool freeBufferCount] == 0);
+	GHAssertTrue(success,@"Buffer went back to the pool while data was still using it");
+	[data release];
+	success = ([pool freeBufferCount] == 1);
+	GHAssertTrue(success,@"Buffer didn't go back to the pool when the data was released");
+
+	// We only keep a few spare buffers of each size
+	NSUInteger i;
+	void *buffers[ASIReadBufferMaximumFreeBuffers+2];
+	for (i=0; i<ASIReadBufferMaximumFreeBuffers+2; i++) {
+		buffers[i] = [pool takeBufferOfSize:16384];
+	}
+	for (i=0; i<ASIReadBufferMaximumFreeBuffers+2; i++) {
+		[pool returnBuffer:buffers[i] ofSize:16384];
+	}
+	success = ([pool freeBufferCount] == ASIReadBufferMaximumFreeBuffers+1);
+	GHAssertTrue(success,@"Pool kept too many spare buffers");
+
+	// A small read in a big buffer is copied, so keeping the data doesn't keep the buffer
+	buffer = [pool takeBufferOfSize:ASIReadBufferMaximumSize];
+	memcpy(buffer, "hello", 5);
+	data = [pool newDataWithBuffer:buffer ofSize:ASIReadBufferMaximumSize length:5];
+	success = ([data bytes] != buffer && [data isEqualToData:[NSData dataWithBytes:"hello" length:5]] && [pool freeBufferCount] == ASIReadBufferMaximumFreeBuffers+2);
+	GHAssertTrue(success,@"Failed to copy a small read out of a big buffer");
+	[data release];
+
+	// Trimming frees every spare buffer
+	[pool trim];
+	success = ([pool freeBufferCount] == 0);
+	GHAssertTrue(success,@"Failed to free spare buffers when trimming the pool");
+
+	// Requests pass on data read into pooled buffers, and grow their reads on a fast connection
+	ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/the_great_american_novel_(abridged).txt"]];
+	[request setAllowCompressedResponse:NO];
+	[self setResponseData:[NSMutableData data]];
+	[request setDelegate:self];
+	[request setDidReceiveDataSelector:@selector(theTestRequest:didReceiveData:)];
+	[request setCallbackMode:ASINetworkThreadCallbackMode];
+	[request startSynchronous];
+	success = ([[self responseData] length] == [request contentLength] && [request contentLength] > 0);
+	GHAssertTrue(success,@"Failed to pass on all the data we read");
+}
+
 @synthesize responseData;
 @end
\ No newline at end of file
@@ -51,6 +51,10 @@ IMPORTANT
 	BOOL receivedResponseHeaders;
 	
 	int queueFinishedCallCount;
+
+	// Requests in testScheduledRequests that have started but not finished, and the most we saw at once
+	int runningRequestCount;
+	int mostRunningRequests;
 }
 - (void)testFailure;
 - (void)testFailureCancelsOtherRequests;
@@ -72,6 +76,8 @@ IMPORTANT
 - (void)testDelegateAuthenticationCredentialsReuse;
 - (void)testPOSTWithAuthentication;
 - (void)testHEADFailure;
+- (void)testScheduledRequests;
+- (void)testAdaptiveConcurrency;
 @property (retain) NSOperationQueue *immediateCancelQueue;
 @property (retain) NSMutableArray *failedRequests;
 @property (retain) NSMutableArray *finishedRequests;
@@ -9,6 +9,7 @@
 #import "ASINetworkQueueTests.h"
 #import "ASIHTTPRequest.h"
 #import "ASINetworkQueue.h"
+#import "ASIConcurrencyLimiter.h"
 #import "ASIFormDataRequest.h"
 #import <SystemConfiguration/SystemConfiguration.h>
 #import <unistd.h>
@@ -1231,6 +1232,188 @@ IMPORTANT
 	complete = YES;
 }
 
+- (void)testScheduledRequests
+{
+	[self performSelectorOnMainThread:@selector(runScheduledRequestsTest) withObject:nil waitUntilDone:YES];
+}
+
+- (void)runScheduledRequestsTest
+{
+	[self setFinishedRequests:[NSMutableArray array]];
+
+	ASINetworkQueue *networkQueue = [ASINetworkQueue queue];
+	[networkQueue setShouldScheduleRequests:YES];
+	[networkQueue setMaxConcurrentOperationCount:1];
+	[networkQueue setDelegate:self];
+	[networkQueue setRequestDidFinishSelector:@selector(scheduledRequestFinished:)];
+	[networkQueue setRequestDidFailSelector:@selector(scheduledRequestFinished:)];
+
+	// Added lowest priority first, so these should finish in the reverse order
+	ASIHTTPRequest *request1 = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/first"]];
+	[request1 setQueuePriority:NSOperationQueuePriorityVeryLow];
+	[networkQueue addOperation:request1];
+	ASIHTTPRequest *request2 = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/second"]];
+	[networkQueue addOperation:request2];
+	ASIHTTPRequest *request3 = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/third"]];
+	[request3 setQueuePriority:NSOperationQueuePriorityVeryHigh];
+	[networkQueue addOperation:request3];
+
+	BOOL success = ([networkQueue operationCount] == 3);
+	GHAssertTrue(success,@"Queue didn't count requests waiting to be scheduled");
+
+	[networkQueue go];
+
+	NSDate *dateStarted = [NSDate date];
+	while ([[self finishedRequests] count] < 3 && [dateStarted timeIntervalSinceNow] > -20) {
+		[[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.25]];
+	}
+	NSArray *expectedOrder = [NSArray arrayWithObjects:request3,request2,request1,nil];
+	success = [[self finishedRequests] isEqualToArray:expectedOrder];
+	GHAssertTrue(success,@"Scheduler failed to start requests in priority order");
+
+	// With aging, a request that has waited long enough goes ahead of newer requests with a higher priority
+	[self setFinishedRequests:[NSMutableArray array]];
+	networkQueue = [ASINetworkQueue queue];
+	[networkQueue setShouldScheduleRequests:YES];
+	[networkQueue setMaxConcurrentOperationCount:1];
+	[networkQueue setPriorityAgingInterval:0.1];
+	[networkQueue setDelegate:self];
+	[networkQueue setRequestDidFinishSelector:@selector(scheduledRequestFinished:)];
+	[networkQueue setRequestDidFailSelector:@selector(scheduledRequestFinished:)];
+
+	request1 = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/first"]];
+	[request1 setQueuePriority:NSOperationQueuePriorityLow];
+	[networkQueue addOperation:request1];
+	[[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.5]];
+	request2 = [ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/second"]];
+	[request2 setQueuePriority:NSOperationQueuePriorityHigh];
+	[networkQueue addOperation:request2];
+	[networkQueue go];
+
+	dateStarted = [NSDate date];
+	while ([[self finishedRequests] count] < 2 && [dateStarted timeIntervalSinceNow] > -20) {
+		[[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.25]];
+	}
+	expectedOrder = [NSArray arrayWithObjects:request1,request2,nil];
+	success = [[self finishedRequests] isEqualToArray:expectedOrder];
+	GHAssertTrue(success,@"Scheduler failed to promote a request that had been waiting");
+
+	// Only one request to the host should run at once, even though the queue would run four
+	[self setFinishedRequests:[NSMutableArray array]];
+	networkQueue = [ASINetworkQueue queue];
+	[networkQueue setShouldScheduleRequests:YES];
+	[networkQueue setMaxConcurrentRequestsPerHost:1];
+	[networkQueue setDelegate:self];
+	[networkQueue setRequestDidStartSelector:@selector(scheduledRequestStarted:)];
+	[networkQueue setRequestDidFinishSelector:@selector(scheduledRequestFinished:)];
+	[networkQueue setRequestDidFailSelector:@selector(scheduledRequestFinished:)];
+	runningRequestCount = 0;
+	mostRunningRequests = 0;
+
+	NSUInteger i;
+	for (i=0; i<4; i++) {
+		[networkQueue addOperation:[ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/the_great_american_novel_(abridged).txt"]]];
+	}
+	[networkQueue go];
+
+	dateStarted = [NSDate date];
+	while ([[self finishedRequests] count] < 4 && [dateStarted timeIntervalSinceNow] > -30) {
+		[[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.25]];
+	}
+	success = ([[self finishedRequests] count] == 4);
+	GHAssertTrue(success,@"Failed to run all the requests");
+	success = (mostRunningRequests == 1);
+	GHAssertTrue(success,@"Ran more requests to a host at once than maxConcurrentRequestsPerHost");
+}
+
+- (void)scheduledRequestStarted:(ASIHTTPRequest *)request
+{
+	runningRequestCount++;
+	mostRunningRequests = MAX(mostRunningRequests,runningRequestCount);
+}
+
+- (void)scheduledRequestFinished:(ASIHTTPRequest *)request
+{
+	runningRequestCount--;
+	[[self finishedRequests] addObject:request];
+}
+
+- (void)testAdaptiveConcurrency
+{
+	// While responses are quick and the limit is being used, the limit should grow
+	ASIConcurrencyLimiter *limiter = [ASIConcurrencyLimiter limiter];
+	NSUInteger i;
+	for (i=0; i<20; i++) {
+		[limiter recordResponseTime:0.05 statusCode:200 requestsInProgress:[limiter limit]];
+	}
+	BOOL success = ([limiter limit] > ASIConcurrencyLimiterDefaultInitialLimit);
+	GHAssertTrue(success,@"Failed to grow the limit when responses were quick");
+	NSUInteger grownLimit = [limiter limit];
+
+	// Responses that aren't using the limit shouldn't grow it
+	for (i=0; i<20; i++) {
+		[limiter recordResponseTime:0.05 statusCode:200 requestsInProgress:1];
+	}
+	success = ([limiter limit] == grownLimit);
+	GHAssertTrue(success,@"Grew the limit when it wasn't being used");
+
+	// When responses slow down a lot, the limit should shrink
+	for (i=0; i<20; i++) {
+		[limiter recordResponseTime:1.0 statusCode:200 requestsInProgress:[limiter limit]];
+	}
+	success = ([limiter limit] < grownLimit);
+	GHAssertTrue(success,@"Failed to shrink the limit when responses slowed down");
+	success = ([limiter minimumResponseTime] == 0.05);
+	GHAssertTrue(success,@"Failed to keep track of the shortest response time");
+
+	// An overloaded server should halve the limit
+	limiter = [ASIConcurrencyLimiter limiter];
+	[limiter recordResponseTime:0.05 statusCode:503 requestsInProgress:4];
+	success = ([limiter limit] == ASIConcurrencyLimiterDefaultInitialLimit/2);
+	GHAssertTrue(success,@"Failed to halve the limit on a 503 response");
+
+	[limiter setMaximumLimit:1];
+	success = ([limiter limit] == 1);
+	GHAssertTrue(success,@"Failed to keep the limit within the maximum");
+
+	// Now check a queue actually uses its limiter
+	[self performSelectorOnMainThread:@selector(runAdaptiveConcurrencyQueueTest) withObject:nil waitUntilDone:YES];
+}
+
+- (void)runAdaptiveConcurrencyQueueTest
+{
+	[self setFinishedRequests:[NSMutableArray array]];
+
+	ASINetworkQueue *networkQueue = [ASINetworkQueue queue];
+	[networkQueue setShouldAdaptConcurrency:YES];
+	[networkQueue setShouldAdaptConcurrencyPerHost:YES];
+	[[networkQueue concurrencyLimiter] setMaximumLimit:2];
+	[networkQueue setDelegate:self];
+	[networkQueue setRequestDidStartSelector:@selector(scheduledRequestStarted:)];
+	[networkQueue setRequestDidFinishSelector:@selector(scheduledRequestFinished:)];
+	[networkQueue setRequestDidFailSelector:@selector(scheduledRequestFinished:)];
+	runningRequestCount = 0;
+	mostRunningRequests = 0;
+
+	NSUInteger i;
+	for (i=0; i<4; i++) {
+		[networkQueue addOperation:[ASIHTTPRequest requestWithURL:[NSURL URLWithString:@"http://allseeing-i.com/ASIHTTPRequest/tests/the_great_american_novel_(abridged).txt"]]];
+	}
+	[networkQueue go];
+
+	NSDate *dateStarted = [NSDate date];
+	while ([[self finishedRequests] count] < 4 && [dateStarted timeIntervalSinceNow] > -30) {
+		[[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.25]];
+	}
+	BOOL success = ([[self finishedRequests] count] == 4);
+	GHAssertTrue(success,@"Failed to run all the requests");
+	success = (mostRunningRequests <= 2);
+	GHAssertTrue(success,@"Ran more requests at once than the queue's concurrency limit");
+	success = ([[networkQueue concurrencyLimiter] responseCount] == 4);
+	GHAssertTrue(success,@"Failed to measure response times");
+	success = ([[networkQueue concurrencyLimiterForHost:@"allseeing-i.com"] smoothedResponseTime] > 0);
+	GHAssertTrue(success,@"Failed to measure response times for the host");
+}
 
 - (void)testDelegateRedirectHandling
 {
@@ -16,6 +16,7 @@
 }
 
 - (void)testAuthenticationHeaderGeneration;
+- (void)testEncryptedObjectETags;
 - (void)testREST;
 - (void)testFailure;
 - (void)testListRequest;
@@ -34,6 +34,13 @@ static NSString *bucket = @"";
 @implementation ASIS3BucketObjectSubclass;
 @end
 
+// Lets us check digests against made up responses
+@interface ASIHTTPRequest (ASIPrivateTesting)
+- (NSError *)digestMismatchError;
+- (void)setResponseStatusCode:(int)newStatusCode;
+- (void)setResponseDigest:(ASIDigest *)newDigest;
+@end
+
 // Stop clang complaining about undeclared selectors
 @interface ASIS3RequestTests ()
 - (void)GETRequestDone:(ASIHTTPRequest *)request;
@@ -124,6 +131,41 @@ static NSString *bucket = @"";
 	//GHAssertTrue(success,@"Failed to generate the correct authorisation header for a list request");		
 }
 
+- (void)testEncryptedObjectETags
+{
+	ASIDigest *digest = [ASIDigest digestWithAlgorithms:ASIMD5DigestAlgorithm];
+	[digest updateWithBytes:"This is the body" length:16];
+	NSString *otherETag = @"\"900150983cd24fb0d6963f7d28e17f72\"";
+
+	// S3 object requests check plain ETags
+	ASIS3ObjectRequest *request = [ASIS3ObjectRequest requestWithBucket:@"bucket" key:@"key"];
+	[request setResponseStatusCode:200];
+	[request setResponseDigest:digest];
+	[request setResponseHeaders:[NSDictionary dictionaryWithObject:otherETag forKey:@"Etag"]];
+	BOOL success = ([[request digestMismatchError] code] == ASIDigestMismatchErrorType);
+	GHAssertTrue(success,@"Failed to notice an S3 object that didn't match its ETag");
+
+	// SSE-KMS ETags aren't an MD5 of the object
+	[request setResponseHeaders:[NSDictionary dictionaryWithObjectsAndKeys:otherETag,@"Etag",@"aws:kms",@"x-amz-server-side-encryption",nil]];
+	GHAssertNil([request digestMismatchError],@"Compared an object encrypted with SSE-KMS with its ETag");
+
+	// Nor are SSE-C ETags, whether we see the headers in the response or only sent them ourselves
+	[request setResponseHeaders:[NSDictionary dictionaryWithObjectsAndKeys:otherETag,@"Etag",@"AES256",@"x-amz-server-side-encryption-customer-algorithm",nil]];
+	GHAssertNil([request digestMismatchError],@"Compared an object encrypted with SSE-C with its ETag");
+
+	[request setResponseHeaders:[NSDictionary dictionaryWithObject:otherETag forKey:@"Etag"]];
+	[request addRequestHeader:@"x-amz-server-side-encryption-customer-algorithm" value:@"AES256"];
+	GHAssertNil([request digestMismatchError],@"Compared an object we encrypted with SSE-C with its ETag");
+
+	// SSE-S3 ETags are still an MD5
+	request = [ASIS3ObjectRequest requestWithBucket:@"bucket" key:@"key"];
+	[request setResponseStatusCode:200];
+	[request setResponseDigest:digest];
+	[request setResponseHeaders:[NSDictionary dictionaryWithObjectsAndKeys:otherETag,@"Etag",@"AES256",@"x-amz-server-side-encryption",nil]];
+	success = ([[request digestMismatchError] code] == ASIDigestMismatchErrorType);
+	GHAssertTrue(success,@"Failed to check the ETag of an object encrypted with SSE-S3");
+}
+
 - (void)testFailure
 {
 	// Needs expanding to cover more failure states - this is just a test to ensure Amazon's error description is being added to the error
@@ -16,10 +16,15 @@
 	int requestsComplete;
 	NSMutableArray *responseData;
 	unsigned long bytesDownloaded;
+
+	// Counts delegate calls in testCallbackThroughput, which may arrive on several threads at once
+	volatile int32_t callbacksReceived;
 }
 
 - (void)testASIHTTPRequestAsyncPerformance;
 - (void)testNSURLConnectionAsyncPerformance;
+- (void)testCallbackThroughput;
+- (void)testCompressionThroughput;
 
 @property (retain,nonatomic) NSURL *testURL;
 @property (retain,nonatomic) NSDate *testStartDate;
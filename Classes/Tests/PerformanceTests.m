@@ -8,6 +8,9 @@
 
 #import "PerformanceTests.h"
 #import "ASIHTTPRequest.h"
+#import "ASIDataCompressor.h"
+#import "ASIDataDecompressor.h"
+#import <libkern/OSAtomic.h>
 
 // IMPORTANT - these tests need to be run one at a time!
 
@@ -27,6 +30,9 @@
 - (void)startASIHTTPRequests;
 - (void)startASIHTTPRequestsWithQueue;
 - (void)startNSURLConnections;
+- (void)measureCallbackThroughputWithMode:(ASICallbackMode)mode name:(NSString *)name;
+- (void)callbackThroughputRequestFinished:(ASIHTTPRequest *)request;
+- (void)measureCompressionThroughputWithData:(NSData *)data name:(NSString *)name;
 @end
 
 
@@ -227,6 +233,131 @@
 	}		
 }
 
+// Measures how quickly finished requests can be reported to their delegate with each callbackMode
+// Requests are finished from several threads at once, as they would be when running on a pool of network threads
+// This doesn't touch the network, so it only measures the cost of getting the callback to where it is delivered
+- (void)testCallbackThroughput
+{
+#if NS_BLOCKS_AVAILABLE
+	[self measureCallbackThroughputWithMode:ASIMainThreadCallbackMode name:@"main thread"];
+	[self measureCallbackThroughputWithMode:ASIDispatchQueueCallbackMode name:@"serial dispatch queue"];
+	[self measureCallbackThroughputWithMode:ASIOperationQueueCallbackMode name:@"serial operation queue"];
+	[self measureCallbackThroughputWithMode:ASINetworkThreadCallbackMode name:@"network thread"];
+#endif
+}
+
+- (void)measureCallbackThroughputWithMode:(ASICallbackMode)mode name:(NSString *)name
+{
+#if NS_BLOCKS_AVAILABLE
+	int requestCount = 10000;
+	NSMutableArray *requests = [NSMutableArray arrayWithCapacity:(NSUInteger)requestCount];
+
+	dispatch_queue_t dispatchQueue = dispatch_queue_create("com.allseeing-i.asihttprequest.callbackthroughput", NULL);
+	NSOperationQueue *operationQueue = [[[NSOperationQueue alloc] init] autorelease];
+	[operationQueue setMaxConcurrentOperationCount:1];
+
+	int i;
+	for (i=0; i<requestCount; i++) {
+		ASIHTTPRequest *request = [ASIHTTPRequest requestWithURL:testURL];
+		[request setDelegate:self];
+		[request setDidFinishSelector:@selector(callbackThroughputRequestFinished:)];
+		[request setCallbackMode:mode];
+		[request setCallbackDispatchQueue:dispatchQueue];
+		[request setCallbackOperationQueue:operationQueue];
+		[requests addObject:request];
+	}
+	dispatch_release(dispatchQueue);
+
+	callbacksReceived = 0;
+	NSDate *startDate = [NSDate date];
+	dispatch_apply((size_t)requestCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t r) {
+		[[requests objectAtIndex:r] requestFinished];
+	});
+	while (callbacksReceived < requestCount && [[NSDate date] timeIntervalSinceDate:startDate] < 30) {
+		[[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.001]];
+	}
+	NSTimeInterval duration = [[NSDate date] timeIntervalSinceDate:startDate];
+
+	BOOL success = (callbacksReceived == requestCount);
+	GHAssertTrue(success,@"Only received %i of %i callbacks on the %@",callbacksReceived,requestCount,name);
+
+	NSLog(@"Callbacks on the %@: reported %i finished requests in %f seconds (%.0f per second)",name,requestCount,duration,requestCount/duration);
+#endif
+}
+
+- (void)callbackThroughputRequestFinished:(ASIHTTPRequest *)request
+{
+	OSAtomicIncrement32Barrier(&callbacksReceived);
+}
+
+// Compares compressing and inflating whole buffers in one go (as compressData: and uncompressData: do) with pushing them through the streaming methods
+// This doesn't touch the network, the corpora are generated here so every run uses the same data
+- (void)testCompressionThroughput
+{
+	NSUInteger corpusSize = 8*1024*1024;
+	NSArray *words = [NSArray arrayWithObjects:@"the",@"hound",@"of",@"baskervilles",@"said",@"holmes",@"watson",@"moor",@"which",@"upon",@"a",@"there",@"light",@"sir",@"henry",@"night",nil];
+	srandom(42);
+
+	NSMutableString *text = [NSMutableString string];
+	while ([text length] < corpusSize) {
+		[text appendFormat:@"%@%@",[words objectAtIndex:(NSUInteger)random()%[words count]],(random()%12 ? @" " : @".\n")];
+	}
+	[self measureCompressionThroughputWithData:[text dataUsingEncoding:NSUTF8StringEncoding] name:@"text"];
+
+	NSMutableString *json = [NSMutableString stringWithString:@"["];
+	while ([json length] < corpusSize) {
+		[json appendFormat:@"{\"id\":%ld,\"name\":\"%@\",\"score\":%ld.%02ld,\"active\":%@},",random()%1000000,[words objectAtIndex:(NSUInteger)random()%[words count]],random()%1000,random()%100,(random()%2 ? @"true" : @"false")];
+	}
+	[json appendString:@"{}]"];
+	[self measureCompressionThroughputWithData:[json dataUsingEncoding:NSUTF8StringEncoding] name:@"JSON"];
+
+	NSMutableData *binary = [NSMutableData dataWithLength:corpusSize];
+	long *longs = (long *)[binary mutableBytes];
+	NSUInteger i;
+	for (i=0; i<corpusSize/sizeof(long); i++) {
+		longs[i] = random();
+	}
+	[self measureCompressionThroughputWithData:binary name:@"binary"];
+}
+
+- (void)measureCompressionThroughputWithData:(NSData *)data name:(NSString *)name
+{
+	int runTimes = 5;
+	double megabytes = [data length]/(1024.0*1024.0);
+	NSData *compressedData = nil;
+	NSData *inflatedData = nil;
+	NSTimeInterval streamingCompressTime = 0, oneShotCompressTime = 0, streamingInflateTime = 0, oneShotInflateTime = 0;
+	NSDate *startDate;
+
+	int i;
+	for (i=0; i<runTimes; i++) {
+		NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+
+		startDate = [NSDate date];
+		[[ASIDataCompressor compressor] compressBytes:(Bytef *)[data bytes] length:[data length] error:NULL shouldFinish:YES];
+		streamingCompressTime += [[NSDate date] timeIntervalSinceDate:startDate];
+
+		startDate = [NSDate date];
+		compressedData = [ASIDataCompressor compressData:data error:NULL];
+		oneShotCompressTime += [[NSDate date] timeIntervalSinceDate:startDate];
+
+		startDate = [NSDate date];
+		[[ASIDataDecompressor decompressor] uncompressBytes:(Bytef *)[compressedData bytes] length:[compressedData length] error:NULL];
+		streamingInflateTime += [[NSDate date] timeIntervalSinceDate:startDate];
+
+		startDate = [NSDate date];
+		inflatedData = [ASIDataDecompressor uncompressData:compressedData error:NULL];
+		oneShotInflateTime += [[NSDate date] timeIntervalSinceDate:startDate];
+
+		BOOL success = [inflatedData isEqualToData:data];
+		[pool release];
+		GHAssertTrue(success,@"Failed to round-trip the %@ corpus",name);
+	}
+
+	NSLog(@"Compressing %@: %.1f MB/s streaming, %.1f MB/s in one go",name,megabytes*runTimes/streamingCompressTime,megabytes*runTimes/oneShotCompressTime);
+	NSLog(@"Inflating %@: %.1f MB/s streaming, %.1f MB/s in one go",name,megabytes*runTimes/streamingInflateTime,megabytes*runTimes/oneShotInflateTime);
+}
+
 @synthesize testURL;
 @synthesize requestsComplete;
 @synthesize testStartDate;